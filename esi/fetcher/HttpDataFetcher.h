@@ -45,6 +45,11 @@ public:
 
   virtual bool addFetchRequest(const std::string &url, FetchedDataProcessor *callback_obj = 0) = 0;
 
+  /** bounds the time (in ms) the request for given url, which has to be
+   * added already, may take to complete; replaces any default timeout.
+   * Once it expires, the request fails, i.e., its status is STATUS_ERROR */
+  virtual void setRequestTimeout(const std::string & /* url */, int /* timeout */) { }
+
   virtual DataStatus getRequestStatus(const char *url, int url_len) const {
     return getRequestStatus(std::string(url, url_len));
   }
@@ -57,6 +62,10 @@ public:
 
   virtual int getNumPendingRequests() const = 0;
 
+  /** milliseconds the fetch of given url took to complete; -1 if not known, e.g., when
+   * the request is pending or was served by something other than its own fetch */
+  virtual int getResponseTime(const std::string & /* url */) const { return -1; }
+
   virtual bool getContent(const char *url, int url_len, const char *&content, int &content_len) const {
     return getContent(std::string(url, url_len), content, content_len);
   }
@@ -65,6 +74,7 @@ public:
     return getContent(std::string(url), content, content_len);
   }
 
+  /** content stays valid for as long as the fetcher keeps the request's data */
   virtual bool getContent(const std::string &url, const char *&content, int &content_len) const = 0;
 
   virtual ~HttpDataFetcher() { };
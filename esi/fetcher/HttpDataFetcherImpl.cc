@@ -23,15 +23,71 @@
 
 #include "HttpDataFetcherImpl.h"
 #include "Utils.h"
+#include "Stats.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 using std::string;
 using namespace EsiLib;
 
 const int HttpDataFetcherImpl::FETCH_EVENT_ID_BASE = 10000;
 
+int HttpDataFetcherImpl::_include_timeout = 0;
+int HttpDataFetcherImpl::_page_deadline = 0;
+
+int HttpDataFetcherImpl::_max_in_flight = 0;
+int HttpDataFetcherImpl::_max_process_in_flight = 0;
+volatile int HttpDataFetcherImpl::_n_process_in_flight = 0;
+
+bool HttpDataFetcherImpl::_coalesce = false;
+HttpDataFetcherImpl::InFlightFetchMap HttpDataFetcherImpl::_in_flight_fetches;
+pthread_mutex_t HttpDataFetcherImpl::_in_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+FragmentCache *HttpDataFetcherImpl::_fragment_cache = 0;
+
+static const char *FRAGMENT_CACHE_DEBUG_TAG = "plugin_esi_fragment_cache";
+
+// hop-by-hop headers concern the client's connection only; conditional and
+// range headers the document, not its includes
+static const char *UNFORWARDED_HEADERS[] = { "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+                                             "Transfer-Encoding", "Upgrade", "If-Match", "If-None-Match",
+                                             "If-Modified-Since", "If-Unmodified-Since", "If-Range", "Range" };
+
+void
+HttpDataFetcherImpl::setFragmentCacheSize(size_t max_size) {
+  if (_fragment_cache) {
+    delete _fragment_cache;
+    _fragment_cache = 0;
+  }
+  if (max_size) {
+    _fragment_cache = new FragmentCache(FRAGMENT_CACHE_DEBUG_TAG, &TSDebug, &TSError, max_size);
+  }
+}
+
+void
+HttpDataFetcherImpl::setConcurrencyLimits(int max_in_flight, int max_process_in_flight) {
+  _max_in_flight = (max_in_flight > 0) ? max_in_flight : 0;
+  _max_process_in_flight = (max_process_in_flight > 0) ? max_process_in_flight : 0;
+}
+
+void
+HttpDataFetcherImpl::setTimeouts(int include_timeout, int page_deadline) {
+  _include_timeout = (include_timeout > 0) ? include_timeout : 0;
+  _page_deadline = (page_deadline > 0) ? page_deadline : 0;
+}
+
 inline void HttpDataFetcherImpl::_release(RequestData &req_data) {
+  if (req_data.response) {
+    req_data.response->release();
+    req_data.response = 0;
+  }
+  if (req_data.stale_fragment.response) {
+    req_data.stale_fragment.response->release();
+    req_data.stale_fragment.response = 0;
+  }
   if (req_data.bufp) {
     if (req_data.hdr_loc) {
       TSHandleMLocRelease(req_data.bufp, TS_NULL_MLOC, req_data.hdr_loc);
@@ -44,8 +100,8 @@ inline void HttpDataFetcherImpl::_release(RequestData &req_data) {
 
 HttpDataFetcherImpl::HttpDataFetcherImpl(TSCont contp,sockaddr const* client_addr,
                                          const char *debug_tag)
-  : _contp(contp), _debug_tag(debug_tag), _n_pending_requests(0), _curr_event_id_base(FETCH_EVENT_ID_BASE),
-    _headers_str(""),_client_addr(client_addr) {
+  : _contp(contp), _debug_tag(debug_tag), _n_pending_requests(0), _n_in_flight(0), _notify_action(0),
+    _page_start(0), _timeout_action(0), _timeout_time(0), _headers_str(""),_client_addr(client_addr) {
   _http_parser = TSHttpParserCreate();
 }
 
@@ -66,17 +122,51 @@ HttpDataFetcherImpl::_buildHeadersString() {
   }
 }
 
+// sets host to the authority of an absolute url
+static bool
+getUrlHost(const string &url, string &host) {
+  size_t host_start = url.find("://");
+  if (host_start == string::npos) {
+    return false;
+  }
+  host_start += 3;
+  size_t host_end = url.find_first_of("/?#", host_start);
+  if (host_end == string::npos) {
+    host_end = url.size();
+  }
+  host.assign(url, host_start, host_end - host_start);
+  return !host.empty();
+}
+
 void
-HttpDataFetcherImpl::_createRequest(std::string &http_req, const string &url) {
+HttpDataFetcherImpl::_createRequest(std::string &http_req, const string &url, const RequestData &req_data) {
   http_req.assign("GET ");
   http_req.append(url);
-  http_req.append(" HTTP/1.0\r\n");
+  http_req.append(" HTTP/1.1\r\n");
+  bool host_forwarded = false;
   if (_headers.size()) {
     if (!_headers_str.size()) {
       _buildHeadersString();
     }
     http_req.append(_headers_str);
+    for (StringHash::const_iterator iter = _headers.begin(); iter != _headers.end(); ++iter) {
+      if (Utils::areEqual(iter->first.data(), iter->first.size(), TS_MIME_FIELD_HOST, TS_MIME_LEN_HOST)) {
+        host_forwarded = true;
+        break;
+      }
+    }
+  }
+  string host;
+  if (!host_forwarded && getUrlHost(url, host)) { // required by HTTP/1.1
+    http_req.append(TS_MIME_FIELD_HOST, TS_MIME_LEN_HOST);
+    http_req.append(": ");
+    http_req.append(host);
+    http_req.append("\r\n");
   }
+  // the session the fetch runs on serves this request only; connections to
+  // the origin are kept alive and reused by the core regardless
+  http_req.append("Connection: close\r\n");
+  http_req.append(req_data.conditional_headers);
   http_req.append("\r\n");
 }
 
@@ -94,14 +184,158 @@ HttpDataFetcherImpl::addFetchRequest(const string &url, FetchedDataProcessor *ca
     return true;
   }
   
+  int base_event_id = static_cast<int>(_page_entry_lookup.size());
+  _page_entry_lookup.push_back(insert_result.first);
+  ++_n_pending_requests;
+  if (!base_event_id) {
+    _page_start = TShrtime();
+  }
+  if (_fragment_cache && _useCachedFragment(base_event_id)) {
+    return true;
+  }
+  RequestData &req_data = (insert_result.first)->second;
+  _setDeadline(req_data, _include_timeout);
+  if (_coalesce && _joinInFlightFetch(base_event_id)) {
+    return true;
+  }
+  _fetch_queue.push_back(base_event_id);
+  _startQueuedFetches();
+
+  if (!req_data.in_flight) {
+    req_data.queue_time = TShrtime();
+    Stats::increment(Stats::N_QUEUED_FETCHES);
+    Stats::increment(Stats::TOTAL_FETCH_QUEUE_DEPTH, static_cast<int>(_fetch_queue.size()));
+    TSDebug(_debug_tag.c_str(), "[%s] Queued fetch request for URL [%s]; %d request(s) in flight, %d queued",
+             __FUNCTION__, url.data(), _n_in_flight, static_cast<int>(_fetch_queue.size()));
+  }
+  return true;
+}
+
+void
+HttpDataFetcherImpl::setRequestTimeout(const string &url, int timeout) {
+  UrlToContentMap::iterator iter = _pages.find(url);
+  if (iter == _pages.end()) {
+    TSError("Timeout being set for unregistered URL [%s]", url.data());
+    return;
+  }
+  RequestData &req_data = iter->second;
+  if (!req_data.complete) {
+    TSDebug(_debug_tag.c_str(), "[%s] Request for URL [%s] times out after %d ms", __FUNCTION__,
+             url.data(), timeout);
+    _setDeadline(req_data, timeout);
+  }
+}
+
+// the page deadline applies in any case
+void
+HttpDataFetcherImpl::_setDeadline(RequestData &req_data, int timeout) {
+  req_data.deadline = (timeout > 0) ? (TShrtime() + TS_HRTIME_MSECOND(timeout)) : 0;
+  if (_page_deadline) {
+    TSHRTime page_end = _page_start + TS_HRTIME_MSECOND(_page_deadline);
+    if (!req_data.deadline || (page_end < req_data.deadline)) {
+      req_data.deadline = page_end;
+    }
+  }
+  _scheduleTimeout(req_data.deadline);
+}
+
+// a single timer is kept for the earliest deadline
+void
+HttpDataFetcherImpl::_scheduleTimeout(TSHRTime deadline) {
+  if (!deadline || (_timeout_action && (_timeout_time <= deadline))) {
+    return;
+  }
+  _cancelTimeout();
+  TSHRTime now = TShrtime();
+  int delay = 0;
+  if (deadline > now) { // rounded up so that the deadline has passed when the timer goes off
+    delay = static_cast<int>((deadline - now + TS_HRTIME_MSECOND(1) - 1) / TS_HRTIME_MSECOND(1));
+  }
+  _timeout_action = TSContSchedule(_contp, delay, TS_THREAD_POOL_DEFAULT);
+  _timeout_time = deadline;
+}
+
+void
+HttpDataFetcherImpl::_handleTimeouts() {
+  _timeout_action = 0;
+  TSHRTime now = TShrtime(), next_deadline = 0;
+  for (int i = 0; i < static_cast<int>(_page_entry_lookup.size()); ++i) {
+    RequestData &req_data = _page_entry_lookup[i]->second;
+    if (req_data.complete || !req_data.deadline) {
+      continue;
+    }
+    if (req_data.deadline <= now) {
+      _timeOut(i);
+    } else if (!next_deadline || (req_data.deadline < next_deadline)) {
+      next_deadline = req_data.deadline;
+    }
+  }
+  _scheduleTimeout(next_deadline);
+  _startQueuedFetches();
+}
+
+/** fails a request that ran out of time; its fetch, if started, is left
+ * running and its response dropped when it comes in */
+void
+HttpDataFetcherImpl::_timeOut(int base_event_id) {
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
+  TSError("[%s] Request for URL [%s] timed out", __FUNCTION__, _page_entry_lookup[base_event_id]->first.c_str());
+  Stats::increment(Stats::N_FETCH_TIMEOUTS);
+  --_n_pending_requests;
+  req_data.complete = true;
+  req_data.timed_out = true;
+  if (req_data.in_flight_fetch) {
+    _leaveInFlightFetch(base_event_id);
+  }
+  if (!req_data.in_flight) {
+    _fetch_queue.remove(base_event_id);
+  }
+}
+
+void
+HttpDataFetcherImpl::_startQueuedFetches() {
+  while (!_fetch_queue.empty() && (!_max_in_flight || (_n_in_flight < _max_in_flight))) {
+    int base_event_id = _fetch_queue.front();
+    if (_coalesce && _joinInFlightFetch(base_event_id)) { // fetch started while this one was queued
+      _fetch_queue.pop_front();
+      continue;
+    }
+    int n_process_in_flight = __sync_add_and_fetch(&_n_process_in_flight, 1);
+    if (_max_process_in_flight && (n_process_in_flight > _max_process_in_flight) && _n_in_flight) {
+      __sync_sub_and_fetch(&_n_process_in_flight, 1);
+      break;
+    }
+    _fetch_queue.pop_front();
+    ++_n_in_flight;
+    _startFetch(base_event_id);
+  }
+}
+
+void
+HttpDataFetcherImpl::_startFetch(int base_event_id) {
+  const string &url = _page_entry_lookup[base_event_id]->first;
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
   string http_req;
-  _createRequest(http_req, url);
+  _createRequest(http_req, url, req_data);
 
   TSFetchEvent event_ids;
-  event_ids.success_event_id = _curr_event_id_base;
-  event_ids.failure_event_id = _curr_event_id_base + 1;
-  event_ids.timeout_event_id = _curr_event_id_base + 2;
-  _curr_event_id_base += 3;
+  event_ids.success_event_id = FETCH_EVENT_ID_BASE + (base_event_id * 3);
+  event_ids.failure_event_id = event_ids.success_event_id + 1;
+  event_ids.timeout_event_id = event_ids.success_event_id + 2;
+
+  req_data.in_flight = true;
+  req_data.start_time = TShrtime();
+  Stats::increment(Stats::N_FETCHES);
+  if (_coalesce) {
+    _leadInFlightFetch(base_event_id);
+  }
+  if (req_data.queue_time) {
+    int wait_ms = static_cast<int>((TShrtime() - req_data.queue_time) / TS_HRTIME_MSECOND(1));
+    Stats::increment(Stats::TOTAL_FETCH_QUEUE_WAIT_MS, wait_ms);
+    TSDebug(_debug_tag.c_str(), "[%s] Request for URL [%s] waited %d ms to be started", __FUNCTION__,
+             url.data(), wait_ms);
+    req_data.queue_time = 0;
+  }
 
 //FIXME. This looks to be a regression.
 TSFetchUrl(http_req.data(), http_req.size(), _client_addr, _contp, AFTER_BODY,
@@ -115,9 +349,15 @@ TSFetchUrl(http_req.data(), http_req.size(), _client_addr, _contp, AFTER_BODY,
   
   TSDebug(_debug_tag.c_str(), "[%s] Successfully added fetch request for URL [%s]",
            __FUNCTION__, url.data());
-  _page_entry_lookup.push_back(insert_result.first);
-  ++_n_pending_requests;
-  return true;
+}
+
+void
+HttpDataFetcherImpl::_fetchDone(RequestData &req_data) {
+  if (req_data.in_flight) {
+    req_data.in_flight = false;
+    --_n_in_flight;
+    __sync_sub_and_fetch(&_n_process_in_flight, 1);
+  }
 }
 
 bool
@@ -131,10 +371,95 @@ HttpDataFetcherImpl::_isFetchEvent(TSEvent event, int &base_event_id) const {
   return true;
 }
 
+static bool
+isNotModified(const char *data, int data_len) {
+  const char *status = static_cast<const char *>(memchr(data, ' ', data_len));
+  return (status && ((data + data_len - status) > 3) && (strncmp(status + 1, "304", 3) == 0));
+}
+
+/** true if the response has a chunked body; response is then set to the
+ * response with the body decoded (trailers are dropped) and without the
+ * Transfer-Encoding header, or left empty if the body is malformed */
+static bool
+dechunk(const char *data, int data_len, string &response) {
+  static const char TRANSFER_ENCODING[] = "Transfer-Encoding:";
+  static const int TRANSFER_ENCODING_LEN = sizeof(TRANSFER_ENCODING) - 1;
+  const char *end = data + data_len, *line = data, *body = 0;
+  const char *te_line = 0, *te_line_end = 0;
+  while (!body) {
+    const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+    if (!eol) {
+      return false; // left to the header parser to complain about
+    }
+    int line_len = eol - line;
+    if (line_len && (line[line_len - 1] == '\r')) {
+      --line_len;
+    }
+    if (!line_len) {
+      body = eol + 1;
+    } else if ((line_len > TRANSFER_ENCODING_LEN) &&
+               (strncasecmp(line, TRANSFER_ENCODING, TRANSFER_ENCODING_LEN) == 0)) {
+      string value(line + TRANSFER_ENCODING_LEN, line_len - TRANSFER_ENCODING_LEN);
+      for (size_t i = 0; i < value.size(); ++i) {
+        value[i] = tolower(value[i]);
+      }
+      if (value.find("chunked") != string::npos) {
+        te_line = line;
+        te_line_end = eol + 1;
+      }
+    }
+    line = eol + 1;
+  }
+  if (!te_line) {
+    return false;
+  }
+  response.assign(data, te_line - data);
+  response.append(te_line_end, body - te_line_end);
+  const char *pos = body;
+  while (true) {
+    int chunk_size = 0, n_digits = 0;
+    for (; (pos < end) && isxdigit(*pos); ++pos, ++n_digits) {
+      if (chunk_size > (0x7fffffff >> 4)) {
+        response.clear();
+        return true;
+      }
+      chunk_size = (chunk_size << 4) + (isdigit(*pos) ? (*pos - '0') : (tolower(*pos) - 'a' + 10));
+    }
+    const char *eol = static_cast<const char *>(memchr(pos, '\n', end - pos)); // skips chunk extensions
+    if (!n_digits || !eol || ((end - (eol + 1)) < chunk_size)) {
+      response.clear();
+      return true;
+    }
+    pos = eol + 1;
+    if (!chunk_size) {
+      break;
+    }
+    response.append(pos, chunk_size);
+    pos += chunk_size;
+    if ((pos < end) && (*pos == '\r')) {
+      ++pos;
+    }
+    if ((pos == end) || (*pos != '\n')) {
+      response.clear();
+      return true;
+    }
+    ++pos;
+  }
+  return true;
+}
+
 bool
 HttpDataFetcherImpl::handleFetchEvent(TSEvent event, void *edata) {
   int base_event_id;
   if (!_isFetchEvent(event, base_event_id)) {
+    if (_timeout_action && (edata == _timeout_action)) {
+      _handleTimeouts();
+      return true;
+    }
+    if (_isSharedResultEvent(edata)) {
+      _handleSharedResults();
+      return true;
+    }
     TSError("[%s] Event %d is not a fetch event", __FUNCTION__, event);
     return false;
   }
@@ -144,6 +469,13 @@ HttpDataFetcherImpl::handleFetchEvent(TSEvent event, void *edata) {
   RequestData &req_data = req_entry->second;
 
   if (req_data.complete) {
+    if (req_data.timed_out && req_data.in_flight) {
+      TSDebug(_debug_tag.c_str(), "[%s] Dropping late response for URL [%s]", __FUNCTION__, req_str.c_str());
+      Stats::increment(Stats::N_LATE_FETCHES);
+      _fetchDone(req_data);
+      _startQueuedFetches();
+      return true;
+    }
     // can only happen if there's a bug in this or fetch API code
     TSError("[%s] URL [%s] already completed; Retaining original data", __FUNCTION__, req_str.c_str());
     return false;
@@ -151,19 +483,64 @@ HttpDataFetcherImpl::handleFetchEvent(TSEvent event, void *edata) {
 
   --_n_pending_requests;
   req_data.complete = true;
+  if (!_n_pending_requests) {
+    _cancelTimeout();
+  }
+  if (req_data.start_time) {
+    req_data.response_time = static_cast<int>((TShrtime() - req_data.start_time) / TS_HRTIME_MSECOND(1));
+  }
+  _fetchDone(req_data);
+  _startQueuedFetches();
 
   int event_id = (static_cast<int>(event) - FETCH_EVENT_ID_BASE) % 3;
   if (event_id != 0) { // failure or timeout
     TSError("[%s] Received failure/timeout event id %d for request [%s]",
              __FUNCTION__, event_id, req_str.data());
+    if (req_data.in_flight_fetch) {
+      _endInFlightFetch(req_data, false);
+    }
     return true;
   }
 
   int page_data_len;
   const char *page_data = TSFetchRespGet(static_cast<TSHttpTxn>(edata), &page_data_len);
-  req_data.response.assign(page_data, page_data_len);
+  bool not_modified = (req_data.stale_fragment.response && isNotModified(page_data, page_data_len));
+  if (not_modified) {
+    TSDebug(_debug_tag.c_str(), "[%s] Cached response for request [%s] is still valid", __FUNCTION__,
+             req_str.c_str());
+    Stats::increment(Stats::N_FRAGMENT_REVALIDATIONS);
+    req_data.response = req_data.stale_fragment.response; // takes over the reference
+    req_data.stale_fragment.response = 0;
+  } else {
+    string dechunked_response;
+    if (dechunk(page_data, page_data_len, dechunked_response)) {
+      if (dechunked_response.empty()) {
+        TSError("[%s] Invalid chunked body in response for request [%s]", __FUNCTION__, req_str.c_str());
+        if (req_data.in_flight_fetch) {
+          _endInFlightFetch(req_data, false);
+        }
+        return true;
+      }
+      page_data = dechunked_response.data();
+      page_data_len = dechunked_response.size();
+    }
+    req_data.response = new SharedResponse(page_data, page_data_len);
+  }
+  if (req_data.in_flight_fetch) {
+    _endInFlightFetch(req_data, false); // waiters check the response themselves
+  }
+  _processResponse(req_str, req_data, !not_modified);
+  if (not_modified && req_data.bufp && _fragment_cache) {
+    _cacheRevalidatedFragment(req_str, req_data, page_data, page_data_len);
+  }
+  return true;
+}
+
+void
+HttpDataFetcherImpl::_processResponse(const string &req_str, RequestData &req_data, bool cache_response) {
   bool valid_data_received = false;
-  const char *startptr = req_data.response.data(), *endptr = startptr + page_data_len;
+  const string &response = req_data.response->data;
+  const char *startptr = response.data(), *endptr = startptr + response.size();
 
   req_data.bufp = TSMBufferCreate();
   req_data.hdr_loc = TSHttpHdrCreate(req_data.bufp);
@@ -179,10 +556,10 @@ HttpDataFetcherImpl::handleFetchEvent(TSEvent event, void *edata) {
       TSDebug(_debug_tag.c_str(),
                "[%s] Inserted page data of size %d starting with [%.6s] for request [%s]", __FUNCTION__,
                req_data.body_len, (req_data.body_len ? req_data.body : "(null)"), req_str.c_str());
-      for (CallbackObjectList::iterator list_iter = req_data.callback_objects.begin();
-           list_iter != req_data.callback_objects.end(); ++list_iter) {
-        (*list_iter)->processData(req_str.data(), req_str.size(), req_data.body, req_data.body_len);
+      if (cache_response && _fragment_cache) {
+        _cacheFragment(req_str, req_data);
       }
+      _callbackObjects(req_str, req_data);
     } else {
       TSDebug(_debug_tag.c_str(), "[%s] Received non-OK status %d for request [%s]",
                __FUNCTION__, resp_status, req_str.data());
@@ -194,12 +571,177 @@ HttpDataFetcherImpl::handleFetchEvent(TSEvent event, void *edata) {
 
   if (!valid_data_received) {
     _release(req_data);
-    req_data.response.clear();
   }
+}
+
+void
+HttpDataFetcherImpl::_callbackObjects(const string &url, RequestData &req_data) {
+  for (CallbackObjectList::iterator list_iter = req_data.callback_objects.begin();
+       list_iter != req_data.callback_objects.end(); ++list_iter) {
+    (*list_iter)->processData(url.data(), url.size(), req_data.body, req_data.body_len);
+  }
+}
+
+void
+HttpDataFetcherImpl::_getRequestKey(const string &url, string &key) {
+  if (_headers.size() && !_headers_str.size()) {
+    _buildHeadersString();
+  }
+  key.assign(url);
+  key.append("\r\n");
+  key.append(_headers_str); // forwarded headers may change the response
+}
 
+bool
+HttpDataFetcherImpl::_joinInFlightFetch(int base_event_id) {
+  const string &url = _page_entry_lookup[base_event_id]->first;
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
+  string key;
+  _getRequestKey(url, key);
+  pthread_mutex_lock(&_in_flight_lock);
+  InFlightFetchMap::iterator iter = _in_flight_fetches.find(key);
+  if (iter != _in_flight_fetches.end()) {
+    iter->second->waiters.push_back(FetchWaiter(this, base_event_id));
+    ++(iter->second->n_refs);
+    req_data.in_flight_fetch = iter->second;
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
+  if (!req_data.in_flight_fetch) {
+    return false;
+  }
+  Stats::increment(Stats::N_COALESCED_FETCHES);
+  TSDebug(_debug_tag.c_str(), "[%s] Request for URL [%s] will use response of fetch already in flight",
+           __FUNCTION__, url.c_str());
   return true;
 }
 
+void
+HttpDataFetcherImpl::_leadInFlightFetch(int base_event_id) {
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
+  string key;
+  _getRequestKey(_page_entry_lookup[base_event_id]->first, key);
+  InFlightFetch *in_flight_fetch = new InFlightFetch(key, FetchWaiter(this, base_event_id));
+  pthread_mutex_lock(&_in_flight_lock);
+  // someone else may have started the same fetch in the meantime; it is then left to itself
+  if (_in_flight_fetches.insert(InFlightFetchMap::value_type(key, in_flight_fetch)).second) {
+    req_data.in_flight_fetch = in_flight_fetch;
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
+  if (!req_data.in_flight_fetch) {
+    delete in_flight_fetch;
+  }
+}
+
+/** called by the leader of a coalesced fetch; hands the response (if
+ * any) over to the waiters and schedules their continuations */
+void
+HttpDataFetcherImpl::_endInFlightFetch(RequestData &req_data, bool abandoned) {
+  pthread_mutex_lock(&_in_flight_lock);
+  InFlightFetch *in_flight_fetch = req_data.in_flight_fetch;
+  _in_flight_fetches.erase(in_flight_fetch->key);
+  for (FetchWaiterList::iterator iter = in_flight_fetch->waiters.begin();
+       iter != in_flight_fetch->waiters.end(); ++iter) {
+    HttpDataFetcherImpl *waiter = iter->first;
+    if (req_data.response && !abandoned) {
+      req_data.response->acquire();
+    }
+    waiter->_shared_results.push_back(SharedResult(iter->second, abandoned ? 0 : req_data.response, abandoned));
+    if (!waiter->_notify_action) {
+      waiter->_notify_action = TSContSchedule(waiter->_contp, 0, TS_THREAD_POOL_DEFAULT);
+    }
+  }
+  TSDebug(_debug_tag.c_str(), "[%s] %s %d waiting request(s) for [%s]", __FUNCTION__,
+           abandoned ? "Abandoned" : "Handed response to", static_cast<int>(in_flight_fetch->waiters.size()),
+           in_flight_fetch->key.c_str());
+  // waiters drop their references once they are done with the result
+  in_flight_fetch->waiters.clear();
+  _releaseInFlightFetch(req_data);
+  pthread_mutex_unlock(&_in_flight_lock);
+}
+
+// the request no longer leads or waits for a coalesced fetch
+void
+HttpDataFetcherImpl::_leaveInFlightFetch(int base_event_id) {
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
+  FetchWaiter self(this, base_event_id);
+  pthread_mutex_lock(&_in_flight_lock);
+  bool leading = (req_data.in_flight_fetch && (req_data.in_flight_fetch->leader == self));
+  if (req_data.in_flight_fetch && !leading) {
+    req_data.in_flight_fetch->waiters.remove(self); // already gone if the leader is done
+    _releaseInFlightFetch(req_data);
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
+  if (leading) {
+    _endInFlightFetch(req_data, true);
+  }
+}
+
+// drops the request's reference to its coalesced fetch; needs _in_flight_lock
+inline void
+HttpDataFetcherImpl::_releaseInFlightFetch(RequestData &req_data) {
+  if (!--(req_data.in_flight_fetch->n_refs)) {
+    delete req_data.in_flight_fetch;
+  }
+  req_data.in_flight_fetch = 0;
+}
+
+bool
+HttpDataFetcherImpl::_isSharedResultEvent(void *edata) const {
+  // only the event scheduled by a leader; others (e.g., those of the
+  // transformation itself) are not the fetcher's to take
+  if (!_coalesce || !edata) {
+    return false;
+  }
+  pthread_mutex_lock(&_in_flight_lock);
+  bool notified = (static_cast<TSAction>(edata) == _notify_action);
+  pthread_mutex_unlock(&_in_flight_lock);
+  return notified;
+}
+
+void
+HttpDataFetcherImpl::_handleSharedResults() {
+  SharedResultList results;
+  pthread_mutex_lock(&_in_flight_lock);
+  results.swap(_shared_results);
+  _notify_action = 0; // results coming in from now on get a new event
+  for (SharedResultList::iterator iter = results.begin(); iter != results.end(); ++iter) {
+    RequestData &req_data = _page_entry_lookup[iter->base_event_id]->second;
+    if (req_data.in_flight_fetch) { // not if the request timed out meanwhile
+      _releaseInFlightFetch(req_data);
+    }
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
+
+  for (SharedResultList::iterator iter = results.begin(); iter != results.end(); ++iter) {
+    const string &url = _page_entry_lookup[iter->base_event_id]->first;
+    RequestData &req_data = _page_entry_lookup[iter->base_event_id]->second;
+    if (req_data.complete) { // timed out before the result was handed over
+      if (iter->response) {
+        iter->response->release();
+      }
+      continue;
+    }
+    if (iter->abandoned) {
+      TSDebug(_debug_tag.c_str(), "[%s] Fetch for URL [%s] was abandoned; will fetch it again",
+               __FUNCTION__, url.c_str());
+      _fetch_queue.push_back(iter->base_event_id);
+      continue;
+    }
+    --_n_pending_requests;
+    req_data.complete = true;
+    if (iter->response) {
+      req_data.response = iter->response;
+      _processResponse(url, req_data, false); // leader took care of caching it
+    } else {
+      TSError("[%s] Shared fetch for request [%s] failed", __FUNCTION__, url.c_str());
+    }
+  }
+  if (!_n_pending_requests) {
+    _cancelTimeout();
+  }
+  _startQueuedFetches();
+}
+
 bool
 HttpDataFetcherImpl::getData(const string &url, ResponseData &resp_data) const {
   UrlToContentMap::const_iterator iter = _pages.find(url);
@@ -213,7 +755,7 @@ HttpDataFetcherImpl::getData(const string &url, ResponseData &resp_data) const {
     TSError("Request for URL [%s] not complete", url.data());
     return false;
   }
-  if (req_data.response.empty()) {
+  if (!req_data.response) {
     // did not receive valid data
     TSError("No valid data received for URL [%s]; returning empty data to be safe", url.data());
     resp_data.clear();
@@ -225,17 +767,299 @@ HttpDataFetcherImpl::getData(const string &url, ResponseData &resp_data) const {
   return true;
 }
 
+// same criteria as for the template itself: no 'Cache-Control: private' and no 'Expires: 0'
+static bool
+isCacheable(TSMBuffer bufp, TSMLoc hdr_loc) {
+  bool cacheable = true;
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL);
+  if (field_loc) {
+    int n_values = TSMimeHdrFieldValuesCount(bufp, hdr_loc, field_loc);
+    for (int i = 0; cacheable && (i < n_values); ++i) {
+      int value_len;
+      const char *value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, i, &value_len);
+      if (Utils::areEqual(value, value_len, TS_HTTP_VALUE_PRIVATE, TS_HTTP_LEN_PRIVATE) ||
+          Utils::areEqual(value, value_len, TS_HTTP_VALUE_NO_STORE, TS_HTTP_LEN_NO_STORE)) {
+        cacheable = false;
+      }
+    }
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+  field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_EXPIRES, TS_MIME_LEN_EXPIRES);
+  if (field_loc) {
+    int value_len;
+    const char *value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, -1, &value_len);
+    if (value && (value_len == 1) && (*value == '0')) {
+      cacheable = false;
+    }
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+  return cacheable;
+}
+
+// appends the values of the response's validators, each preceded by a newline;
+// etag first, then last-modified (see getConditionalHeaders()). Values of the
+// headers of a 304 response, if given, take precedence
+static bool
+getValidators(TSMBuffer bufp, TSMLoc hdr_loc, string &validators, TSMBuffer update_bufp = 0,
+              TSMLoc update_hdr_loc = 0) {
+  static const char *VALIDATORS[] = { TS_MIME_FIELD_ETAG, TS_MIME_FIELD_LAST_MODIFIED, TS_MIME_FIELD_EXPIRES };
+  static const int VALIDATOR_LENS[] = { TS_MIME_LEN_ETAG, TS_MIME_LEN_LAST_MODIFIED, TS_MIME_LEN_EXPIRES };
+  bool got_validator = false;
+  for (int i = 0; i < static_cast<int>(sizeof(VALIDATORS) / sizeof(VALIDATORS[0])); ++i) {
+    validators += '\n';
+    TSMBuffer field_bufp = update_bufp;
+    TSMLoc field_hdr_loc = update_hdr_loc;
+    TSMLoc field_loc = update_bufp ? TSMimeHdrFieldFind(update_bufp, update_hdr_loc, VALIDATORS[i], VALIDATOR_LENS[i]) : 0;
+    if (!field_loc) {
+      field_bufp = bufp;
+      field_hdr_loc = hdr_loc;
+      field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, VALIDATORS[i], VALIDATOR_LENS[i]);
+    }
+    if (field_loc) {
+      int value_len;
+      const char *value = TSMimeHdrFieldValueStringGet(field_bufp, field_hdr_loc, field_loc, -1, &value_len);
+      if (value && value_len) {
+        validators.append(value, value_len);
+        got_validator = true;
+      }
+      TSHandleMLocRelease(field_bufp, field_hdr_loc, field_loc);
+    }
+  }
+  return got_validator;
+}
+
+// builds If-None-Match and If-Modified-Since headers from validators as
+// appended by getValidators(); false if there is nothing to build them from
+static bool
+getConditionalHeaders(const string &validators, string &headers) {
+  static const char *CONDITIONAL_HEADERS[] = { "If-None-Match", "If-Modified-Since" };
+  headers.clear();
+  size_t pos = 0;
+  for (int i = 0; i < static_cast<int>(sizeof(CONDITIONAL_HEADERS) / sizeof(CONDITIONAL_HEADERS[0])); ++i) {
+    pos = validators.find('\n', pos);
+    if (pos == string::npos) {
+      break;
+    }
+    ++pos;
+    size_t value_end = validators.find('\n', pos);
+    if (value_end == string::npos) {
+      value_end = validators.size();
+    }
+    if (value_end > pos) {
+      headers.append(CONDITIONAL_HEADERS[i]);
+      headers.append(": ");
+      headers.append(validators, pos, value_end - pos);
+      headers.append("\r\n");
+    }
+    pos = value_end;
+  }
+  return !headers.empty();
+}
+
+bool
+HttpDataFetcherImpl::getResponseVersions(string &versions) const {
+  for (IteratorArray::const_iterator iter = _page_entry_lookup.begin(); iter != _page_entry_lookup.end(); ++iter) {
+    const string &url = (*iter)->first;
+    const RequestData &req_data = (*iter)->second;
+    if (!req_data.complete || !req_data.response) {
+      TSDebug(_debug_tag.c_str(), "[%s] No valid response for URL [%s]", __FUNCTION__, url.c_str());
+      return false;
+    }
+    versions.append(url);
+    if (!req_data.bufp) { // served from the fragment cache, which only has cacheable responses
+      if (req_data.validators.empty()) {
+        TSDebug(_debug_tag.c_str(), "[%s] Response for URL [%s] has no validator", __FUNCTION__, url.c_str());
+        return false;
+      }
+      versions.append(req_data.validators);
+    } else {
+      if (!isCacheable(req_data.bufp, req_data.hdr_loc)) {
+        TSDebug(_debug_tag.c_str(), "[%s] Response for URL [%s] is not cacheable", __FUNCTION__, url.c_str());
+        return false;
+      }
+      if (!getValidators(req_data.bufp, req_data.hdr_loc, versions)) {
+        TSDebug(_debug_tag.c_str(), "[%s] Response for URL [%s] has no validator", __FUNCTION__, url.c_str());
+        return false;
+      }
+    }
+    versions += '\n';
+  }
+  return true;
+}
+
+// whether the response has a Cache-Control or Expires header, i.e., one
+// that getFreshnessLifetime() goes by
+static bool
+hasFreshnessHeader(TSMBuffer bufp, TSMLoc hdr_loc) {
+  bool found = false;
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL);
+  if (!field_loc) {
+    field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_EXPIRES, TS_MIME_LEN_EXPIRES);
+  }
+  if (field_loc) {
+    found = true;
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+  return found;
+}
+
+// seconds the response may be cached for as per its Cache-Control or
+// Expires header; 0 if it may not be cached
+static int
+getFreshnessLifetime(TSMBuffer bufp, TSMLoc hdr_loc, time_t now) {
+  int lifetime = -1;
+  TSMLoc field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_CACHE_CONTROL, TS_MIME_LEN_CACHE_CONTROL);
+  if (field_loc) {
+    int n_values = TSMimeHdrFieldValuesCount(bufp, hdr_loc, field_loc);
+    for (int i = 0; i < n_values; ++i) {
+      int value_len;
+      const char *value = TSMimeHdrFieldValueStringGet(bufp, hdr_loc, field_loc, i, &value_len);
+      if (!value) {
+        continue;
+      }
+      if (Utils::areEqual(value, value_len, TS_HTTP_VALUE_PRIVATE, TS_HTTP_LEN_PRIVATE) ||
+          Utils::areEqual(value, value_len, TS_HTTP_VALUE_NO_STORE, TS_HTTP_LEN_NO_STORE) ||
+          Utils::areEqual(value, value_len, TS_HTTP_VALUE_NO_CACHE, TS_HTTP_LEN_NO_CACHE)) {
+        lifetime = 0;
+        break;
+      }
+      if ((value_len > (TS_HTTP_LEN_MAX_AGE + 1)) &&
+          (strncasecmp(value, TS_HTTP_VALUE_MAX_AGE, TS_HTTP_LEN_MAX_AGE) == 0) &&
+          (value[TS_HTTP_LEN_MAX_AGE] == '=')) {
+        lifetime = atoi(string(value + TS_HTTP_LEN_MAX_AGE + 1, value_len - TS_HTTP_LEN_MAX_AGE - 1).c_str());
+      }
+    }
+    TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+  }
+  if (lifetime == -1) { // max-age takes precedence over expires
+    lifetime = 0;
+    field_loc = TSMimeHdrFieldFind(bufp, hdr_loc, TS_MIME_FIELD_EXPIRES, TS_MIME_LEN_EXPIRES);
+    if (field_loc) {
+      time_t expires = TSMimeHdrFieldValueDateGet(bufp, hdr_loc, field_loc);
+      if (expires > now) {
+        lifetime = static_cast<int>(expires - now);
+      }
+      TSHandleMLocRelease(bufp, hdr_loc, field_loc);
+    }
+  }
+  return (lifetime > 0) ? lifetime : 0;
+}
+
+void
+HttpDataFetcherImpl::_cacheFragment(const string &url, const RequestData &req_data,
+                                    TSMBuffer update_bufp /* = 0 */, TSMLoc update_hdr_loc /* = 0 */) {
+  time_t now = time(NULL);
+  int lifetime;
+  if (update_bufp && hasFreshnessHeader(update_bufp, update_hdr_loc)) {
+    lifetime = getFreshnessLifetime(update_bufp, update_hdr_loc, now);
+  } else {
+    lifetime = getFreshnessLifetime(req_data.bufp, req_data.hdr_loc, now);
+  }
+  if (!lifetime) {
+    TSDebug(_debug_tag.c_str(), "[%s] Response for URL [%s] is not to be cached", __FUNCTION__, url.c_str());
+    return;
+  }
+  FragmentCache::Fragment fragment;
+  fragment.response = req_data.response;
+  fragment.body_offset = req_data.body - req_data.response->data.data();
+  fragment.body_len = req_data.body_len;
+  fragment.expiry_time = now + lifetime;
+  if (!getValidators(req_data.bufp, req_data.hdr_loc, fragment.validators, update_bufp, update_hdr_loc)) {
+    fragment.validators.clear(); // cannot be used for output cache versions
+  }
+  string key;
+  _getRequestKey(url, key);
+  _fragment_cache->insert(key, fragment);
+}
+
+/** caches the revalidated response again; freshness and validators are
+ * those of the 304 response where it has them */
+void
+HttpDataFetcherImpl::_cacheRevalidatedFragment(const string &url, const RequestData &req_data,
+                                               const char *not_modified_resp, int not_modified_resp_len) {
+  TSMBuffer bufp = TSMBufferCreate();
+  TSMLoc hdr_loc = TSHttpHdrCreate(bufp);
+  TSHttpHdrTypeSet(bufp, hdr_loc, TS_HTTP_TYPE_RESPONSE);
+  TSHttpParserClear(_http_parser);
+  const char *startptr = not_modified_resp;
+  if (TSHttpHdrParseResp(_http_parser, bufp, hdr_loc, &startptr,
+                         not_modified_resp + not_modified_resp_len) == TS_PARSE_DONE) {
+    _cacheFragment(url, req_data, bufp, hdr_loc);
+  } else {
+    TSDebug(_debug_tag.c_str(), "[%s] Could not parse 304 response for URL [%s]; using cached headers",
+             __FUNCTION__, url.c_str());
+    _cacheFragment(url, req_data);
+  }
+  TSHandleMLocRelease(bufp, TS_NULL_MLOC, hdr_loc);
+  TSMBufferDestroy(bufp);
+}
+
+bool
+HttpDataFetcherImpl::_useCachedFragment(int base_event_id) {
+  const string &url = _page_entry_lookup[base_event_id]->first;
+  RequestData &req_data = _page_entry_lookup[base_event_id]->second;
+  string key;
+  _getRequestKey(url, key);
+  FragmentCache::Fragment fragment;
+  bool stale;
+  if (!_fragment_cache->lookup(key, time(NULL), fragment, &stale)) {
+    return false;
+  }
+  if (stale) {
+    if (getConditionalHeaders(fragment.validators, req_data.conditional_headers)) {
+      TSDebug(_debug_tag.c_str(), "[%s] Will revalidate cached response for URL [%s]", __FUNCTION__,
+               url.c_str());
+      req_data.stale_fragment = fragment;
+    } else {
+      fragment.response->release();
+    }
+    return false;
+  }
+  req_data.response = fragment.response;
+  req_data.body = fragment.response->data.data() + fragment.body_offset;
+  req_data.body_len = fragment.body_len;
+  req_data.validators = fragment.validators;
+  req_data.complete = true;
+  --_n_pending_requests;
+  TSDebug(_debug_tag.c_str(), "[%s] Serving URL [%s] from fragment cache; body of size %d", __FUNCTION__,
+           url.c_str(), req_data.body_len);
+  _callbackObjects(url, req_data);
+  return true;
+}
+
 void
 HttpDataFetcherImpl::clear() {
+  for (int i = 0; i < static_cast<int>(_page_entry_lookup.size()); ++i) {
+    if (_page_entry_lookup[i]->second.in_flight_fetch) {
+      _leaveInFlightFetch(i);
+    }
+  }
+  _cancelTimeout();
+  pthread_mutex_lock(&_in_flight_lock);
+  for (SharedResultList::iterator iter = _shared_results.begin(); iter != _shared_results.end(); ++iter) {
+    if (iter->response) {
+      iter->response->release();
+    }
+  }
+  _shared_results.clear();
+  if (_notify_action) {
+    TSActionCancel(_notify_action);
+    _notify_action = 0;
+  }
+  pthread_mutex_unlock(&_in_flight_lock);
   for (UrlToContentMap::iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
     _release(iter->second);
   }
   _n_pending_requests = 0;
+  if (_n_in_flight) { // responses to these will not be looked at
+    __sync_sub_and_fetch(&_n_process_in_flight, _n_in_flight);
+    _n_in_flight = 0;
+  }
+  _fetch_queue.clear();
   _pages.clear();
   _page_entry_lookup.clear();
   _headers_str.clear();
   _headers.clear();
-  _curr_event_id_base = FETCH_EVENT_ID_BASE;
 }
 
 DataStatus
@@ -248,18 +1072,29 @@ HttpDataFetcherImpl::getRequestStatus(const string &url) const {
   if (!(iter->second).complete) {
     return STATUS_DATA_PENDING;
   }
-  if ((iter->second).response.empty()) {
+  if (!(iter->second).response) {
     return STATUS_ERROR;
   }
   return STATUS_DATA_AVAILABLE;
 }
 
+int
+HttpDataFetcherImpl::getResponseTime(const string &url) const {
+  UrlToContentMap::const_iterator iter = _pages.find(url);
+  return (iter == _pages.end()) ? -1 : (iter->second).response_time;
+}
+
 void
 HttpDataFetcherImpl::useHeader(const HttpHeader &header) {
   if (Utils::areEqual(header.name, header.name_len,
                       TS_MIME_FIELD_ACCEPT_ENCODING, TS_MIME_LEN_ACCEPT_ENCODING)) {
     return;
   }
+  for (int i = 0; i < static_cast<int>(sizeof(UNFORWARDED_HEADERS) / sizeof(UNFORWARDED_HEADERS[0])); ++i) {
+    if (Utils::areEqual(header.name, header.name_len, UNFORWARDED_HEADERS[i], strlen(UNFORWARDED_HEADERS[i]))) {
+      return;
+    }
+  }
   string name(header.name, header.name_len);
   string value(header.value, header.value_len);
   std::pair<StringHash::iterator, bool> result = _headers.insert(StringHash::value_type(name, value));
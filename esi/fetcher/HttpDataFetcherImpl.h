@@ -27,11 +27,13 @@
 #include <string>
 #include <list>
 #include <vector>
+#include <pthread.h>
 
 #include "ts/ts.h"
 #include "StringHash.h"
 #include "HttpHeader.h"
 #include "HttpDataFetcher.h"
+#include "FragmentCache.h"
 
 class HttpDataFetcherImpl : public HttpDataFetcher
 {
@@ -45,6 +47,8 @@ public:
   void useHeaders(const EsiLib::HttpHeaderList &headers);
 
   bool addFetchRequest(const std::string &url, FetchedDataProcessor *callback_obj = 0);
+
+  void setRequestTimeout(const std::string &url, int timeout);
   
   bool handleFetchEvent(TSEvent event, void *edata);
 
@@ -53,12 +57,25 @@ public:
     return _isFetchEvent(event, base_event_id);
   }
 
+  /** also recognizes the events the fetcher schedules for itself (its
+   * timer and the hand-over of coalesced fetch results), which have to be
+   * handed to handleFetchEvent() as well */
+  bool isFetchEvent(TSEvent event, void *edata) const {
+    return ((_timeout_action && (edata == _timeout_action)) || _isSharedResultEvent(edata) || isFetchEvent(event));
+  }
+
   bool isFetchComplete() const { return (_n_pending_requests == 0); };
 
+  /** fetches of requests that timed out may still be running; the
+   * continuation must not go away before their (late) events came in */
+  bool hasFetchesInFlight() const { return (_n_in_flight > 0); };
+
   DataStatus getRequestStatus(const std::string &url) const;
 
   int getNumPendingRequests() const { return _n_pending_requests; };
 
+  int getResponseTime(const std::string &url) const;
+
   // used to return data to callers
   struct ResponseData {
     const char *content;
@@ -82,8 +99,47 @@ public:
     return false;
   }
 
+  /** appends the url and the validators (etag, last-modified and expires headers)
+   * of the response to each request made so far, in request order. Returns
+   * false if a request failed or its response carries no validator or is not
+   * to be cached */
+  bool getResponseVersions(std::string &versions) const;
+
   void clear();
 
+  /** bounds the number of fetches in flight per fetcher (i.e., per
+   * document) and across all fetchers; 0 means no limit. Requests over
+   * the limit are queued and started in the order they were added,
+   * i.e., in document order. The process limit never holds back the
+   * first fetch of a fetcher so that every document makes progress */
+  static void setConcurrencyLimits(int max_in_flight, int max_process_in_flight);
+
+  int getNumQueuedRequests() const { return static_cast<int>(_fetch_queue.size()); };
+
+  /** if enabled, a request for an include (url and forwarded headers)
+   * that another fetcher of this process is already fetching waits for
+   * that fetch instead of making its own; the response is then shared.
+   * The waiting fetcher's continuation is scheduled (and sees a fetch
+   * event) once the response is in */
+  static void setCoalescing(bool coalesce) { _coalesce = coalesce; };
+
+  /** sets up a process-wide cache of include responses of given size; 0
+   * disables it. Requests for cached includes are served right when they
+   * are added, i.e., without a fetch. Responses are cached for as long as
+   * their Cache-Control max-age or Expires header allows, and only if they
+   * are neither private nor no-store/no-cache. Expired responses with an
+   * ETag or Last-Modified header are revalidated with a conditional
+   * request; a 304 response makes the cached one fresh again. Meant to be
+   * called once at startup */
+  static void setFragmentCacheSize(size_t max_size);
+
+  /** sets the default time (in ms) a request may take to complete and the
+   * time all requests of a fetcher may take, counted from the first request
+   * added after construction or clear(); 0 means no limit. Requests that
+   * run out of time fail (see setRequestTimeout()); their late responses
+   * are dropped */
+  static void setTimeouts(int include_timeout, int page_deadline);
+
   ~HttpDataFetcherImpl();
 
 private:
@@ -92,17 +148,31 @@ private:
   std::string _debug_tag;
 
   typedef std::list<FetchedDataProcessor *> CallbackObjectList;
+
+  struct InFlightFetch;
  
   // used to track a request that was made
   struct RequestData {
-    std::string response;
+    EsiLib::SharedResponse *response; // null if no valid response was received
     const char *body;
     int body_len;
     CallbackObjectList callback_objects;
     bool complete;
+    bool in_flight;
     TSMBuffer bufp;
     TSMLoc hdr_loc;
-    RequestData() : body(0), body_len(0), complete(false), bufp(0), hdr_loc(0) { };
+    TSHRTime queue_time; // set while the request waits to be started
+    TSHRTime start_time; // set when the request's own fetch is started
+    int response_time; // ms; -1 until the request's own fetch completes
+    TSHRTime deadline; // 0 if the request may take as long as it takes
+    bool timed_out; // its fetch may still be in flight then
+    InFlightFetch *in_flight_fetch; // coalesced fetch this request leads or waits for
+    std::string validators; // of a response served from the fragment cache (which has no parsed headers)
+    EsiLib::FragmentCache::Fragment stale_fragment; // expired cached response being revalidated
+    std::string conditional_headers; // for the revalidation
+    RequestData() : response(0), body(0), body_len(0), complete(false), in_flight(false), bufp(0), hdr_loc(0),
+                    queue_time(0), start_time(0), response_time(-1), deadline(0), timed_out(false),
+                    in_flight_fetch(0) { };
   };
 
   typedef __gnu_cxx::hash_map<std::string, RequestData, EsiLib::StringHasher> UrlToContentMap;
@@ -112,7 +182,54 @@ private:
   IteratorArray _page_entry_lookup; // used to map event ids to requests
 
   int _n_pending_requests;
-  int _curr_event_id_base;
+  int _n_in_flight;
+
+  typedef std::list<int> RequestQueue;
+  RequestQueue _fetch_queue; // base event ids of requests not started yet
+
+  typedef std::pair<HttpDataFetcherImpl *, int> FetchWaiter; // fetcher and base event id
+  typedef std::list<FetchWaiter> FetchWaiterList;
+
+  // guarded by _in_flight_lock
+  struct InFlightFetch {
+    std::string key;
+    FetchWaiter leader;
+    FetchWaiterList waiters;
+    int n_refs; // leader and waiters still pointing to it
+    InFlightFetch(const std::string &k, const FetchWaiter &l) : key(k), leader(l), n_refs(1) { };
+  };
+
+  typedef __gnu_cxx::hash_map<std::string, InFlightFetch *, EsiLib::StringHasher> InFlightFetchMap;
+
+  // responses of coalesced fetches handed over by their leaders
+  struct SharedResult {
+    int base_event_id;
+    EsiLib::SharedResponse *response;
+    bool abandoned; // leader went away before the fetch completed
+    SharedResult(int id, EsiLib::SharedResponse *r, bool a) : base_event_id(id), response(r), abandoned(a) { };
+  };
+
+  typedef std::list<SharedResult> SharedResultList;
+
+  // guarded by _in_flight_lock
+  SharedResultList _shared_results;
+  TSAction _notify_action;
+
+  static bool _coalesce;
+  static EsiLib::FragmentCache *_fragment_cache;
+  static InFlightFetchMap _in_flight_fetches;
+  static pthread_mutex_t _in_flight_lock;
+
+  TSHRTime _page_start;
+  TSAction _timeout_action; // timer for the earliest deadline
+  TSHRTime _timeout_time;
+
+  static int _include_timeout;
+  static int _page_deadline;
+
+  static int _max_in_flight;
+  static int _max_process_in_flight;
+  static volatile int _n_process_in_flight;
   TSHttpParser _http_parser;
 
   static const int FETCH_EVENT_ID_BASE;
@@ -127,12 +244,43 @@ private:
   std::string _headers_str;
   
   inline void _buildHeadersString();
-  void _createRequest(std::string &http_req, const std::string &url);
+  void _createRequest(std::string &http_req, const std::string &url, const RequestData &req_data);
+  void _startFetch(int base_event_id);
+  void _startQueuedFetches();
+  void _fetchDone(RequestData &req_data);
+  void _processResponse(const std::string &url, RequestData &req_data, bool cache_response);
+  void _callbackObjects(const std::string &url, RequestData &req_data);
+  bool _useCachedFragment(int base_event_id);
+  void _cacheFragment(const std::string &url, const RequestData &req_data, TSMBuffer update_bufp = 0,
+                      TSMLoc update_hdr_loc = 0);
+  void _cacheRevalidatedFragment(const std::string &url, const RequestData &req_data,
+                                 const char *not_modified_resp, int not_modified_resp_len);
+  void _getRequestKey(const std::string &url, std::string &key);
+  bool _joinInFlightFetch(int base_event_id);
+  void _leadInFlightFetch(int base_event_id);
+  void _endInFlightFetch(RequestData &req_data, bool abandoned);
+  void _leaveInFlightFetch(int base_event_id);
+  inline void _releaseInFlightFetch(RequestData &req_data);
+  bool _isSharedResultEvent(void *edata) const;
+  void _handleSharedResults();
   inline void _release(RequestData &req_data);
+  void _setDeadline(RequestData &req_data, int timeout);
+  void _scheduleTimeout(TSHRTime deadline);
+  inline void _cancelTimeout();
+  void _handleTimeouts();
+  void _timeOut(int base_event_id);
 
   sockaddr const* _client_addr;
 };
 
+inline void
+HttpDataFetcherImpl::_cancelTimeout() {
+  if (_timeout_action) {
+    TSActionCancel(_timeout_action);
+    _timeout_action = 0;
+  }
+}
+
 inline void
 HttpDataFetcherImpl::ResponseData::set(const char *c, int clen, TSMBuffer b, TSMLoc loc) {
   content = c;
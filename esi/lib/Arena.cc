@@ -0,0 +1,108 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#include <stdlib.h>
+
+#include "Arena.h"
+
+using namespace EsiLib;
+
+const size_t Arena::DEFAULT_BLOCK_SIZE = 16 * 1024;
+const size_t Arena::ALIGNMENT = 2 * sizeof(void *);
+
+static inline size_t
+alignSize(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+Arena::Arena(size_t block_size /* = DEFAULT_BLOCK_SIZE */)
+  : _blocks(0), _curr(0), _end(0), _block_size(block_size), _n_allocations(0), _n_blocks(0) {
+}
+
+char *
+Arena::_addBlock(size_t size) {
+  size_t header_size = alignSize(sizeof(Block), ALIGNMENT);
+  Block *block = static_cast<Block *>(malloc(header_size + size));
+  if (!block) {
+    throw std::bad_alloc();
+  }
+  block->size = size;
+  block->next = _blocks;
+  _blocks = block;
+  ++_n_blocks;
+  return reinterpret_cast<char *>(block) + header_size;
+}
+
+void *
+Arena::allocate(size_t size) {
+  size = alignSize(size ? size : 1, ALIGNMENT);
+  ++_n_allocations;
+  if (static_cast<size_t>(_end - _curr) >= size) {
+    void *retval = _curr;
+    _curr += size;
+    return retval;
+  }
+  if (size > (_block_size / 4)) {
+    // big allocations get a block of their own so that the current
+    // block's remaining space is not wasted
+    return _addBlock(size);
+  }
+  _curr = _addBlock(_block_size);
+  _end = _curr + _block_size;
+  void *retval = _curr;
+  _curr += size;
+  return retval;
+}
+
+void
+Arena::reset() {
+  Block *keep = 0;
+  while (_blocks) {
+    Block *next = _blocks->next;
+    if (!keep && (_blocks->size == _block_size)) {
+      keep = _blocks;
+    } else {
+      free(_blocks);
+    }
+    _blocks = next;
+  }
+  _blocks = keep;
+  _n_blocks = 0;
+  _n_allocations = 0;
+  if (keep) {
+    keep->next = 0;
+    _curr = reinterpret_cast<char *>(keep) + alignSize(sizeof(Block), ALIGNMENT);
+    _end = _curr + _block_size;
+  } else {
+    _curr = _end = 0;
+  }
+}
+
+Arena::~Arena() {
+  while (_blocks) {
+    Block *next = _blocks->next;
+    free(_blocks);
+    _blocks = next;
+  }
+}
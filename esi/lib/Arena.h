@@ -0,0 +1,152 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#ifndef _ESI_ARENA_H
+#define _ESI_ARENA_H
+
+#include <stddef.h>
+#include <new>
+
+namespace EsiLib {
+
+/** bump allocator for objects that share a lifetime (e.g., the node
+ * tree of a request). Individual frees are no-ops; all memory is
+ * handed back by reset() or on destruction */
+class Arena
+{
+
+public:
+
+  static const size_t DEFAULT_BLOCK_SIZE;
+
+  Arena(size_t block_size = DEFAULT_BLOCK_SIZE);
+
+  void *allocate(size_t size);
+
+  /** releases all allocations; the first block is kept for reuse */
+  void reset();
+
+  /** number of allocations since last reset (for stats/benchmarks) */
+  size_t getNumAllocations() const { return _n_allocations; };
+
+  /** number of blocks obtained from the heap since last reset */
+  size_t getNumBlocks() const { return _n_blocks; };
+
+  ~Arena();
+
+private:
+
+  struct Block {
+    Block *next;
+    size_t size;
+  };
+
+  static const size_t ALIGNMENT;
+
+  Block *_blocks; // most recently allocated first
+  char *_curr;
+  char *_end;
+  size_t _block_size;
+  size_t _n_allocations;
+  size_t _n_blocks;
+
+  char *_addBlock(size_t size);
+
+  // not copyable
+  Arena(const Arena &);
+  Arena &operator =(const Arena &);
+
+};
+
+/** STL allocator over an arena; falls back to the heap when no arena is
+ * given. Containers can only exchange elements (splice, swap) when
+ * their allocators use the same arena */
+template<typename T>
+class ArenaAllocator
+{
+
+public:
+
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef T value_type;
+
+  template<typename U>
+  struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator(Arena *arena = 0) throw() : _arena(arena) { };
+
+  template<typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) throw() : _arena(other.getArena()) { };
+
+  pointer address(reference x) const { return &x; };
+
+  const_pointer address(const_reference x) const { return &x; };
+
+  pointer allocate(size_type n, const void * = 0) {
+    if (_arena) {
+      return static_cast<pointer>(_arena->allocate(n * sizeof(T)));
+    }
+    return static_cast<pointer>(::operator new(n * sizeof(T)));
+  };
+
+  void deallocate(pointer p, size_type) {
+    if (!_arena) {
+      ::operator delete(p);
+    }
+  };
+
+  size_type max_size() const throw() { return static_cast<size_type>(-1) / sizeof(T); };
+
+  void construct(pointer p, const T &val) { new(static_cast<void *>(p)) T(val); };
+
+  void destroy(pointer p) { p->~T(); };
+
+  Arena *getArena() const { return _arena; };
+
+private:
+
+  Arena *_arena;
+
+};
+
+template<typename T, typename U>
+inline bool operator ==(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+  return lhs.getArena() == rhs.getArena();
+}
+
+template<typename T, typename U>
+inline bool operator !=(const ArenaAllocator<T> &lhs, const ArenaAllocator<U> &rhs) {
+  return lhs.getArena() != rhs.getArena();
+}
+
+};
+
+#endif // _ESI_ARENA_H
@@ -26,6 +26,8 @@
 
 #include <list>
 
+#include "Arena.h"
+
 namespace EsiLib {
 
 struct Attribute {
@@ -37,7 +39,7 @@ struct Attribute {
     : name(n), name_len(n_len), value(v), value_len(v_len) { };
 };
 
-typedef std::list<Attribute> AttributeList;
+typedef std::list<Attribute, ArenaAllocator<Attribute> > AttributeList;
 
 };
 
@@ -21,7 +21,10 @@
   limitations under the License.
  */
 
+#include <string.h>
+
 #include "DocNode.h"
+#include "Expression.h"
 #include "Utils.h"
 
 using std::string;
@@ -60,6 +63,10 @@ const char *DocNode::type_names_[] = { "UNKNOWN",
 
 const char DocNode::VERSION = 1;
 
+// smallest valid node: version, size, type, data length, attribute
+// count and child count
+static const int MIN_PACKED_NODE_SIZE = sizeof(char) + (5 * sizeof(int32_t));
+
 // helper functions 
 
 inline void
@@ -70,18 +77,36 @@ packString(const char *str, int32_t str_len, string &buffer) {
   }
 }
 
-inline void
-unpackString(const char *&packed_data, const char *&item, int32_t &item_len) {
-  item_len = *(reinterpret_cast<const int32_t *>(packed_data));
-  packed_data += sizeof(int32_t);
+template<typename T> inline bool
+unpackItem(const char *&packed_data, const char *packed_data_end, T &item) {
+  if ((packed_data_end - packed_data) < static_cast<int>(sizeof(T))) {
+    return false;
+  }
+  memcpy(&item, packed_data, sizeof(T)); // packed data need not be aligned
+  packed_data += sizeof(T);
+  return true;
+}
+
+inline bool
+unpackString(const char *&packed_data, const char *packed_data_end, const char *&item, int32_t &item_len) {
+  if (!unpackItem(packed_data, packed_data_end, item_len) || (item_len < 0) ||
+      (item_len > (packed_data_end - packed_data))) {
+    return false;
+  }
   item = item_len ? packed_data : 0;
   packed_data += item_len;
+  return true;
 }
 
-template<typename T> inline void
-unpackItem(const char *&packed_data, T &item) {
-  item = *(reinterpret_cast<const T *>(packed_data));
-  packed_data += sizeof(T);
+inline bool
+isValidType(DocNode::TYPE type) {
+  return ((type >= DocNode::TYPE_UNKNOWN) && (type <= DocNode::TYPE_SPECIAL_INCLUDE));
+}
+
+// checks that count items of given size starting at offset fit in limit
+inline bool
+isValidRange(int32_t offset, int32_t count, int32_t item_size, int32_t limit) {
+  return ((offset >= 0) && (count >= 0) && (offset <= limit) && (count <= ((limit - offset) / item_size)));
 }
 
 void
@@ -98,7 +123,8 @@ DocNode::pack(string &buffer) const {
     packString(iter->value, iter->value_len, buffer);
   }
   child_nodes.packToBuffer(buffer);
-  *(reinterpret_cast<int32_t *>(&buffer[orig_buf_size + 1])) = buffer.size() - orig_buf_size;
+  int32_t node_size = buffer.size() - orig_buf_size;
+  memcpy(&buffer[orig_buf_size + 1], &node_size, sizeof(node_size)); // may not be aligned
 }
 
 bool
@@ -117,29 +143,38 @@ DocNode::unpack(const char *packed_data, int packed_data_len, int &node_len) {
   ++packed_data;
 
   int32_t node_size;
-  unpackItem(packed_data, node_size);
+  unpackItem(packed_data, packed_data_start + packed_data_len, node_size);
   if (node_size > packed_data_len) {
     Utils::ERROR_LOG("[%s] Data size (%d) not sufficient to hold node of size %d",
                      __FUNCTION__, packed_data_len, node_size);
     return false;
   }
+  if (node_size < MIN_PACKED_NODE_SIZE) {
+    Utils::ERROR_LOG("[%s] Invalid node size %d", __FUNCTION__, node_size);
+    return false;
+  }
   node_len = node_size;
-
-  unpackItem(packed_data, type);
-
-  unpackString(packed_data, data, data_len);
+  const char *packed_data_end = packed_data_start + node_size;
 
   int32_t n_elements;
-  unpackItem(packed_data, n_elements);
+  if (!unpackItem(packed_data, packed_data_end, type) || !isValidType(type) ||
+      !unpackString(packed_data, packed_data_end, data, data_len) ||
+      !unpackItem(packed_data, packed_data_end, n_elements) || (n_elements < 0)) {
+    Utils::ERROR_LOG("[%s] Corrupt node data", __FUNCTION__);
+    return false;
+  }
   Attribute attr;
   attr_list.clear();
   for (int i = 0; i < n_elements; ++i) {
-    unpackString(packed_data, attr.name, attr.name_len);
-    unpackString(packed_data, attr.value, attr.value_len);
+    if (!unpackString(packed_data, packed_data_end, attr.name, attr.name_len) ||
+        !unpackString(packed_data, packed_data_end, attr.value, attr.value_len)) {
+      Utils::ERROR_LOG("[%s] Corrupt attribute data", __FUNCTION__);
+      return false;
+    }
     attr_list.push_back(attr);
   }
 
-  if (!child_nodes.unpack(packed_data, packed_data_len - (packed_data - packed_data_start))) {
+  if (!child_nodes.unpack(packed_data, packed_data_end - packed_data)) {
     Utils::ERROR_LOG("[%s] Could not unpack child nodes", __FUNCTION__);
     return false;
   }
@@ -155,25 +190,436 @@ DocNodeList::packToBuffer(string &buffer) const {
   }
 }
 
+static void
+addFlatNodes(const FlatDocNodeList &flat_list, int begin, int end, DocNodeList &node_list) {
+  for (int index = begin; index < end; index = flat_list[index].subtree_end) {
+    FlatDocNode flat_node = flat_list[index];
+    node_list.push_back(DocNode(flat_node.type, flat_node.data, flat_node.data_len, node_list.getArena()));
+    DocNode &node = node_list.back();
+    for (int i = 0; i < flat_node.n_attrs; ++i) {
+      node.attr_list.push_back(flat_list.getAttribute(flat_node, i));
+    }
+    addFlatNodes(flat_list, index + 1, flat_node.subtree_end, node.child_nodes);
+  }
+}
+
 bool
 DocNodeList::unpack(const char *data, int data_len) {
   if (!data || (data_len < static_cast<int>(sizeof(int32_t)))) {
     Utils::ERROR_LOG("[%s] Invalid arguments", __FUNCTION__);
     return false;
   }
+  clear();
+  if (FlatDocNodeList::isPackedVersion2(data, data_len)) {
+    FlatDocNodeList flat_list;
+    if (!flat_list.unpack(data, data_len)) {
+      Utils::ERROR_LOG("[%s] Could not unpack version 2 node list", __FUNCTION__);
+      return false;
+    }
+    addFlatNodes(flat_list, 0, flat_list.size(), *this);
+    return true;
+  }
   const char *data_start = data;
   int32_t n_elements;
-  unpackItem(data, n_elements);
+  unpackItem(data, data_start + data_len, n_elements);
+  int data_offset = data - data_start, node_size;
+  for (int i = 0; i < n_elements; ++i) {
+    // unpack in place to avoid copying the node's subtree
+    push_back(DocNode(DocNode::TYPE_UNKNOWN, 0, 0, getArena()));
+    if (!back().unpack(data_start + data_offset, data_len - data_offset, node_size)) {
+      Utils::ERROR_LOG("[%s] Could not unpack node", __FUNCTION__);
+      pop_back();
+      return false;
+    }
+    data_offset += node_size;
+  }
+  return true;
+}
+
+const char FlatDocNodeList::PACK_MAGIC[3] = { 'E', 'S', 'I' };
+
+void
+FlatDocNodeList::clear() {
+  _nodes.clear();
+  _attrs.clear();
+  _packed_nodes = 0;
+  _packed_attrs = 0;
+  _packed_strings = 0;
+  _n_packed_nodes = 0;
+  _n_packed_attrs = 0;
+  _packed_deps = 0;
+  _packed_deps_len = 0;
+}
+
+/** moves nodes of a version 2 buffer in use into own storage */
+void
+FlatDocNodeList::_copyPackedNodes() {
+  _nodes.clear();
+  _attrs.clear();
+  _nodes.reserve(_n_packed_nodes);
+  _attrs.reserve(_n_packed_attrs);
+  PackedNode node; // buffer may not be aligned; hence the copies
+  for (int i = 0; i < _n_packed_nodes; ++i) {
+    memcpy(&node, _packed_nodes + i, sizeof(node));
+    _nodes.push_back(FlatDocNode(node.type, node.data_len ? (_packed_strings + node.data_offset) : 0,
+                                 node.data_len, node.attr_begin, node.n_attrs, node.subtree_end,
+                                 node.code_len ? (_packed_strings + node.code_offset) : 0, node.code_len));
+  }
+  PackedAttribute attr;
+  for (int i = 0; i < _n_packed_attrs; ++i) {
+    memcpy(&attr, _packed_attrs + i, sizeof(attr));
+    _attrs.push_back(Attribute(attr.name_len ? (_packed_strings + attr.name_offset) : 0, attr.name_len,
+                               attr.value_len ? (_packed_strings + attr.value_offset) : 0, attr.value_len));
+  }
+  _packed_nodes = 0;
+  _packed_attrs = 0;
+  _packed_strings = 0;
+  _n_packed_nodes = 0;
+  _n_packed_attrs = 0;
+}
+
+void
+FlatDocNodeList::append(const DocNodeList &node_list) {
+  if (_packed_nodes) {
+    _copyPackedNodes();
+  }
+  for (DocNodeList::const_iterator iter = node_list.begin(); iter != node_list.end(); ++iter) {
+    _append(*iter);
+  }
+}
+
+void
+FlatDocNodeList::_append(const DocNode &node) {
+  int index = _nodes.size();
+  _nodes.push_back(FlatDocNode(node.type, node.data, node.data_len));
+  FlatDocNode &flat_node = _nodes.back();
+  flat_node.attr_begin = _attrs.size();
+  flat_node.n_attrs = node.attr_list.size();
+  _attrs.insert(_attrs.end(), node.attr_list.begin(), node.attr_list.end());
+  for (DocNodeList::const_iterator iter = node.child_nodes.begin(); iter != node.child_nodes.end(); ++iter) {
+    _append(*iter);
+  }
+  _nodes[index].subtree_end = _nodes.size(); // flat_node may have been invalidated by now
+}
+
+void
+FlatDocNodeList::pack(string &buffer, bool retain_buffer_data /* = false */,
+                      PackVersion version /* = PACK_VERSION_1 */) const {
+  if (!retain_buffer_data) {
+    buffer.clear();
+  }
+  if (version == PACK_VERSION_2) {
+    _packVersion2(buffer);
+  } else {
+    _packList(0, size(), buffer);
+  }
+}
+
+void
+FlatDocNodeList::_packList(int begin, int end, string &buffer) const {
+  int32_t n_elements = 0;
+  for (int index = begin; index < end; index = (*this)[index].subtree_end) {
+    ++n_elements;
+  }
+  buffer.append(reinterpret_cast<const char *>(&n_elements), sizeof(n_elements));
+  for (int index = begin; index < end; index = (*this)[index].subtree_end) {
+    _packNode(index, buffer);
+  }
+}
+
+void
+FlatDocNodeList::_packNode(int index, string &buffer) const {
+  FlatDocNode node = (*this)[index];
+  int32_t orig_buf_size = buffer.size();
+  buffer += DocNode::VERSION;
+  buffer.append(sizeof(int32_t), ' '); // reserve space for length
+  buffer.append(reinterpret_cast<const char *>(&node.type), sizeof(node.type));
+  packString(node.data, node.data_len, buffer);
+  buffer.append(reinterpret_cast<const char *>(&node.n_attrs), sizeof(node.n_attrs));
+  for (int i = 0; i < node.n_attrs; ++i) {
+    Attribute attr = _getAttribute(node.attr_begin + i);
+    packString(attr.name, attr.name_len, buffer);
+    packString(attr.value, attr.value_len, buffer);
+  }
+  _packList(index + 1, node.subtree_end, buffer);
+  int32_t node_size = buffer.size() - orig_buf_size;
+  memcpy(&buffer[orig_buf_size + 1], &node_size, sizeof(node_size)); // may not be aligned
+}
+
+void
+FlatDocNodeList::_packVersion2(string &buffer) const {
+  int n_nodes = size(), n_attrs = _getNumAttributes();
+  size_t header_pos = buffer.size();
+  PackedHeader header;
+  memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+  header.version = PACK_VERSION_2;
+  header.n_nodes = n_nodes;
+  header.n_attrs = n_attrs;
+  header.nodes_offset = sizeof(PackedHeader);
+  header.attrs_offset = header.nodes_offset + (n_nodes * sizeof(PackedNode));
+  header.strings_offset = header.attrs_offset + (n_attrs * sizeof(PackedAttribute));
+  buffer.resize(header_pos + header.strings_offset);
+
+  // records first; string offsets follow the order strings are appended in below
+  int32_t strings_size = 0;
+  string codes, deps_data;
+  for (int i = 0; i < n_nodes; ++i) {
+    FlatDocNode node = (*this)[i];
+    int32_t code_len = 0;
+    if ((node.type == DocNode::TYPE_VARS) ||
+        (((node.type == DocNode::TYPE_WHEN) || (node.type == DocNode::TYPE_INCLUDE)) && node.n_attrs)) {
+      size_t code_pos = codes.size();
+      if (node.code_len) {
+        codes.append(node.code, node.code_len);
+      } else if (node.type == DocNode::TYPE_VARS) {
+        Expression::compileExpansion(node.data, node.data_len, codes);
+      } else {
+        Attribute attr = getAttribute(node, 0); // test expression or src
+        if (node.type == DocNode::TYPE_WHEN) {
+          Expression::compile(attr.value, attr.value_len, codes);
+        } else {
+          Expression::compileExpansion(attr.value, attr.value_len, codes);
+        }
+      }
+      code_len = codes.size() - code_pos;
+    }
+    PackedNode packed_node = { node.type, strings_size, node.data_len, node.attr_begin, node.n_attrs,
+                               node.subtree_end, strings_size + node.data_len, code_len };
+    strings_size += node.data_len + code_len;
+    memcpy(&buffer[header_pos + header.nodes_offset + (i * sizeof(PackedNode))], &packed_node, sizeof(packed_node));
+  }
+  for (int i = 0; i < n_attrs; ++i) {
+    Attribute attr = _getAttribute(i);
+    PackedAttribute packed_attr = { strings_size, attr.name_len, strings_size + attr.name_len, attr.value_len };
+    strings_size += attr.name_len + attr.value_len;
+    memcpy(&buffer[header_pos + header.attrs_offset + (i * sizeof(PackedAttribute))], &packed_attr,
+           sizeof(packed_attr));
+  }
+  VariableDependencies deps;
+  getDependencies(deps);
+  deps.pack(deps_data);
+  header.deps_offset = strings_size;
+  header.deps_size = deps_data.size();
+  strings_size += header.deps_size;
+  header.strings_size = strings_size;
+  header.total_size = header.strings_offset + strings_size;
+  memcpy(&buffer[header_pos], &header, sizeof(header));
+
+  buffer.reserve(header_pos + header.total_size);
+  PackedNode packed_node;
+  const char *code = codes.data();
+  for (int i = 0; i < n_nodes; ++i) {
+    FlatDocNode node = (*this)[i];
+    buffer.append(node.data, node.data_len);
+    memcpy(&packed_node, &buffer[header_pos + header.nodes_offset + (i * sizeof(PackedNode))], sizeof(packed_node));
+    buffer.append(code, packed_node.code_len);
+    code += packed_node.code_len;
+  }
+  for (int i = 0; i < n_attrs; ++i) {
+    Attribute attr = _getAttribute(i);
+    buffer.append(attr.name, attr.name_len);
+    buffer.append(attr.value, attr.value_len);
+  }
+  buffer.append(deps_data);
+}
+
+void
+FlatDocNodeList::getDependencies(VariableDependencies &deps) const {
+  if (_packed_deps && deps.unpack(_packed_deps, _packed_deps_len)) {
+    return;
+  }
+  deps.clear();
+  _computeDependencies(deps);
+}
+
+void
+FlatDocNodeList::_computeDependencies(VariableDependencies &deps) const {
+  for (int i = 0; i < size(); ++i) {
+    FlatDocNode node = (*this)[i];
+    if ((node.type == DocNode::TYPE_VARS) || (node.type == DocNode::TYPE_HTML_COMMENT)) {
+      Expression::getDependencies(node.data, node.data_len, deps);
+    } else if (((node.type == DocNode::TYPE_WHEN) || (node.type == DocNode::TYPE_INCLUDE)) && node.n_attrs) {
+      Attribute attr = getAttribute(node, 0); // test expression or src
+      Expression::getDependencies(attr.value, attr.value_len, deps);
+    } else if (node.type == DocNode::TYPE_SPECIAL_INCLUDE) {
+      deps.setIncomplete(); // handlers have access to all variables
+    }
+  }
+}
+
+bool
+FlatDocNodeList::isPackedVersion2(const char *data, int data_len) {
+  // a version 1 list starts with its node count which would have to be
+  // over 38 million to look like this
+  return (data && (data_len >= static_cast<int>(sizeof(PackedHeader))) &&
+          (memcmp(data, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0) && (data[sizeof(PACK_MAGIC)] == PACK_VERSION_2));
+}
+
+bool
+FlatDocNodeList::unpack(const char *data, int data_len) {
   clear();
+  bool retval;
+  if (isPackedVersion2(data, data_len)) {
+    retval = _unpackVersion2(data, data_len);
+  } else {
+    retval = _unpackList(data, data_len);
+  }
+  if (!retval) {
+    clear();
+  }
+  return retval;
+}
+
+bool
+FlatDocNodeList::_unpackList(const char *data, int data_len) {
+  if (!data || (data_len < static_cast<int>(sizeof(int32_t)))) {
+    Utils::ERROR_LOG("[%s] Invalid arguments", __FUNCTION__);
+    return false;
+  }
+  const char *data_start = data;
+  int32_t n_elements;
+  unpackItem(data, data_start + data_len, n_elements);
   int data_offset = data - data_start, node_size;
-  DocNode node;
   for (int i = 0; i < n_elements; ++i) {
-    if (!node.unpack(data_start + data_offset, data_len - data_offset, node_size)) {
+    if (!_unpackNode(data_start + data_offset, data_len - data_offset, node_size)) {
       Utils::ERROR_LOG("[%s] Could not unpack node", __FUNCTION__);
       return false;
     }
     data_offset += node_size;
-    push_back(node);
+  }
+  return true;
+}
+
+bool
+FlatDocNodeList::_unpackNode(const char *packed_data, int packed_data_len, int &node_len) {
+  const char *packed_data_start = packed_data;
+
+  if (!packed_data || (packed_data_len < static_cast<int>((sizeof(char) + sizeof(int32_t))))) {
+    Utils::ERROR_LOG("[%s] Invalid arguments (%p, %d)", __FUNCTION__, packed_data, packed_data_len);
+    return false;
+  }
+  if (*packed_data != DocNode::VERSION) {
+    Utils::ERROR_LOG("[%s] Version %d not in supported set (%d)",
+                     __FUNCTION__, static_cast<int>(*packed_data), static_cast<int>(DocNode::VERSION));
+    return false;
+  }
+  ++packed_data;
+
+  int32_t node_size;
+  unpackItem(packed_data, packed_data_start + packed_data_len, node_size);
+  if (node_size > packed_data_len) {
+    Utils::ERROR_LOG("[%s] Data size (%d) not sufficient to hold node of size %d",
+                     __FUNCTION__, packed_data_len, node_size);
+    return false;
+  }
+  if (node_size < MIN_PACKED_NODE_SIZE) {
+    Utils::ERROR_LOG("[%s] Invalid node size %d", __FUNCTION__, node_size);
+    return false;
+  }
+  node_len = node_size;
+  const char *packed_data_end = packed_data_start + node_size;
+
+  int index = _nodes.size();
+  _nodes.push_back(FlatDocNode());
+  FlatDocNode &node = _nodes.back();
+  if (!unpackItem(packed_data, packed_data_end, node.type) || !isValidType(node.type) ||
+      !unpackString(packed_data, packed_data_end, node.data, node.data_len) ||
+      !unpackItem(packed_data, packed_data_end, node.n_attrs) || (node.n_attrs < 0)) {
+    Utils::ERROR_LOG("[%s] Corrupt node data", __FUNCTION__);
+    return false;
+  }
+  node.attr_begin = _attrs.size();
+  Attribute attr;
+  for (int i = 0; i < node.n_attrs; ++i) {
+    if (!unpackString(packed_data, packed_data_end, attr.name, attr.name_len) ||
+        !unpackString(packed_data, packed_data_end, attr.value, attr.value_len)) {
+      Utils::ERROR_LOG("[%s] Corrupt attribute data", __FUNCTION__);
+      return false;
+    }
+    _attrs.push_back(attr);
+  }
+
+  if (!_unpackList(packed_data, packed_data_end - packed_data)) {
+    Utils::ERROR_LOG("[%s] Could not unpack child nodes", __FUNCTION__);
+    return false;
+  }
+  _nodes[index].subtree_end = _nodes.size();
+  return true;
+}
+
+/** checks that every node's subtree lies within that of its parent */
+bool
+FlatDocNodeList::_isValidTree(const PackedNode *nodes, int n_nodes) {
+  std::vector<int32_t> subtree_ends; // of the node's ancestors
+  subtree_ends.push_back(n_nodes);
+  PackedNode node;
+  for (int i = 0; i < n_nodes; ++i) {
+    while (i >= subtree_ends.back()) {
+      subtree_ends.pop_back(); // bottom entry is never popped
+    }
+    memcpy(&node, nodes + i, sizeof(node));
+    if ((node.subtree_end <= i) || (node.subtree_end > subtree_ends.back())) {
+      return false;
+    }
+    subtree_ends.push_back(node.subtree_end);
+  }
+  return true;
+}
+
+bool
+FlatDocNodeList::_unpackVersion2(const char *data, int data_len) {
+  PackedHeader header;
+  memcpy(&header, data, sizeof(header));
+  if ((header.total_size < static_cast<int32_t>(sizeof(header))) || (header.total_size > data_len) ||
+      (header.nodes_offset != static_cast<int32_t>(sizeof(header))) ||
+      !isValidRange(header.nodes_offset, header.n_nodes, sizeof(PackedNode), header.total_size) ||
+      (header.attrs_offset != static_cast<int32_t>(header.nodes_offset + (header.n_nodes * sizeof(PackedNode)))) ||
+      !isValidRange(header.attrs_offset, header.n_attrs, sizeof(PackedAttribute), header.total_size) ||
+      (header.strings_offset !=
+       static_cast<int32_t>(header.attrs_offset + (header.n_attrs * sizeof(PackedAttribute)))) ||
+      !isValidRange(header.strings_offset, header.strings_size, 1, header.total_size) ||
+      !isValidRange(header.deps_offset, header.deps_size, 1, header.strings_size)) {
+    Utils::ERROR_LOG("[%s] Invalid header in data of size %d", __FUNCTION__, data_len);
+    return false;
+  }
+
+  // records may be unaligned here; hence the copies
+  const PackedNode *nodes = reinterpret_cast<const PackedNode *>(data + header.nodes_offset);
+  const PackedAttribute *attrs = reinterpret_cast<const PackedAttribute *>(data + header.attrs_offset);
+  const char *strings = data + header.strings_offset;
+  PackedNode node;
+  for (int i = 0; i < header.n_nodes; ++i) {
+    memcpy(&node, nodes + i, sizeof(node));
+    if (!isValidType(node.type) || !isValidRange(node.data_offset, node.data_len, 1, header.strings_size) ||
+        !isValidRange(node.attr_begin, node.n_attrs, 1, header.n_attrs) ||
+        !isValidRange(node.code_offset, node.code_len, 1, header.strings_size)) {
+      Utils::ERROR_LOG("[%s] Invalid node record %d", __FUNCTION__, i);
+      return false;
+    }
+  }
+  PackedAttribute attr;
+  for (int i = 0; i < header.n_attrs; ++i) {
+    memcpy(&attr, attrs + i, sizeof(attr));
+    if (!isValidRange(attr.name_offset, attr.name_len, 1, header.strings_size) ||
+        !isValidRange(attr.value_offset, attr.value_len, 1, header.strings_size)) {
+      Utils::ERROR_LOG("[%s] Invalid attribute record %d", __FUNCTION__, i);
+      return false;
+    }
+  }
+  if (!_isValidTree(nodes, header.n_nodes)) {
+    Utils::ERROR_LOG("[%s] Invalid node structure", __FUNCTION__);
+    return false;
+  }
+
+  _packed_nodes = nodes;
+  _packed_attrs = attrs;
+  _packed_strings = strings;
+  _n_packed_nodes = header.n_nodes;
+  _n_packed_attrs = header.n_attrs;
+  _packed_deps = strings + header.deps_offset;
+  _packed_deps_len = header.deps_size;
+  if (reinterpret_cast<uintptr_t>(data) % sizeof(int32_t)) {
+    _copyPackedNodes();
   }
   return true;
 }
@@ -27,6 +27,7 @@
 #include <stdint.h>
 #include <list>
 #include <string>
+#include <vector>
 
 #include "Attribute.h"
 
@@ -34,10 +35,19 @@ namespace EsiLib {
 
 struct DocNode;
 
-class DocNodeList : public std::list<DocNode> {
+class VariableDependencies;
+
+class DocNodeList : public std::list<DocNode, ArenaAllocator<DocNode> > {
 
 public:
 
+  /** nodes (and their attributes and children) are allocated from
+   * given arena if any; else from the heap */
+  explicit DocNodeList(Arena *arena = 0)
+    : std::list<DocNode, ArenaAllocator<DocNode> >(ArenaAllocator<DocNode>(arena)) { };
+
+  Arena *getArena() const { return get_allocator().getArena(); };
+
   inline void pack(std::string &buffer, bool retain_buffer_data = false) const {
     if (!retain_buffer_data) {
       buffer.clear();
@@ -98,8 +108,9 @@ public:
 
   DocNodeList child_nodes;
 
-  DocNode(TYPE _type = TYPE_UNKNOWN, const char *_data = 0, int32_t _data_len = 0) 
-    : type(_type), data(_data), data_len(_data_len) { };
+  DocNode(TYPE _type = TYPE_UNKNOWN, const char *_data = 0, int32_t _data_len = 0, Arena *arena = 0) 
+    : type(_type), data(_data), data_len(_data_len), attr_list(AttributeList::allocator_type(arena)),
+      child_nodes(arena) { };
 
   void pack(std::string &buffer) const;
 
@@ -109,8 +120,194 @@ private:
 
   static const char VERSION;
 
+  friend class FlatDocNodeList; // to use the version above
+
+};
+
+/** node of a FlatDocNodeList; the subtree of a node is stored right
+ * after it, so the node's descendants are [index + 1, subtree_end) */
+struct FlatDocNode
+{
+  DocNode::TYPE type;
+  int32_t data_len;
+  const char *data;
+  int32_t attr_begin; // index of first attribute in list's attribute array
+  int32_t n_attrs;
+  int32_t subtree_end; // index of next sibling (or one past parent's last descendant)
+  // compiled form of the node's expression: test of a when node (see Expression::compile()),
+  // expansion plan of a vars node's data or an include's src (see Expression::compileExpansion())
+  const char *code;
+  int32_t code_len;
+
+  FlatDocNode(DocNode::TYPE _type = DocNode::TYPE_UNKNOWN, const char *_data = 0, int32_t _data_len = 0,
+              int32_t _attr_begin = 0, int32_t _n_attrs = 0, int32_t _subtree_end = 0,
+              const char *_code = 0, int32_t _code_len = 0)
+    : type(_type), data_len(_data_len), data(_data), attr_begin(_attr_begin), n_attrs(_n_attrs),
+      subtree_end(_subtree_end), code(_code), code_len(_code_len) { };
+};
+
+/** array based, read-only form of a DocNodeList; nodes are stored in
+ * document (pre-)order and refer to attributes and children by index
+ * so that traversals are linear.
+ *
+ * Packs to the DocNodeList format (version 1) or to version 2, which
+ * consists of a header, fixed width node and attribute records and a
+ * string section. A version 2 buffer is used in place by unpack(), i.e.,
+ * without copying the nodes out of it. Version 2 also carries compiled
+ * expressions for when, vars and include nodes and the document's
+ * variable dependencies, which are generated at pack time; nodes of
+ * other lists have no code */
+class FlatDocNodeList
+{
+
+public:
+
+  enum PackVersion { PACK_VERSION_1 = 1, PACK_VERSION_2 = 2 };
+
+  FlatDocNodeList() : _packed_nodes(0), _packed_attrs(0), _packed_strings(0), _n_packed_nodes(0),
+                      _n_packed_attrs(0), _packed_deps(0), _packed_deps_len(0) { };
+
+  /** appends given nodes and their subtrees as top-level nodes */
+  void append(const DocNodeList &node_list);
+
+  int size() const { return _packed_nodes ? _n_packed_nodes : static_cast<int>(_nodes.size()); };
+
+  bool empty() const { return (size() == 0); };
+
+  inline FlatDocNode operator [](int index) const;
+
+  inline Attribute getAttribute(const FlatDocNode &node, int attr_index) const;
+
+  void clear();
+
+  void pack(std::string &buffer, bool retain_buffer_data = false, PackVersion version = PACK_VERSION_1) const;
+
+  inline std::string pack(PackVersion version = PACK_VERSION_1) const {
+    std::string buffer("");
+    pack(buffer, false, version);
+    return buffer;
+  }
+
+  /** replaces current contents with nodes unpacked from data of either
+   * version; as with DocNodeList, nodes point to data in given buffer,
+   * and a version 2 list is used in place if suitably aligned */
+  bool unpack(const char *data, int data_len);
+
+  inline bool unpack(const std::string &data) {
+    return unpack(data.data(), data.size());
+  }
+
+  /** sets deps to the variables the document's expressions (including those in
+   * esi comments) refer to; read from the buffer for a version 2 list, computed
+   * from the nodes otherwise */
+  void getDependencies(VariableDependencies &deps) const;
+
+  /** returns true if given data holds a version 2 list */
+  static bool isPackedVersion2(const char *data, int data_len);
+
+private:
+
+  struct PackedHeader {
+    char magic[3];
+    char version;
+    int32_t total_size;
+    int32_t n_nodes;
+    int32_t n_attrs;
+    int32_t nodes_offset;
+    int32_t attrs_offset;
+    int32_t strings_offset;
+    int32_t strings_size;
+    int32_t deps_offset; // packed VariableDependencies; relative to the string section
+    int32_t deps_size;
+  };
+
+  // offsets are relative to the string section
+  struct PackedNode {
+    int32_t type;
+    int32_t data_offset;
+    int32_t data_len;
+    int32_t attr_begin;
+    int32_t n_attrs;
+    int32_t subtree_end;
+    int32_t code_offset;
+    int32_t code_len;
+  };
+
+  struct PackedAttribute {
+    int32_t name_offset;
+    int32_t name_len;
+    int32_t value_offset;
+    int32_t value_len;
+  };
+
+  std::vector<FlatDocNode> _nodes;
+  std::vector<Attribute> _attrs;
+
+  // set if a version 2 buffer is used in place
+  const PackedNode *_packed_nodes;
+  const PackedAttribute *_packed_attrs;
+  const char *_packed_strings;
+  int _n_packed_nodes;
+  int _n_packed_attrs;
+
+  // dependencies of a version 2 buffer; retained by _copyPackedNodes()
+  const char *_packed_deps;
+  int _packed_deps_len;
+
+  static const char PACK_MAGIC[3];
+
+  int _getNumAttributes() const { return _packed_nodes ? _n_packed_attrs : static_cast<int>(_attrs.size()); };
+
+  inline Attribute _getAttribute(int index) const;
+
+  void _copyPackedNodes();
+
+  void _append(const DocNode &node);
+
+  void _packList(int begin, int end, std::string &buffer) const;
+
+  void _packNode(int index, std::string &buffer) const;
+
+  void _packVersion2(std::string &buffer) const;
+
+  void _computeDependencies(VariableDependencies &deps) const;
+
+  bool _unpackList(const char *data, int data_len);
+
+  bool _unpackNode(const char *data, int data_len, int &node_len);
+
+  bool _unpackVersion2(const char *data, int data_len);
+
+  static bool _isValidTree(const PackedNode *nodes, int n_nodes);
+
 };
 
+inline FlatDocNode
+FlatDocNodeList::operator [](int index) const {
+  if (!_packed_nodes) {
+    return _nodes[index];
+  }
+  const PackedNode &node = _packed_nodes[index];
+  return FlatDocNode(node.type, node.data_len ? (_packed_strings + node.data_offset) : 0, node.data_len,
+                     node.attr_begin, node.n_attrs, node.subtree_end,
+                     node.code_len ? (_packed_strings + node.code_offset) : 0, node.code_len);
+}
+
+inline Attribute
+FlatDocNodeList::_getAttribute(int index) const {
+  if (!_packed_nodes) {
+    return _attrs[index];
+  }
+  const PackedAttribute &attr = _packed_attrs[index];
+  return Attribute(attr.name_len ? (_packed_strings + attr.name_offset) : 0, attr.name_len,
+                   attr.value_len ? (_packed_strings + attr.value_offset) : 0, attr.value_len);
+}
+
+inline Attribute
+FlatDocNodeList::getAttribute(const FlatDocNode &node, int attr_index) const {
+  return _getAttribute(node.attr_begin + attr_index);
+}
+
 };
 
 #endif // _ESI_DOC_NODE_H
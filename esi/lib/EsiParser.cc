@@ -26,6 +26,11 @@
 
 #include <ctype.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ESI_PARSER_SIMD_SCAN 1
+#include <immintrin.h>
+#endif
+
 using std::string;
 using namespace EsiLib;
 
@@ -36,8 +41,70 @@ const int EsiParser::ESI_TAG_PREFIX_LEN = 5;
 const string EsiParser::SRC_ATTR_STR("src");
 const string EsiParser::TEST_ATTR_STR("test");
 const string EsiParser::HANDLER_ATTR_STR("handler");
+const string EsiParser::TIMEOUT_ATTR_STR("timeout");
+const string EsiParser::DEADLINE_ATTR_STR("deadline");
 
 const unsigned int EsiParser::MAX_DOC_SIZE = 1024 * 1024;
+const unsigned int EsiParser::MIN_BUFFER_SIZE = 8 * 1024;
+
+bool EsiParser::_scalar_tag_scan = false;
+
+// byte finders used to skip over plain text to the next candidate '<';
+// all return end if the byte is not found
+
+typedef const char *(*FindByteFunc)(const char *data, const char *end, char c);
+
+static const char *
+findByteGeneric(const char *data, const char *end, char c) {
+  const char *pos = static_cast<const char *>(memchr(data, c, end - data));
+  return pos ? pos : end;
+}
+
+#ifdef ESI_PARSER_SIMD_SCAN
+
+__attribute__((target("sse2"))) static const char *
+findByteSse2(const char *data, const char *end, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; (end - data) >= 16; data += 16) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)),
+                                                needle));
+    if (mask) {
+      return data + __builtin_ctz(mask);
+    }
+  }
+  return findByteGeneric(data, end, c);
+}
+
+__attribute__((target("avx2"))) static const char *
+findByteAvx2(const char *data, const char *end, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  for (; (end - data) >= 32; data += 32) {
+    int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data)),
+                                                      needle));
+    if (mask) {
+      return data + __builtin_ctz(mask);
+    }
+  }
+  return findByteSse2(data, end, c);
+}
+
+#endif
+
+static FindByteFunc
+selectFindByte() {
+#ifdef ESI_PARSER_SIMD_SCAN
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &findByteAvx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &findByteSse2;
+  }
+#endif
+  return &findByteGeneric;
+}
+
+static const FindByteFunc findByte = selectFindByte();
 
 const EsiParser::EsiNodeInfo EsiParser::ESI_NODES[] = {
   EsiNodeInfo(DocNode::TYPE_INCLUDE, "include ", 8, "/>", 2),
@@ -48,6 +115,7 @@ const EsiParser::EsiNodeInfo EsiParser::ESI_NODES[] = {
   EsiNodeInfo(DocNode::TYPE_WHEN, "when ", 5, "</esi:when>", 11),
   EsiNodeInfo(DocNode::TYPE_OTHERWISE, "otherwise>", 10, "</esi:otherwise>", 16),
   EsiNodeInfo(DocNode::TYPE_TRY, "try>", 4, "</esi:try>", 10),
+  EsiNodeInfo(DocNode::TYPE_TRY, "try ", 4, "</esi:try>", 10),
   EsiNodeInfo(DocNode::TYPE_ATTEMPT, "attempt> ", 8, "</esi:attempt>", 14),
   EsiNodeInfo(DocNode::TYPE_EXCEPT, "except> ", 7, "</esi:except>", 13),
   EsiNodeInfo(DocNode::TYPE_SPECIAL_INCLUDE, "special-include ", 15, "/>", 2),
@@ -60,10 +128,55 @@ const EsiParser::EsiNodeInfo EsiParser::HTML_COMMENT_NODE_INFO(DocNode::TYPE_HTM
 EsiParser::EsiParser(const char *debug_tag, 
                      ComponentBase::Debug debug_func, 
                      ComponentBase::Error error_func) 
-  : ComponentBase(debug_tag, debug_func, error_func), _parse_start_pos(-1) {
-  // do this so that object doesn't move around in memory;
-  // (because we return pointers into this object)
-  _data.reserve(MAX_DOC_SIZE);
+  : ComponentBase(debug_tag, debug_func, error_func), _retired_data_size(0), _parse_start_pos(-1),
+    _closing_tag_search_pos(0) {
+  _data.reserve(MIN_BUFFER_SIZE);
+}
+
+/** makes room for data_len more bytes in _data without letting it
+ * reallocate (as we return pointers into it). If the current buffer is
+ * full, it is retired and only the yet unparsed tail is carried over to
+ * a new buffer; nodes already returned keep pointing into the old one */
+bool
+EsiParser::_reserveData(const char *data_ptr, int &data_len) {
+  if (!data_ptr || !data_len) {
+    return true;
+  }
+  if (data_len == -1) {
+    data_len = strlen(data_ptr);
+  }
+  if ((_retired_data_size + _data.size() + data_len) > MAX_DOC_SIZE) {
+    _errorLog("[%s] Cannot allow attempted doc of size %d; Max allowed size is %d", __FUNCTION__,
+              _retired_data_size + _data.size() + data_len, MAX_DOC_SIZE);
+    return false;
+  }
+  if ((_data.size() + data_len) <= _data.capacity()) {
+    return true;
+  }
+  size_t tail_pos = (_parse_start_pos == -1) ? _data.size() : _parse_start_pos;
+  size_t tail_len = _data.size() - tail_pos;
+  size_t new_capacity = 2 * (tail_len + data_len);
+  if (new_capacity < MIN_BUFFER_SIZE) {
+    new_capacity = MIN_BUFFER_SIZE;
+  }
+  string new_data;
+  new_data.reserve(new_capacity);
+  new_data.append(_data, tail_pos, tail_len);
+  if (tail_pos) { // nodes may point into the parsed part of the old buffer
+    _retired_data.push_back(string());
+    _retired_data.back().swap(_data);
+  }
+  _data.swap(new_data);
+  _retired_data_size += tail_pos;
+  if (_parse_start_pos != -1) {
+    _parse_start_pos -= tail_pos;
+  }
+  if (_closing_tag_search_pos) {
+    _closing_tag_search_pos -= tail_pos;
+  }
+  _debugLog(_debug_tag.c_str(), "[%s] Carried over %d unparsed byte(s) to new buffer of capacity %d",
+            __FUNCTION__, tail_len, new_capacity);
+  return true;
 }
 
 bool
@@ -95,10 +208,13 @@ EsiParser::_setup(string &data, int &parse_start_pos, size_t &orig_output_list_s
 
 bool
 EsiParser::parseChunk(const char *data, DocNodeList &node_list, int data_len /* = -1 */) {
+  if (!_reserveData(data, data_len)) {
+    return false;
+  }
   if (!_setup(_data, _parse_start_pos, _orig_output_list_size, node_list, data, data_len)) {
     return false;
   }
-  if (!_parse(_data, _parse_start_pos, node_list)) {
+  if (!_parse(_data, _parse_start_pos, _closing_tag_search_pos, node_list)) {
     _errorLog("[%s] Failed to parse chunk of size %d starting with [%.5s]...", __FUNCTION__, data_len,
               (data_len ? data : "(null)"));
     return false;
@@ -106,9 +222,18 @@ EsiParser::parseChunk(const char *data, DocNodeList &node_list, int data_len /*
   return true;
 }
 
+bool
+EsiParser::completeParse(DocNodeList &node_list, const char *data /* = 0 */, int data_len /* = -1 */) {
+  if (!_reserveData(data, data_len)) {
+    return false;
+  }
+  return _completeParse(_data, _parse_start_pos, _orig_output_list_size, _closing_tag_search_pos,
+                        node_list, data, data_len);
+}
+
 bool
 EsiParser::_completeParse(string &data, int &parse_start_pos, size_t &orig_output_list_size,
-                          DocNodeList &node_list, const char *data_ptr /* = 0 */,
+                          size_t &closing_tag_search_pos, DocNodeList &node_list, const char *data_ptr /* = 0 */,
                           int data_len /* = -1 */) const {
   if (!_setup(data, parse_start_pos, orig_output_list_size, node_list, data_ptr, data_len)) {
     return false;
@@ -117,7 +242,7 @@ EsiParser::_completeParse(string &data, int &parse_start_pos, size_t &orig_outpu
     _debugLog(_debug_tag.c_str(), "[%s] No data to parse!", __FUNCTION__);
     return true;
   }
-  if (!_parse(data, parse_start_pos, node_list, true)) {
+  if (!_parse(data, parse_start_pos, closing_tag_search_pos, node_list, true)) {
     _errorLog("[%s] Failed to complete parse of data of total size %d starting with [%.5s]...", 
               __FUNCTION__, data.size(), (data.size() ? data.data() : "(null)"));
     node_list.resize(orig_output_list_size);
@@ -126,39 +251,43 @@ EsiParser::_completeParse(string &data, int &parse_start_pos, size_t &orig_outpu
   return true;
 }
 
+/** Boyer-Moore-Horspool search for the node's closing tag using the
+ * shift table precomputed in the static node info. A trailing prefix of
+ * the closing tag is reported as a partial match */
 EsiParser::MATCH_TYPE
-EsiParser::_searchData(const string &data, size_t start_pos, const char *str, int str_len, size_t &pos) const {
-  const char *data_ptr = data.data() + start_pos;
-  int data_len = data.size() - start_pos;
-  int i_data = 0, i_str = 0; 
-
-  while (i_data < data_len) {
-    if (data_ptr[i_data] == str[i_str]) {
-      ++i_str;
-      if (i_str == str_len) {
-        break;
-      }
-    } else {
-      i_data -= i_str;
-      i_str = 0;
+EsiParser::_searchData(const string &data, size_t start_pos, const EsiNodeInfo &node_info, size_t &pos) const {
+  const char *data_ptr = data.data();
+  size_t data_size = data.size();
+  const char *str = node_info.closing_tag;
+  size_t str_len = node_info.closing_tag_len;
+  unsigned char last_char;
+
+  for (size_t i_data = start_pos; (i_data + str_len) <= data_size; i_data += node_info.closing_tag_shifts[last_char]) {
+    last_char = data_ptr[i_data + str_len - 1];
+    if ((last_char == static_cast<unsigned char>(str[str_len - 1])) &&
+        (memcmp(data_ptr + i_data, str, str_len - 1) == 0)) {
+      pos = i_data;
+      _debugLog(_debug_tag.c_str(), "[%s] Found full match of %.*s in [%.5s...] at position %d", 
+                __FUNCTION__, str_len, str, data_ptr + start_pos, pos);
+      return COMPLETE_MATCH;
     }
-    ++i_data;
   }
 
-  if (i_str == str_len) {
-    pos = start_pos + i_data + 1 - i_str;
-    _debugLog(_debug_tag.c_str(), "[%s] Found full match of %.*s in [%.5s...] at position %d", 
-              __FUNCTION__, str_len, str, data_ptr, pos);
-    return COMPLETE_MATCH;
-  } else if (i_str) {
-    pos = start_pos + i_data - i_str;
-    _debugLog(_debug_tag.c_str(), "[%s] Found partial match of %.*s in [%.5s...] at position %d", 
-              __FUNCTION__, str_len, str, data_ptr, pos);
-    return PARTIAL_MATCH;
-  } else {
-    _debugLog(_debug_tag.c_str(), "[%s] Found no match of %.*s in [%.5s...]", __FUNCTION__, str_len, str, data_ptr);
-    return NO_MATCH;
+  size_t tail_len = (data_size > start_pos) ? (data_size - start_pos) : 0;
+  if (tail_len > (str_len - 1)) {
+    tail_len = str_len - 1;
+  }
+  for (; tail_len; --tail_len) {
+    if (memcmp(data_ptr + data_size - tail_len, str, tail_len) == 0) {
+      pos = data_size - tail_len;
+      _debugLog(_debug_tag.c_str(), "[%s] Found partial match of %.*s in [%.5s...] at position %d", 
+                __FUNCTION__, str_len, str, data_ptr + start_pos, pos);
+      return PARTIAL_MATCH;
+    }
   }
+  _debugLog(_debug_tag.c_str(), "[%s] Found no match of %.*s in [%.5s...]", __FUNCTION__, str_len, str,
+            data_ptr + start_pos);
+  return NO_MATCH;
 }
 
 EsiParser::MATCH_TYPE
@@ -185,13 +314,59 @@ EsiParser::_compareData(const string &data, size_t pos, const char *str, int str
   return PARTIAL_MATCH;
 }
 
+/** Jumps from one '<' to the next using the fastest byte finder
+ * available and only then compares against the two opening tags. A
+ * trailing '<' sequence that is a prefix of either tag is reported as a
+ * partial match at the same position the scalar scanner would report */
+EsiParser::MATCH_TYPE
+EsiParser::_findOpeningTag(const string &data, size_t start_pos,
+                           size_t &opening_tag_pos, bool &is_html_comment_node) const {
+  if (_scalar_tag_scan) {
+    return _findOpeningTagScalar(data, start_pos, opening_tag_pos, is_html_comment_node);
+  }
+  const char *data_start = data.data();
+  const char *data_end = data_start + data.size();
+  const char *html_tag = HTML_COMMENT_NODE_INFO.tag_suffix;
+  int html_tag_len = HTML_COMMENT_NODE_INFO.tag_suffix_len;
+  const char *curr = data_start + start_pos;
+  int avail;
+
+  while ((curr = findByte(curr, data_end, '<')) != data_end) {
+    avail = data_end - curr;
+    if (avail >= ESI_TAG_PREFIX_LEN) {
+      if (memcmp(curr, ESI_TAG_PREFIX, ESI_TAG_PREFIX_LEN) == 0) {
+        is_html_comment_node = false;
+        opening_tag_pos = curr - data_start;
+        return COMPLETE_MATCH;
+      }
+    } else if (memcmp(curr, ESI_TAG_PREFIX, avail) == 0) {
+      is_html_comment_node = false;
+      opening_tag_pos = curr - data_start;
+      return PARTIAL_MATCH;
+    }
+    if (avail >= html_tag_len) {
+      if (memcmp(curr, html_tag, html_tag_len) == 0) {
+        is_html_comment_node = true;
+        opening_tag_pos = curr - data_start;
+        return COMPLETE_MATCH;
+      }
+    } else if (memcmp(curr, html_tag, avail) == 0) {
+      is_html_comment_node = true;
+      opening_tag_pos = curr - data_start;
+      return PARTIAL_MATCH;
+    }
+    ++curr;
+  }
+  return NO_MATCH;
+}
+
 /** This implementation is optimized but not completely correct.  If
  * the opening tag were to have a repeating opening sequence ('<e<esi'
  * or something like that), this will break. However that is not the
  * case for the two opening tags we are looking for */
 EsiParser::MATCH_TYPE
-EsiParser::_findOpeningTag(const string &data, size_t start_pos,
-                           size_t &opening_tag_pos, bool &is_html_comment_node) const {
+EsiParser::_findOpeningTagScalar(const string &data, size_t start_pos,
+                                 size_t &opening_tag_pos, bool &is_html_comment_node) const {
   size_t i_data = start_pos;
   int i_esi = 0, i_html_comment = 0;
 
@@ -250,18 +425,19 @@ EsiParser::_findOpeningTag(const string &data, size_t start_pos,
 inline bool
 EsiParser::_processSimpleContentTag(DocNode::TYPE node_type, const char *data, int data_len,
                                     DocNodeList &node_list) const {
-  DocNode new_node(node_type);
-  if (!parse(new_node.child_nodes, data, data_len)) {
+  // children are parsed in place to avoid copying the subtree
+  node_list.push_back(DocNode(node_type, 0, 0, node_list.getArena()));
+  if (!parse(node_list.back().child_nodes, data, data_len)) {
     _errorLog("[%s] Could not parse simple content of [%s] node", __FUNCTION__,
               DocNode::type_names_[node_type]);
+    node_list.pop_back();
     return false;
   }
-  node_list.push_back(new_node);
   return true;
 }
 
 bool
-EsiParser::_parse(const string &data, int &parse_start_pos,
+EsiParser::_parse(const string &data, int &parse_start_pos, size_t &closing_tag_search_pos,
                   DocNodeList &node_list, bool last_chunk /* = false */) const {
   size_t orig_list_size = node_list.size();
   size_t curr_pos, end_pos;
@@ -294,8 +470,8 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
       // add text till here as a PRE node
       _debugLog(_debug_tag.c_str(), "[%s], Adding data of size %d before (newly found) ESI tag as PRE node", 
                 __FUNCTION__, curr_pos - parse_start_pos);
-      node_list.push_back(DocNode(DocNode::TYPE_PRE, 
-                                  data_start_ptr + parse_start_pos, curr_pos - parse_start_pos));
+      node_list.push_back(DocNode(DocNode::TYPE_PRE, data_start_ptr + parse_start_pos,
+                                  curr_pos - parse_start_pos, node_list.getArena()));
       parse_start_pos = curr_pos;
     }
     
@@ -324,7 +500,10 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
     }
 
     curr_pos += node_info->tag_suffix_len;
-    search_result = _searchData(data, curr_pos, node_info->closing_tag, node_info->closing_tag_len, end_pos);
+    // data already searched for this tag's closing tag in previous
+    // chunk(s) need not be searched again
+    search_result = _searchData(data, (closing_tag_search_pos > curr_pos) ? closing_tag_search_pos : curr_pos,
+                                *node_info, end_pos);
 
     if ((search_result == NO_MATCH) || (search_result == PARTIAL_MATCH)) {
       if (last_chunk) {
@@ -333,9 +512,16 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
         goto lFail;
       }
       else {
+        // a closing tag found later can at most start in the last
+        // (closing_tag_len - 1) bytes of current data
+        closing_tag_search_pos = data_size - node_info->closing_tag_len + 1;
+        if (closing_tag_search_pos < curr_pos) {
+          closing_tag_search_pos = curr_pos;
+        }
         goto lPartialMatch;
       }
     }
+    closing_tag_search_pos = 0;
 
     parse_result = false;
     
@@ -346,7 +532,7 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
     } else if ((node_info->type == DocNode::TYPE_COMMENT) || (node_info->type == DocNode::TYPE_REMOVE)) {
       _debugLog(_debug_tag.c_str(), "[%s] Adding node [%s]", __FUNCTION__,
                 DocNode::type_names_[node_info->type]);
-      node_list.push_back(DocNode(node_info->type)); // no data required
+      node_list.push_back(DocNode(node_info->type, 0, 0, node_list.getArena())); // no data required
       parse_result = true;
     } else if (node_info->type == DocNode::TYPE_WHEN) {
       _debugLog(_debug_tag.c_str(), "[%s] Handling when tag...", __FUNCTION__);
@@ -369,7 +555,8 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
       _debugLog(_debug_tag.c_str(), "[%s] added string of size %d starting with [%.5s] for node %s",
                 __FUNCTION__, end_pos - curr_pos, data.data() + curr_pos,
                 DocNode::type_names_[node_info->type]);
-      node_list.push_back(DocNode(node_info->type, data.data() + curr_pos, end_pos - curr_pos));
+      node_list.push_back(DocNode(node_info->type, data.data() + curr_pos, end_pos - curr_pos,
+                                  node_list.getArena()));
       parse_result = true;
     } else if (node_info->type == DocNode::TYPE_SPECIAL_INCLUDE) {
       _debugLog(_debug_tag.c_str(), "[%s] Handling special include tag...", __FUNCTION__);
@@ -396,14 +583,15 @@ EsiParser::_parse(const string &data, int &parse_start_pos,
   if (last_chunk && (parse_start_pos < static_cast<int>(data_size))) {
     _debugLog(_debug_tag.c_str(), "[%s] Adding trailing text of size %d starting at [%.5s] as a PRE node", 
               __FUNCTION__, data_size - parse_start_pos, data_start_ptr + parse_start_pos);
-    node_list.push_back(DocNode(DocNode::TYPE_PRE, 
-                                data_start_ptr + parse_start_pos, data_size - parse_start_pos));
+    node_list.push_back(DocNode(DocNode::TYPE_PRE, data_start_ptr + parse_start_pos,
+                                data_size - parse_start_pos, node_list.getArena()));
   }
   _debugLog(_debug_tag.c_str(), "[%s] Added %d node(s) during parse", __FUNCTION__, node_list.size() - orig_list_size);
   return true;
 
 lFail:
   node_list.resize(orig_list_size);   // delete whatever nodes we have added so far
+  closing_tag_search_pos = 0;
   return false;
 }
 
@@ -415,13 +603,59 @@ EsiParser::_processIncludeTag(const string &data, size_t curr_pos, size_t end_po
     _errorLog("[%s] Could not find src attribute", __FUNCTION__);
     return false;
   }
-  node_list.push_back(DocNode(DocNode::TYPE_INCLUDE));
+  node_list.push_back(DocNode(DocNode::TYPE_INCLUDE, 0, 0, node_list.getArena()));
   node_list.back().attr_list.push_back(src_info);
   _debugLog(_debug_tag.c_str(), "[%s] Added include tag with url [%.*s]",
             __FUNCTION__, src_info.value_len, src_info.value);
+
+  // optional
+  size_t timeout_pos = _findAttribute(data, TIMEOUT_ATTR_STR, curr_pos, end_pos);
+  if (timeout_pos < end_pos) {
+    Attribute timeout_info;
+    if (!Utils::getAttribute(data, TIMEOUT_ATTR_STR, timeout_pos, end_pos, timeout_info)) {
+      _errorLog("[%s] Invalid timeout attribute", __FUNCTION__);
+      node_list.pop_back();
+      return false;
+    }
+    node_list.back().attr_list.push_back(timeout_info);
+    _debugLog(_debug_tag.c_str(), "[%s] Include has timeout [%.*s]",
+              __FUNCTION__, timeout_info.value_len, timeout_info.value);
+  }
   return true;
 }
 
+/** returns the position of the given attribute of a tag, i.e., of the name
+ * where it starts a (whitespace separated) word outside quotes and is
+ * followed by an '='; std::string::npos if the tag has no such attribute */
+size_t
+EsiParser::_findAttribute(const string &data, const string &attr, size_t curr_pos, size_t end_pos) const {
+  char quote_char = 0; // quotes are matched the way Utils::getAttribute() matches them
+  for (size_t pos = curr_pos; (pos + attr.size()) < end_pos; ++pos) {
+    if (quote_char) {
+      if (data[pos] == quote_char) {
+        quote_char = 0;
+      }
+      continue;
+    }
+    if ((data[pos] == '"') || (data[pos] == '\'')) {
+      quote_char = data[pos];
+      continue;
+    }
+    if (((pos > curr_pos) && !isspace(data[pos - 1])) ||
+        (data.compare(pos, attr.size(), attr) != 0)) {
+      continue;
+    }
+    size_t next_pos = pos + attr.size();
+    while ((next_pos < end_pos) && isspace(data[next_pos])) {
+      ++next_pos;
+    }
+    if ((next_pos < end_pos) && (data[next_pos] == '=')) {
+      return pos;
+    }
+  }
+  return string::npos;
+}
+
 bool
 EsiParser::_processSpecialIncludeTag(const string &data, size_t curr_pos, size_t end_pos,
                                      DocNodeList &node_list) const {
@@ -430,7 +664,7 @@ EsiParser::_processSpecialIncludeTag(const string &data, size_t curr_pos, size_t
     _errorLog("[%s] Could not find handler attribute", __FUNCTION__);
     return false;
   }
-  node_list.push_back(DocNode(DocNode::TYPE_SPECIAL_INCLUDE));
+  node_list.push_back(DocNode(DocNode::TYPE_SPECIAL_INCLUDE, 0, 0, node_list.getArena()));
   DocNode &node = node_list.back();
   node.attr_list.push_back(handler_info);
   node.data = data.data() + curr_pos;
@@ -475,13 +709,40 @@ EsiParser::_processWhenTag(const string &data, size_t curr_pos, size_t end_pos,
 bool
 EsiParser::_processTryTag(const string &data, size_t curr_pos, size_t end_pos,
                           DocNodeList &node_list) const {
+  Attribute deadline_info;
+  bool has_deadline = false;
+  if (data[curr_pos - 1] != '>') { // opening tag has attributes
+    size_t term_pos = data.find('>', curr_pos);
+    if (term_pos >= end_pos) {
+      _errorLog("[%s] Unterminated try tag", __FUNCTION__);
+      return false;
+    }
+    // optional
+    size_t deadline_pos = _findAttribute(data, DEADLINE_ATTR_STR, curr_pos, term_pos);
+    if (deadline_pos < term_pos) {
+      if (!Utils::getAttribute(data, DEADLINE_ATTR_STR, deadline_pos, end_pos, deadline_info, &term_pos, '>')) {
+        _errorLog("[%s] Invalid deadline attribute", __FUNCTION__);
+        return false;
+      }
+      has_deadline = true;
+    }
+    curr_pos = term_pos + 1; // go past the terminator
+  }
   const char *data_start_ptr = data.data() + curr_pos;
   int data_size = end_pos - curr_pos;
-  DocNode try_node(DocNode::TYPE_TRY);
+  // children are parsed in place to avoid copying the subtree
+  node_list.push_back(DocNode(DocNode::TYPE_TRY, 0, 0, node_list.getArena()));
+  DocNode &try_node = node_list.back();
   if (!parse(try_node.child_nodes, data_start_ptr, data_size)) {
     _errorLog("[%s] Could not parse try node's content", __FUNCTION__);
+    node_list.pop_back();
     return false;
   }
+  if (has_deadline) {
+    try_node.attr_list.push_back(deadline_info);
+    _debugLog(_debug_tag.c_str(), "[%s] Try block has deadline [%.*s]",
+              __FUNCTION__, deadline_info.value_len, deadline_info.value);
+  }
 
   DocNodeList::iterator iter, end_node, attempt_node, except_node, temp_iter;
   end_node = try_node.child_nodes.end();
@@ -491,18 +752,21 @@ EsiParser::_processTryTag(const string &data, size_t curr_pos, size_t end_pos,
     if (iter->type == DocNode::TYPE_ATTEMPT) {
       if (attempt_node != end_node) {
         _errorLog("[%s] Can have exactly one attempt node in try block", __FUNCTION__);
+        node_list.pop_back();
         return false;
       }
       attempt_node = iter;
     } else if (iter->type == DocNode::TYPE_EXCEPT) {
       if (except_node != end_node) {
         _errorLog("[%s] Can have exactly one except node in try block", __FUNCTION__);
+        node_list.pop_back();
         return false;
       }
       except_node = iter;
     } else if (iter->type == DocNode::TYPE_PRE) {
       if (!_isWhitespace(iter->data, iter->data_len)) {
         _errorLog("[%s] Cannot have non-whitespace raw text as top level node in try block", __FUNCTION__);
+        node_list.pop_back();
         return false;
       }
       _debugLog(_debug_tag.c_str(), "[%s] Ignoring top-level whitespace raw text", __FUNCTION__); 
@@ -514,15 +778,16 @@ EsiParser::_processTryTag(const string &data, size_t curr_pos, size_t end_pos,
     } else {
       _errorLog("[%s] Only attempt/except/text nodes allowed in try block; [%s] node invalid",
                 __FUNCTION__, DocNode::type_names_[iter->type]);
+      node_list.pop_back();
       return false;
     }
     ++iter;
   }
   if ((attempt_node == end_node) || (except_node == end_node)) {
     _errorLog("[%s] try block must contain one each of attempt and except nodes", __FUNCTION__);
+    node_list.pop_back();
     return false;
   }
-  node_list.push_back(try_node);
   _debugLog(_debug_tag.c_str(), "[%s] Added try node successfully", __FUNCTION__);
   return true;
 }
@@ -532,9 +797,12 @@ EsiParser::_processChooseTag(const string &data, size_t curr_pos, size_t end_pos
                              DocNodeList &node_list) const {
   const char *data_start_ptr = data.data() + curr_pos;
   size_t data_size = end_pos - curr_pos;
-  DocNode choose_node(DocNode::TYPE_CHOOSE);
+  // children are parsed in place to avoid copying the subtree
+  node_list.push_back(DocNode(DocNode::TYPE_CHOOSE, 0, 0, node_list.getArena()));
+  DocNode &choose_node = node_list.back();
   if (!parse(choose_node.child_nodes, data_start_ptr, data_size)) {
     _errorLog("[%s] Couldn't parse choose node content", __FUNCTION__);
+    node_list.pop_back();
     return false;
   }
   DocNodeList::iterator end_node = choose_node.child_nodes.end();
@@ -544,6 +812,7 @@ EsiParser::_processChooseTag(const string &data, size_t curr_pos, size_t end_pos
     if (iter->type == DocNode::TYPE_OTHERWISE) {
       if (otherwise_node != end_node) {
         _errorLog("[%s] Cannot have more than one esi:otherwise node in an esi:choose node", __FUNCTION__);
+        node_list.pop_back();
         return false;
       }
       otherwise_node = iter;
@@ -551,6 +820,7 @@ EsiParser::_processChooseTag(const string &data, size_t curr_pos, size_t end_pos
       if (!_isWhitespace(iter->data, iter->data_len)) {
         _errorLog("[%s] Cannot have non-whitespace raw text as top-level node in choose data",
                   __FUNCTION__, DocNode::type_names_[iter->type]);
+        node_list.pop_back();
         return false;
       }
       _debugLog(_debug_tag.c_str(), "[%s] Ignoring top-level whitespace raw text", __FUNCTION__); 
@@ -562,18 +832,21 @@ EsiParser::_processChooseTag(const string &data, size_t curr_pos, size_t end_pos
     } else if (iter->type != DocNode::TYPE_WHEN) {
       _errorLog("[%s] Cannot have %s as top-level node in choose data; only when/otherwise/whitespace-text "
                 "permitted", __FUNCTION__, DocNode::type_names_[iter->type]);
+      node_list.pop_back();
       return false;
     }
     ++iter;
   }
-  node_list.push_back(choose_node);
   return true;
 }
 
 void
 EsiParser::clear() {
   _data.clear();
+  _retired_data.clear();
+  _retired_data_size = 0;
   _parse_start_pos = -1;
+  _closing_tag_search_pos = 0;
 }
 
 EsiParser::~EsiParser() {
@@ -607,7 +880,9 @@ EsiParser::parse(DocNodeList &node_list, const char *ext_data_ptr, int data_len
   string data;
   size_t orig_output_list_size;
   int parse_start_pos = -1;
-  bool retval = _completeParse(data, parse_start_pos, orig_output_list_size, node_list, ext_data_ptr, data_len);
+  size_t closing_tag_search_pos = 0;
+  bool retval = _completeParse(data, parse_start_pos, orig_output_list_size, closing_tag_search_pos, node_list,
+                               ext_data_ptr, data_len);
   if (retval && (node_list.size() - orig_output_list_size)) {
     // adjust all pointers to addresses in input parameter
     const char *int_data_start = data.data();
@@ -25,6 +25,7 @@
 #define _ESI_PARSER_H
 
 #include <string>
+#include <list>
 
 #include "ComponentBase.h"
 #include "DocNode.h"
@@ -43,7 +44,9 @@ public:
   /** parses a chunk of the document; adds complete nodes found;
    * data is assumed to be NULL-terminated is data_len is set to -1.
    *
-   * Output nodes contain pointers to internal data; use with care */
+   * Output nodes contain pointers to internal data; use with care.
+   * Such pointers stay valid till clear() is called - chunk data is
+   * never moved once nodes point into it */
   bool parseChunk(const char *data, EsiLib::DocNodeList &node_list, int data_len = -1);
 
   /** convenient alternative to method above */
@@ -56,9 +59,7 @@ public:
    * only chunk can be provided.
    *
    * Output nodes contain pointers to internal data; use with care. */
-  bool completeParse(EsiLib::DocNodeList &node_list, const char *data = 0, int data_len = -1) {
-    return _completeParse(_data, _parse_start_pos, _orig_output_list_size, node_list, data, data_len);
-  }
+  bool completeParse(EsiLib::DocNodeList &node_list, const char *data = 0, int data_len = -1);
   
   /** convenient alternative to method above */
   bool completeParse(EsiLib::DocNodeList &node_list, const std::string &data) {
@@ -74,6 +75,11 @@ public:
     return parse(node_list, ext_data.data(), ext_data.size());
   }
 
+  /** by default opening tags are located with a vectorized scan for
+   * '<' (picked at runtime based on cpu support); this forces the
+   * original byte-at-a-time scanner instead (for tests/benchmarks) */
+  static void setScalarTagScan(bool scalar) { _scalar_tag_scan = scalar; };
+
   virtual ~EsiParser();
 
 private:
@@ -85,13 +91,24 @@ private:
     int tag_suffix_len;
     const char *closing_tag;
     int closing_tag_len; 
+    unsigned char closing_tag_shifts[256]; // Boyer-Moore-Horspool shift table for closing tag
     EsiNodeInfo(EsiLib::DocNode::TYPE t, const char *s, int s_len, const char *ct, int ct_len)
-      : type(t), tag_suffix(s), tag_suffix_len(s_len), closing_tag(ct), closing_tag_len(ct_len) { };
+      : type(t), tag_suffix(s), tag_suffix_len(s_len), closing_tag(ct), closing_tag_len(ct_len) {
+      for (int i = 0; i < 256; ++i) {
+        closing_tag_shifts[i] = ct_len;
+      }
+      for (int i = 0; i < (ct_len - 1); ++i) {
+        closing_tag_shifts[static_cast<unsigned char>(ct[i])] = ct_len - 1 - i;
+      }
+    };
   };
   
   std::string _data;
+  std::list<std::string> _retired_data; // earlier buffers that output nodes still point into
+  size_t _retired_data_size;
   int _parse_start_pos;
   size_t _orig_output_list_size;
+  size_t _closing_tag_search_pos; // where the pending tag's closing tag search resumes
 
   static const EsiNodeInfo ESI_NODES[];
   static const EsiNodeInfo HTML_COMMENT_NODE_INFO;
@@ -102,12 +119,17 @@ private:
   static const std::string SRC_ATTR_STR;
   static const std::string TEST_ATTR_STR;
   static const std::string HANDLER_ATTR_STR;
+  static const std::string TIMEOUT_ATTR_STR;
+  static const std::string DEADLINE_ATTR_STR;
 
   static const unsigned int MAX_DOC_SIZE;
+  static const unsigned int MIN_BUFFER_SIZE;
+
+  static bool _scalar_tag_scan;
 
   enum MATCH_TYPE { NO_MATCH, COMPLETE_MATCH, PARTIAL_MATCH };
   
-  MATCH_TYPE _searchData(const std::string &data, size_t start_pos, const char *str, int str_len,
+  MATCH_TYPE _searchData(const std::string &data, size_t start_pos, const EsiNodeInfo &node_info,
                          size_t &pos) const;
 
   MATCH_TYPE _compareData(const std::string &data, size_t pos, const char *str, int str_len) const;
@@ -115,12 +137,18 @@ private:
   MATCH_TYPE _findOpeningTag(const std::string &data, size_t start_pos,
                              size_t &opening_tag_pos, bool &is_html_comment_node) const;
 
-  bool _parse(const std::string &data, int &parse_start_pos, EsiLib::DocNodeList &node_list,
-              bool last_chunk = false) const;
+  MATCH_TYPE _findOpeningTagScalar(const std::string &data, size_t start_pos,
+                                   size_t &opening_tag_pos, bool &is_html_comment_node) const;
+
+  bool _parse(const std::string &data, int &parse_start_pos, size_t &closing_tag_search_pos,
+              EsiLib::DocNodeList &node_list, bool last_chunk = false) const;
   
   bool _processIncludeTag(const std::string &data, size_t curr_pos, size_t end_pos,
                           EsiLib::DocNodeList &node_list) const;
 
+  size_t _findAttribute(const std::string &data, const std::string &attr, size_t curr_pos,
+                        size_t end_pos) const;
+
   bool _processSpecialIncludeTag(const std::string &data, size_t curr_pos, size_t end_pos,
                                  EsiLib::DocNodeList &node_list) const;
 
@@ -138,11 +166,13 @@ private:
   inline bool _processSimpleContentTag(EsiLib::DocNode::TYPE node_type, const char *data, int data_len,
                                        EsiLib::DocNodeList &node_list) const;
 
+  bool _reserveData(const char *data_ptr, int &data_len);
+
   bool _setup(std::string &data, int &parse_start_pos, size_t &orig_output_list_size,
               EsiLib::DocNodeList &node_list, const char *data_ptr, int &data_len) const;
 
   bool _completeParse(std::string &data, int &parse_start_pos, size_t &orig_output_list_size,
-                      EsiLib::DocNodeList &node_list, const char *data_ptr = 0, int data_len = -1) const;
+                      size_t &closing_tag_search_pos, EsiLib::DocNodeList &node_list, const char *data_ptr = 0, int data_len = -1) const;
 
   inline void _adjustPointers(EsiLib::DocNodeList::iterator node_iter, EsiLib::DocNodeList::iterator end,
                               const char *ext_data_ptr, const char *int_data_start) const;
@@ -24,16 +24,18 @@
 #include "EsiProcessor.h"
 #include "Stats.h"
 #include "FailureInfo.h"
+#include <stdlib.h>
 #include <ctype.h>
+#include <algorithm>
 
 using std::string;
 using namespace EsiLib;
-extern pthread_key_t threadKey;
-// this needs to be a fixed address as only the address is used for comparision
-const char *EsiProcessor::INCLUDE_DATA_ID_ATTR = reinterpret_cast<const char *>(0xbeadface);
-
 #define FAILURE_INFO_TAG "plugin_esi_failureInfo"
 
+FailureRegistry *EsiProcessor::_failure_registry = 0;
+int EsiProcessor::_attempt_deadline = 0;
+int EsiProcessor::_attempt_deadline_percentile = 90;
+
 
 EsiProcessor::EsiProcessor(const char *debug_tag, const char *parser_debug_tag,
                            const char *expression_debug_tag,
@@ -41,10 +43,11 @@ EsiProcessor::EsiProcessor(const char *debug_tag, const char *parser_debug_tag,
                            HttpDataFetcher &fetcher, Variables &variables,
                            const HandlerManager &handler_mgr)
   : ComponentBase(debug_tag, debug_func, error_func),
-    _curr_state(STOPPED),
+    _curr_state(STOPPED), _output_blocks(0),
     _parser(parser_debug_tag, debug_func, error_func),
-    _n_prescanned_nodes(0),
-    _fetcher(fetcher), _esi_vars(variables),
+    _node_list(&_arena),
+    _n_prescanned_nodes(0), _n_flushed_nodes(0),
+    _fetcher(fetcher), _swapping_attempt(false), _esi_vars(variables),
     _expression(expression_debug_tag, debug_func, error_func, _esi_vars), _n_try_blocks_processed(0),
     _handler_manager(handler_mgr) {
 }
@@ -78,7 +81,8 @@ EsiProcessor::addParseData(const char *data, int data_len) {
     Stats::increment(Stats::N_PARSE_ERRS);
     return false;
   }
-  if (!_preprocess(_node_list, _n_prescanned_nodes)) {
+  _addParsedNodes();
+  if (!_preprocess(_node_ids, _n_prescanned_nodes)) {
     _errorLog("[%s] Failed to preprocess parsed nodes; Stopping processor...", __FUNCTION__);
     error();
     return false;
@@ -105,9 +109,22 @@ EsiProcessor::completeParse(const char *data /* = 0 */, int data_len /* = -1 */)
     Stats::increment(Stats::N_PARSE_ERRS);
     return false;
   }
+  _addParsedNodes();
   return _handleParseComplete();
 }
 
+/** moves newly parsed nodes from the parser's output list to the flat
+ * document list and queues them up for processing */
+void
+EsiProcessor::_addParsedNodes() {
+  int index = _doc_nodes.size();
+  _doc_nodes.append(_node_list);
+  for (; index < _doc_nodes.size(); index = _doc_nodes[index].subtree_end) {
+    _node_ids.push_back(index);
+  }
+  _node_list.clear();
+}
+
 bool
 EsiProcessor::usePackedNodeList(const char *data, int data_len) {
   if (_curr_state != STOPPED) {
@@ -115,11 +132,14 @@ EsiProcessor::usePackedNodeList(const char *data, int data_len) {
     return false;
   }
   start();
-  if (!_node_list.unpack(data, data_len)) {
+  if (!_doc_nodes.unpack(data, data_len)) {
     _errorLog("[%s] Could not unpack node list from provided data!", __FUNCTION__);
     error();
     return false;
   }
+  for (int index = 0; index < _doc_nodes.size(); index = _doc_nodes[index].subtree_end) {
+    _node_ids.push_back(index);
+  }
   return _handleParseComplete();
 }
 
@@ -129,7 +149,7 @@ EsiProcessor::_handleParseComplete() {
     _debugLog(_debug_tag.c_str(), "[%s] Cannot handle parse complete in state %d", __FUNCTION__, _curr_state);
     return false;
   }
-  if (!_preprocess(_node_list, _n_prescanned_nodes)) {
+  if (!_preprocess(_node_ids, _n_prescanned_nodes)) {
     _errorLog("[%s] Failed to preprocess parsed nodes; Stopping processor...", __FUNCTION__);
     error();
     return false;
@@ -139,17 +159,18 @@ EsiProcessor::_handleParseComplete() {
     map_iter->second->handleParseComplete();
   }
 
-  _debugLog(_debug_tag.c_str(), "[%s] Parsed ESI document with %d nodes", __FUNCTION__, _node_list.size());
+  _debugLog(_debug_tag.c_str(), "[%s] Parsed ESI document with %d nodes", __FUNCTION__, _doc_nodes.size());
   _curr_state = WAITING_TO_PROCESS;
   
   return true;
 }
 
 bool
-EsiProcessor::_getIncludeData(const DocNode &node, const char **content_ptr /* = 0 */,
+EsiProcessor::_getIncludeData(int node_id, const char **content_ptr /* = 0 */,
                               int *content_len_ptr /* = 0 */) {
+  const FlatDocNode &node = _getNode(node_id);
   if (node.type == DocNode::TYPE_INCLUDE) {
-    const Attribute &url = node.attr_list.front();
+    const Attribute &url = _getAttribute(node_id, 0);
     string raw_url(url.value, url.value_len);
     StringHash::iterator iter = _include_urls.find(raw_url);
     if (iter == _include_urls.end()) {
@@ -174,15 +195,13 @@ EsiProcessor::_getIncludeData(const DocNode &node, const char **content_ptr /* =
               processed_url.size(), processed_url.data());
     return true;
   } else if (node.type == DocNode::TYPE_SPECIAL_INCLUDE) {
-    AttributeList::const_iterator attr_iter;
-    for (attr_iter = node.attr_list.begin(); attr_iter != node.attr_list.end(); ++attr_iter) {
-      if (attr_iter->name == INCLUDE_DATA_ID_ATTR) {
-        break;
-      }
+    SpecialIncludeMap::const_iterator include_iter = _special_includes.find(node_id);
+    if (include_iter == _special_includes.end()) {
+      _errorLog("[%s] Special include node %d was not handled", __FUNCTION__, node_id);
+      return false;
     }
-    int include_data_id = attr_iter->value_len;
-    SpecialIncludeHandler *handler = 
-      reinterpret_cast<SpecialIncludeHandler *>(const_cast<char *>(attr_iter->value));
+    int include_data_id = include_iter->second.data_id;
+    SpecialIncludeHandler *handler = include_iter->second.handler;
     bool result;
     if (content_ptr && content_len_ptr) {
       result = handler->getData(include_data_id, *content_ptr, *content_len_ptr);
@@ -203,16 +222,46 @@ EsiProcessor::_getIncludeData(const DocNode &node, const char **content_ptr /* =
   return false;
 }
 
-EsiProcessor::ReturnCode
-EsiProcessor::process(const char *&data, int &data_len) {
-  if (_curr_state == ERRORED) {
-    return FAILURE;
+DataStatus
+EsiProcessor::_getIncludeStatus(int node_id) {
+  if (_getNode(node_id).type == DocNode::TYPE_INCLUDE) {
+    const Attribute &url = _getAttribute(node_id, 0);
+    StringHash::iterator iter = _include_urls.find(string(url.value, url.value_len));
+    if (iter == _include_urls.end()) {
+      return STATUS_ERROR;
+    }
+    return _fetcher.getRequestStatus(iter->second);
   }
-  if (_curr_state != WAITING_TO_PROCESS) {
-    _errorLog("[%s] Processor has to finish parsing via completeParse() before process() call", __FUNCTION__);
-    return FAILURE;
+  SpecialIncludeMap::const_iterator include_iter = _special_includes.find(node_id);
+  if (include_iter == _special_includes.end()) {
+    return STATUS_ERROR;
+  }
+  return include_iter->second.handler->getIncludeStatus(include_iter->second.data_id);
+}
+
+bool
+EsiProcessor::_isAttemptDataPending() {
+  TryBlockList::iterator try_iter = _try_blocks.begin();
+  for (int i = 0; i < _n_try_blocks_processed; ++i, ++try_iter);
+  for (; try_iter != _try_blocks.end(); ++try_iter) {
+    if (try_iter->swapped) {
+      continue;
+    }
+    const NodeIdList &attempt_nodes = try_iter->attempt_nodes;
+    for (NodeIdList::const_iterator id_iter = attempt_nodes.begin(); id_iter != attempt_nodes.end(); ++id_iter) {
+      DocNode::TYPE type = _getNode(*id_iter).type;
+      if (((type == DocNode::TYPE_INCLUDE) || (type == DocNode::TYPE_SPECIAL_INCLUDE)) &&
+          (_getIncludeStatus(*id_iter) == STATUS_DATA_PENDING)) {
+        return true;
+      }
+    }
   }
-  DocNodeList::iterator node_iter,iter;
+  return false;
+}
+
+EsiProcessor::ReturnCode
+EsiProcessor::_handleTryBlocks() {
+  NodeIdList::iterator node_iter,iter;
   bool attempt_succeeded;
   std::vector<std::string> attemptUrls;
   TryBlockList::iterator try_iter = _try_blocks.begin();
@@ -220,63 +269,46 @@ EsiProcessor::process(const char *&data, int &data_len) {
   for (; _n_try_blocks_processed < static_cast<int>(_try_blocks.size()); ++try_iter) {
     ++_n_try_blocks_processed;
     attempt_succeeded = true;
-    for (node_iter = try_iter->attempt_nodes.begin(); node_iter != try_iter->attempt_nodes.end(); ++node_iter) {
-      if ((node_iter->type == DocNode::TYPE_INCLUDE) ||
-          (node_iter->type == DocNode::TYPE_SPECIAL_INCLUDE)) {
-          const Attribute &url = (*node_iter).attr_list.front();              
-          string raw_url(url.value, url.value_len);
-          attemptUrls.push_back(_expression.expand(raw_url));
-        if (!_getIncludeData(*node_iter)) {
-          attempt_succeeded = false;
-          break;
+    if (try_iter->swapped) {
+      _debugLog(_debug_tag.c_str(), "[%s] attempt section is too slow; not waiting for it", __FUNCTION__);
+      Stats::increment(Stats::N_ATTEMPTS_SWAPPED);
+      attempt_succeeded = false;
+    } else {
+      for (node_iter = try_iter->attempt_nodes.begin(); node_iter != try_iter->attempt_nodes.end(); ++node_iter) {
+        if ((_getNode(*node_iter).type == DocNode::TYPE_INCLUDE) ||
+            (_getNode(*node_iter).type == DocNode::TYPE_SPECIAL_INCLUDE)) {
+          if (!_getIncludeData(*node_iter)) {
+            attempt_succeeded = false;
+            break;
+          }
         }
       }
     }
           
     /* FAILURE CACHE */
-    FailureData* data=static_cast<FailureData*>(pthread_getspecific(threadKey));
-    _debugLog("plugin_esi_failureInfo","[%s]Fetched data related to thread specfic %p",__FUNCTION__,data);
-    
+    attemptUrls.clear();
+    bool attempt_made=true;
     for (iter=try_iter->attempt_nodes.begin(); iter != try_iter->attempt_nodes.end(); ++iter) {
-      if ((iter->type == DocNode::TYPE_INCLUDE) || iter->type == DocNode::TYPE_SPECIAL_INCLUDE)
+      if ((_getNode(*iter).type == DocNode::TYPE_INCLUDE) || _getNode(*iter).type == DocNode::TYPE_SPECIAL_INCLUDE)
       {
-          if(!attempt_succeeded && iter==node_iter)
-              continue;
-          const Attribute &url = (*iter).attr_list.front();              
-          string raw_url(url.value, url.value_len);
-          attemptUrls.push_back(_expression.expand(raw_url));
+          attemptUrls.push_back(_expandIncludeUrl(*iter));
+          if(_skipped_urls.find(attemptUrls.back())!=_skipped_urls.end())
+              attempt_made=false;
       }
     }
    
-    if(attemptUrls.size()>0 && data)
+    //Should be registered only if attempt was made;
+    //skipped includes say nothing about the backend
+    if(attemptUrls.size()>0 && _failure_registry && attempt_made)
     { 
-        FailureData::iterator it =data->find(attemptUrls[0]);
-        FailureInfo* info;
-    
-        if(it == data->end())
-        {
-            _debugLog("plugin_esi_failureInfo","[%s]Inserting object for the attempt URLS",__FUNCTION__);
-            info=new FailureInfo(FAILURE_INFO_TAG,_debugLog,_errorLog);
-            for(int i=0;i<static_cast<int>(attemptUrls.size());i++)
-            {
-                _debugLog("plugin_esi_failureInfo", "[%s] Urls [%.*s]",__FUNCTION__,attemptUrls[i].size(),attemptUrls[i].data());
-                (*data)[attemptUrls[i]]=info;
-            }
-    
-            info->registerSuccFail(attempt_succeeded);
-
-        } else {
-            info=it->second;
-            //Should be registered only if attemp was made
-            //and it failed
-            if(_reqAdded)
-                info->registerSuccFail(attempt_succeeded);   
-    
-        }
+        if(try_iter->swapped)
+            _deferred_attempts.push_back(attemptUrls); // outcome known once the fetches complete
+        else
+            _registerAttempt(attemptUrls,attempt_succeeded);
     }
     if (attempt_succeeded) {
       _debugLog(_debug_tag.c_str(), "[%s] attempt section succeded; using attempt section", __FUNCTION__);
-      _node_list.splice(try_iter->pos, try_iter->attempt_nodes);
+      _insertTryNodes(try_iter, try_iter->attempt_nodes);
     } else {
       _debugLog(_debug_tag.c_str(), "[%s] attempt section errored; trying except section", __FUNCTION__); 
       int n_prescanned_nodes = 0;
@@ -285,45 +317,306 @@ EsiProcessor::process(const char *&data, int &data_len) {
         stop();
         return FAILURE;
       }
-      _node_list.splice(try_iter->pos, try_iter->except_nodes);
-      if (_fetcher.getNumPendingRequests()) { 
+      _insertTryNodes(try_iter, try_iter->except_nodes);
+      if (_getNumBlockingRequests()) { 
         _debugLog(_debug_tag.c_str(), "[%s] New fetch requests were triggered by except block; "
                   "Returning NEED_MORE_DATA...", __FUNCTION__);
         return NEED_MORE_DATA;
       }
     }
   }
+  registerDeferredAttempts();
+  return SUCCESS;
+}
+
+void
+EsiProcessor::_registerAttempt(const std::vector<std::string> &urls, bool succeeded) {
+  int latency = -1;
+  for (std::vector<std::string>::const_iterator iter = urls.begin(); iter != urls.end(); ++iter) {
+    latency = std::max(latency, _fetcher.getResponseTime(*iter));
+  }
+  time_t now = time(NULL);
+  for (std::vector<std::string>::const_iterator iter = urls.begin(); iter != urls.end(); ++iter) {
+    _debugLog(FAILURE_INFO_TAG, "[%s] Registering %s for url [%.*s]", __FUNCTION__,
+              succeeded ? "success" : "failure", iter->size(), iter->data());
+    FailureInfo *info = _failure_registry->get(*iter, now);
+    if (info) {
+      info->registerSuccFail(succeeded, latency);
+      _failure_registry->release(info);
+    }
+  }
+}
+
+void
+EsiProcessor::registerDeferredAttempts() {
+  UrlGroupList::iterator group_iter = _deferred_attempts.begin();
+  while (group_iter != _deferred_attempts.end()) {
+    bool complete = true, succeeded = true;
+    for (std::vector<std::string>::iterator iter = group_iter->begin(); iter != group_iter->end(); ++iter) {
+      DataStatus status = _fetcher.getRequestStatus(*iter);
+      if (status == STATUS_DATA_PENDING) {
+        complete = false;
+        break;
+      }
+      if (status == STATUS_ERROR) {
+        succeeded = false;
+      }
+    }
+    if (!complete) {
+      ++group_iter;
+      continue;
+    }
+    _registerAttempt(*group_iter, succeeded);
+    group_iter = _deferred_attempts.erase(group_iter);
+  }
+}
+
+/** number of pending requests that processing has to wait for */
+int
+EsiProcessor::_getNumBlockingRequests() const {
+  int n_pending = _fetcher.getNumPendingRequests();
+  for (std::set<std::string>::const_iterator iter = _swapped_urls.begin();
+       n_pending && (iter != _swapped_urls.end()); ++iter) {
+    if (_fetcher.getRequestStatus(*iter) == STATUS_DATA_PENDING) {
+      --n_pending;
+    }
+  }
+  return n_pending;
+}
+
+/** checks if the includes of given attempt section recently took
+ * longer than the given deadline */
+bool
+EsiProcessor::_isAttemptSlow(const NodeIdList &attempt_nodes, int deadline) {
+  time_t now = time(NULL);
+  for (NodeIdList::const_iterator iter = attempt_nodes.begin(); iter != attempt_nodes.end(); ++iter) {
+    if (_getNode(*iter).type != DocNode::TYPE_INCLUDE) {
+      continue;
+    }
+    const string &url = _expandIncludeUrl(*iter);
+    FailureInfo *info = _failure_registry->find(url, now);
+    int latency = -1;
+    if (info) {
+      latency = info->getLatencyPercentile(_attempt_deadline_percentile);
+      _failure_registry->release(info);
+    }
+    if (latency > deadline) {
+      _debugLog(_debug_tag.c_str(), "[%s] %d%% of recent fetches of [%.*s] took up to %d ms; deadline is %d ms",
+                __FUNCTION__, _attempt_deadline_percentile, url.size(), url.data(), latency, deadline);
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+EsiProcessor::setAttemptDeadline(int deadline, int percentile) {
+  _attempt_deadline = (deadline > 0) ? deadline : 0;
+  _attempt_deadline_percentile = ((percentile > 0) && (percentile <= 100)) ? percentile : 90;
+}
+
+/** puts chosen attempt/except nodes of a try block in place of the try
+ * block, i.e., just before the try node */
+void
+EsiProcessor::_insertTryNodes(TryBlockList::iterator &try_iter, NodeIdList &nodes) {
+  NodeIdList &parent_nodes = *(try_iter->parent_nodes);
+  int pos = std::find(parent_nodes.begin(), parent_nodes.end(), try_iter->try_node) - parent_nodes.begin();
+  parent_nodes.insert(parent_nodes.begin() + pos, nodes.begin(), nodes.end());
+  if ((&parent_nodes == &_node_ids) && (pos < _n_prescanned_nodes)) {
+    _n_prescanned_nodes += nodes.size();
+  }
+  // try blocks nested in given nodes now live in the parent list
+  for (TryBlockList::iterator iter = try_iter; iter != _try_blocks.end(); ++iter) {
+    if (iter->parent_nodes == &nodes) {
+      iter->parent_nodes = &parent_nodes;
+    }
+  }
+  nodes.clear();
+}
+
+/** adds data that outlives processing, i.e., template or fetched data, to the output */
+inline void
+EsiProcessor::_appendOutput(const char *data, int data_len) {
+  if (!_output_blocks) {
+    _output_data.append(data, data_len);
+  } else if (data_len > 0) {
+    _output_blocks->push_back(ByteBlock(data, data_len));
+  }
+}
+
+/** adds data appended to _output_data beyond given size to the output
+ * blocks, if any; such blocks get their data pointers once processing
+ * is done, as _output_data may move until then */
+inline void
+EsiProcessor::_addOwnedOutput(size_t orig_output_size) {
+  int data_len = _output_data.size() - orig_output_size;
+  if (!_output_blocks || !data_len) {
+    return;
+  }
+  if (!_output_blocks->empty() && !_output_blocks->back().data) {
+    _output_blocks->back().data_len += data_len;
+  } else {
+    _output_blocks->push_back(ByteBlock(0, data_len));
+  }
+}
+
+EsiProcessor::ReturnCode
+EsiProcessor::process(const char *&data, int &data_len) {
+  ReturnCode retval = _process();
+  if (retval == SUCCESS) {
+    data = _output_data.c_str();
+    data_len = _output_data.size();
+    _debugLog(_debug_tag.c_str(), "[%s] ESI processed document of size %d starting with [%.10s]",
+              __FUNCTION__, data_len, (data_len ? data : "(null)"));
+  }
+  return retval;
+}
+
+EsiProcessor::ReturnCode
+EsiProcessor::process(ByteBlockList &blocks) {
+  ByteBlockList new_blocks;
+  size_t orig_output_size = _output_data.size();
+  _output_blocks = &new_blocks;
+  ReturnCode retval = _process();
+  _output_blocks = 0;
+  if (retval != SUCCESS) {
+    return retval;
+  }
+  const char *owned_data = _output_data.data() + orig_output_size;
+  int data_len = 0;
+  for (ByteBlockList::iterator iter = new_blocks.begin(); iter != new_blocks.end(); ++iter) {
+    if (!iter->data) {
+      iter->data = owned_data;
+      owned_data += iter->data_len;
+    }
+    data_len += iter->data_len;
+  }
+  _debugLog(_debug_tag.c_str(), "[%s] ESI processed document of size %d in %d block(s)",
+            __FUNCTION__, data_len, new_blocks.size());
+  blocks.splice(blocks.end(), new_blocks);
+  return SUCCESS;
+}
+
+EsiProcessor::ReturnCode
+EsiProcessor::_process() {
+  if (_curr_state == ERRORED) {
+    return FAILURE;
+  }
+  if (_curr_state != WAITING_TO_PROCESS) {
+    _errorLog("[%s] Processor has to finish parsing via completeParse() before process() call", __FUNCTION__);
+    return FAILURE;
+  }
+  ReturnCode try_retval = _handleTryBlocks();
+  if (try_retval != SUCCESS) {
+    return try_retval;
+  }
   _curr_state = PROCESSED;
-  for (node_iter = _node_list.begin(); node_iter != _node_list.end(); ++node_iter) {
-    DocNode &doc_node = *node_iter; // handy reference
+  for (NodeIdList::iterator id_iter = _node_ids.begin(); id_iter != _node_ids.end(); ++id_iter) {
+    const FlatDocNode &doc_node = _getNode(*id_iter); // handy reference
     _debugLog(_debug_tag.c_str(), "[%s] Processing ESI node [%s] with data of size %d starting with [%.5s...]", 
               __FUNCTION__, DocNode::type_names_[doc_node.type], doc_node.data_len,
               (doc_node.data_len ? doc_node.data : "(null)"));
     if (doc_node.type == DocNode::TYPE_PRE) {
       // just copy the data
-      _output_data.append(doc_node.data, doc_node.data_len);
-    } else if (!_processEsiNode(node_iter)) {
+      _appendOutput(doc_node.data, doc_node.data_len);
+    } else if (!_processEsiNode(*id_iter)) {
       _errorLog("[%s] Failed to process ESI node [%.*s]", __FUNCTION__, doc_node.data_len, doc_node.data);
       stop();
       return FAILURE;
     }
   }
   _addFooterData();
-  data = _output_data.c_str();
-  data_len = _output_data.size();
-  _debugLog(_debug_tag.c_str(), "[%s] ESI processed document of size %d starting with [%.10s]",
-            __FUNCTION__, data_len, (data_len ? data : "(null)"));
   return SUCCESS;
 }
 
+EsiProcessor::ReturnCode
+EsiProcessor::flush(const char *&data, int &data_len) {
+  data = "";
+  data_len = 0;
+  if (_curr_state == ERRORED) {
+    return FAILURE;
+  }
+  if (_curr_state == PROCESSED) {
+    return SUCCESS;
+  }
+  if ((_curr_state != PARSING) && (_curr_state != WAITING_TO_PROCESS)) {
+    _errorLog("[%s] Cannot flush in state %d", __FUNCTION__, _curr_state);
+    return FAILURE;
+  }
+  _output_data.clear();
+  while (_n_flushed_nodes < static_cast<int>(_node_ids.size())) {
+    int node_id = _node_ids[_n_flushed_nodes];
+    const FlatDocNode &doc_node = _getNode(node_id); // handy reference
+    if ((doc_node.type == DocNode::TYPE_TRY) &&
+        (_n_try_blocks_processed < static_cast<int>(_try_blocks.size()))) {
+      // try blocks can only be resolved once the whole document is
+      // parsed and all attempt data has come in
+      if ((_curr_state != WAITING_TO_PROCESS) || _isAttemptDataPending()) {
+        break;
+      }
+      ReturnCode try_retval = _handleTryBlocks();
+      if (try_retval == FAILURE) {
+        return FAILURE;
+      }
+      if (try_retval == NEED_MORE_DATA) {
+        break;
+      }
+      // chosen attempt/except nodes have been put in before the try
+      // node; resume from there
+      continue;
+    }
+    if ((doc_node.type == DocNode::TYPE_INCLUDE) || (doc_node.type == DocNode::TYPE_SPECIAL_INCLUDE)) {
+      if ((doc_node.type == DocNode::TYPE_SPECIAL_INCLUDE) && (_curr_state != WAITING_TO_PROCESS)) {
+        // handlers get to see the whole document before serving data
+        break;
+      }
+      if (_getIncludeStatus(node_id) == STATUS_DATA_PENDING) {
+        _debugLog(_debug_tag.c_str(), "[%s] Data for include node %d pending; flushing %d bytes till here",
+                  __FUNCTION__, _n_flushed_nodes, _output_data.size());
+        break;
+      }
+    }
+    if (doc_node.type == DocNode::TYPE_PRE) {
+      _output_data.append(doc_node.data, doc_node.data_len);
+    } else if (!_processEsiNode(node_id)) {
+      _errorLog("[%s] Failed to process ESI node [%.*s]", __FUNCTION__, doc_node.data_len, doc_node.data);
+      stop();
+      return FAILURE;
+    }
+    ++_n_flushed_nodes;
+  }
+  ReturnCode retval = NEED_MORE_DATA;
+  if ((_n_flushed_nodes == static_cast<int>(_node_ids.size())) && (_curr_state == WAITING_TO_PROCESS)) {
+    _addFooterData();
+    _curr_state = PROCESSED;
+    retval = SUCCESS;
+  }
+  data = _output_data.data();
+  data_len = _output_data.size();
+  _debugLog(_debug_tag.c_str(), "[%s] Flushing %d bytes after %d node(s); document %s", __FUNCTION__,
+            data_len, _n_flushed_nodes, (retval == SUCCESS) ? "complete" : "incomplete");
+  return retval;
+}
+
 void
 EsiProcessor::stop() {
   _output_data.clear();
-  _node_list.clear();
+  _node_list.clear(); // only runs destructors; memory goes back to the arena below
+  _arena.reset();
+  _doc_nodes.clear();
+  _comment_nodes.clear();
+  _node_ids.clear();
+  _special_includes.clear();
+  _parser.clear();
   _include_urls.clear();
   _try_blocks.clear();
   _n_prescanned_nodes = 0;
   _n_try_blocks_processed = 0;
+  _n_flushed_nodes = 0;
+  _skipped_urls.clear();
+  _swapped_urls.clear();
+  _swapping_attempt = false;
+  _deferred_attempts.clear();
   for (IncludeHandlerMap::iterator map_iter = _include_handlers.begin();
        map_iter != _include_handlers.end(); ++map_iter) {
     delete map_iter->second;
@@ -339,14 +632,14 @@ EsiProcessor::~EsiProcessor() {
 }
 
 bool
-EsiProcessor::_processEsiNode(const DocNodeList::iterator &iter) {
+EsiProcessor::_processEsiNode(int node_id) {
   bool retval;
-  const DocNode &node = *iter;
+  const FlatDocNode &node = _getNode(node_id);
   if ((node.type == DocNode::TYPE_INCLUDE) || (node.type == DocNode::TYPE_SPECIAL_INCLUDE)) {
     const char *content;
     int content_len;
-    if ((retval = _getIncludeData(node, &content, &content_len))) {
-      _output_data.append(content, content_len);
+    if ((retval = _getIncludeData(node_id, &content, &content_len))) {
+      _appendOutput(content, content_len);
     }
   } else if ((node.type == DocNode::TYPE_COMMENT) || (node.type == DocNode::TYPE_REMOVE) ||
              (node.type == DocNode::TYPE_TRY) || (node.type == DocNode::TYPE_CHOOSE) ||
@@ -355,7 +648,7 @@ EsiProcessor::_processEsiNode(const DocNodeList::iterator &iter) {
     _debugLog(_debug_tag.c_str(), "[%s] No-op for [%s] node", __FUNCTION__, DocNode::type_names_[node.type]);
     retval = true;
   } else if (node.type == DocNode::TYPE_VARS) {
-    retval = _handleVars(node.data, node.data_len);
+    retval = _handleVars(node);
   } else {
     _errorLog("[%s] Unknown ESI Doc node type %d", __FUNCTION__, node.type);
     retval = false;
@@ -378,23 +671,37 @@ EsiProcessor::_isWhitespace(const char *data, int data_len) {
   return true;
 }
 
+void
+EsiProcessor::_getChildIds(int id, NodeIdList &child_ids) const {
+  int end_id = _getNextSiblingId(id);
+  for (int child_id = _getFirstChildId(id); child_id != end_id; child_id = _getNextSiblingId(child_id)) {
+    child_ids.push_back(child_id);
+  }
+}
+
 bool
-EsiProcessor::_handleChoose(DocNodeList::iterator &curr_node) {
-  DocNodeList::iterator iter, otherwise_node, winning_node, end_node;
-  end_node = curr_node->child_nodes.end();
+EsiProcessor::_handleChoose(NodeIdList &node_ids, int pos) {
+  int choose_id = node_ids[pos];
+  int id, otherwise_node, winning_node, end_node;
+  end_node = _getNextSiblingId(choose_id);
   otherwise_node = end_node;
-  for (iter = curr_node->child_nodes.begin(); iter != end_node; ++iter) {
-    if (iter->type == DocNode::TYPE_OTHERWISE) {
-      otherwise_node = iter;
+  for (id = _getFirstChildId(choose_id); id != end_node; id = _getNextSiblingId(id)) {
+    if (_getNode(id).type == DocNode::TYPE_OTHERWISE) {
+      otherwise_node = id;
       break;
     }
   }
   winning_node = end_node;
-  for (iter = curr_node->child_nodes.begin(); iter != end_node; ++iter) {
-    if (iter->type == DocNode::TYPE_WHEN) {
-      const Attribute &test_expr = iter->attr_list.front();
-      if (_expression.evaluate(test_expr.value, test_expr.value_len)) {
-        winning_node = iter;
+  for (id = _getFirstChildId(choose_id); id != end_node; id = _getNextSiblingId(id)) {
+    const FlatDocNode when_node = _getNode(id);
+    if (when_node.type == DocNode::TYPE_WHEN) {
+      bool result;
+      if (!when_node.code_len || !_expression.evaluateCompiled(when_node.code, when_node.code_len, result)) {
+        const Attribute &test_expr = _getAttribute(id, 0);
+        result = _expression.evaluate(test_expr.value, test_expr.value_len);
+      }
+      if (result) {
+        winning_node = id;
         break;
       }
     }
@@ -409,101 +716,152 @@ EsiProcessor::_handleChoose(DocNodeList::iterator &curr_node) {
       return true;
     }
   }
-  // splice() inserts elements *before* given position, but we need to
-  // insert new nodes after the choose node for them to be seen by
-  // preprocess(); hence...
-  DocNodeList::iterator next_node = curr_node;
-  ++next_node;
-  _node_list.splice(next_node, winning_node->child_nodes);
+  // new nodes go after the choose node for them to be seen by
+  // preprocess()
+  NodeIdList child_ids;
+  _getChildIds(winning_node, child_ids);
+  node_ids.insert(node_ids.begin() + pos + 1, child_ids.begin(), child_ids.end());
   return true;
 }
 
 bool
-EsiProcessor::_handleTry(DocNodeList::iterator &curr_node) {
-  DocNodeList::iterator iter, end_node = curr_node->child_nodes.end();
-  DocNodeList::iterator attempt_node = end_node, except_node = end_node;
-  for (iter = curr_node->child_nodes.begin(); iter != end_node; ++iter) {
-    if (iter->type == DocNode::TYPE_ATTEMPT) {
-        
-          attempt_node = iter;
-    } else if (iter->type == DocNode::TYPE_EXCEPT) {
-      except_node = iter;
-    }
-  }
-  TryBlock try_info(attempt_node->child_nodes, except_node->child_nodes, curr_node);
+EsiProcessor::_handleTry(NodeIdList &node_ids, int pos) {
+  int try_id = node_ids[pos];
+  int id, end_node = _getNextSiblingId(try_id);
+  int attempt_node = end_node, except_node = end_node;
+  for (id = _getFirstChildId(try_id); id != end_node; id = _getNextSiblingId(id)) {
+    if (_getNode(id).type == DocNode::TYPE_ATTEMPT) {
+      attempt_node = id;
+    } else if (_getNode(id).type == DocNode::TYPE_EXCEPT) {
+      except_node = id;
+    }
+  }
+  // try blocks nested in the attempt section get added while it is
+  // preprocessed and have to be resolved before this one, so this block
+  // is moved to the end of the list after; list nodes don't move in
+  // memory, so nested blocks can point to the attempt list
+  TryBlockList::iterator try_iter = _try_blocks.insert(_try_blocks.end(), TryBlock(&node_ids, try_id));
+  _getChildIds(attempt_node, try_iter->attempt_nodes);
+  _getChildIds(except_node, try_iter->except_nodes);
+  // a deadline attribute of the try block overrides the configured one
+  int deadline = _attempt_deadline;
+  if (_getNode(try_id).n_attrs) {
+    const Attribute &deadline_attr = _getAttribute(try_id, 0);
+    int deadline_ms = atoi(string(deadline_attr.value, deadline_attr.value_len).c_str());
+    if (deadline_ms > 0) {
+      deadline = deadline_ms;
+    } else {
+      _errorLog("[%s] Ignoring invalid deadline [%.*s] of try block", __FUNCTION__,
+                deadline_attr.value_len, deadline_attr.value);
+    }
+  }
+  try_iter->swapped = (deadline && _failure_registry && _isAttemptSlow(try_iter->attempt_nodes, deadline));
+  // includes of a swapped attempt section (and sections nested in it)
+  // are still fetched but processing does not wait for them
+  bool swapping_attempt = _swapping_attempt;
+  _swapping_attempt = (swapping_attempt || try_iter->swapped);
   int n_prescanned_nodes = 0;
-  if (!_preprocess(try_info.attempt_nodes, n_prescanned_nodes)) {
+  bool preprocessed = _preprocess(try_iter->attempt_nodes, n_prescanned_nodes);
+  _swapping_attempt = swapping_attempt;
+  if (!preprocessed) {
     _errorLog("[%s] Couldn't preprocess attempt node of try block", __FUNCTION__);
     return false;
   }
-  _try_blocks.push_back(try_info);
+  _try_blocks.splice(_try_blocks.end(), _try_blocks, try_iter);
   return true;
 }
 
 bool
-EsiProcessor::_handleVars(const char *str, int str_len) {
-  const string &str_value = _expression.expand(str, str_len);
-  _debugLog(_debug_tag.c_str(), "[%s] Vars expression [%.*s] expanded to [%.*s]",
-            __FUNCTION__, str_len, str, str_value.size(), str_value.data());
-  _output_data += str_value;
+EsiProcessor::_handleVars(const FlatDocNode &node) {
+  size_t orig_output_size = _output_data.size();
+  // a compiled plan expands straight into the output
+  if (!node.code_len || !_expression.expandCompiled(node.code, node.code_len, _output_data)) {
+    const string &str_value = _expression.expand(node.data, node.data_len);
+    _debugLog(_debug_tag.c_str(), "[%s] Vars expression [%.*s] expanded to [%.*s]",
+              __FUNCTION__, node.data_len, node.data, str_value.size(), str_value.data());
+    _output_data += str_value;
+  }
+  _addOwnedOutput(orig_output_size);
   return true;
 }
 
+/** returns the expanded src of given include node; the returned
+ * string is only valid till the next expansion */
+const string &
+EsiProcessor::_expandIncludeUrl(int node_id) {
+  const FlatDocNode node = _getNode(node_id);
+  if (node.code_len) {
+    _expanded_url.clear();
+    if (_expression.expandCompiled(node.code, node.code_len, _expanded_url)) {
+      return _expanded_url;
+    }
+  }
+  const Attribute &url = _getAttribute(node_id, 0);
+  return _expression.expand(url.value, url.value_len);
+}
+
 bool
-EsiProcessor::_handleHtmlComment(const DocNodeList::iterator &curr_node) {
-  DocNodeList inner_nodes;
-  if (!_parser.parse(inner_nodes, curr_node->data, curr_node->data_len)) {
+EsiProcessor::_handleHtmlComment(NodeIdList &node_ids, int pos) {
+  const FlatDocNode &comment_node = _getNode(node_ids[pos]);
+  DocNodeList inner_nodes(_node_list.getArena());
+  if (!_parser.parse(inner_nodes, comment_node.data, comment_node.data_len)) {
     _errorLog("[%s] Couldn't parse html comment node content", __FUNCTION__);
     Stats::increment(Stats::N_PARSE_ERRS);
     return false;
   }
   _debugLog(_debug_tag.c_str(), "[%s] parsed %d inner nodes from html comment node", __FUNCTION__, inner_nodes.size());
-  DocNodeList::iterator next_node = curr_node;
-  ++next_node;
-  _node_list.splice(next_node, inner_nodes); // insert after curr node for preprocessing
+  int index = _comment_nodes.size();
+  _comment_nodes.append(inner_nodes);
+  NodeIdList inner_ids;
+  for (; index < _comment_nodes.size(); index = _comment_nodes[index].subtree_end) {
+    inner_ids.push_back(~index);
+  }
+  node_ids.insert(node_ids.begin() + pos + 1, inner_ids.begin(), inner_ids.end()); // after curr node for preprocessing
   return true;
 }
 
 bool
-EsiProcessor::_preprocess(DocNodeList &node_list, int &n_prescanned_nodes) {
-  DocNodeList::iterator list_iter = node_list.begin();
+EsiProcessor::_preprocess(NodeIdList &node_ids, int &n_prescanned_nodes) {
   StringHash::iterator hash_iter;
   string raw_url;
   
-  // skip previously examined nodes
-  for (int i = 0; i < n_prescanned_nodes; ++i, ++list_iter);
-  
-  for (; list_iter != node_list.end(); ++list_iter, ++n_prescanned_nodes) {
-    if (list_iter->type == DocNode::TYPE_CHOOSE) {
-      if (!_handleChoose(list_iter)) {
+  // previously examined nodes are skipped
+  for (; n_prescanned_nodes < static_cast<int>(node_ids.size()); ++n_prescanned_nodes) {
+    int node_id = node_ids[n_prescanned_nodes];
+    const FlatDocNode &node = _getNode(node_id);
+    if (node.type == DocNode::TYPE_CHOOSE) {
+      if (!_handleChoose(node_ids, n_prescanned_nodes)) {
         _errorLog("[%s] Failed to preprocess choose node", __FUNCTION__);
         return false;
       } 
       _debugLog(_debug_tag.c_str(), "[%s] handled choose node successfully", __FUNCTION__);
-    } else if (list_iter->type == DocNode::TYPE_TRY) {
-      if (!_handleTry(list_iter)) {
+    } else if (node.type == DocNode::TYPE_TRY) {
+      if (!_handleTry(node_ids, n_prescanned_nodes)) {
         _errorLog("[%s] Failed to preprocess try node", __FUNCTION__);
         return false;
       }
       _debugLog(_debug_tag.c_str(), "[%s] handled try node successfully", __FUNCTION__);
-    } else if (list_iter->type == DocNode::TYPE_HTML_COMMENT) {
-      if (!_handleHtmlComment(list_iter)) {
+    } else if (node.type == DocNode::TYPE_HTML_COMMENT) {
+      if (!_handleHtmlComment(node_ids, n_prescanned_nodes)) {
         _errorLog("[%s] Failed to preprocess try node", __FUNCTION__);
         return false;
       }
-    } else if (list_iter->type == DocNode::TYPE_INCLUDE) {
+    } else if (node.type == DocNode::TYPE_INCLUDE) {
       Stats::increment(Stats::N_INCLUDES);
-      const Attribute &src = list_iter->attr_list.front();
+      const Attribute &src = _getAttribute(node_id, 0);
       raw_url.assign(src.value, src.value_len);
       _debugLog(_debug_tag.c_str(), "[%s] Adding fetch request for url [%.*s]", 
                 __FUNCTION__, raw_url.size(), raw_url.data());
       hash_iter = _include_urls.find(raw_url);
       if (hash_iter != _include_urls.end()) { // we have already processed this URL
+        if (!_swapping_attempt) {
+          _swapped_urls.erase(hash_iter->second); // needed outside swapped attempts too
+        }
         _debugLog(_debug_tag.c_str(), "[%s] URL [%.*s] already processed",
                   __FUNCTION__, raw_url.size(), raw_url.data());
         continue;
       }
-      const string &expanded_url = _expression.expand(raw_url);
+      const string &expanded_url = _expandIncludeUrl(node_id);
       if (!expanded_url.size()) {
         _errorLog("[%s] Couldn't expand raw URL [%.*s]", __FUNCTION__, raw_url.size(), raw_url.data());
         Stats::increment(Stats::N_INCLUDE_ERRS);
@@ -511,29 +869,20 @@ EsiProcessor::_preprocess(DocNodeList &node_list, int &n_prescanned_nodes) {
       }
 
       bool fetch=true;
-      FailureData* threadData;
       /* FAILURE CACHE */
-      if((threadData=static_cast<FailureData*>(pthread_getspecific(threadKey))) == NULL){
-          threadData=new FailureData();  
-          if(pthread_setspecific(threadKey,threadData))
-          {
-              TSError("[%s] Unable to set the key", __FUNCTION__);
-              abort();
-          }
-          _debugLog("plugin_esi_failureInfo", "[%s] Data is set for this thread [threadData]%p [threadID]%u [%.*s]", __FUNCTION__,threadData,pthread_self(),expanded_url.size(),expanded_url.data());
-      }else {
-       
-          _debugLog("plugin_esi_failureInfo", "[%s] URL request [%.*s] %u",
-                  __FUNCTION__, expanded_url.size(), expanded_url.data(),pthread_self());
+      if(_skipped_urls.find(expanded_url)!=_skipped_urls.end()){
+          fetch=false;
+      } else if(_failure_registry){
+          _debugLog(FAILURE_INFO_TAG, "[%s] URL request [%.*s]",
+                  __FUNCTION__, expanded_url.size(), expanded_url.data());
       
-          FailureData::iterator it =threadData->find(expanded_url);
-          FailureInfo* info;
+          FailureInfo* info=_failure_registry->find(expanded_url,time(NULL));
 
-          if(it != threadData->end()) {
-              info=it->second; 
-              fetch=_reqAdded=info->isAttemptReq();
+          if(info) {
+              fetch=info->isAttemptReq();
+              _failure_registry->release(info);
               _debugLog(_debug_tag.c_str(),"[%s] Fetch result is %d",__FUNCTION__,fetch);
-        }
+          }
       }
      
       if(fetch){
@@ -543,15 +892,30 @@ EsiProcessor::_preprocess(DocNodeList &node_list, int &n_prescanned_nodes) {
             Stats::increment(Stats::N_INCLUDE_ERRS);
             continue;
           }
+          if (node.n_attrs > 1) { // timeout attribute
+            const Attribute &timeout = _getAttribute(node_id, 1);
+            int timeout_ms = atoi(string(timeout.value, timeout.value_len).c_str());
+            if (timeout_ms > 0) {
+              _fetcher.setRequestTimeout(expanded_url, timeout_ms);
+            } else {
+              _errorLog("[%s] Ignoring invalid timeout [%.*s] of include [%.*s]", __FUNCTION__,
+                        timeout.value_len, timeout.value, raw_url.size(), raw_url.data());
+            }
+          }
           _include_urls.insert(StringHash::value_type(raw_url, expanded_url));
+          if (_swapping_attempt) {
+            _swapped_urls.insert(expanded_url);
+          }
       }
       else{
           _debugLog("plugin_esi_failureInfo","[%s] Not adding fetch request for [%.*s]",__FUNCTION__,expanded_url.size(),expanded_url.data());
+          if(_skipped_urls.insert(expanded_url).second)
+              Stats::increment(Stats::N_ATTEMPTS_SKIPPED);
           continue;
       }
-    } else if (list_iter->type == DocNode::TYPE_SPECIAL_INCLUDE) {
+    } else if (node.type == DocNode::TYPE_SPECIAL_INCLUDE) {
       Stats::increment(Stats::N_SPCL_INCLUDES);
-      const Attribute &handler_attr = list_iter->attr_list.front();
+      const Attribute &handler_attr = _getAttribute(node_id, 0);
       string handler_id(handler_attr.value, handler_attr.value_len);
       SpecialIncludeHandler *handler;
       IncludeHandlerMap::const_iterator map_iter = _include_handlers.find(handler_id);
@@ -568,18 +932,14 @@ EsiProcessor::_preprocess(DocNodeList &node_list, int &n_prescanned_nodes) {
       } else {
         handler = map_iter->second;
       }
-      int special_data_id = handler->handleInclude(list_iter->data, list_iter->data_len);
+      int special_data_id = handler->handleInclude(node.data, node.data_len);
       if (special_data_id == -1) {
         _errorLog("[%s] Include handler [%s] couldn't process include with data [%.*s]",
-                  __FUNCTION__, handler_id.c_str(), list_iter->data_len, list_iter->data);
+                  __FUNCTION__, handler_id.c_str(), node.data_len, node.data);
         Stats::increment(Stats::N_SPCL_INCLUDE_ERRS);
         return false;
       }
-      // overloading this structure's members
-      // handler will be in value and include id will be in value_len of the structure
-      list_iter->attr_list.push_back(Attribute(INCLUDE_DATA_ID_ATTR, 0,
-                                               reinterpret_cast<const char *>(handler),
-                                               special_data_id));
+      _special_includes[node_id] = SpecialInclude(handler, special_data_id);
       _debugLog(_debug_tag.c_str(), "[%s] Got id %d for special include at node %d from handler [%s]",
                 __FUNCTION__, special_data_id, n_prescanned_nodes + 1, handler_id.c_str());
     }
@@ -594,7 +954,7 @@ EsiProcessor::_addFooterData() {
   for (IncludeHandlerMap::iterator iter = _include_handlers.begin(); iter != _include_handlers.end(); ++iter) {
     iter->second->getFooter(footer, footer_len);
     if (footer_len > 0) {
-      _output_data.append(footer, footer_len);
+      _appendOutput(footer, footer_len);
     }
   }
 }
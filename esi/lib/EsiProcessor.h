@@ -26,6 +26,9 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <set>
+#include <vector>
 #include<pthread.h>
 #include "ComponentBase.h"
 #include "StringHash.h"
@@ -36,6 +39,8 @@
 #include "Expression.h"
 #include "SpecialIncludeHandler.h"
 #include "HandlerManager.h"
+#include "gzip.h"
+#include "FailureInfo.h"
 
 extern pthread_key_t key;
 class EsiProcessor : private EsiLib::ComponentBase
@@ -79,14 +84,31 @@ public:
    * else FAILURE/SUCCESS is returned. */
   ReturnCode process(const char *&data, int &data_len);
 
+  /** Scatter-gather alternative to process() above; the document is
+   * handed out as blocks pointing into the template, fetched data and
+   * the processor's own buffer (for expanded variables) instead of
+   * being copied into one buffer. Blocks are appended to given list
+   * and are valid till the processor is stopped */
+  ReturnCode process(EsiLib::ByteBlockList &blocks);
+
+  /** Streaming alternative to process(). Can be called any time after
+   * parsing starts; returns output of the leading nodes that can be
+   * processed so far, i.e., up to the first include whose data hasn't
+   * come in yet. Output is valid till the next call. Returns SUCCESS
+   * when the last of the document has been output and NEED_MORE_DATA
+   * when more parsed or fetched data is required. Output already
+   * returned cannot be taken back if processing fails later */
+  ReturnCode flush(const char *&data, int &data_len);
+
   /** returns packed version of document currently being processed */
   void packNodeList(std::string &buffer, bool retain_buffer_data) {
-    return _node_list.pack(buffer, retain_buffer_data);
+    return _doc_nodes.pack(buffer, retain_buffer_data, EsiLib::FlatDocNodeList::PACK_VERSION_2);
   }
   
   /** Unpacks previously parsed and packed ESI node list from given
    * buffer and preps for process(); Unpacked document will point to
-   * data in argument (i.e., caller space) */
+   * data in argument (i.e., caller space). Lists packed by
+   * packNodeList() are used in place */
   bool usePackedNodeList(const char *data, int data_len);
 
   /** convenient alternative to method above */
@@ -94,9 +116,37 @@ public:
     return usePackedNodeList(data.data(), data.size());
   }
 
+  /** sets deps to the variables the document refers to; valid once parsing
+   * is complete or a packed node list is in use */
+  void getDependencies(EsiLib::VariableDependencies &deps) const {
+    _doc_nodes.getDependencies(deps);
+  }
+
   /** Clears state from current request */
   void stop(); 
 
+  /** sets the process-wide registry that try/attempt failure statistics
+   * are kept in; attempt sections are always fetched when unset */
+  static void setFailureRegistry(FailureRegistry *registry) { _failure_registry = registry; }
+
+  /** attempt sections whose includes recently took longer than deadline
+   * ms (at given percentile) are swapped for their except sections right
+   * away; their fetches run on to keep the statistics current. 0 disables.
+   * A deadline attribute of a try block takes precedence. Needs the
+   * failure registry */
+  static void setAttemptDeadline(int deadline, int percentile);
+
+  /** true if process() can go ahead although fetches are pending, i.e.,
+   * if all of them belong to attempt sections that were swapped */
+  bool canProcess() const {
+    return ((_curr_state == WAITING_TO_PROCESS) && !_swapped_urls.empty() && !_getNumBlockingRequests());
+  }
+
+  /** registers the outcome of swapped attempt sections whose fetches
+   * have completed; to be called as such fetches complete after
+   * processing */
+  void registerDeferredAttempts();
+
   virtual ~EsiProcessor();
 
 private:
@@ -105,44 +155,97 @@ private:
   EXEC_STATE _curr_state;
 
   std::string _output_data;
+  EsiLib::ByteBlockList *_output_blocks; // set while process() hands out blocks
 
   EsiParser _parser;
-  EsiLib::DocNodeList _node_list;
+  EsiLib::Arena _arena; // backs the parser output of the current request
+  EsiLib::DocNodeList _node_list; // parser output; moved to _doc_nodes as it comes in
+  EsiLib::FlatDocNodeList _doc_nodes;
+  EsiLib::FlatDocNodeList _comment_nodes; // nodes parsed out of html comments
+
+  // nodes are referred to by id; ids of nodes in _comment_nodes are the
+  // complements (~) of their indices
+  typedef std::vector<int> NodeIdList;
+  NodeIdList _node_ids; // top-level nodes in processing order
   int _n_prescanned_nodes;
+  int _n_flushed_nodes;
 
   HttpDataFetcher &_fetcher;
   EsiLib::StringHash _include_urls;
+  std::string _expanded_url;
 
-  bool _reqAdded;
+  std::set<std::string> _skipped_urls; // expanded include URLs not fetched due to failure statistics
+  std::set<std::string> _swapped_urls; // expanded include URLs only needed by swapped attempt sections
+  bool _swapping_attempt; // set while preprocessing a swapped attempt section
+  typedef std::list<std::vector<std::string> > UrlGroupList;
+  UrlGroupList _deferred_attempts; // URLs of swapped attempt sections yet to be registered
+  static FailureRegistry *_failure_registry;
+  static int _attempt_deadline;
+  static int _attempt_deadline_percentile;
   
-  bool _processEsiNode(const EsiLib::DocNodeList::iterator &iter);
+  EsiLib::FlatDocNode _getNode(int id) const {
+    return (id >= 0) ? _doc_nodes[id] : _comment_nodes[~id];
+  }
+  EsiLib::Attribute _getAttribute(int id, int attr_index) const {
+    return (id >= 0) ? _doc_nodes.getAttribute(_doc_nodes[id], attr_index) :
+      _comment_nodes.getAttribute(_comment_nodes[~id], attr_index);
+  }
+  // children of a node are [_getFirstChildId(id), _getNextSiblingId(id))
+  // when stepping with _getNextSiblingId()
+  int _getFirstChildId(int id) const { return (id >= 0) ? (id + 1) : (id - 1); };
+  int _getNextSiblingId(int id) const {
+    return (id >= 0) ? _doc_nodes[id].subtree_end : ~(_comment_nodes[~id].subtree_end);
+  }
+  void _getChildIds(int id, NodeIdList &child_ids) const;
+
+  void _addParsedNodes();
+  bool _processEsiNode(int node_id);
   bool _handleParseComplete();
-  bool _getIncludeData(const EsiLib::DocNode &node, const char **content_ptr = 0, int *content_len_ptr = 0);
-  bool _handleVars(const char *str, int str_len);
-  bool _handleChoose(EsiLib::DocNodeList::iterator &curr_node);
-  bool _handleTry(EsiLib::DocNodeList::iterator &curr_node);
-  bool _handleHtmlComment(const EsiLib::DocNodeList::iterator &curr_node);
-  bool _preprocess(EsiLib::DocNodeList &node_list, int &n_prescanned_nodes);
+  DataStatus _getIncludeStatus(int node_id);
+  bool _isAttemptDataPending();
+  ReturnCode _handleTryBlocks();
+  bool _isAttemptSlow(const NodeIdList &attempt_nodes, int deadline);
+  void _registerAttempt(const std::vector<std::string> &urls, bool succeeded);
+  int _getNumBlockingRequests() const;
+  bool _getIncludeData(int node_id, const char **content_ptr = 0, int *content_len_ptr = 0);
+  bool _handleVars(const EsiLib::FlatDocNode &node);
+  const std::string &_expandIncludeUrl(int node_id);
+  bool _handleChoose(NodeIdList &node_ids, int pos);
+  bool _handleTry(NodeIdList &node_ids, int pos);
+  bool _handleHtmlComment(NodeIdList &node_ids, int pos);
+  bool _preprocess(NodeIdList &node_ids, int &n_prescanned_nodes);
   inline bool _isWhitespace(const char *data, int data_len);
   void _addFooterData();
+  ReturnCode _process();
+  inline void _appendOutput(const char *data, int data_len);
+  inline void _addOwnedOutput(size_t orig_output_size);
 
   EsiLib::Variables &_esi_vars;
   EsiLib::Expression _expression;
 
   struct TryBlock {
-    EsiLib::DocNodeList &attempt_nodes;
-    EsiLib::DocNodeList &except_nodes;
-    EsiLib::DocNodeList::iterator pos;
-    TryBlock(EsiLib::DocNodeList &att, EsiLib::DocNodeList &exc, EsiLib::DocNodeList::iterator p) 
-      : attempt_nodes(att), except_nodes(exc), pos(p) { };
+    NodeIdList attempt_nodes;
+    NodeIdList except_nodes;
+    NodeIdList *parent_nodes; // list holding the try node
+    int try_node;
+    bool swapped; // except section is used without waiting for the attempt
+    TryBlock(NodeIdList *parent, int node) : parent_nodes(parent), try_node(node), swapped(false) { };
   };
   typedef std::list<TryBlock> TryBlockList;
   TryBlockList _try_blocks;
   int _n_try_blocks_processed;
 
+  void _insertTryNodes(TryBlockList::iterator &try_iter, NodeIdList &nodes);
+
   const EsiLib::HandlerManager &_handler_manager;
 
-  static const char *INCLUDE_DATA_ID_ATTR; 
+  struct SpecialInclude {
+    EsiLib::SpecialIncludeHandler *handler;
+    int data_id;
+    SpecialInclude(EsiLib::SpecialIncludeHandler *h = 0, int id = -1) : handler(h), data_id(id) { };
+  };
+  typedef std::map<int, SpecialInclude> SpecialIncludeMap;
+  SpecialIncludeMap _special_includes; // keyed by node id
 
   typedef std::map<std::string, EsiLib::SpecialIncludeHandler *> IncludeHandlerMap;
   IncludeHandlerMap _include_handlers;
@@ -24,11 +24,14 @@
 #include "Expression.h"
 #include "Utils.h"
 
+#include <string.h>
+
 using std::string;
 using namespace EsiLib;
 
 const string Expression::EMPTY_STRING("");
 const string Expression::TRUE_STRING("true");
+const char Expression::CODE_VERSION = 3;
 const Expression::OperatorString Expression::OPERATOR_STRINGS[N_OPERATORS] = { 
   Expression::OperatorString("==", 2),
   Expression::OperatorString("!=", 2),
@@ -47,7 +50,7 @@ Expression::Expression(const char *debug_tag, ComponentBase::Debug debug_func,
 }
   
 inline bool
-Expression::_stripQuotes(const char *&expr, int &expr_len) const {
+Expression::_removeQuotes(const char *&expr, int &expr_len) {
   char quote_char = 0;
   if (expr[0] == '\'') {
     quote_char = '\'';
@@ -56,7 +59,6 @@ Expression::_stripQuotes(const char *&expr, int &expr_len) const {
   }
   if (quote_char) {
     if (expr[expr_len - 1] != quote_char) {
-      _errorLog("[%s] Unterminated quote in expression [%.*s]", __FUNCTION__, expr_len, expr);
       return false;
     }
     expr_len -= 2;
@@ -65,6 +67,15 @@ Expression::_stripQuotes(const char *&expr, int &expr_len) const {
   return true;
 }
 
+inline bool
+Expression::_stripQuotes(const char *&expr, int &expr_len) const {
+  if (!_removeQuotes(expr, expr_len)) {
+    _errorLog("[%s] Unterminated quote in expression [%.*s]", __FUNCTION__, expr_len, expr);
+    return false;
+  }
+  return true;
+}
+
 const string &
 Expression::expand(const char *expr, int expr_len /* = -1 */) {
   int var_start_index = -1, var_size;
@@ -117,6 +128,9 @@ Expression::expand(const char *expr, int expr_len /* = -1 */) {
         if (!_stripQuotes(default_value, default_value_len)) {
           goto lFail;
         }
+        if (default_value_len < 0) { // lone quote
+          default_value_len = 0;
+        }
         if (!last_variable_expanded) {
           _debugLog(_debug_tag.c_str(), "[%s] Using default value [%.*s] as variable expanded to empty string",
                     __FUNCTION__, default_value_len, default_value);
@@ -142,15 +156,14 @@ lFail:
 }
 
 inline int
-Expression::_findOperator(const char *expr, int expr_len, Operator &op) const {
-  string expr_str(expr, expr_len);
-  size_t sep;
+Expression::_findOperator(const char *expr, int expr_len, Operator &op) {
   for (int i = 0; i < N_OPERATORS; ++i) {
     const OperatorString &op_str = OPERATOR_STRINGS[i];
-    sep = (op_str.str_len == 1) ? expr_str.find(op_str.str[0]) : expr_str.find(op_str.str);
-    if (sep < expr_str.size()) {
-      op = static_cast<Operator>(i);
-      return static_cast<int>(sep);
+    for (int sep = 0; sep <= (expr_len - op_str.str_len); ++sep) {
+      if ((expr[sep] == op_str.str[0]) && ((op_str.str_len == 1) || (expr[sep + 1] == op_str.str[1]))) {
+        op = static_cast<Operator>(i);
+        return sep;
+      }
     }
   }
   return -1;
@@ -161,8 +174,7 @@ Expression::_evalSimpleExpr(const char *expr, int expr_len) {
   const string &lhs = expand(expr, expr_len);
   _debugLog(_debug_tag.c_str(), "[%s] simple expression [%.*s] evaluated to [%.*s]",
             __FUNCTION__, expr_len, expr, lhs.size(), lhs.data());
-  double val;
-  return _convert(lhs, val) ? val : !lhs.empty();
+  return _evalSimpleValue(lhs);
 }
 
 
@@ -254,3 +266,396 @@ Expression::evaluate(const char *expr, int expr_len /* = -1 */) {
             __FUNCTION__, (retval ? "true" : "false"), expr_len, expr);
   return retval;
 }
+
+static inline void
+appendString(string &code, const char *str, int32_t str_len) {
+  code.append(reinterpret_cast<const char *>(&str_len), sizeof(str_len));
+  code.append(str, str_len);
+}
+
+static inline bool
+readString(const char *&code, const char *code_end, const char *&str, int32_t &str_len) {
+  if ((code_end - code) < static_cast<int>(sizeof(str_len))) {
+    return false;
+  }
+  memcpy(&str_len, code, sizeof(str_len));
+  code += sizeof(str_len);
+  if ((str_len < 0) || (str_len > (code_end - code))) {
+    return false;
+  }
+  str = code;
+  code += str_len;
+  return true;
+}
+
+void
+Expression::compileExpansion(const char *expr, int expr_len, string &plan) {
+  size_t plan_start = plan.size();
+  int var_start_index = -1;
+  string literal;
+  plan += CODE_VERSION;
+  Utils::trimWhiteSpace(expr, expr_len);
+  if (!expr_len) {
+    return;
+  }
+  if (!_removeQuotes(expr, expr_len)) {
+    Utils::ERROR_LOG("[%s] Unterminated quote in expression [%.*s]", __FUNCTION__, expr_len, expr);
+    return;
+  }
+  // mirrors expand(); literal text is gathered up to the next variable
+  for (int i = 0; i < expr_len; ++i) {
+    if ((expr[i] == '$') && ((expr_len - i) >= 3) && (expr[i + 1] == '(')) {
+      if (var_start_index != -1) {
+        goto lFail;
+      }
+      var_start_index = i + 2;
+      ++i;
+    } else if (((expr[i] == ')') || (expr[i] == '|')) && (var_start_index != -1)) {
+      const char *var_name = expr + var_start_index;
+      int var_name_len = i - var_start_index;
+      const char *default_value = "";
+      int default_value_len = 0;
+      if (expr[i] == '|') {
+        int default_value_start = ++i;
+        for (; (i < expr_len) && (expr[i] != ')'); ++i);
+        if (i == expr_len) {
+          goto lFail;
+        }
+        default_value = expr + default_value_start;
+        default_value_len = i - default_value_start;
+        if (!_removeQuotes(default_value, default_value_len)) {
+          Utils::ERROR_LOG("[%s] Unterminated quote in expression [%.*s]", __FUNCTION__,
+                           default_value_len, default_value);
+          goto lFail;
+        }
+        if (default_value_len < 0) {
+          default_value_len = 0;
+        }
+      }
+      if (var_name_len) {
+        if (literal.size()) {
+          plan += static_cast<char>(SEGMENT_LITERAL);
+          appendString(plan, literal.data(), literal.size());
+          literal.clear();
+        }
+        const char *attr;
+        int attr_len;
+        int32_t variable_id = Variables::getVariableId(var_name, var_name_len, attr, attr_len);
+        plan += static_cast<char>(SEGMENT_VARIABLE);
+        plan.append(reinterpret_cast<const char *>(&variable_id), sizeof(variable_id));
+        appendString(plan, attr, attr_len);
+        appendString(plan, default_value, default_value_len);
+      } else {
+        literal.append(default_value, default_value_len);
+      }
+      var_start_index = -1;
+    } else if (var_start_index == -1) {
+      literal += expr[i];
+    }
+  }
+  if (var_start_index != -1) {
+    goto lFail;
+  }
+  if (literal.size()) {
+    plan += static_cast<char>(SEGMENT_LITERAL);
+    appendString(plan, literal.data(), literal.size());
+  }
+  return;
+
+lFail:
+  plan.resize(plan_start + 1); // expands to empty string
+}
+
+bool
+Expression::expandCompiled(const char *plan, int plan_len, string &value) {
+  const char *plan_end = plan + plan_len;
+  size_t value_size = value.size();
+  const char *str, *default_value;
+  int32_t str_len, default_value_len, variable_id;
+  if ((plan_len < 1) || (*plan != CODE_VERSION)) {
+    goto lFail;
+  }
+  for (++plan; plan < plan_end; ) {
+    char type = *plan++;
+    if (type == SEGMENT_LITERAL) {
+      if (!readString(plan, plan_end, str, str_len)) {
+        goto lFail;
+      }
+      value.append(str, str_len);
+    } else if (type == SEGMENT_VARIABLE) {
+      if ((plan_end - plan) < static_cast<int>(sizeof(variable_id))) {
+        goto lFail;
+      }
+      memcpy(&variable_id, plan, sizeof(variable_id));
+      plan += sizeof(variable_id);
+      if (!readString(plan, plan_end, str, str_len) ||
+          !readString(plan, plan_end, default_value, default_value_len)) {
+        goto lFail;
+      }
+      const string &var_value = _variables.getValue(variable_id, str, str_len);
+      _debugLog(_debug_tag.c_str(), "[%s] Got value [%.*s] for variable %d [%.*s]",
+                __FUNCTION__, var_value.size(), var_value.data(), variable_id, str_len, str);
+      if (var_value.size()) {
+        value += var_value;
+      } else {
+        value.append(default_value, default_value_len);
+      }
+    } else {
+      goto lFail;
+    }
+  }
+  return true;
+
+lFail:
+  value.resize(value_size);
+  _errorLog("[%s] Invalid expansion plan of length %d", __FUNCTION__, plan_len);
+  return false;
+}
+
+/** returns true if given plan has no variables, along with the value it expands to */
+bool
+Expression::_getLiteral(const string &plan, const char *&value, int &value_len) {
+  value = "";
+  value_len = 0;
+  if (plan.size() == 1) {
+    return true;
+  }
+  if (plan[1] != SEGMENT_LITERAL) {
+    return false;
+  }
+  const char *plan_ptr = plan.data() + 2, *str;
+  int32_t str_len;
+  if (!readString(plan_ptr, plan.data() + plan.size(), str, str_len) || (plan_ptr != (plan.data() + plan.size()))) {
+    return false;
+  }
+  value = str;
+  value_len = str_len;
+  return true;
+}
+
+void
+Expression::_compileOperand(const char *expr, int expr_len, string &code) {
+  string plan;
+  compileExpansion(expr, expr_len, plan);
+  const char *value;
+  int value_len;
+  if (_getLiteral(plan, value, value_len)) {
+    code += static_cast<char>(OPERAND_LITERAL);
+    appendString(code, value, value_len);
+    double numerical_value;
+    if (_convert(string(value, value_len), numerical_value)) {
+      code += static_cast<char>(1);
+      code.append(reinterpret_cast<const char *>(&numerical_value), sizeof(numerical_value));
+    } else {
+      code += static_cast<char>(0);
+    }
+  } else {
+    code += static_cast<char>(OPERAND_VARIABLE);
+    appendString(code, plan.data(), plan.size());
+  }
+}
+
+void
+Expression::_compileSimpleExpr(const char *expr, int expr_len, bool negate, string &code) {
+  string plan;
+  compileExpansion(expr, expr_len, plan);
+  const char *value;
+  int value_len;
+  if (_getLiteral(plan, value, value_len)) {
+    double numerical_value;
+    string str(value, value_len);
+    bool result = _convert(str, numerical_value) ? numerical_value : !str.empty();
+    code += static_cast<char>(OPCODE_CONST);
+    code += static_cast<char>(negate ? !result : result);
+  } else {
+    code += static_cast<char>(negate ? OPCODE_NOT : OPCODE_SIMPLE);
+    code += static_cast<char>(OPERAND_VARIABLE);
+    appendString(code, plan.data(), plan.size());
+  }
+}
+
+void
+Expression::compile(const char *expr, int expr_len, string &code) {
+  Utils::trimWhiteSpace(expr, expr_len);
+  code += CODE_VERSION;
+  if (!expr_len) {
+    code += static_cast<char>(OPCODE_CONST);
+    code += static_cast<char>(false);
+    return;
+  }
+  Operator op = OP_EQ;
+  int sep = _findOperator(expr, expr_len, op);
+  if (sep == -1) {
+    _compileSimpleExpr(expr, expr_len, false, code);
+  } else if (_isBinaryOperator(op)) {
+    int op_len = OPERATOR_STRINGS[op].str_len;
+    code += static_cast<char>(OPCODE_BINARY);
+    code += static_cast<char>(op);
+    _compileOperand(expr, sep, code);
+    _compileOperand(expr + sep + op_len, expr_len - sep - op_len, code);
+  } else if ((op == OP_NOT) && (sep == 0)) {
+    _compileSimpleExpr(expr + 1, expr_len - 1, true, code);
+  } else {
+    // negation not preceding literal is assumed to be true
+    code += static_cast<char>(OPCODE_CONST);
+    code += static_cast<char>(op == OP_NOT);
+  }
+}
+
+bool
+Expression::_readOperand(const char *&code, const char *code_end, Operand &operand) {
+  if (code == code_end) {
+    return false;
+  }
+  char type = *code++;
+  if (((type != OPERAND_LITERAL) && (type != OPERAND_VARIABLE)) ||
+      !readString(code, code_end, operand.str, operand.str_len)) {
+    return false;
+  }
+  operand.is_variable = (type == OPERAND_VARIABLE);
+  operand.is_numerical = false;
+  if (!operand.is_variable) {
+    if (code == code_end) {
+      return false;
+    }
+    operand.is_numerical = *code++;
+    if (operand.is_numerical) {
+      if ((code_end - code) < static_cast<int>(sizeof(operand.value))) {
+        return false;
+      }
+      memcpy(&operand.value, code, sizeof(operand.value));
+      code += sizeof(operand.value);
+    }
+  }
+  return true;
+}
+
+static inline int
+compareStrings(const char *str1, int str1_len, const char *str2, int str2_len) {
+  int min_len = (str1_len < str2_len) ? str1_len : str2_len;
+  int retval = min_len ? memcmp(str1, str2, min_len) : 0;
+  return retval ? retval : (str1_len - str2_len);
+}
+
+inline bool
+Expression::_evalBinaryExpr(Operator op, const Operand &lhs, const Operand &rhs) {
+  bool are_numerical = lhs.is_numerical && rhs.is_numerical;
+  int cmp = are_numerical ? 0 : compareStrings(lhs.str, lhs.str_len, rhs.str, rhs.str_len);
+  switch (op) {
+  case OP_EQ:
+    return are_numerical ? (lhs.value == rhs.value) : (cmp == 0);
+  case OP_NEQ:
+    return are_numerical ? (lhs.value != rhs.value) : (cmp != 0);
+  case OP_OR:
+    return are_numerical ? (lhs.value || rhs.value) : (lhs.str_len || rhs.str_len);
+  case OP_AND:
+    return are_numerical ? (lhs.value && rhs.value) : (lhs.str_len && rhs.str_len);
+  default:
+    break;
+  }
+  if (!lhs.str_len || !rhs.str_len) {
+    _debugLog(_debug_tag.c_str(), "[%s] LHS/RHS empty. Cannot evaluate comparisons", __FUNCTION__);
+    return false;
+  }
+  switch (op) {
+  case OP_LT:
+    return are_numerical ? (lhs.value < rhs.value) : (cmp < 0);
+  case OP_GT:
+    return are_numerical ? (lhs.value > rhs.value) : (cmp > 0);
+  case OP_LTEQ:
+    return are_numerical ? (lhs.value <= rhs.value) : (cmp <= 0);
+  case OP_GTEQ:
+    return are_numerical ? (lhs.value >= rhs.value) : (cmp >= 0);
+  default:
+    break;
+  }
+  return false;
+}
+
+bool
+Expression::evaluateCompiled(const char *code, int code_len, bool &result) {
+  const char *code_end = code + code_len;
+  Operand lhs, rhs;
+  char opcode;
+  if ((code_len < 3) || (code[0] != CODE_VERSION)) {
+    goto lFail;
+  }
+  opcode = code[1];
+  switch (opcode) {
+  case OPCODE_CONST:
+    result = code[2];
+    break;
+  case OPCODE_SIMPLE:
+  case OPCODE_NOT:
+    code += 2;
+    if (!_readOperand(code, code_end, lhs) || !lhs.is_variable) {
+      goto lFail;
+    }
+    _value.clear();
+    if (!expandCompiled(lhs.str, lhs.str_len, _value)) {
+      goto lFail;
+    }
+    result = _evalSimpleValue(_value);
+    if (opcode == OPCODE_NOT) {
+      result = !result;
+    }
+    break;
+  case OPCODE_BINARY:
+    {
+      Operator op = static_cast<Operator>(code[2]);
+      code += 3;
+      if (!_isBinaryOperator(op) || !_readOperand(code, code_end, lhs) || !_readOperand(code, code_end, rhs)) {
+        goto lFail;
+      }
+      if (lhs.is_variable) {
+        _lhs_value.clear();
+        if (!expandCompiled(lhs.str, lhs.str_len, _lhs_value)) {
+          goto lFail;
+        }
+        lhs.str = _lhs_value.data();
+        lhs.str_len = _lhs_value.size();
+        lhs.is_numerical = _convert(_lhs_value, lhs.value);
+      }
+      if (rhs.is_variable) {
+        _value.clear();
+        if (!expandCompiled(rhs.str, rhs.str_len, _value)) {
+          goto lFail;
+        }
+        rhs.str = _value.data();
+        rhs.str_len = _value.size();
+        rhs.is_numerical = _convert(_value, rhs.value);
+      }
+      result = _evalBinaryExpr(op, lhs, rhs);
+    }
+    break;
+  default:
+    goto lFail;
+  }
+  _debugLog(_debug_tag.c_str(), "[%s] Returning [%s] for compiled expression",
+            __FUNCTION__, (result ? "true" : "false"));
+  return true;
+
+lFail:
+  _errorLog("[%s] Invalid compiled expression of length %d", __FUNCTION__, code_len);
+  return false;
+}
+
+void
+Expression::getDependencies(const char *expr, int expr_len, VariableDependencies &deps) {
+  int var_start_index = -1;
+  const char *attr;
+  int attr_len;
+  if (expr_len == -1) {
+    expr_len = strlen(expr);
+  }
+  for (int i = 0; i < expr_len; ++i) {
+    if ((expr[i] == '$') && ((expr_len - i) >= 3) && (expr[i + 1] == '(')) {
+      var_start_index = i + 2; // expand() would fail on nested variables; simply restart here
+      ++i;
+    } else if (((expr[i] == ')') || (expr[i] == '|')) && (var_start_index != -1)) {
+      int variable_id = Variables::getVariableId(expr + var_start_index, i - var_start_index, attr, attr_len);
+      deps.add(variable_id, attr, attr_len);
+      var_start_index = -1;
+    }
+  }
+}
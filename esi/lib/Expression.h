@@ -27,6 +27,7 @@
 
 #include <string>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "ComponentBase.h"
 #include "Variables.h"
@@ -48,6 +49,15 @@ public:
     return expand(expr.data(), expr.size());
   }
 
+  /** compiles given expression into an expansion plan (appended to plan), i.e., the
+   * list of literal and variable segments expand() would produce, so that the
+   * expression need not be scanned again */
+  static void compileExpansion(const char *expr, int expr_len, std::string &plan);
+
+  /** appends expansion of plan generated by compileExpansion() to value; returns
+   * false (leaving value untouched) if plan is malformed */
+  bool expandCompiled(const char *plan, int plan_len, std::string &value);
+
   /** evaluates boolean value of given expression */
   bool evaluate(const char *expr, int expr_len = -1);
 
@@ -56,6 +66,20 @@ public:
     return evaluate(expr.data(), expr.size());
   }
 
+  /** compiles given expression into a position independent code string (appended to
+   * code) that can be stored along with the document and run with evaluateCompiled();
+   * quoting, operator parsing and numerical conversion of literals are done here once */
+  static void compile(const char *expr, int expr_len, std::string &code);
+
+  /** runs code generated by compile(); only variables are resolved at this
+   * point. returns false if code is malformed */
+  bool evaluateCompiled(const char *code, int code_len, bool &result);
+
+  /** adds the variables given expression refers to to deps; markup holding several
+   * expressions can be passed as well. Malformed expressions may add variables
+   * their expansion would not look up */
+  static void getDependencies(const char *expr, int expr_len, VariableDependencies &deps);
+
   virtual ~Expression() { };
 
 private:
@@ -65,6 +89,7 @@ private:
 
   Variables &_variables;
   std::string _value;
+  std::string _lhs_value;
 
   // these are arranged in parse priority format indices correspond to op strings array 
   enum Operator { OP_EQ, OP_NEQ, OP_LTEQ, OP_GTEQ, OP_LT, OP_GT, OP_NOT, OP_OR, OP_AND, N_OPERATORS };
@@ -80,15 +105,17 @@ private:
   inline void _trimWhiteSpace(const char *&expr, int &expr_len) const;
   
   inline bool _stripQuotes(const char *&expr, int &expr_len) const;
+
+  static inline bool _removeQuotes(const char *&expr, int &expr_len);
   
-  inline int _findOperator(const char *expr, int expr_len, Operator &op) const;
+  static inline int _findOperator(const char *expr, int expr_len, Operator &op);
   
-  inline bool _isBinaryOperator(Operator &op) const {
+  static inline bool _isBinaryOperator(Operator op) {
     return ((op == OP_EQ) || (op == OP_NEQ) || (op == OP_LT) || (op == OP_GT) ||
             (op == OP_LTEQ) || (op == OP_GTEQ) || (op == OP_OR) || (op == OP_AND));
   }
 
-  inline bool _convert(const std::string &str, double &value) {
+  static inline bool _convert(const std::string &str, double &value) {
     size_t str_size = str.size();
     if (str_size) {
       char *endp;
@@ -100,6 +127,42 @@ private:
   }
 
   inline bool _evalSimpleExpr(const char *expr, int expr_len);
+
+  inline bool _evalSimpleValue(const std::string &value) {
+    double val;
+    return _convert(value, val) ? val : !value.empty();
+  }
+
+  // compiled code is a version byte and an opcode followed by its operands
+  enum Opcode { OPCODE_CONST = 'c', OPCODE_SIMPLE = 's', OPCODE_NOT = 'n', OPCODE_BINARY = 'b' };
+
+  // an operand is either a literal (with its numerical value precomputed) or the
+  // expansion plan of an expression that has variables
+  enum OperandType { OPERAND_LITERAL = 'l', OPERAND_VARIABLE = 'v' };
+
+  // expansion plans are a version byte followed by segments; a variable segment has
+  // the variable's id and attribute (see Variables::getVariableId()) and its default value
+  enum SegmentType { SEGMENT_LITERAL = 'l', SEGMENT_VARIABLE = 'v' };
+
+  struct Operand {
+    bool is_variable;
+    const char *str;
+    int32_t str_len;
+    bool is_numerical;
+    double value;
+  };
+
+  static const char CODE_VERSION;
+
+  static bool _getLiteral(const std::string &plan, const char *&value, int &value_len);
+
+  static void _compileOperand(const char *expr, int expr_len, std::string &code);
+
+  static void _compileSimpleExpr(const char *expr, int expr_len, bool negate, std::string &code);
+
+  static bool _readOperand(const char *&code, const char *code_end, Operand &operand);
+
+  inline bool _evalBinaryExpr(Operator op, const Operand &lhs, const Operand &rhs);
 };
 
 };
@@ -22,66 +22,344 @@
  */
 
 #include "FailureInfo.h"
+#include "TemplateCache.h"
+#include "Utils.h"
+#include "Stats.h"
 #include <cstdlib>
+#include <sched.h>
+
+using namespace EsiLib;
 
 static int LOWER_CUT_OFF=300;
 static int HIGHER_CUT_OFF=1000;
 
-void FailureInfo::registerSuccFail(bool isSuccess)
+/* Layout of a statistics slot: window tag (16 bits),
+ * failures (24 bits), successes (24 bits)
+ */
+static const int COUNT_BITS=24;
+static const uint64_t COUNT_MASK=(1ULL<<COUNT_BITS)-1;
+static const uint64_t WINDOW_TAG_MASK=0xffff;
+
+static inline uint64_t packSlot(uint64_t windowTag,uint64_t failures,uint64_t successes)
+{
+    return (windowTag<<(2*COUNT_BITS))|(failures<<COUNT_BITS)|successes;
+}
+
+static inline uint64_t slotWindowTag(uint64_t slot) { return slot>>(2*COUNT_BITS); }
+static inline uint64_t slotFailures(uint64_t slot) { return (slot>>COUNT_BITS)&COUNT_MASK; }
+static inline uint64_t slotSuccesses(uint64_t slot) { return slot&COUNT_MASK; }
+
+/* Layout of the circuit breaker word: time in ms
+ * (54 bits), probes (8 bits), state (2 bits)
+ */
+static const int CIRCUIT_STATE_BITS=2;
+static const int CIRCUIT_PROBE_BITS=8;
+static const int MAX_CIRCUIT_PROBES=(1<<CIRCUIT_PROBE_BITS)-1;
+
+static inline uint64_t packCircuit(int state,int64_t ms,int nProbes)
+{
+    return (static_cast<uint64_t>(ms)<<(CIRCUIT_STATE_BITS+CIRCUIT_PROBE_BITS))|
+        (static_cast<uint64_t>(nProbes)<<CIRCUIT_STATE_BITS)|state;
+}
+
+static inline int circuitState(uint64_t circuit) { return circuit&((1<<CIRCUIT_STATE_BITS)-1); }
+static inline int circuitProbes(uint64_t circuit) { return (circuit>>CIRCUIT_STATE_BITS)&MAX_CIRCUIT_PROBES; }
+static inline int64_t circuitMs(uint64_t circuit) { return circuit>>(CIRCUIT_STATE_BITS+CIRCUIT_PROBE_BITS); }
+
+static int64_t getCurrentMs()
 {
-    struct timeval currTime,result;
+    struct timeval currTime;
     gettimeofday(&currTime,NULL);
-    timersub(&currTime,&_start,&result);
+    return static_cast<int64_t>(currTime.tv_sec)*1000+currTime.tv_usec/1000;
+}
+
+static int64_t getCurrentWindow()
+{
+    return getCurrentMs()/WINDOW_SIZE;
+}
+
+CircuitBreakerParams FailureInfo::_breakerParams;
+
+const int FailureInfo::LATENCY_BUCKET_BOUNDS[FailureInfo::N_LATENCY_BUCKETS]=
+    { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 30000, 60000 };
+
+void FailureInfo::setCircuitBreakerParams(const CircuitBreakerParams &params)
+{
+    CircuitBreakerParams defaults;
+    _breakerParams=params;
+    if((params.error_rate<=0)||(params.error_rate>100))
+    {
+        Utils::ERROR_LOG("[%s] Invalid error rate %d; using %d",__FUNCTION__,params.error_rate,defaults.error_rate);
+        _breakerParams.error_rate=defaults.error_rate;
+    }
+    if(params.min_requests<1)
+        _breakerParams.min_requests=defaults.min_requests;
+    if(params.latency_threshold<0)
+        _breakerParams.latency_threshold=0;
+    if(params.open_duration<=0)
+        _breakerParams.open_duration=defaults.open_duration;
+    if((params.max_probes<1)||(params.max_probes>MAX_CIRCUIT_PROBES))
+        _breakerParams.max_probes=defaults.max_probes;
+}
+
+void FailureInfo::reset()
+{
+    for(int i=0;i<TOTAL_SLOTS;i++)
+    {
+        _statistics[i]=0;
+        for(int j=0;j<N_LATENCY_BUCKETS;j++)
+            _latencies[i][j]=0;
+    }
+    _windowsPassed=0;
+    _avgOverWindow=0;
+    _circuit=packCircuit(CIRCUIT_CLOSED,0,0);
+}
+
+void FailureInfo::registerSuccFail(bool isSuccess,int latency /* = -1 */)
+{
+    if(_breakerParams.enabled && _breakerParams.latency_threshold && (latency>_breakerParams.latency_threshold))
+    {
+        _debugLog(_debug_tag.c_str(),"[%s] Attempt took %d ms; counting it as failed",__FUNCTION__,latency);
+        isSuccess=false;
+    }
+
+    int64_t window=getCurrentWindow();
+    int slotIndex=window%TOTAL_SLOTS;
+    uint64_t windowTag=window&WINDOW_TAG_MASK;
+    volatile uint64_t &slot=_statistics[slotIndex];
+    uint64_t oldValue,newValue;
+    bool openedWindow;
+
+    do {
+        oldValue=slot;
+        uint64_t failures=0,successes=0;
+        // a slot still holding an older window is started afresh
+        openedWindow=(slotWindowTag(oldValue)!=windowTag);
+        if(!openedWindow)
+        {
+            failures=slotFailures(oldValue);
+            successes=slotSuccesses(oldValue);
+        }
+        if(isSuccess)
+        {
+            if(successes<COUNT_MASK)
+                ++successes;
+        }
+        else
+        {
+            if(failures<COUNT_MASK)
+                ++failures;
+        }
+        newValue=packSlot(windowTag,failures,successes);
+    } while(!__sync_bool_compare_and_swap(&slot,oldValue,newValue));
+
+    if(openedWindow)
+    {
+        for(int i=0;i<N_LATENCY_BUCKETS;i++)
+            _latencies[slotIndex][i]=0;
+    }
+    if(latency>=0)
+    {
+        int bucket=0;
+        while((bucket<N_LATENCY_BUCKETS-1) && (latency>LATENCY_BUCKET_BOUNDS[bucket]))
+            ++bucket;
+        __sync_add_and_fetch(&_latencies[slotIndex][bucket],1);
+    }
+
+    if(openedWindow && (slotIndex==TOTAL_SLOTS-1))
+    {
+        int windowsPassed=__sync_add_and_fetch(&_windowsPassed,1);
+        _avgOverWindow+=_getFailureRatioSum(window)/windowsPassed;
+        _debugLog(_debug_tag.c_str(),"[%s] current average over window is %lf",__FUNCTION__,_avgOverWindow);
+    }
+
+    if(_breakerParams.enabled)
+        _updateCircuit(!isSuccess);
+}
+
+FailureInfo::CircuitState FailureInfo::getCircuitState() const
+{
+    return static_cast<CircuitState>(circuitState(_circuit));
+}
 
-    if( ( result.tv_sec*1000000+result.tv_usec )   > (WINDOW_SIZE*1000) )
+// moves the circuit to given word if it is (still) in given state
+bool FailureInfo::_setCircuit(int oldState,uint64_t circuit)
+{
+    for(;;)
+    {
+        uint64_t oldCircuit=_circuit;
+        if(circuitState(oldCircuit)!=oldState)
+            return false;
+        if(__sync_bool_compare_and_swap(&_circuit,oldCircuit,circuit))
+            return true;
+    }
+}
+
+void FailureInfo::_openCircuit(int oldState)
+{
+    if(_setCircuit(oldState,packCircuit(CIRCUIT_OPEN,getCurrentMs()+_breakerParams.open_duration,0)))
+    {
+        Stats::increment(Stats::N_CIRCUITS_OPENED);
+        _debugLog(_debug_tag.c_str(),"[%s] Circuit opened for %d ms",__FUNCTION__,_breakerParams.open_duration);
+    }
+}
+
+void FailureInfo::_updateCircuit(bool failed)
+{
+    int state=circuitState(_circuit);
+    if(state==CIRCUIT_HALF_OPEN)
     {
-        ++_windowMarker;
-        _windowMarker%=_totalSlots;
-      
-        if(_windowMarker==_totalSlots-1)
+        if(failed)
         {
-            ++_windowsPassed;
-            double avg=0;
-            for(size_t i=0;i<_totalSlots;i++)
+            _openCircuit(CIRCUIT_HALF_OPEN);
+        }
+        else if(_setCircuit(CIRCUIT_HALF_OPEN,packCircuit(CIRCUIT_CLOSED,0,0)))
+        {
+            // the failures that opened the circuit would open it again
+            for(int i=0;i<TOTAL_SLOTS;i++)
+                _statistics[i]=0;
+            Stats::increment(Stats::N_CIRCUITS_CLOSED);
+            _debugLog(_debug_tag.c_str(),"[%s] Probe succeeded; circuit closed",__FUNCTION__);
+        }
+    }
+    else if((state==CIRCUIT_CLOSED) && failed)
+    {
+        int nFailures,nSuccesses;
+        getCounts(nFailures,nSuccesses);
+        int nAttempts=nFailures+nSuccesses;
+        if((nAttempts>=_breakerParams.min_requests) && (nFailures*100>=_breakerParams.error_rate*nAttempts))
+        {
+            _debugLog(_debug_tag.c_str(),"[%s] %d of %d attempts failed",__FUNCTION__,nFailures,nAttempts);
+            _openCircuit(CIRCUIT_CLOSED);
+        }
+    }
+}
+
+bool FailureInfo::_isCircuitAttemptReq()
+{
+    int64_t nowMs=getCurrentMs();
+    for(;;)
+    {
+        uint64_t circuit=_circuit;
+        int state=circuitState(circuit);
+        if(state==CIRCUIT_CLOSED)
+            return true;
+
+        uint64_t newCircuit;
+        if(state==CIRCUIT_OPEN)
+        {
+            if(nowMs<circuitMs(circuit))
             {
-                if(_statistics[i].first >0)
-                {
-                    avg+=_statistics[i].first/(_statistics[i].first+_statistics[i].second);
-                }
+                _debugLog(_debug_tag.c_str(),"[%s] Circuit open; fetch request will not be added",__FUNCTION__);
+                return false;
             }
-            _avgOverWindow+=avg/_windowsPassed;
-            _debugLog(_debug_tag.c_str(),"[%s] current average over window is %lf",__FUNCTION__,_avgOverWindow);
+            newCircuit=packCircuit(CIRCUIT_HALF_OPEN,nowMs,1);
+        }
+        else if(nowMs-circuitMs(circuit)>_breakerParams.open_duration)
+        {
+            // probes that never report back (e.g. their documents were
+            // aborted) must not keep the circuit half-open for good
+            newCircuit=packCircuit(CIRCUIT_HALF_OPEN,nowMs,1);
+        }
+        else if(circuitProbes(circuit)<_breakerParams.max_probes)
+        {
+            newCircuit=packCircuit(CIRCUIT_HALF_OPEN,circuitMs(circuit),circuitProbes(circuit)+1);
+        }
+        else
+        {
+            _debugLog(_debug_tag.c_str(),"[%s] Circuit half-open; fetch request will not be added",__FUNCTION__);
+            return false;
+        }
+
+        if(__sync_bool_compare_and_swap(&_circuit,circuit,newCircuit))
+        {
+            if(state==CIRCUIT_OPEN)
+            {
+                Stats::increment(Stats::N_CIRCUITS_HALF_OPENED);
+                _debugLog(_debug_tag.c_str(),"[%s] Circuit half-open",__FUNCTION__);
+            }
+            _debugLog(_debug_tag.c_str(),"[%s] Circuit half-open; fetch request will be added as probe",__FUNCTION__);
+            return true;
         }
-    
-        gettimeofday(&_start,NULL);
     }
+}
 
-   if(isSuccess)
-   {
-       _statistics[_windowMarker].second++;
-   } 
-   
-   else
-   {
-       _statistics[_windowMarker].first++;
-   }
+bool FailureInfo::_isCurrentSlot(uint64_t slot,uint64_t windowTag) const
+{
+    return (((windowTag-slotWindowTag(slot))&WINDOW_TAG_MASK)<static_cast<uint64_t>(TOTAL_SLOTS));
 }
-    
-bool FailureInfo::isAttemptReq()
+
+double FailureInfo::_getFailureRatioSum(int64_t window) const
+{
+    uint64_t windowTag=window&WINDOW_TAG_MASK;
+    double sum=0;
+    for(int i=0;i<TOTAL_SLOTS;i++)
+    {
+        uint64_t slot=_statistics[i];
+        if(!_isCurrentSlot(slot,windowTag))
+            continue; // belongs to a window that has passed
+        double failures=slotFailures(slot);
+        if(failures>0)
+        {
+            sum+=failures/(failures+slotSuccesses(slot));
+        }
+    }
+    return sum;
+}
+
+void FailureInfo::getCounts(int &n_failures,int &n_successes) const
 {
-    double avg=0;
-    for(size_t i=0;i<_totalSlots;i++)
+    uint64_t windowTag=getCurrentWindow()&WINDOW_TAG_MASK;
+    n_failures=n_successes=0;
+    for(int i=0;i<TOTAL_SLOTS;i++)
     {
-        if(_statistics[i].first >0)
+        uint64_t slot=_statistics[i];
+        if(_isCurrentSlot(slot,windowTag))
         {
-            avg+=_statistics[i].first/(_statistics[i].first+_statistics[i].second);
-            
+            n_failures+=slotFailures(slot);
+            n_successes+=slotSuccesses(slot);
         }
     }
+}
+
+int FailureInfo::getLatencyPercentile(int percentile) const
+{
+    uint64_t windowTag=getCurrentWindow()&WINDOW_TAG_MASK;
+    uint32_t counts[N_LATENCY_BUCKETS]={0};
+    uint32_t nSamples=0;
+    for(int i=0;i<TOTAL_SLOTS;i++)
+    {
+        if(!_isCurrentSlot(_statistics[i],windowTag))
+            continue;
+        for(int j=0;j<N_LATENCY_BUCKETS;j++)
+        {
+            counts[j]+=_latencies[i][j];
+            nSamples+=_latencies[i][j];
+        }
+    }
+    if(!nSamples)
+        return -1;
+    uint64_t needed=(static_cast<uint64_t>(nSamples)*percentile+99)/100;
+    uint64_t seen=0;
+    for(int j=0;j<N_LATENCY_BUCKETS-1;j++)
+    {
+        seen+=counts[j];
+        if(seen>=needed)
+            return LATENCY_BUCKET_BOUNDS[j];
+    }
+    return LATENCY_BUCKET_BOUNDS[N_LATENCY_BUCKETS-1];
+}
+    
+bool FailureInfo::isAttemptReq()
+{
+    if(_breakerParams.enabled)
+        return _isCircuitAttemptReq();
+
+    double avg=_getFailureRatioSum(getCurrentWindow());
     
     if(avg) { 
         //Average it out for time being
-        avg=avg/_totalSlots;
+        avg=avg/TOTAL_SLOTS;
         double prob;
 
         if(avg*1000<LOWER_CUT_OFF) {
@@ -100,10 +378,167 @@ bool FailureInfo::isAttemptReq()
 
         if(decision<prob*100) {
             _debugLog(_debug_tag.c_str(),"[%s] fetch request will not be added for an attempt request",__FUNCTION__);
-            return (_requestMade=false);
+            return false;
         }
     }
         
     _debugLog(_debug_tag.c_str(),"[%s] fetch request will be added for an attempt request",__FUNCTION__);
     return true;
 }
+
+const int FailureRegistry::DEFAULT_MAX_ENTRIES=4096;
+const int FailureRegistry::DEFAULT_IDLE_TIMEOUT=300;
+
+FailureRegistry::FailureRegistry(const char* debug_tag,ComponentBase::Debug debug_func,ComponentBase::Error error_func,
+                                 int max_entries /* = DEFAULT_MAX_ENTRIES */,
+                                 int idle_timeout /* = DEFAULT_IDLE_TIMEOUT */)
+    :ComponentBase(debug_tag,debug_func,error_func),_idle_timeout(idle_timeout)
+{
+    _n_entries=MAX_PROBES;
+    while(_n_entries<max_entries)
+        _n_entries<<=1;
+    _entries=new Entry[_n_entries];
+    for(int i=0;i<_n_entries;i++)
+    {
+        _entries[i].key=0;
+        _entries[i].last_used=0;
+        _entries[i].info=new FailureInfo(debug_tag,debug_func,error_func);
+    }
+    _debugLog(_debug_tag.c_str(),"[%s] Created registry with %d entries; idle timeout %d secs",
+              __FUNCTION__,_n_entries,_idle_timeout);
+}
+
+uint64_t FailureRegistry::_getKey(const std::string &url) const
+{
+    uint64_t key=EsiLib::TemplateCache::hash(url.data(),url.size());
+    return (key&&(key!=CLAIMING_KEY))?key:1; // 0 marks free entries
+}
+
+uint64_t FailureRegistry::_getEntryKey(const Entry &entry) const
+{
+    uint64_t key=entry.key;
+    for(int i=0;(key==CLAIMING_KEY)&&(i<MAX_CLAIM_WAITS);i++)
+    {
+        sched_yield(); // another thread is resetting the entry
+        key=entry.key;
+    }
+    return key;
+}
+
+bool FailureRegistry::_acquire(Entry &entry,uint64_t key)
+{
+    // pairs with _claim(): either the claiming thread sees the
+    // reference or this one sees the changed key
+    __sync_fetch_and_add(&entry.info->_nRefs,1);
+    if(entry.key==key)
+        return true;
+    __sync_fetch_and_sub(&entry.info->_nRefs,1);
+    return false;
+}
+
+bool FailureRegistry::_claim(Entry &entry,uint64_t key)
+{
+    if(!__sync_bool_compare_and_swap(&entry.key,key,CLAIMING_KEY))
+        return false;
+    if(entry.info->_nRefs)
+    {
+        // results still being recorded for the current key
+        __sync_bool_compare_and_swap(&entry.key,CLAIMING_KEY,key);
+        return false;
+    }
+    return true;
+}
+
+void FailureRegistry::_publish(Entry &entry,uint64_t key,time_t now,bool reset)
+{
+    // the entry is claimed, so no other thread can get hold of it
+    // (under this key) before it is reset
+    if(reset)
+        entry.info->reset();
+    entry.last_used=now;
+    __sync_bool_compare_and_swap(&entry.key,CLAIMING_KEY,key);
+}
+
+FailureInfo* FailureRegistry::find(const std::string &url,time_t now)
+{
+    uint64_t key=_getKey(url);
+    for(int i=0;i<MAX_PROBES;i++)
+    {
+        Entry &entry=_entries[(key+i)&(_n_entries-1)];
+        if(_getEntryKey(entry)==key)
+        {
+            if(_isIdle(entry,now) || !_acquire(entry,key))
+                return 0;
+            _touch(entry,now);
+            return entry.info;
+        }
+    }
+    return 0;
+}
+
+FailureInfo* FailureRegistry::get(const std::string &url,time_t now)
+{
+    uint64_t key=_getKey(url);
+    Entry* victim=0;
+    uint64_t victimKey=0;
+    for(int i=0;i<MAX_PROBES;i++)
+    {
+        Entry &entry=_entries[(key+i)&(_n_entries-1)];
+        uint64_t entryKey=_getEntryKey(entry);
+        if(entryKey==key)
+        {
+            // statistics of an idle entry are too old to go by; another
+            // thread may have reset it just before though
+            if(_isIdle(entry,now) && _claim(entry,key))
+                _publish(entry,key,now,_isIdle(entry,now));
+            if(!_acquire(entry,key))
+                return 0; // taken over meanwhile
+            _touch(entry,now);
+            return entry.info;
+        }
+        if(entryKey==CLAIMING_KEY)
+            continue;
+        // free entries have never been used, so they come first
+        if(!victim || ((entryKey==0)&&(victimKey!=0)) ||
+           ((victimKey!=0)&&(entry.last_used<victim->last_used)))
+        {
+            victim=&entry;
+            victimKey=entryKey;
+        }
+    }
+
+    if(!victim)
+        return 0;
+    bool evicting=(victimKey && !_isIdle(*victim,now));
+    if(!_claim(*victim,victimKey))
+    {
+        // another thread took the entry over first or it is still held
+        return ((_getEntryKey(*victim)==key)&&_acquire(*victim,key))?victim->info:0;
+    }
+    if(evicting)
+    {
+        _debugLog(_debug_tag.c_str(),"[%s] Registry full; evicting entry in use for [%.*s]",
+                  __FUNCTION__,url.size(),url.data());
+    }
+    _publish(*victim,key,now,true);
+    _debugLog(_debug_tag.c_str(),"[%s] Inserted entry for [%.*s]",__FUNCTION__,url.size(),url.data());
+    return _acquire(*victim,key)?victim->info:0;
+}
+
+int FailureRegistry::getNumEntries(time_t now) const
+{
+    int n_entries=0;
+    for(int i=0;i<_n_entries;i++)
+    {
+        if(_entries[i].key && !_isIdle(_entries[i],now))
+            ++n_entries;
+    }
+    return n_entries;
+}
+
+FailureRegistry::~FailureRegistry()
+{
+    for(int i=0;i<_n_entries;i++)
+        delete _entries[i].info;
+    delete[] _entries;
+}
@@ -24,40 +24,52 @@
 #ifndef FAILURE_INFO_H
 #define FAILURE_INFO_H
 #include <time.h>
-#include <vector>
-#include <map>
+#include <stdint.h>
 #include <sys/time.h>
 #include <string>
-#include <pthread.h>
 #include "ComponentBase.h"
 using namespace std;
 
-typedef std::vector <std::pair <double , double > > FailureToSuccess;
-typedef std::map<std::string,class FailureInfo*> FailureData;
-
 static const int WINDOW_SIZE=200;
 static const int TOTAL_DURATION=2000;
 
+/*
+ * Settings of the circuit breaker mode. When enabled,
+ * attempts of a URL are stopped altogether (the circuit
+ * opens) once its error rate over TOTAL_DURATION crosses
+ * the threshold; after open_duration a limited number of
+ * probe attempts is let through (half-open) and the first
+ * of them to complete closes or reopens the circuit
+ */
+struct CircuitBreakerParams {
+    bool enabled;          // false: attempts are skipped at random based on failure ratios
+    int error_rate;        // percentage of failed attempts that opens the circuit
+    int min_requests;      // attempts needed in the statistics before the error rate counts
+    int latency_threshold; // ms; slower attempts count as failures; 0 disables
+    int open_duration;     // ms
+    int max_probes;        // attempts let through while half-open
+    CircuitBreakerParams() : enabled(false),error_rate(50),min_requests(10),latency_threshold(0),
+                             open_duration(5000),max_probes(1) { };
+};
+
 class FailureInfo : private EsiLib::ComponentBase
 {
 public:
 
     FailureInfo(const char* debug_tag,ComponentBase::Debug debug_func,ComponentBase::Error error_func)
-            :ComponentBase(debug_tag,debug_func,error_func),_windowsPassed(0),_avgOverWindow(0),_requestMade(true)
+            :ComponentBase(debug_tag,debug_func,error_func),_nRefs(0)
     {
-        _totalSlots=TOTAL_DURATION/WINDOW_SIZE;
-        _windowMarker=0;
-        for(size_t i=0;i<_totalSlots;i++)
-            _statistics.push_back(make_pair(0,0));
-        _debugLog(_debug_tag.c_str(),"FailureInfo Ctor:inserting URL object into the statistics map [FailureInfo object]%p",this);
+        reset();
     };
 
     ~FailureInfo(){}
 
-    /* Fills the statistics vector depending
-     * upon the position of the window marker
+    /* Fills the statistics slot of the current
+     * window; safe to call from any thread. latency
+     * is the time taken by the attempt in ms (-1 if
+     * unknown)
      */
-    void registerSuccFail(bool isSuccess);
+    void registerSuccFail(bool isSuccess,int latency=-1);
 
     /*
      * Decides if an attempt shud be made
@@ -66,35 +78,178 @@ public:
      */
     bool isAttemptReq();
 
+    /* Sums up the failures and successes registered
+     * over the last TOTAL_DURATION milliseconds
+     */
+    void getCounts(int &n_failures, int &n_successes) const;
+
+    /* Latency (ms) under which given percentage of the
+     * attempts registered over the last TOTAL_DURATION
+     * milliseconds completed, rounded up to the bound
+     * of a histogram bucket; -1 if none reported one
+     */
+    int getLatencyPercentile(int percentile) const;
+
+    /* Clears the statistics; used when the object
+     * is handed over to another URL
+     */
+    void reset();
+
+    enum CircuitState { CIRCUIT_CLOSED=0, CIRCUIT_OPEN=1, CIRCUIT_HALF_OPEN=2 };
+
+    CircuitState getCircuitState() const;
+
+    /* meant to be called once at startup; invalid
+     * values are replaced by defaults
+     */
+    static void setCircuitBreakerParams(const CircuitBreakerParams &params);
+
+    static const CircuitBreakerParams &getCircuitBreakerParams() { return _breakerParams; }
+
 private:
+    static const int TOTAL_SLOTS=TOTAL_DURATION/WINDOW_SIZE;
+    static const int N_LATENCY_BUCKETS=12;
+    static const int LATENCY_BUCKET_BOUNDS[N_LATENCY_BUCKETS];
+
     /*
      * Keeps track of failures of attempt
-     * vs success
+     * vs success; each slot packs the tag of the window
+     * it belongs to with the failure and success counts
+     * so that it can be updated with a single CAS
      */
-    FailureToSuccess _statistics;
+    volatile uint64_t _statistics[TOTAL_SLOTS];
 
-    /* Slot on which to register success/failures
-     * Changes as soon as time has passed windowSize
+    /* Latency histograms of the windows in _statistics;
+     * cleared by the thread that opens a window, so a
+     * sample racing with that may get lost
      */
-    size_t _windowMarker;
-
-    /* Number of slots to be filled over time */
-    size_t _totalSlots;
-
-    /* Start time for the window slots */
-    struct timeval _start;
+    volatile uint32_t _latencies[TOTAL_SLOTS][N_LATENCY_BUCKETS];
 
     /* Keep track of the number of windows filled prev*/
-    size_t _windowsPassed;
+    volatile int _windowsPassed;
     
     /*Used as a deciding factor between attempt/except
-     * incase prob is complete truth
+     * incase prob is complete truth; only written by
+     * the thread that opens the last slot of a round
      */
-    double _avgOverWindow;
-    
+    volatile double _avgOverWindow;
+
+    /* Circuit breaker state packed with the time (ms)
+     * it is open until or half-open since and the number
+     * of probes let through since going half-open, so
+     * that a transition is made with a single CAS and
+     * only the thread making it acts on it
+     */
+    volatile uint64_t _circuit;
+
+    static CircuitBreakerParams _breakerParams;
+
+    /* Threads holding the object; maintained by the
+     * FailureRegistry, which doesn't hand it over to
+     * another URL while it is held
+     */
+    volatile int _nRefs;
+    friend class FailureRegistry;
+
+    /* Sum of failure ratios of the slots that belong to
+     * the windows preceding (and including) given one
+     */
+    double _getFailureRatioSum(int64_t window) const;
+
+    bool _isCurrentSlot(uint64_t slot,uint64_t windowTag) const;
+
+    bool _isCircuitAttemptReq();
+
+    void _updateCircuit(bool failed);
+
+    bool _setCircuit(int oldState,uint64_t circuit);
+
+    void _openCircuit(int oldState);
+
+};
+
+/*
+ * Process-wide table of FailureInfo objects keyed by
+ * include URL. The table has a fixed number of entries
+ * and is searched and updated with atomic operations;
+ * an entry being handed over to another URL is waited
+ * for only briefly, after which the URL goes untracked
+ * for the time being. Entries that haven't been used
+ * for the idle timeout (or the least recently used one
+ * of a full probe sequence) are handed over to new URLs
+ * once no thread holds them
+ */
+class FailureRegistry : private EsiLib::ComponentBase
+{
 public:
-    /*Was a reqeust made*/
-    bool _requestMade;
+
+    static const int DEFAULT_MAX_ENTRIES;
+    static const int DEFAULT_IDLE_TIMEOUT; // seconds
+
+    FailureRegistry(const char* debug_tag,ComponentBase::Debug debug_func,ComponentBase::Error error_func,
+                    int max_entries=DEFAULT_MAX_ENTRIES,int idle_timeout=DEFAULT_IDLE_TIMEOUT);
+
+    /* Returns the entry for given URL; 0 if there is
+     * none or it has been idle for too long. The entry
+     * is held until passed to release()
+     */
+    FailureInfo* find(const std::string &url,time_t now);
+
+    /* Returns the entry for given URL, taking over
+     * a free, idle or least recently used one if needed;
+     * 0 if none can be taken over right now. The entry
+     * is held until passed to release()
+     */
+    FailureInfo* get(const std::string &url,time_t now);
+
+    /* Lets go of an entry returned by find() or get() */
+    void release(FailureInfo *info) { __sync_fetch_and_sub(&info->_nRefs,1); }
+
+    /* Number of entries that are in use */
+    int getNumEntries(time_t now) const;
+
+    ~FailureRegistry();
+
+private:
+    static const int MAX_PROBES=8;
+    // key of an entry while a thread resets it for its new key
+    static const uint64_t CLAIMING_KEY=~static_cast<uint64_t>(0);
+    static const int MAX_CLAIM_WAITS=64;
+
+    struct Entry {
+        volatile uint64_t key; // 0 when free
+        volatile time_t last_used;
+        FailureInfo* info;
+    };
+
+    Entry* _entries;
+    int _n_entries; // power of 2
+    int _idle_timeout;
+
+    uint64_t _getKey(const std::string &url) const;
+
+    // waits (for a while) for a claimed entry to get its new
+    // key; CLAIMING_KEY if it doesn't
+    uint64_t _getEntryKey(const Entry &entry) const;
+
+    // holds the entry if it still belongs to given key
+    bool _acquire(Entry &entry,uint64_t key);
+
+    // claims the entry if it still has given key and isn't held
+    bool _claim(Entry &entry,uint64_t key);
+
+    // hands a claimed entry over to given key
+    void _publish(Entry &entry,uint64_t key,time_t now,bool reset);
+
+    bool _isIdle(const Entry &entry,time_t now) const {
+        return ((now - entry.last_used) > _idle_timeout);
+    }
+
+    void _touch(Entry &entry,time_t now) {
+        if (entry.last_used != now) {
+            entry.last_used = now;
+        }
+    }
 
 };
 
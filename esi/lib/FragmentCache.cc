@@ -0,0 +1,173 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include "FragmentCache.h"
+#include "TemplateCache.h"
+#include "Stats.h"
+
+using std::string;
+using namespace EsiLib;
+
+const int FragmentCache::DEFAULT_N_SHARDS = 16;
+
+FragmentCache::FragmentCache(const char *debug_tag, ComponentBase::Debug debug_func,
+                             ComponentBase::Error error_func, size_t max_size, int n_shards /* = DEFAULT_N_SHARDS */)
+  : ComponentBase(debug_tag, debug_func, error_func) {
+  if (n_shards <= 0) {
+    n_shards = 1;
+  }
+  _max_shard_size = max_size / n_shards;
+  for (int i = 0; i < n_shards; ++i) {
+    Shard *shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->curr_size = 0;
+    _shards.push_back(shard);
+  }
+}
+
+bool
+FragmentCache::lookup(const string &key, time_t now, Fragment &fragment, bool *stale /* = 0 */) {
+  uint64_t hash = TemplateCache::hash(key.data(), key.size());
+  Shard &shard = _getShard(hash);
+  bool hit = false, expired = false;
+  pthread_mutex_lock(&shard.lock);
+  EntryMap::iterator map_iter = shard.entry_map.find(hash);
+  if ((map_iter != shard.entry_map.end()) && (map_iter->second->key == key)) {
+    expired = (map_iter->second->fragment.expiry_time <= now);
+    if (expired && (!stale || map_iter->second->fragment.validators.empty())) {
+      _debugLog(_debug_tag.c_str(), "[%s] Entry for [%s] expired", __FUNCTION__, key.c_str());
+      _erase(shard, map_iter);
+    } else {
+      shard.entries.splice(shard.entries.begin(), shard.entries, map_iter->second);
+      fragment = map_iter->second->fragment;
+      fragment.response->acquire();
+      hit = true;
+    }
+  }
+  pthread_mutex_unlock(&shard.lock);
+  if (stale) {
+    *stale = (hit && expired);
+  }
+  if (hit && expired) {
+    _debugLog(_debug_tag.c_str(), "[%s] Entry for [%s] expired; returning it for revalidation", __FUNCTION__,
+              key.c_str());
+    Stats::increment(Stats::N_FRAGMENT_CACHE_MISSES);
+  } else if (hit) {
+    _debugLog(_debug_tag.c_str(), "[%s] Hit for [%s]; body size %d", __FUNCTION__, key.c_str(),
+              fragment.body_len);
+    Stats::increment(Stats::N_FRAGMENT_CACHE_HITS);
+  } else {
+    Stats::increment(Stats::N_FRAGMENT_CACHE_MISSES);
+  }
+  return hit;
+}
+
+void
+FragmentCache::insert(const string &key, const Fragment &fragment) {
+  uint64_t hash = TemplateCache::hash(key.data(), key.size());
+  Entry entry(hash, key, fragment);
+  size_t entry_size = _getEntrySize(entry);
+  if (entry_size > _max_shard_size) {
+    _debugLog(_debug_tag.c_str(), "[%s] Not caching entry of size %d; max shard size is %d", __FUNCTION__,
+              entry_size, _max_shard_size);
+    return;
+  }
+  Shard &shard = _getShard(hash);
+  int n_evictions = 0;
+  fragment.response->acquire();
+  pthread_mutex_lock(&shard.lock);
+  EntryMap::iterator map_iter = shard.entry_map.find(hash);
+  if (map_iter != shard.entry_map.end()) { // older entry or hash collision; newer one wins
+    _erase(shard, map_iter);
+  }
+  while ((shard.curr_size + entry_size) > _max_shard_size) {
+    _erase(shard, shard.entry_map.find(shard.entries.back().hash));
+    ++n_evictions;
+  }
+  shard.entries.push_front(entry);
+  shard.entry_map.insert(EntryMap::value_type(hash, shard.entries.begin()));
+  shard.curr_size += entry_size;
+  pthread_mutex_unlock(&shard.lock);
+  if (n_evictions) {
+    Stats::increment(Stats::N_FRAGMENT_CACHE_EVICTIONS, n_evictions);
+  }
+  _debugLog(_debug_tag.c_str(), "[%s] Cached [%s] with body of size %d; evicted %d entries", __FUNCTION__,
+            key.c_str(), fragment.body_len, n_evictions);
+}
+
+void
+FragmentCache::_erase(Shard &shard, EntryMap::iterator map_iter) {
+  shard.curr_size -= _getEntrySize(*(map_iter->second));
+  map_iter->second->fragment.response->release();
+  shard.entries.erase(map_iter->second);
+  shard.entry_map.erase(map_iter);
+}
+
+size_t
+FragmentCache::getNumEntries() const {
+  size_t n_entries = 0;
+  for (size_t i = 0; i < _shards.size(); ++i) {
+    pthread_mutex_lock(&_shards[i]->lock);
+    n_entries += _shards[i]->entry_map.size();
+    pthread_mutex_unlock(&_shards[i]->lock);
+  }
+  return n_entries;
+}
+
+size_t
+FragmentCache::getSize() const {
+  size_t size = 0;
+  for (size_t i = 0; i < _shards.size(); ++i) {
+    pthread_mutex_lock(&_shards[i]->lock);
+    size += _shards[i]->curr_size;
+    pthread_mutex_unlock(&_shards[i]->lock);
+  }
+  return size;
+}
+
+void
+FragmentCache::_clear(Shard &shard) {
+  for (EntryList::iterator iter = shard.entries.begin(); iter != shard.entries.end(); ++iter) {
+    iter->fragment.response->release();
+  }
+  shard.entries.clear();
+  shard.entry_map.clear();
+  shard.curr_size = 0;
+}
+
+void
+FragmentCache::clear() {
+  for (size_t i = 0; i < _shards.size(); ++i) {
+    pthread_mutex_lock(&_shards[i]->lock);
+    _clear(*_shards[i]);
+    pthread_mutex_unlock(&_shards[i]->lock);
+  }
+}
+
+FragmentCache::~FragmentCache() {
+  for (size_t i = 0; i < _shards.size(); ++i) {
+    _clear(*_shards[i]);
+    pthread_mutex_destroy(&_shards[i]->lock);
+    delete _shards[i];
+  }
+}
@@ -0,0 +1,152 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#ifndef _ESI_FRAGMENT_CACHE_H
+#define _ESI_FRAGMENT_CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <ext/hash_map>
+
+#include "ComponentBase.h"
+
+namespace EsiLib {
+
+/** immutable, reference counted response data; shared by the fetchers
+ * and the fragment cache entries that refer to it */
+class SharedResponse {
+
+public:
+
+  const std::string data;
+
+  SharedResponse(const char *d, int d_len) : data(d, d_len), _ref_count(1) { };
+
+  void acquire() { __sync_add_and_fetch(&_ref_count, 1); };
+
+  void release() {
+    if (__sync_sub_and_fetch(&_ref_count, 1) == 0) {
+      delete this;
+    }
+  };
+
+private:
+
+  volatile int _ref_count;
+
+  ~SharedResponse() { };
+
+};
+
+/** process-wide LRU cache of fetched include responses. The cache is
+ * split into shards, each with its own lock and an equal share of the
+ * size limit, so that threads rarely contend. Entries hold a reference to
+ * the response and the span of its (already parsed) body, and expire at
+ * the time the fragment's headers allow */
+class FragmentCache : private ComponentBase
+{
+
+public:
+
+  struct Fragment {
+    SharedResponse *response;
+    int body_offset;
+    int body_len;
+    std::string validators; // as returned by the fetcher for the output cache
+    time_t expiry_time;
+    Fragment() : response(0), body_offset(0), body_len(0), expiry_time(0) { };
+  };
+
+  FragmentCache(const char *debug_tag, ComponentBase::Debug debug_func, ComponentBase::Error error_func,
+                size_t max_size, int n_shards = DEFAULT_N_SHARDS);
+
+  /** on hit, fills in fragment and acquires a reference to its response
+   * for the caller. Expired entries are removed, unless stale is given and
+   * the entry has validators: it is then returned (with stale set) so that
+   * it can be revalidated and is kept until replaced or evicted */
+  bool lookup(const std::string &key, time_t now, Fragment &fragment, bool *stale = 0);
+
+  /** adds an entry (with a reference of its own to the response), replacing
+   * any entry for the same key and evicting least recently used entries of
+   * the shard to stay within its share of the size limit */
+  void insert(const std::string &key, const Fragment &fragment);
+
+  size_t getNumEntries() const;
+
+  size_t getSize() const;
+
+  void clear();
+
+  virtual ~FragmentCache();
+
+  static const int DEFAULT_N_SHARDS;
+
+private:
+
+  struct Entry {
+    uint64_t hash;
+    std::string key;
+    Fragment fragment;
+    Entry(uint64_t h, const std::string &k, const Fragment &f) : hash(h), key(k), fragment(f) { };
+  };
+
+  typedef std::list<Entry> EntryList; // most recently used first
+
+  struct KeyHasher {
+    inline size_t operator ()(uint64_t key) const {
+      return static_cast<size_t>(key ^ (key >> 32));
+    };
+  };
+
+  typedef __gnu_cxx::hash_map<uint64_t, EntryList::iterator, KeyHasher> EntryMap;
+
+  struct Shard {
+    pthread_mutex_t lock;
+    EntryList entries;
+    EntryMap entry_map;
+    size_t curr_size;
+  };
+
+  std::vector<Shard *> _shards;
+  size_t _max_shard_size;
+
+  Shard &_getShard(uint64_t hash) const { return *(_shards[hash % _shards.size()]); };
+
+  static size_t _getEntrySize(const Entry &entry) {
+    return sizeof(Entry) + entry.key.size() + entry.fragment.validators.size() +
+      entry.fragment.response->data.size();
+  };
+
+  void _erase(Shard &shard, EntryMap::iterator map_iter);
+
+  void _clear(Shard &shard);
+
+};
+
+};
+
+#endif // _ESI_FRAGMENT_CACHE_H
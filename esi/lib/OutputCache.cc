@@ -0,0 +1,109 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#include "OutputCache.h"
+#include "TemplateCache.h"
+#include "Stats.h"
+
+using std::string;
+using namespace EsiLib;
+
+OutputCache::OutputCache(const char *debug_tag, ComponentBase::Debug debug_func,
+                         ComponentBase::Error error_func, size_t max_size)
+  : ComponentBase(debug_tag, debug_func, error_func), _max_size(max_size), _curr_size(0) {
+}
+
+bool
+OutputCache::lookup(const string &identity, const string &include_versions, const char *&output,
+                    int &output_len) {
+  EntryMap::iterator map_iter = _entry_map.find(TemplateCache::hash(identity.data(), identity.size()));
+  if ((map_iter == _entry_map.end()) || (map_iter->second->identity != identity)) {
+    _debugLog(_debug_tag.c_str(), "[%s] Miss for identity of size %d", __FUNCTION__, identity.size());
+    Stats::increment(Stats::N_OUTPUT_CACHE_MISSES);
+    return false;
+  }
+  if (map_iter->second->include_versions != include_versions) {
+    _debugLog(_debug_tag.c_str(), "[%s] Entry for identity of size %d built from other include versions",
+              __FUNCTION__, identity.size());
+    Stats::increment(Stats::N_OUTPUT_CACHE_STALE);
+    Stats::increment(Stats::N_OUTPUT_CACHE_MISSES);
+    return false;
+  }
+  _entries.splice(_entries.begin(), _entries, map_iter->second);
+  output = map_iter->second->output.data();
+  output_len = map_iter->second->output.size();
+  _debugLog(_debug_tag.c_str(), "[%s] Hit for identity of size %d; output size %d", __FUNCTION__,
+            identity.size(), output_len);
+  Stats::increment(Stats::N_OUTPUT_CACHE_HITS);
+  Stats::increment(Stats::OUTPUT_CACHE_BYTES_SAVED, output_len);
+  return true;
+}
+
+void
+OutputCache::insert(const string &identity, const string &include_versions, const ByteBlockList &output) {
+  int output_len = 0;
+  for (ByteBlockList::const_iterator iter = output.begin(); iter != output.end(); ++iter) {
+    output_len += iter->data_len;
+  }
+  uint64_t key = TemplateCache::hash(identity.data(), identity.size());
+  size_t entry_size = sizeof(Entry) + identity.size() + include_versions.size() + output_len;
+  if (entry_size > _max_size) {
+    _debugLog(_debug_tag.c_str(), "[%s] Not caching entry of size %d; max cache size is %d", __FUNCTION__,
+              entry_size, _max_size);
+    return;
+  }
+  EntryMap::iterator map_iter = _entry_map.find(key);
+  if (map_iter != _entry_map.end()) { // stale entry or hash collision; newer one wins
+    _erase(map_iter);
+  }
+  while ((_curr_size + entry_size) > _max_size) {
+    _debugLog(_debug_tag.c_str(), "[%s] Evicting entry with output of size %d", __FUNCTION__,
+              _entries.back().output.size());
+    _erase(_entry_map.find(_entries.back().key));
+  }
+  _entries.push_front(Entry(key, identity, include_versions));
+  string &entry_output = _entries.front().output; // output can be big; copy it just once
+  entry_output.reserve(output_len);
+  for (ByteBlockList::const_iterator iter = output.begin(); iter != output.end(); ++iter) {
+    entry_output.append(iter->data, iter->data_len);
+  }
+  _entry_map.insert(EntryMap::value_type(key, _entries.begin()));
+  _curr_size += entry_size;
+  _debugLog(_debug_tag.c_str(), "[%s] Cached output of size %d; cache has %d entries of total size %d",
+            __FUNCTION__, output_len, _entry_map.size(), _curr_size);
+}
+
+void
+OutputCache::_erase(EntryMap::iterator map_iter) {
+  _curr_size -= _getEntrySize(*(map_iter->second));
+  _entries.erase(map_iter->second);
+  _entry_map.erase(map_iter);
+}
+
+void
+OutputCache::clear() {
+  _entries.clear();
+  _entry_map.clear();
+  _curr_size = 0;
+}
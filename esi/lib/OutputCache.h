@@ -0,0 +1,117 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#ifndef _ESI_OUTPUT_CACHE_H
+#define _ESI_OUTPUT_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <ext/hash_map>
+
+#include "ComponentBase.h"
+#include "gzip.h"
+
+namespace EsiLib {
+
+/** LRU cache of processed (and possibly gzipped) documents. Entries are
+ * keyed by an identity string, which callers build out of the template's
+ * identity and the values of the variables the template depends on (see
+ * Variables::getFingerprint()), and carry the versions of the includes
+ * the output was built from; an entry whose include versions differ from
+ * the current ones is stale.
+ *
+ * Not thread-safe; meant to be used one per thread */
+class OutputCache : private ComponentBase
+{
+
+public:
+
+  OutputCache(const char *debug_tag, ComponentBase::Debug debug_func, ComponentBase::Error error_func,
+              size_t max_size);
+
+  /** on hit, points output to the cached document, which stays valid till the
+   * next call to insert() or clear(), and marks the entry most recently used.
+   * Stale entries are left in place for insert() to replace */
+  bool lookup(const std::string &identity, const std::string &include_versions, const char *&output,
+              int &output_len);
+
+  /** adds an entry, replacing any entry for the same identity and evicting
+   * least recently used entries to stay within the size limit; entries bigger
+   * than the limit are not added */
+  void insert(const std::string &identity, const std::string &include_versions, const ByteBlockList &output);
+
+  /** convenient alternative to method above */
+  void insert(const std::string &identity, const std::string &include_versions, const char *output,
+              int output_len) {
+    ByteBlockList blocks;
+    blocks.push_back(ByteBlock(output, output_len));
+    insert(identity, include_versions, blocks);
+  }
+
+  size_t getNumEntries() const { return _entry_map.size(); };
+
+  size_t getSize() const { return _curr_size; };
+
+  void clear();
+
+  virtual ~OutputCache() { };
+
+private:
+
+  struct Entry {
+    uint64_t key;
+    std::string identity;
+    std::string include_versions;
+    std::string output;
+    Entry(uint64_t k, const std::string &i, const std::string &v)
+      : key(k), identity(i), include_versions(v) { };
+  };
+
+  typedef std::list<Entry> EntryList; // most recently used first
+
+  struct KeyHasher {
+    inline size_t operator ()(uint64_t key) const {
+      return static_cast<size_t>(key ^ (key >> 32));
+    };
+  };
+
+  typedef __gnu_cxx::hash_map<uint64_t, EntryList::iterator, KeyHasher> EntryMap;
+
+  EntryList _entries;
+  EntryMap _entry_map;
+  size_t _max_size;
+  size_t _curr_size;
+
+  static size_t _getEntrySize(const Entry &entry) {
+    return sizeof(Entry) + entry.identity.size() + entry.include_versions.size() + entry.output.size();
+  };
+
+  void _erase(EntryMap::iterator map_iter);
+
+};
+
+};
+
+#endif // _ESI_OUTPUT_CACHE_H
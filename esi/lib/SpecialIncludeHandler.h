@@ -51,6 +51,8 @@ public:
     return getData(include_id, data, data_len) ? STATUS_DATA_AVAILABLE : STATUS_ERROR;
   }
 
+  /** data (as well as the footer below) has to stay valid for the lifetime of the
+   * handler, as processed output may point into it */
   virtual bool getData(int include_id, const char *&data, int &data_len) = 0;
 
   virtual void getFooter(const char *&footer, int &footer_len) {
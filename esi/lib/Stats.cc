@@ -34,7 +34,33 @@ const char *STAT_NAMES[Stats::MAX_STAT_ENUM] = {
   "esi.n_includes",
   "esi.n_include_errs",
   "esi.n_spcl_includes",
-  "esi.n_spcl_include_errs"
+  "esi.n_spcl_include_errs",
+  "esi.n_streamed_docs",
+  "esi.n_ttfb_docs",
+  "esi.total_ttfb_ms",
+  "esi.n_template_cache_hits",
+  "esi.n_template_cache_misses",
+  "esi.n_template_cache_evictions",
+  "esi.n_output_cache_hits",
+  "esi.n_output_cache_misses",
+  "esi.n_output_cache_stale",
+  "esi.output_cache_bytes_saved",
+  "esi.n_queued_fetches",
+  "esi.total_fetch_queue_depth",
+  "esi.total_fetch_queue_wait_ms",
+  "esi.n_fetches",
+  "esi.n_coalesced_fetches",
+  "esi.n_fragment_cache_hits",
+  "esi.n_fragment_cache_misses",
+  "esi.n_fragment_cache_evictions",
+  "esi.n_circuits_opened",
+  "esi.n_circuits_half_opened",
+  "esi.n_circuits_closed",
+  "esi.n_attempts_skipped",
+  "esi.n_attempts_swapped",
+  "esi.n_fetch_timeouts",
+  "esi.n_late_fetches",
+  "esi.n_fragment_revalidations"
 };
 
 int g_stat_indices[Stats::MAX_STAT_ENUM];
@@ -48,7 +48,33 @@ enum STAT { N_OS_DOCS = 0,
             N_INCLUDE_ERRS = 4,
             N_SPCL_INCLUDES = 5,
             N_SPCL_INCLUDE_ERRS = 6,
-            MAX_STAT_ENUM = 7 };
+            N_STREAMED_DOCS = 7,
+            N_TTFB_DOCS = 8,
+            TOTAL_TTFB_MS = 9,
+            N_TEMPLATE_CACHE_HITS = 10,
+            N_TEMPLATE_CACHE_MISSES = 11,
+            N_TEMPLATE_CACHE_EVICTIONS = 12,
+            N_OUTPUT_CACHE_HITS = 13,
+            N_OUTPUT_CACHE_MISSES = 14,
+            N_OUTPUT_CACHE_STALE = 15,
+            OUTPUT_CACHE_BYTES_SAVED = 16,
+            N_QUEUED_FETCHES = 17,
+            TOTAL_FETCH_QUEUE_DEPTH = 18,
+            TOTAL_FETCH_QUEUE_WAIT_MS = 19,
+            N_FETCHES = 20,
+            N_COALESCED_FETCHES = 21,
+            N_FRAGMENT_CACHE_HITS = 22,
+            N_FRAGMENT_CACHE_MISSES = 23,
+            N_FRAGMENT_CACHE_EVICTIONS = 24,
+            N_CIRCUITS_OPENED = 25,
+            N_CIRCUITS_HALF_OPENED = 26,
+            N_CIRCUITS_CLOSED = 27,
+            N_ATTEMPTS_SKIPPED = 28,
+            N_ATTEMPTS_SWAPPED = 29,
+            N_FETCH_TIMEOUTS = 30,
+            N_LATE_FETCHES = 31,
+            N_FRAGMENT_REVALIDATIONS = 32,
+            MAX_STAT_ENUM = 33 };
 
 extern const char *STAT_NAMES[MAX_STAT_ENUM];
 extern int g_stat_indices[Stats::MAX_STAT_ENUM];
@@ -0,0 +1,106 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#include "TemplateCache.h"
+#include "Stats.h"
+
+using std::string;
+using namespace EsiLib;
+
+const uint64_t TemplateCache::HASH_SEED = 14695981039346656037ULL;
+
+TemplateCache::TemplateCache(const char *debug_tag, ComponentBase::Debug debug_func,
+                             ComponentBase::Error error_func, size_t max_size)
+  : ComponentBase(debug_tag, debug_func, error_func), _max_size(max_size), _curr_size(0) {
+}
+
+uint64_t
+TemplateCache::hash(const char *data, int data_len, uint64_t seed /* = HASH_SEED */) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+  for (int i = 0; i < data_len; ++i) {
+    seed ^= bytes[i];
+    seed *= 1099511628211ULL;
+  }
+  return seed;
+}
+
+bool
+TemplateCache::lookup(uint64_t key, int template_len, const string &validator, string &packed_node_list) {
+  EntryMap::iterator map_iter = _entry_map.find(key);
+  if ((map_iter == _entry_map.end()) || (map_iter->second->template_len != template_len) ||
+      (map_iter->second->validator != validator)) {
+    _debugLog(_debug_tag.c_str(), "[%s] Miss for template of size %d", __FUNCTION__, template_len);
+    Stats::increment(Stats::N_TEMPLATE_CACHE_MISSES);
+    return false;
+  }
+  _entries.splice(_entries.begin(), _entries, map_iter->second);
+  packed_node_list.assign(map_iter->second->packed_node_list);
+  _debugLog(_debug_tag.c_str(), "[%s] Hit for template of size %d; packed node list size %d", __FUNCTION__,
+            template_len, packed_node_list.size());
+  Stats::increment(Stats::N_TEMPLATE_CACHE_HITS);
+  return true;
+}
+
+void
+TemplateCache::insert(uint64_t key, int template_len, const string &validator, const string &packed_node_list) {
+  Entry entry(key, template_len, validator, packed_node_list);
+  size_t entry_size = _getEntrySize(entry);
+  if (entry_size > _max_size) {
+    _debugLog(_debug_tag.c_str(), "[%s] Not caching entry of size %d; max cache size is %d", __FUNCTION__,
+              entry_size, _max_size);
+    return;
+  }
+  EntryMap::iterator map_iter = _entry_map.find(key);
+  if (map_iter != _entry_map.end()) { // stale entry or hash collision; newer one wins
+    _curr_size -= _getEntrySize(*(map_iter->second));
+    _entries.erase(map_iter->second);
+    _entry_map.erase(map_iter);
+  }
+  while ((_curr_size + entry_size) > _max_size) {
+    _evict(_entry_map.find(_entries.back().key));
+  }
+  _entries.push_front(entry);
+  _entry_map.insert(EntryMap::value_type(key, _entries.begin()));
+  _curr_size += entry_size;
+  _debugLog(_debug_tag.c_str(), "[%s] Cached packed node list of size %d for template of size %d; "
+            "cache has %d entries of total size %d", __FUNCTION__, packed_node_list.size(), template_len,
+            _entry_map.size(), _curr_size);
+}
+
+void
+TemplateCache::_evict(EntryMap::iterator map_iter) {
+  _debugLog(_debug_tag.c_str(), "[%s] Evicting entry for template of size %d", __FUNCTION__,
+            map_iter->second->template_len);
+  _curr_size -= _getEntrySize(*(map_iter->second));
+  _entries.erase(map_iter->second);
+  _entry_map.erase(map_iter);
+  Stats::increment(Stats::N_TEMPLATE_CACHE_EVICTIONS);
+}
+
+void
+TemplateCache::clear() {
+  _entries.clear();
+  _entry_map.clear();
+  _curr_size = 0;
+}
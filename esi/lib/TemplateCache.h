@@ -0,0 +1,109 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#ifndef _ESI_TEMPLATE_CACHE_H
+#define _ESI_TEMPLATE_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <ext/hash_map>
+
+#include "ComponentBase.h"
+
+namespace EsiLib {
+
+/** LRU cache of packed node lists keyed by a hash of the raw template
+ * bytes plus the template's validators (etag/last-modified) so that
+ * identical templates served by different URLs are parsed only once.
+ *
+ * Not thread-safe; meant to be used one per thread */
+class TemplateCache : private ComponentBase
+{
+
+public:
+
+  TemplateCache(const char *debug_tag, ComponentBase::Debug debug_func, ComponentBase::Error error_func,
+                size_t max_size);
+
+  static const uint64_t HASH_SEED;
+
+  /** 64-bit FNV-1a; pass the previous return value as seed to hash
+   * data available in pieces */
+  static uint64_t hash(const char *data, int data_len, uint64_t seed = HASH_SEED);
+
+  /** on hit, copies the packed node list into given buffer and marks
+   * the entry most recently used */
+  bool lookup(uint64_t key, int template_len, const std::string &validator, std::string &packed_node_list);
+
+  /** adds an entry evicting least recently used entries to stay within
+   * the size limit; entries bigger than the limit are not added */
+  void insert(uint64_t key, int template_len, const std::string &validator,
+              const std::string &packed_node_list);
+
+  size_t getNumEntries() const { return _entry_map.size(); };
+
+  size_t getSize() const { return _curr_size; };
+
+  void clear();
+
+  virtual ~TemplateCache() { };
+
+private:
+
+  struct Entry {
+    uint64_t key;
+    int template_len;
+    std::string validator;
+    std::string packed_node_list;
+    Entry(uint64_t k, int t_len, const std::string &v, const std::string &p)
+      : key(k), template_len(t_len), validator(v), packed_node_list(p) { };
+  };
+
+  typedef std::list<Entry> EntryList; // most recently used first
+
+  struct KeyHasher {
+    inline size_t operator ()(uint64_t key) const {
+      return static_cast<size_t>(key ^ (key >> 32));
+    };
+  };
+
+  typedef __gnu_cxx::hash_map<uint64_t, EntryList::iterator, KeyHasher> EntryMap;
+
+  EntryList _entries;
+  EntryMap _entry_map;
+  size_t _max_size;
+  size_t _curr_size;
+
+  static size_t _getEntrySize(const Entry &entry) {
+    return sizeof(Entry) + entry.validator.size() + entry.packed_node_list.size();
+  };
+
+  void _evict(EntryMap::iterator map_iter);
+
+};
+
+};
+
+#endif // _ESI_TEMPLATE_CACHE_H
@@ -52,7 +52,7 @@ Utils::getAttribute(const string &data, const string &attr, size_t curr_pos, siz
   curr_pos = attr_start + attr.size();
   bool equals_found = false;
   for (; curr_pos < end_pos; ++curr_pos) {
-    if (data[curr_pos] == ' ') {
+    if (isspace(data[curr_pos])) {
       continue;
     } else {
       if (data[curr_pos] == '=') {
@@ -70,24 +70,23 @@ Utils::getAttribute(const string &data, const string &attr, size_t curr_pos, siz
     ERROR_LOG("[%s] No space for value after [%.*s] attribute", __FUNCTION__, attr.size(), attr.data());
     return false;
   }
-  bool in_quoted_part = false;
+  char quote_char = 0; // quote of the part we are in, if any
   bool quoted = false;
   size_t i;
   for (i = curr_pos; i < end_pos; ++i) {
-    if (data[i] == '"') {
-      quoted = true;
-      in_quoted_part = !in_quoted_part;
-    }
-    else if (data[i] == ' ') {
-      if (!in_quoted_part) {
-        break;
+    if (quote_char) {
+      if (data[i] == quote_char) {
+        quote_char = 0;
       }
-    } else if (terminator && !in_quoted_part && (data[i] == terminator)) {
+    } else if ((data[i] == '"') || (data[i] == '\'')) {
+      quoted = true;
+      quote_char = data[i];
+    } else if (isspace(data[i]) || (terminator && (data[i] == terminator))) {
       break;
     }
   }
   const char *data_start_ptr = data.data();
-  if (in_quoted_part) {
+  if (quote_char) {
     ERROR_LOG("[%s] Unterminated quote in value for attribute [%.*s] starting at [%.10s]",
               __FUNCTION__, attr.size(), attr.data(), data_start_ptr + curr_pos);
     return false;
@@ -134,10 +133,10 @@ Utils::parseKeyValueConfig(const std::list<string> &lines, KeyValueMap &kvMap) {
   }
 }
 
-void
-Utils::parseAttributes(const char *data, int data_len, AttributeList &attr_list,
-                       const char *pair_separators /* = " " */) {
-  attr_list.clear();
+// calls handler with every non-empty name=value attribute found in data
+template<typename AttributeHandler>
+static void
+scanAttributes(const char *data, int data_len, const char *pair_separators, AttributeHandler &handler) {
   if (!data || (data_len <= 0)) {
     return;
   }
@@ -164,16 +163,14 @@ Utils::parseAttributes(const char *data, int data_len, AttributeList &attr_list,
       if (!inside_quotes) {
         if (attr.value > attr.name) {
           attr.value_len = data + i - attr.value;
-          trimWhiteSpace(attr.name, attr.name_len);
-          trimWhiteSpace(attr.value, attr.value_len);
+          Utils::trimWhiteSpace(attr.name, attr.name_len);
+          Utils::trimWhiteSpace(attr.value, attr.value_len);
           if (attr.value[0] == '"') {
             ++attr.value;
             attr.value_len -= 2;
           }
           if (attr.name_len && attr.value_len) {
-            DEBUG_LOG(DEBUG_TAG, "[%s] Added attribute with name [%.*s] and value [%.*s]",
-                      __FUNCTION__, attr.name_len, attr.name, attr.value_len, attr.value);
-            attr_list.push_back(attr);
+            handler(attr);
           } // else ignore empty name/value
         } // else ignore attribute with no value
       } // else ignore variable with unterminated quotes
@@ -193,3 +190,45 @@ Utils::parseAttributes(const char *data, int data_len, AttributeList &attr_list,
     escape_on = (data[i] == '\\') ? true : false;
   }
 }
+
+struct AttributeAppender {
+  AttributeList &attr_list;
+  AttributeAppender(AttributeList &list) : attr_list(list) { };
+  void operator ()(const Attribute &attr) {
+    Utils::DEBUG_LOG(DEBUG_TAG, "[parseAttributes] Added attribute with name [%.*s] and value [%.*s]",
+                     attr.name_len, attr.name, attr.value_len, attr.value);
+    attr_list.push_back(attr);
+  }
+};
+
+struct AttributeFinder {
+  const char *name;
+  int name_len;
+  const char *value;
+  int value_len;
+  AttributeFinder(const char *n, int n_len) : name(n), name_len(n_len), value(0), value_len(0) { };
+  void operator ()(const Attribute &attr) {
+    if ((attr.name_len == name_len) && (strncmp(attr.name, name, name_len) == 0)) {
+      value = attr.value;
+      value_len = attr.value_len;
+    }
+  }
+};
+
+void
+Utils::parseAttributes(const char *data, int data_len, AttributeList &attr_list,
+                       const char *pair_separators /* = " " */) {
+  attr_list.clear();
+  AttributeAppender appender(attr_list);
+  scanAttributes(data, data_len, pair_separators, appender);
+}
+
+bool
+Utils::findAttribute(const char *data, int data_len, const char *name, int name_len,
+                     const char *&value, int &value_len, const char *pair_separators /* = " " */) {
+  AttributeFinder finder(name, name_len);
+  scanAttributes(data, data_len, pair_separators, finder);
+  value = finder.value;
+  value_len = finder.value_len;
+  return (value != 0);
+}
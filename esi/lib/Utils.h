@@ -93,6 +93,11 @@ namespace Utils {
     parseAttributes(data.data(), data.size(), attr_list, pair_separators);
   }
 
+  // looks for attribute with given name (as parseAttributes() would find it) in place;
+  // if there are several, the last one wins
+  bool findAttribute(const char *data, int data_len, const char *name, int name_len,
+                     const char *&value, int &value_len, const char *pair_separators = " ");
+
   typedef std::map<std::string, std::string> KeyValueMap;
 
   // parses given lines (assumes <key><whitespace><value> format) and
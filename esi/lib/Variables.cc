@@ -47,24 +47,40 @@ const string Variables::SPECIAL_HEADERS[] = { string("ACCEPT-LANGUAGE"),
                                               string("QUERY_STRING"),
                                               string("") };
 
-const string Variables::NORM_SIMPLE_HEADERS[] = { string("HTTP_HOST"),
-                                                  string("HTTP_REFERER"),
-                                                  string("") };
-
 const string Variables::NORM_SPECIAL_HEADERS[] = { string("HTTP_ACCEPT_LANGUAGE"),
                                                    string("HTTP_COOKIE"),
                                                    string("HTTP_USER_AGENT"),
                                                    string("QUERY_STRING"),
                                                    string("") };
 
-inline string &
-Variables::_toUpperCase(string &str) const {
-  for (size_t i = 0; i < str.size(); ++i) {
-    if ((str[i] >= 'a') && (str[i] <= 'z')) {
-      str[i] = 'A' + (str[i] - 'a');
-    }
+// slots are given by _lookupName()'s hash, i.e., (length + first character) modulo table size
+const Variables::VariableName Variables::NAME_TABLE[NAME_TABLE_SIZE] = {
+  { 0, 0, -1, -1 },
+  { "HTTP_HOST", 9, HTTP_HOST, -1 },
+  { 0, 0, -1, -1 },
+  { "HTTP_COOKIE", 11, -1, HTTP_COOKIE },
+  { "HTTP_REFERER", 12, HTTP_REFERER, -1 },
+  { 0, 0, -1, -1 },
+  { 0, 0, -1, -1 },
+  { "HTTP_USER_AGENT", 15, -1, HTTP_USER_AGENT },
+  { 0, 0, -1, -1 },
+  { 0, 0, -1, -1 },
+  { 0, 0, -1, -1 },
+  { 0, 0, -1, -1 },
+  { "HTTP_ACCEPT_LANGUAGE", 20, -1, HTTP_ACCEPT_LANGUAGE },
+  { "QUERY_STRING", 12, QUERY_STRING_VARIABLE, QUERY_STRING },
+  { 0, 0, -1, -1 },
+  { 0, 0, -1, -1 }
+};
+
+inline const Variables::VariableName *
+Variables::_lookupName(const char *name, int name_len) {
+  const VariableName &entry =
+    NAME_TABLE[(name_len + toupper(static_cast<unsigned char>(name[0]))) & (NAME_TABLE_SIZE - 1)];
+  if ((entry.name_len == name_len) && (strncasecmp(entry.name, name, name_len) == 0)) {
+    return &entry;
   }
-  return str;
+  return 0;
 }
 
 inline int 
@@ -95,25 +111,31 @@ Variables::populate(const HttpHeader &header) {
     int name_len = (header.name_len == -1) ? strlen(header.name) : header.name_len;
     int value_len = (header.value_len == -1) ? strlen(header.value) : header.value_len;
 
-    // we need to save the cookie string to build the jar from
+    // cookies are only kept as one raw string, which is parsed or searched in place on lookup
     if ((name_len == 6) && (strncasecmp(header.name, "Cookie", 6) == 0)) {
-      _releaseCookieJar();
       if (_cookie_str.size()) {
         _cookie_str.append(", ");
       }
       _cookie_str.append(header.value, value_len);
-    }
-
-    if (_headers_parsed) {
-      _parseHeader(header.name, name_len, header.value, value_len);
+      if (_dict_parsed[HTTP_COOKIE]) {
+        _parseCookieString(header.value, value_len);
+      }
     } else {
       int match_index = _searchHeaders(SIMPLE_HEADERS, header.name, name_len);
       if (match_index != -1) {
-        _cached_simple_headers[match_index].push_back(string(header.value, value_len));
+        if (_headers_parsed) {
+          _parseSimpleHeader(static_cast<SimpleHeader>(match_index), header.value, value_len);
+        } else {
+          _cached_simple_headers[match_index].push_back(string(header.value, value_len));
+        }
       } else {
         match_index = _searchHeaders(SPECIAL_HEADERS, header.name, name_len);
         if (match_index != -1) {
-          _cached_special_headers[match_index].push_back(string(header.value, value_len));
+          if (_dict_parsed[match_index]) {
+            _parseSpecialHeader(static_cast<SpecialHeader>(match_index), header.value, value_len);
+          } else {
+            _cached_special_headers[match_index].push_back(string(header.value, value_len));
+          }
         } else {
           _debugLog(_debug_tag.c_str(), "[%s] Not retaining header [%.*s]", __FUNCTION__, name_len,
                     header.name);
@@ -127,7 +149,7 @@ inline void
 Variables::_parseSimpleHeader(SimpleHeader hdr, const string &value) {
   _debugLog(_debug_tag.c_str(), "[%s] Inserting value for simple header [%s]",
             __FUNCTION__, SIMPLE_HEADERS[hdr].c_str());
-  _simple_data[NORM_SIMPLE_HEADERS[hdr]] = value;
+  _simple_values[hdr] = value;
 }
 
 inline void
@@ -153,24 +175,9 @@ Variables::_parseSpecialHeader(SpecialHeader hdr, const char *value, int value_l
   }
 }
 
-void
-Variables::_parseHeader(const char *name, int name_len, const char *value, int value_len) {
-  int match_index = _searchHeaders(SIMPLE_HEADERS, name, name_len);
-  if (match_index != -1) {
-    _parseSimpleHeader(static_cast<SimpleHeader>(match_index), value, value_len);
-  } else {
-    match_index = _searchHeaders(SPECIAL_HEADERS, name, name_len);
-    if (match_index != -1) {
-      _parseSpecialHeader(static_cast<SpecialHeader>(match_index), value, value_len);
-    } else {
-      _debugLog(_debug_tag.c_str(), "[%s] Unrecognized header [%.*s]", __FUNCTION__, value_len, value);
-    }
-  }
-}
-
 void
 Variables::_parseQueryString(const char *query_string, int query_string_len) {
-  _insert(_simple_data, string("QUERY_STRING"), string(query_string, query_string_len));
+  _simple_values[QUERY_STRING_VARIABLE].assign(query_string, query_string_len);
   AttributeList attr_list;
   Utils::parseAttributes(query_string, query_string_len, attr_list, "&");
   for (AttributeList::iterator iter = attr_list.begin(); iter != attr_list.end(); ++iter) {
@@ -190,25 +197,61 @@ Variables::_parseCachedHeaders() {
       _parseSimpleHeader(static_cast<SimpleHeader>(i), *value_iter);
     }
   }
-  for (int i = 0; i < N_SPECIAL_HEADERS; ++i) {
-    for (HeaderValueList::iterator value_iter = _cached_special_headers[i].begin();
-         value_iter != _cached_special_headers[i].end(); ++value_iter) {
-      _parseSpecialHeader(static_cast<SpecialHeader>(i), value_iter->data(), value_iter->size());
+}
+
+void
+Variables::_parseCachedDictHeaders(SpecialHeader hdr) {
+  _debugLog(_debug_tag.c_str(), "[%s] Parsing %s dictionary", __FUNCTION__, NORM_SPECIAL_HEADERS[hdr].c_str());
+  if (hdr == HTTP_COOKIE) {
+    _parseCookieString(_cookie_str.data(), _cookie_str.size());
+  } else {
+    for (HeaderValueList::iterator value_iter = _cached_special_headers[hdr].begin();
+         value_iter != _cached_special_headers[hdr].end(); ++value_iter) {
+      _parseSpecialHeader(hdr, value_iter->data(), value_iter->size());
     }
   }
+  _dict_parsed[hdr] = true;
+}
+
+int
+Variables::getVariableId(const char *name, int name_len, const char *&attr, int &attr_len) {
+  attr = 0;
+  attr_len = 0;
+  if (!name) {
+    return UNKNOWN_VARIABLE;
+  }
+  if (name_len == -1) {
+    name_len = strlen(name);
+  }
+  if (!name_len) {
+    return UNKNOWN_VARIABLE;
+  }
+  const VariableName *var_name = _lookupName(name, name_len);
+  if (var_name && (var_name->simple_id != -1)) {
+    return var_name->simple_id;
+  }
+  const char *header;
+  int header_len;
+  if (!_parseDictVariable(name, name_len, header, header_len, attr, attr_len)) {
+    return UNKNOWN_VARIABLE;
+  }
+  var_name = _lookupName(header, header_len);
+  if (!var_name || (var_name->dict_index == -1)) {
+    attr = 0;
+    attr_len = 0;
+    return UNKNOWN_VARIABLE;
+  }
+  return N_SIMPLE_VARIABLES + var_name->dict_index;
 }
 
 const std::string &
-Variables::getValue(const string &name) const {
-  if (!_headers_parsed || !_query_string_parsed) {
-    // we need to do this because we want to
-    // 1) present const getValue() to clients
-    // 2) parse lazily (only on demand)
-    Variables &non_const_self = const_cast<Variables &>(*this);
-    if (!_headers_parsed) {
-      non_const_self._parseCachedHeaders();
-      non_const_self._headers_parsed = true;
-    }
+Variables::getValue(int variable_id, const char *attr, int attr_len) const {
+  // we need the const_cast because we want to
+  // 1) present const getValue() to clients
+  // 2) parse lazily (only on demand), and only the headers the variable needs
+  Variables &non_const_self = const_cast<Variables &>(*this);
+  int dict_index = variable_id - N_SIMPLE_VARIABLES;
+  if ((variable_id == QUERY_STRING_VARIABLE) || (dict_index == QUERY_STRING)) {
     if (!_query_string_parsed) {
       int query_string_size = static_cast<int>(_query_string.size());
       if (query_string_size) {
@@ -216,35 +259,29 @@ Variables::getValue(const string &name) const {
         non_const_self._query_string_parsed = true;
       }
     }
+  } else if ((variable_id >= 0) && (variable_id < N_SIMPLE_VARIABLES)) {
+    if (!_headers_parsed) {
+      non_const_self._parseCachedHeaders();
+      non_const_self._headers_parsed = true;
+    }
+  } else if ((dict_index >= 0) && (dict_index < N_SPECIAL_HEADERS) && !_dict_parsed[dict_index]) {
+    non_const_self._parseCachedDictHeaders(static_cast<SpecialHeader>(dict_index));
   }
-  string search_key(name);
-  _toUpperCase(search_key);
-  StringHash::const_iterator iter = _simple_data.find(search_key);
-  if (iter != _simple_data.end()) {
-    _debugLog(_debug_tag.c_str(), "[%s] Found value [%.*s] for variable [%.*s] in simple data", 
-              __FUNCTION__, iter->second.size(), iter->second.data(), name.size(), name.data());
-    return iter->second;
-  }
-  const char *header;
-  int header_len;
-  const char *attr;
-  int attr_len;
-  if (!_parseDictVariable(name, header, header_len, attr, attr_len)) {
-    _debugLog(_debug_tag.c_str(), "[%s] Unmatched simple variable [%.*s] not in dict variable form",
-              __FUNCTION__, name.size(), name.data());
-    return EMPTY_STRING;
+  if ((variable_id >= 0) && (variable_id < N_SIMPLE_VARIABLES)) {
+    _debugLog(_debug_tag.c_str(), "[%s] Found value [%.*s] for simple variable %d", __FUNCTION__,
+              _simple_values[variable_id].size(), _simple_values[variable_id].data(), variable_id);
+    return _simple_values[variable_id];
   }
-  int dict_index = _searchHeaders(NORM_SPECIAL_HEADERS, header, header_len); // ignore the HTTP_ prefix
-  if (dict_index == -1) {
-    _debugLog(_debug_tag.c_str(), "[%s] Dict variable [%.*s] refers to unknown dictionary",
-              __FUNCTION__, name.size(), name.data());
+  if ((dict_index < 0) || (dict_index >= N_SPECIAL_HEADERS)) {
+    _debugLog(_debug_tag.c_str(), "[%s] Unknown variable %d", __FUNCTION__, variable_id);
     return EMPTY_STRING;
   }
 
-  // change variable name to use only the attribute field
+  // the key buffer is reused to avoid allocating on every lookup
+  string &search_key = non_const_self._search_key;
   search_key.assign(attr, attr_len);
 
-  iter = _dict_data[dict_index].find(search_key);
+  StringHash::const_iterator iter = _dict_data[dict_index].find(search_key);
 
   if (dict_index == HTTP_ACCEPT_LANGUAGE) {
     _debugLog(_debug_tag.c_str(), "[%s] Returning boolean literal for lang variable [%.*s]",
@@ -266,67 +303,58 @@ Variables::getValue(const string &name) const {
     return _getSubCookieValue(search_key, cookie_part_divider);
   }
   
-  _debugLog(_debug_tag.c_str(), "[%s] Found no value for dict variable [%s]", __FUNCTION__, name.c_str());
+  _debugLog(_debug_tag.c_str(), "[%s] Found no value for variable [%.*s] in %s dictionary", __FUNCTION__,
+            search_key.size(), search_key.data(), NORM_SPECIAL_HEADERS[dict_index].c_str());
   return EMPTY_STRING;
 }
 
 const string &
 Variables::_getSubCookieValue(const string &cookie_str, size_t cookie_part_divider) const {
-  if (!_cookie_jar_created) {
-    if (_cookie_str.size()) {
-      Variables &non_const_self = const_cast<Variables &>(*this); // same reasoning as in getValue()
-      // TODO - code was here
-      non_const_self._cookie_jar_created = true;
-    } else {
-      _debugLog(_debug_tag.c_str(), "[%s] Cookie string empty; nothing to construct jar from", __FUNCTION__);
-    }
+  if (!_cookie_str.size()) {
+    _debugLog(_debug_tag.c_str(), "[%s] Cookie string empty; no sub cookies", __FUNCTION__);
+    return EMPTY_STRING;
   }
-  if (_cookie_jar_created) {
-    // we need to do this as we are going to manipulate the 'divider'
-    // character, and we don't need to create a copy of the string for
-    // that; hence this shortcut
-    string &non_const_cookie_str = const_cast<string &>(cookie_str);
-    
-    non_const_cookie_str[cookie_part_divider] = '\0'; // make sure cookie name is NULL terminated
-    const char *cookie_name = non_const_cookie_str.data(); /* above NULL will take effect */
-    const char *part_name = 
-      non_const_cookie_str.c_str() /* NULL terminate the part */ + cookie_part_divider + 1;
-    bool user_name = (part_name[0] == 'u') && (part_name[1] == '\0');
-    if (user_name) {
-      part_name = "l";
-    }
+  const char *cookie_name = cookie_str.data();
+  int cookie_name_len = cookie_part_divider;
+  const char *part_name = cookie_name + cookie_part_divider + 1;
+  int part_name_len = cookie_str.size() - cookie_part_divider - 1;
+  bool user_name = (part_name_len == 1) && (part_name[0] == 'u');
+  if (user_name) {
+    part_name = "l";
+  }
+
+  // both the cookie and its part ('&' separated) are looked up in the raw cookie string
+  const char *cookie_value, *sub_cookie_value;
+  int cookie_value_len, sub_cookie_value_len;
+  if (!Utils::findAttribute(_cookie_str.data(), _cookie_str.size(), cookie_name, cookie_name_len,
+                            cookie_value, cookie_value_len, ";,") ||
+      !Utils::findAttribute(cookie_value, cookie_value_len, part_name, part_name_len,
+                            sub_cookie_value, sub_cookie_value_len, "&")) {
+    _debugLog(_debug_tag.c_str(), "[%s] Could not find value for part [%.*s] of cookie [%.*s]", __FUNCTION__,
+              part_name_len, part_name, cookie_name_len, cookie_name);
+    return EMPTY_STRING;
+  }
+
+  // we need to do this as have to return a string reference
+  string &retval = const_cast<Variables &>(*this)._cached_sub_cookie_value;
+  if (user_name) {
+    char unscrambled_login[256] = "";
     // TODO - code was here
-    const char *sub_cookie_value = NULL;
-    non_const_cookie_str[cookie_part_divider] = ';'; // restore before returning
-    if (!sub_cookie_value) {
-      _debugLog(_debug_tag.c_str(), "[%s] Could not find value for part [%s] of cookie [%.*s]", __FUNCTION__,
-                part_name, cookie_part_divider, cookie_name);
-      return EMPTY_STRING;
-    } else {
-      // we need to do this as have to return a string reference
-      string &retval = const_cast<Variables &>(*this)._cached_sub_cookie_value;
-
-      if (user_name) {
-        char unscrambled_login[256];
-        // TODO - code was here
-        _debugLog(_debug_tag.c_str(), "[%s] Unscrambled login name to [%s]", __FUNCTION__, unscrambled_login);
-        retval.assign(unscrambled_login);
-      } else {
-        _debugLog(_debug_tag.c_str(), "[%s] Got value [%s] for cookie name [%.*s] and part [%s]",
-                  __FUNCTION__, sub_cookie_value, cookie_part_divider, cookie_name, part_name);
-        retval.assign(sub_cookie_value);
-      }
-      return retval;
-    }
+    _debugLog(_debug_tag.c_str(), "[%s] Unscrambled login name to [%s]", __FUNCTION__, unscrambled_login);
+    retval.assign(unscrambled_login);
   } else {
-    _errorLog("[%s] Cookie jar not available; Returning empty string", __FUNCTION__);
-    return EMPTY_STRING;
+    _debugLog(_debug_tag.c_str(), "[%s] Got value [%.*s] for cookie name [%.*s] and part [%.*s]", __FUNCTION__,
+              sub_cookie_value_len, sub_cookie_value, cookie_name_len, cookie_name, part_name_len, part_name);
+    retval.assign(sub_cookie_value, sub_cookie_value_len);
   }
+  return retval;
 }
 
 void
 Variables::clear() {
-  _simple_data.clear();
+  for (int i = 0; i < N_SIMPLE_VARIABLES; ++i) {
+    _simple_values[i].clear();
+  }
   for (int i = 0; i < N_SPECIAL_HEADERS; ++i) {
     _dict_data[i].clear();
     _cached_special_headers[i].clear();
@@ -336,8 +364,10 @@ Variables::clear() {
   }
   _query_string.clear();
   _headers_parsed = _query_string_parsed = false;
+  for (int i = 0; i < N_SPECIAL_HEADERS; ++i) {
+    _dict_parsed[i] = false;
+  }
   _cookie_str.clear();
-  _releaseCookieJar();
 }
 
 void
@@ -381,43 +411,25 @@ Variables::_parseAcceptLangString(const char *str, int str_len) {
 }
 
 bool
-Variables::_parseDictVariable(const std::string &variable, const char *&header, int &header_len,
-                              const char *&attr, int &attr_len) const {
-  const char *var_ptr = variable.data();
-  int var_size = variable.size();
-  if ((var_size <= 4) || (variable[var_size - 1] != '}')) {
+Variables::_parseDictVariable(const char *var_ptr, int var_size, const char *&header, int &header_len,
+                              const char *&attr, int &attr_len) {
+  if ((var_size <= 4) || (var_ptr[var_size - 1] != '}')) {
     return false;
   }
   int paranth_index = -1;
   for (int i = 0; i < (var_size - 1); ++i) {
-    if (variable[i] == '{') {
+    if (var_ptr[i] == '{') {
       if (paranth_index != -1) {
-        _debugLog(_debug_tag.c_str(), "[%s] Cannot have multiple paranthesis in dict variable [%.*s]",
-                  __FUNCTION__, var_size, var_ptr);
-        return false;
+        return false; // multiple paranthesis
       }
       paranth_index = i;
     }
-    if (variable[i] == '}') {
-      _debugLog(_debug_tag.c_str(), "[%s] Cannot have multiple paranthesis in dict variable [%.*s]",
-                __FUNCTION__, var_size, var_ptr);
+    if (var_ptr[i] == '}') {
       return false;
     }
   }
-  if (paranth_index == -1) {
-    _debugLog(_debug_tag.c_str(), "[%s] Could not find opening paranthesis in variable [%.*s]",
-              __FUNCTION__, var_size, var_ptr);
-    return false;
-  }
-  if (paranth_index == 0) {
-    _debugLog(_debug_tag.c_str(), "[%s] Dict variable has no dict name [%.*s]",
-              __FUNCTION__, var_size, var_ptr);
-    return false;
-  }
-  if (paranth_index == (var_size - 2)) {
-    _debugLog(_debug_tag.c_str(), "[%s] Dict variable has no attribute name [%.*s]",
-              __FUNCTION__, var_size, var_ptr);
-    return false;
+  if ((paranth_index == -1) || (paranth_index == 0) || (paranth_index == (var_size - 2))) {
+    return false; // no dict or attribute name
   }
   header = var_ptr;
   header_len = paranth_index;
@@ -425,3 +437,85 @@ Variables::_parseDictVariable(const std::string &variable, const char *&header,
   attr_len = var_size - header_len - 2;
   return true;
 }
+
+void
+Variables::getFingerprint(const VariableDependencies &deps, string &fingerprint) const {
+  uint32_t id_bitmap = deps.getIdBitmap();
+  for (int variable_id = 0; variable_id < N_SIMPLE_VARIABLES; ++variable_id) {
+    if (id_bitmap & (1 << variable_id)) {
+      const string &value = getValue(variable_id, 0, 0);
+      int32_t value_len = value.size(); // length prefixed so that values cannot run into each other
+      fingerprint.append(reinterpret_cast<const char *>(&value_len), sizeof(value_len));
+      fingerprint.append(value);
+    }
+  }
+  const VariableDependencies::DictVariableSet &dict_variables = deps.getDictVariables();
+  for (VariableDependencies::DictVariableSet::const_iterator iter = dict_variables.begin();
+       iter != dict_variables.end(); ++iter) {
+    const string &value = getValue(iter->first, iter->second.data(), iter->second.size());
+    int32_t value_len = value.size();
+    fingerprint.append(reinterpret_cast<const char *>(&value_len), sizeof(value_len));
+    fingerprint.append(value);
+  }
+}
+
+void
+VariableDependencies::add(int variable_id, const char *attr, int attr_len) {
+  if (variable_id == Variables::UNKNOWN_VARIABLE) {
+    return; // always expands to an empty string
+  }
+  _id_bitmap |= (1 << variable_id);
+  if (Variables::isDictVariable(variable_id)) {
+    _dict_variables.insert(DictVariable(variable_id, string(attr, attr_len)));
+  }
+}
+
+void
+VariableDependencies::pack(string &buffer) const {
+  int32_t n_dict_variables = _dict_variables.size();
+  buffer.append(reinterpret_cast<const char *>(&_id_bitmap), sizeof(_id_bitmap));
+  buffer.append(reinterpret_cast<const char *>(&n_dict_variables), sizeof(n_dict_variables));
+  for (DictVariableSet::const_iterator iter = _dict_variables.begin(); iter != _dict_variables.end(); ++iter) {
+    int32_t variable_id = iter->first, attr_len = iter->second.size();
+    buffer.append(reinterpret_cast<const char *>(&variable_id), sizeof(variable_id));
+    buffer.append(reinterpret_cast<const char *>(&attr_len), sizeof(attr_len));
+    buffer.append(iter->second);
+  }
+}
+
+bool
+VariableDependencies::unpack(const char *data, int data_len) {
+  clear();
+  const char *data_end = data + data_len;
+  int32_t n_dict_variables;
+  if (!data || (data_len < static_cast<int>(sizeof(_id_bitmap) + sizeof(n_dict_variables)))) {
+    return false;
+  }
+  memcpy(&_id_bitmap, data, sizeof(_id_bitmap));
+  data += sizeof(_id_bitmap);
+  memcpy(&n_dict_variables, data, sizeof(n_dict_variables));
+  data += sizeof(n_dict_variables);
+  for (int i = 0; i < n_dict_variables; ++i) {
+    int32_t variable_id, attr_len;
+    if ((data_end - data) < static_cast<int>(sizeof(variable_id) + sizeof(attr_len))) {
+      clear();
+      return false;
+    }
+    memcpy(&variable_id, data, sizeof(variable_id));
+    data += sizeof(variable_id);
+    memcpy(&attr_len, data, sizeof(attr_len));
+    data += sizeof(attr_len);
+    if ((attr_len < 0) || (attr_len > (data_end - data)) || !Variables::isDictVariable(variable_id) ||
+        (variable_id > MAX_VARIABLE_ID)) {
+      clear();
+      return false;
+    }
+    _dict_variables.insert(DictVariable(variable_id, string(data, attr_len)));
+    data += attr_len;
+  }
+  if (data != data_end) {
+    clear();
+    return false;
+  }
+  return true;
+}
@@ -26,6 +26,9 @@
 #define _ESI_VARIABLES_H
 
 #include <list>
+#include <set>
+#include <utility>
+#include <stdint.h>
 #include <boost/noncopyable.hpp>
 
 #include <cstring>
@@ -35,15 +38,22 @@
 
 namespace EsiLib {
 
+class VariableDependencies;
+
 class Variables : private ComponentBase, boost::noncopyable {
 
 public:
 
   Variables(const char *debug_tag, ComponentBase::Debug debug_func, ComponentBase::Error error_func)
     : ComponentBase(debug_tag, debug_func, error_func), _headers_parsed(false), _query_string(""),
-      _query_string_parsed(false), _cookie_jar_created(false) { };
+      _query_string_parsed(false) {
+    for (int i = 0; i < N_SPECIAL_HEADERS; ++i) {
+      _dict_parsed[i] = false;
+    }
+  };
   
-  /** currently 'host', 'referer', 'accept-language', 'cookie' and 'user-agent' headers are parsed */
+  /** currently 'host', 'referer', 'accept-language', 'cookie' and 'user-agent' headers are parsed;
+   * parsing is deferred to the first lookup of a variable that needs the header */
   void populate(const HttpHeader &header);
 
   void populate(const HttpHeaderList &headers) {
@@ -67,25 +77,38 @@ public:
 
   /** returns value of specified variable; empty string returned for unknown variable; key
    * has to be prefixed with 'http_' string for all variable names except 'query_string' */
-  const std::string &getValue(const std::string &name) const;
+  const std::string &getValue(const std::string &name) const {
+    return getValue(name.data(), name.size());
+  }
 
   /** convenient alternative for method above */
   const std::string &getValue(const char *name, int name_len = -1) const {
-    if (!name) {
-      return EMPTY_STRING;
-    }
-    std::string var_name;
-    if (name_len == -1) {
-      var_name.assign(name);
-    } else {
-      var_name.assign(name, name_len);
-    }
-    return getValue(var_name);
+    const char *attr;
+    int attr_len;
+    int variable_id = getVariableId(name, name_len, attr, attr_len);
+    return getValue(variable_id, attr, attr_len);
   }
 
+  static const int UNKNOWN_VARIABLE = -1;
+
+  /** resolves given variable name to an id that can be passed to getValue() below
+   * (for any Variables object); attr is set to the attribute of dict variables */
+  static int getVariableId(const char *name, int name_len, const char *&attr, int &attr_len);
+
+  /** returns value of variable with given id and attribute; allocates no memory
+   * once headers have been parsed */
+  const std::string &getValue(int variable_id, const char *attr, int attr_len) const;
+
+  /** appends the values of the variables in deps to fingerprint; a document
+   * depending on deps expands alike for equal fingerprints */
+  void getFingerprint(const VariableDependencies &deps, std::string &fingerprint) const;
+
+  /** returns true if variables with given id are looked up by attribute */
+  static bool isDictVariable(int variable_id) { return (variable_id >= N_SIMPLE_VARIABLES); };
+
   void clear();
 
-  virtual ~Variables() { _releaseCookieJar(); };
+  virtual ~Variables() { };
 
 private:
 
@@ -101,20 +124,36 @@ private:
   enum SpecialHeader { HTTP_ACCEPT_LANGUAGE = 0, HTTP_COOKIE = 1, HTTP_USER_AGENT = 2, QUERY_STRING = 3 };
   static const std::string SPECIAL_HEADERS[];  // indices should map to enum values above
 
-  // normalized versions of the headers above; indices should correspond correctly
-  static const std::string NORM_SIMPLE_HEADERS[];
-  static const std::string NORM_SPECIAL_HEADERS[]; // indices should again map to enum values
+  // normalized versions of the special headers above; indices should again map to enum values
+  static const std::string NORM_SPECIAL_HEADERS[];
 
   static const int N_SIMPLE_HEADERS = HTTP_REFERER + 1;
   static const int N_SPECIAL_HEADERS = QUERY_STRING + 1;
 
-  StringHash _simple_data;
+  // variable ids: simple variables (simple headers and the query string) index
+  // _simple_values; dict variables come after them, in SpecialHeader order
+  static const int QUERY_STRING_VARIABLE = N_SIMPLE_HEADERS;
+  static const int N_SIMPLE_VARIABLES = QUERY_STRING_VARIABLE + 1;
+
+  // perfect hash table over the normalized variable and dictionary names
+  struct VariableName {
+    const char *name;
+    int name_len;
+    int simple_id;
+    int dict_index;
+  };
+  static const int NAME_TABLE_SIZE = 16;
+  static const VariableName NAME_TABLE[NAME_TABLE_SIZE];
+
+  static inline const VariableName *_lookupName(const char *name, int name_len);
+
+  std::string _simple_values[N_SIMPLE_VARIABLES];
   StringHash _dict_data[N_SPECIAL_HEADERS];
+  std::string _search_key; // reused for dict lookups
 
-  inline std::string &_toUpperCase(std::string &str) const;
   inline int _searchHeaders(const std::string headers[], const char *name, int name_len) const;
-  bool _parseDictVariable(const std::string &variable, const char *&header, int &header_len,
-                                 const char *&attr, int &attr_len) const;
+  static bool _parseDictVariable(const char *variable, int var_size, const char *&header, int &header_len,
+                                 const char *&attr, int &attr_len);
   void _parseCookieString(const char *str, int str_len);
   void _parseUserAgentString(const char *str, int str_len);
   void _parseAcceptLangString(const char *str, int str_len);
@@ -122,6 +161,7 @@ private:
   inline void _parseSimpleHeader(SimpleHeader hdr, const char *value, int value_len);
   void _parseSpecialHeader(SpecialHeader hdr, const char *value, int value_len);
   void _parseCachedHeaders();
+  void _parseCachedDictHeaders(SpecialHeader hdr);
 
   inline void _insert(StringHash &hash, const std::string &key, const std::string &value);
 
@@ -130,27 +170,64 @@ private:
   HeaderValueList _cached_special_headers[N_SPECIAL_HEADERS];
   
   std::string _cookie_str;
-  bool _headers_parsed;
+  bool _headers_parsed; // simple headers
+  bool _dict_parsed[N_SPECIAL_HEADERS]; // special headers; the query string is tracked separately
   std::string _query_string;
   bool _query_string_parsed;
 
-  void _parseHeader(const char *name, int name_len, const char *value, int value_len);
   void _parseQueryString(const char *query_string, int query_string_len);
   
-  // TODO - code was here
-  bool _cookie_jar_created;
-
-  inline void _releaseCookieJar() {
-    if (_cookie_jar_created) {
-      _cookie_jar_created = false;
-    }
-  }
-
   std::string _cached_sub_cookie_value;
   const std::string &_getSubCookieValue(const std::string &cookie_str, size_t cookie_part_divider) const;
 
 };
 
+/** set of variables a document refers to: a bitmap of the variable ids used (see
+ * Variables::getVariableId()) and, for dict variables, the attributes looked up */
+class VariableDependencies {
+
+public:
+
+  typedef std::pair<int, std::string> DictVariable; // variable id and attribute
+  typedef std::set<DictVariable> DictVariableSet;
+
+  VariableDependencies() : _id_bitmap(0) { };
+
+  /** attribute is ignored for simple variables */
+  void add(int variable_id, const char *attr, int attr_len);
+
+  /** records that the document may refer to variables not in this set, e.g., from
+   * special include handlers */
+  void setIncomplete() { _id_bitmap |= INCOMPLETE_BIT; };
+
+  bool isComplete() const { return !(_id_bitmap & INCOMPLETE_BIT); };
+
+  uint32_t getIdBitmap() const { return (_id_bitmap & ~INCOMPLETE_BIT); };
+
+  bool dependsOn(int variable_id) const { return (getIdBitmap() & (1 << variable_id)); };
+
+  const DictVariableSet &getDictVariables() const { return _dict_variables; };
+
+  void clear() {
+    _id_bitmap = 0;
+    _dict_variables.clear();
+  };
+
+  void pack(std::string &buffer) const;
+
+  /** replaces current contents with set packed in given data */
+  bool unpack(const char *data, int data_len);
+
+private:
+
+  static const uint32_t INCOMPLETE_BIT = 0x80000000;
+  static const int MAX_VARIABLE_ID = 30; // so that ids map to bits below the one above
+
+  uint32_t _id_bitmap;
+  DictVariableSet _dict_variables;
+
+};
+
 };
 
 #endif // _ESI_VARIABLES_H
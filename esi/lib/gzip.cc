@@ -22,6 +22,9 @@
  */
 
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
 
 #include "gzip.h"
 #include <zlib.h>
@@ -29,10 +32,11 @@
 #include "Utils.h"
 
 using namespace EsiLib;
+
+#define DEBUG_TAG "plugin_esi_gzip"
 using std::string;
 
-static const int COMPRESSION_LEVEL = 6;
-static const int ZLIB_MEM_LEVEL = 8;
+static const int FAST_COMPRESSION_LEVEL = 1;
 
 static const int GZIP_HEADER_SIZE = 10;
 static const int GZIP_TRAILER_SIZE = 8;
@@ -60,72 +64,319 @@ inline void extract(const char *in, T &data) {
   }
 }
 
-inline int runDeflateLoop(z_stream &zstrm, int flush, std::string &cdata) {
-  char buf[BUF_SIZE];
-  int deflate_result = Z_OK;
-  do {
-    zstrm.next_out = reinterpret_cast<Bytef *>(buf);
-    zstrm.avail_out = BUF_SIZE;
-    deflate_result = deflate(&zstrm, flush);
-    if ((deflate_result == Z_OK) || (deflate_result == Z_STREAM_END)) {
-      cdata.append(buf, BUF_SIZE - zstrm.avail_out);
-      if ((deflate_result == Z_STREAM_END) || zstrm.avail_out) {
-        break;
+static GzipParams gParams;
+
+void
+EsiLib::setGzipParams(const GzipParams &params) {
+  GzipParams defaults;
+  gParams = params;
+  if ((gParams.level < Z_NO_COMPRESSION) || (gParams.level > Z_BEST_COMPRESSION)) {
+    Utils::ERROR_LOG("[%s] Invalid compression level %d; using %d", __FUNCTION__, gParams.level,
+                     defaults.level);
+    gParams.level = defaults.level;
+  }
+  if ((gParams.mem_level < 1) || (gParams.mem_level > MAX_MEM_LEVEL)) {
+    Utils::ERROR_LOG("[%s] Invalid memory level %d; using %d", __FUNCTION__, gParams.mem_level,
+                     defaults.mem_level);
+    gParams.mem_level = defaults.mem_level;
+  }
+  if (gParams.fast_mode_min_size < 0) {
+    gParams.fast_mode_min_size = 0;
+  }
+  if (gParams.max_pooled_streams < 0) {
+    gParams.max_pooled_streams = 0;
+  }
+  Utils::DEBUG_LOG(DEBUG_TAG, "[%s] Level %d, memory level %d, fast mode from %d bytes, %d pooled streams per thread",
+                   __FUNCTION__, gParams.level, gParams.mem_level, gParams.fast_mode_min_size,
+                   gParams.max_pooled_streams);
+}
+
+const GzipParams &
+EsiLib::getGzipParams() {
+  return gParams;
+}
+
+namespace {
+
+/** initialized (or reset) deflate streams of a thread; a stream can be
+ * released into another thread's pool than the one it came from */
+class DeflatePool {
+
+public:
+
+  DeflatePool() : n_inits(0), n_reuses(0) { };
+
+  z_stream *acquire(int level, int mem_level) {
+    for (std::vector<Entry>::iterator iter = _entries.begin(); iter != _entries.end(); ++iter) {
+      if ((iter->level == level) && (iter->mem_level == mem_level)) {
+        z_stream *zstrm = iter->zstrm;
+        _entries.erase(iter);
+        ++n_reuses;
+        return zstrm;
       }
+    }
+    z_stream *zstrm = new z_stream;
+    zstrm->zalloc = Z_NULL;
+    zstrm->zfree = Z_NULL;
+    zstrm->opaque = Z_NULL;
+    if (deflateInit2(zstrm, level, Z_DEFLATED, -MAX_WBITS, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+      Utils::ERROR_LOG("[%s] deflateInit2 failed!", __FUNCTION__);
+      delete zstrm;
+      return 0;
+    }
+    ++n_inits;
+    return zstrm;
+  }
+
+  void release(z_stream *zstrm, int level, int mem_level) {
+    if ((static_cast<int>(_entries.size()) < gParams.max_pooled_streams) && (deflateReset(zstrm) == Z_OK)) {
+      _entries.push_back(Entry(zstrm, level, mem_level));
     } else {
+      destroy(zstrm);
+    }
+  }
+
+  ~DeflatePool() {
+    for (std::vector<Entry>::iterator iter = _entries.begin(); iter != _entries.end(); ++iter) {
+      destroy(iter->zstrm);
+    }
+  }
+
+  static void destroy(z_stream *zstrm) {
+    deflateEnd(zstrm);
+    delete zstrm;
+  }
+
+  int n_inits;
+  int n_reuses;
+
+private:
+
+  struct Entry {
+    z_stream *zstrm;
+    int level;
+    int mem_level;
+    Entry(z_stream *z, int l, int m) : zstrm(z), level(l), mem_level(m) { };
+  };
+
+  std::vector<Entry> _entries;
+
+};
+
+pthread_key_t gPoolKey;
+pthread_once_t gPoolKeyOnce = PTHREAD_ONCE_INIT;
+bool gPoolKeyValid = false;
+
+void
+deletePool(void *pool) {
+  delete static_cast<DeflatePool *>(pool);
+}
+
+void
+createPoolKey() {
+  if (pthread_key_create(&gPoolKey, deletePool) == 0) {
+    gPoolKeyValid = true;
+  } else {
+    Utils::ERROR_LOG("[%s] Could not create key; deflate streams will not be pooled", __FUNCTION__);
+  }
+}
+
+DeflatePool *
+getPool() {
+  pthread_once(&gPoolKeyOnce, createPoolKey);
+  if (!gPoolKeyValid) {
+    return 0;
+  }
+  DeflatePool *pool = static_cast<DeflatePool *>(pthread_getspecific(gPoolKey));
+  if (!pool) {
+    pool = new DeflatePool();
+    pthread_setspecific(gPoolKey, pool);
+  }
+  return pool;
+}
+
+}
+
+void
+EsiLib::getGzipPoolStats(int &n_inits, int &n_reuses) {
+  DeflatePool *pool = getPool();
+  n_inits = pool ? pool->n_inits : 0;
+  n_reuses = pool ? pool->n_reuses : 0;
+}
+
+char *
+StringGzipOutput::getWriteSpace(int &avail) {
+  _str.resize(_used + BUF_SIZE);
+  avail = BUF_SIZE;
+  return &_str[_used];
+}
+
+void
+StringGzipOutput::produce(int n_bytes) {
+  _used += n_bytes;
+  _str.resize(_used);
+}
+
+GzipStream::GzipStream(GzipOutput &output)
+  : _output(output), _zstrm(0), _level(gParams.level), _mem_level(gParams.mem_level),
+    _initialized(false), _header_written(false),
+    _finished(false), _total_in(0) {
+  _crc = crc32(0, Z_NULL, 0);
+}
+
+bool
+GzipStream::init(int expected_size /* = -1 */) {
+  if (_initialized) {
+    Utils::ERROR_LOG("[%s] Stream already initialized", __FUNCTION__);
+    return false;
+  }
+  if (gParams.fast_mode_min_size && (expected_size >= gParams.fast_mode_min_size)) {
+    _level = FAST_COMPRESSION_LEVEL;
+  }
+  DeflatePool *pool = getPool();
+  _zstrm = pool ? pool->acquire(_level, _mem_level) : DeflatePool().acquire(_level, _mem_level);
+  if (!_zstrm) {
+    return false;
+  }
+  _initialized = true;
+  return true;
+}
+
+bool
+GzipStream::_write(const char *data, int data_len) {
+  while (data_len > 0) {
+    int avail;
+    char *space = _output.getWriteSpace(avail);
+    if (!space || (avail <= 0)) {
+      Utils::ERROR_LOG("[%s] Output has no space to write to", __FUNCTION__);
+      return false;
+    }
+    int n_bytes = (avail < data_len) ? avail : data_len;
+    memcpy(space, data, n_bytes);
+    _output.produce(n_bytes);
+    data += n_bytes;
+    data_len -= n_bytes;
+  }
+  return true;
+}
+
+bool
+GzipStream::_deflate(int flush, const char *data /* = 0 */, int data_len /* = 0 */) {
+  if (!_initialized || _finished) {
+    Utils::ERROR_LOG("[%s] Stream not initialized or already finished", __FUNCTION__);
+    return false;
+  }
+  if (!_header_written) {
+    char header[GZIP_HEADER_SIZE] = { MAGIC_BYTE_1, MAGIC_BYTE_2, Z_DEFLATED, 0, 0, 0, 0, 0, 0, OS_TYPE };
+    if (!_write(header, GZIP_HEADER_SIZE)) {
+      return false;
+    }
+    _header_written = true;
+  }
+  _zstrm->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  _zstrm->avail_in = data_len;
+  int deflate_result;
+  do {
+    int avail;
+    char *space = _output.getWriteSpace(avail);
+    if (!space || (avail <= 0)) {
+      Utils::ERROR_LOG("[%s] Output has no space to write to", __FUNCTION__);
+      return false;
+    }
+    _zstrm->next_out = reinterpret_cast<Bytef *>(space);
+    _zstrm->avail_out = avail;
+    deflate_result = deflate(_zstrm, flush);
+    _output.produce(avail - _zstrm->avail_out);
+    if (deflate_result == Z_STREAM_END) {
       break;
     }
-  } while (true);
-  return deflate_result;
+    if (deflate_result == Z_BUF_ERROR) { // nothing left to do for a (repeated) flush
+      deflate_result = Z_OK;
+      break;
+    }
+    if (deflate_result != Z_OK) {
+      Utils::ERROR_LOG("[%s] Failure while deflating; error code %d", __FUNCTION__, deflate_result);
+      return false;
+    }
+  } while (!_zstrm->avail_out || ((flush == Z_FINISH) || _zstrm->avail_in));
+  if ((flush == Z_FINISH) && (deflate_result != Z_STREAM_END)) {
+    Utils::ERROR_LOG("[%s] Deflate did not end stream; error code %d", __FUNCTION__, deflate_result);
+    return false;
+  }
+  return true;
 }
 
 bool
-EsiLib::gzip(const ByteBlockList& blocks, std::string &cdata) {
-  cdata.assign(GZIP_HEADER_SIZE, 0); // reserving space for the header
-  z_stream zstrm;
-  zstrm.zalloc = Z_NULL;
-  zstrm.zfree = Z_NULL;
-  zstrm.opaque = Z_NULL;
-  if (deflateInit2(&zstrm, COMPRESSION_LEVEL, Z_DEFLATED, -MAX_WBITS,
-                   ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
-    Utils::ERROR_LOG("[%s] deflateInit2 failed!", __FUNCTION__);
+GzipStream::stream(const char *data, int data_len) {
+  if (!data || (data_len <= 0)) {
+    return true;
+  }
+  if (!_deflate(Z_NO_FLUSH, data, data_len)) {
     return false;
   }
+  _crc = crc32(_crc, reinterpret_cast<const Bytef *>(data), data_len);
+  _total_in += data_len;
+  return true;
+}
 
-  int total_data_len = 0;
-  uLong crc = crc32(0, Z_NULL, 0);
-  int deflate_result = Z_OK;
-  int in_data_size = 0;
+bool
+GzipStream::stream(const ByteBlockList &blocks) {
   for (ByteBlockList::const_iterator iter = blocks.begin(); iter != blocks.end(); ++iter) {
-    if (iter->data && (iter->data_len > 0)) {
-      zstrm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(iter->data));
-      zstrm.avail_in = iter->data_len;
-      in_data_size += iter->data_len;
-      deflate_result = runDeflateLoop(zstrm, 0, cdata);
-      if (deflate_result != Z_OK) {
-        break; // break out of the blocks iteration
-      }
-      crc = crc32(crc, reinterpret_cast<const Bytef *>(iter->data), iter->data_len);
-      total_data_len += iter->data_len;
+    if (!stream(iter->data, iter->data_len)) {
+      return false;
     }
   }
-  if (!in_data_size) {
-      zstrm.avail_in = 0; // required for the "finish" loop as no data has been given so far
+  return true;
+}
+
+bool
+GzipStream::flush() {
+  return _deflate(Z_SYNC_FLUSH);
+}
+
+bool
+GzipStream::finish() {
+  if (!_deflate(Z_FINISH)) {
+    return false;
+  }
+  _finished = true;
+  _releaseStream();
+  string trailer;
+  append(trailer, static_cast<uint32_t>(_crc));
+  append(trailer, _total_in);
+  return _write(trailer.data(), trailer.size());
+}
+
+void
+GzipStream::_releaseStream() {
+  if (_zstrm) {
+    DeflatePool *pool = getPool();
+    if (pool) {
+      pool->release(_zstrm, _level, _mem_level);
+    } else {
+      DeflatePool::destroy(_zstrm);
+    }
+    _zstrm = 0;
   }
-  if (deflate_result == Z_OK) {
-    deflate_result = runDeflateLoop(zstrm, Z_FINISH, cdata);
+}
+
+GzipStream::~GzipStream() {
+  _releaseStream();
+}
+
+bool
+EsiLib::gzip(const ByteBlockList& blocks, std::string &cdata) {
+  cdata.clear();
+  StringGzipOutput output(cdata);
+  GzipStream gzip_stream(output);
+  int data_size = 0;
+  for (ByteBlockList::const_iterator iter = blocks.begin(); iter != blocks.end(); ++iter) {
+    data_size += (iter->data && (iter->data_len > 0)) ? iter->data_len : 0;
   }
-  deflateEnd(&zstrm);
-  if (deflate_result != Z_STREAM_END) {
-    Utils::ERROR_LOG("[%s] Failure while deflating; error code %d", __FUNCTION__, deflate_result);
+  if (!gzip_stream.init(data_size) || !gzip_stream.stream(blocks) || !gzip_stream.finish()) {
+    cdata.clear();
     return false;
   }
-  cdata[0] = MAGIC_BYTE_1;
-  cdata[1] = MAGIC_BYTE_2;
-  cdata[2] = Z_DEFLATED;
-  cdata[9] = OS_TYPE;
-  append(cdata, static_cast<uint32_t>(crc));
-  append(cdata, static_cast<int32_t>(total_data_len));
   return true;
 }
 
@@ -192,7 +443,7 @@ EsiLib::gunzip(const char *data, int data_len, BufferList &buf_list) {
     return false;
   }
   int32_t orig_size;
-  uLong orig_crc;
+  uint32_t orig_crc; // trailer fields are 4 bytes each
   extract(data + data_len, orig_crc);
   extract(data + data_len + 4, orig_size);
   if ((crc != orig_crc) || (unzipped_data_size != orig_size)) {
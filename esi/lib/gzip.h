@@ -25,8 +25,10 @@
 
 #define _GZIP_H 
 
+#include <stdint.h>
 #include <string>
 #include <list>
+#include <zlib.h>
 
 namespace EsiLib {
 
@@ -46,6 +48,107 @@ inline bool gzip(const char *data, int data_len, std::string &cdata) {
   return gzip(blocks, cdata);
 }
 
+/** compression settings for gzip() and GzipStream. zlib streams are
+ * kept in a per-thread pool and reset for reuse instead of being
+ * allocated and initialized for every document */
+struct GzipParams {
+  int level;
+  int mem_level;
+  int fast_mode_min_size; // documents of at least this size are compressed at level 1; 0 disables
+  int max_pooled_streams; // per thread; 0 disables pooling
+  GzipParams() : level(6), mem_level(8), fast_mode_min_size(0), max_pooled_streams(4) { };
+};
+
+/** meant to be called once at startup; invalid values are replaced by defaults */
+void setGzipParams(const GzipParams &params);
+
+const GzipParams &getGzipParams();
+
+/** number of streams the calling thread initialized and reused so far */
+void getGzipPoolStats(int &n_inits, int &n_reuses);
+
+/** destination of a GzipStream; compressed data is written straight
+ * into the space handed out by the implementation */
+class GzipOutput {
+
+public:
+
+  /** returns space for at least one byte and sets avail to its size */
+  virtual char *getWriteSpace(int &avail) = 0;
+
+  /** marks the first n_bytes of the space last handed out as written */
+  virtual void produce(int n_bytes) = 0;
+
+  virtual ~GzipOutput() { };
+
+};
+
+/** GzipOutput that appends to a string */
+class StringGzipOutput : public GzipOutput {
+
+public:
+
+  explicit StringGzipOutput(std::string &str) : _str(str), _used(str.size()) { };
+
+  char *getWriteSpace(int &avail);
+
+  void produce(int n_bytes);
+
+private:
+
+  std::string &_str;
+  size_t _used;
+
+};
+
+/** incremental gzip compression; data is compressed as it is streamed
+ * in and written to the output as soon as deflate hands it out. The
+ * gzip header precedes the first compressed data and finish() writes
+ * the trailer */
+class GzipStream {
+
+public:
+
+  explicit GzipStream(GzipOutput &output);
+
+  /** gets a stream from the pool; expected_size (if known) selects fast mode */
+  bool init(int expected_size = -1);
+
+  bool stream(const char *data, int data_len);
+
+  bool stream(const ByteBlockList &blocks);
+
+  /** writes out everything streamed in so far (at some cost in
+   * compression) so that the receiver can decompress it right away */
+  bool flush();
+
+  /** completes the gzip stream; no data can be streamed in afterwards */
+  bool finish();
+
+  int getTotalIn() const { return _total_in; };
+
+  ~GzipStream();
+
+private:
+
+  GzipOutput &_output;
+  z_stream *_zstrm;
+  int _level;
+  int _mem_level;
+  bool _initialized;
+  bool _header_written;
+  bool _finished;
+  uLong _crc;
+  int32_t _total_in;
+
+  bool _deflate(int flush, const char *data = 0, int data_len = 0);
+
+  void _releaseStream();
+
+  bool _write(const char *data, int data_len);
+
+};
+
 typedef std::list<std::string> BufferList;
 
 bool gunzip(const char *data, int data_len, BufferList &buf_list);
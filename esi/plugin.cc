@@ -40,12 +40,19 @@
 #include "gzip.h"
 #include "HttpDataFetcherImpl.h"
 #include "FailureInfo.h"
+#include "TemplateCache.h"
+#include "OutputCache.h"
 using std::string;
 using std::list;
 using namespace EsiLib;
 using namespace Stats;
 
 static HandlerManager *gHandlerManager;
+static bool gStreamOutput = false; // hand out processed output as soon as leading nodes are ready
+static size_t gTemplateCacheSize = 0; // per thread; 0 disables the template cache
+static pthread_key_t gTemplateCacheKey;
+static size_t gOutputCacheSize = 0; // per thread; 0 disables the output cache
+static pthread_key_t gOutputCacheKey;
 
 #define DEBUG_TAG "plugin_esi"
 #define PROCESSOR_DEBUG_TAG "plugin_esi_processor"
@@ -53,6 +60,9 @@ static HandlerManager *gHandlerManager;
 #define FETCHER_DEBUG_TAG "plugin_esi_fetcher"
 #define VARS_DEBUG_TAG "plugin_esi_vars"
 #define HANDLER_MGR_DEBUG_TAG "plugin_esi_handler_mgr"
+#define TEMPLATE_CACHE_DEBUG_TAG "plugin_esi_template_cache"
+#define OUTPUT_CACHE_DEBUG_TAG "plugin_esi_output_cache"
+#define FAILURE_INFO_DEBUG_TAG "plugin_esi_failureInfo"
 #define EXPR_DEBUG_TAG VARS_DEBUG_TAG
 
 #define MIME_FIELD_XESI "X-Esi"
@@ -66,6 +76,26 @@ static const char *DATA_TYPE_NAMES_[] = { "RAW_ESI",
 static const char *HEADER_MASK_PREFIX = "Mask-";
 static const int HEADER_MASK_PREFIX_SIZE = 5;
 
+struct ContData;
+
+/** compresses output straight into the blocks of the transformation's
+ * output buffer */
+class IOBufferGzipOutput : public GzipOutput {
+
+public:
+
+  explicit IOBufferGzipOutput(ContData *cont_data) : _cont_data(cont_data) { };
+
+  char *getWriteSpace(int &avail);
+
+  void produce(int n_bytes);
+
+private:
+
+  ContData *_cont_data;
+
+};
+
 struct ContData
 {
   enum STATE { READING_ESI_DOC, FETCHING_DATA, PROCESSING_COMPLETE };
@@ -90,17 +120,32 @@ struct ContData
   list<string> post_headers;
   TSHttpTxn txnp;
   bool gzip_output;
+  IOBufferGzipOutput *gzip_sink;
+  GzipStream *gzip_stream; // created with the first gzipped output
   string gzipped_data;
   sockaddr const* client_addr;
   bool got_server_state;
+  bool stream_output;
+  TSHRTime start_time;
+  bool first_byte_sent;
+  int64_t n_output_bytes;
+  bool use_template_cache;
+  string template_data;
+  string template_validator;
+  string template_id; // identifies the template for the output cache
+  bool use_output_cache;
+  bool output_cache_checked;
+  string output_identity;
   
   ContData(TSCont contptr, TSHttpTxn tx)
     : curr_state(READING_ESI_DOC), input_vio(NULL), output_vio(NULL), output_buffer(NULL), output_reader(NULL),
       esi_vars(NULL), data_fetcher(NULL), esi_proc(NULL), initialized(false),
       xform_closed(false), contp(contptr), input_type(DATA_TYPE_RAW_ESI),
       packed_node_list(""), request_url(NULL), os_response_cacheable(true), txnp(tx), gzip_output(false),
-      gzipped_data(""), got_server_state(false) {
+      gzip_sink(NULL), gzip_stream(NULL), gzipped_data(""), got_server_state(false), stream_output(false), first_byte_sent(false),
+      n_output_bytes(0), use_template_cache(false), use_output_cache(false), output_cache_checked(false) {
     client_addr = TSHttpTxnClientAddrGet(txnp);
+    start_time = TShrtime();
   }
   
   void getClientState();
@@ -212,6 +257,16 @@ ContData::init()
     TSDebug(debug_tag.c_str(), "[%s] Set input data type to [%s]", __FUNCTION__,
              DATA_TYPE_NAMES_[input_type]);
 
+    stream_output = gStreamOutput;
+    if (stream_output) {
+      TSDebug(debug_tag.c_str(), "[%s] Will stream output", __FUNCTION__);
+      Stats::increment(Stats::N_STREAMED_DOCS);
+    }
+    // output is cached once it is complete
+    use_output_cache = (gOutputCacheSize > 0) && !stream_output;
+    // template has to be seen in full before it can be looked up (or identified for the output cache)
+    use_template_cache = ((gTemplateCacheSize > 0) || use_output_cache) && (input_type != DATA_TYPE_PACKED_ESI);
+
     retval = true;
   } else {
     TSDebug(debug_tag.c_str(), "[%s] Transformation closed during initialization; Returning false",
@@ -369,6 +424,12 @@ ContData::getServerState() {
                 header.append(", ");
               }
               header.append(value, value_len);
+              if (Utils::areEqual(act_name, act_name_len, TS_MIME_FIELD_ETAG, TS_MIME_LEN_ETAG) ||
+                  Utils::areEqual(act_name, act_name_len, TS_MIME_FIELD_LAST_MODIFIED,
+                                  TS_MIME_LEN_LAST_MODIFIED)) {
+                template_validator.append(value, value_len);
+                template_validator += '\n';
+              }
               checkForCacheHeader(act_name, act_name_len, value, value_len,
                                   os_response_cacheable);
               if (!os_response_cacheable) {
@@ -415,6 +476,12 @@ ContData::~ContData()
   if (esi_proc) {
     delete esi_proc;
   }
+  if (gzip_stream) {
+    delete gzip_stream;
+  }
+  if (gzip_sink) {
+    delete gzip_sink;
+  }
 }
 
 static void
@@ -453,6 +520,234 @@ cacheNodeList(ContData *cont_data) {
                   cont_data->contp, NO_CALLBACK, event_ids);
 }
 
+static TemplateCache *
+getTemplateCache() {
+  TemplateCache *cache = static_cast<TemplateCache *>(pthread_getspecific(gTemplateCacheKey));
+  if (!cache) {
+    cache = new TemplateCache(TEMPLATE_CACHE_DEBUG_TAG, &TSDebug, &TSError, gTemplateCacheSize);
+    if (pthread_setspecific(gTemplateCacheKey, cache)) {
+      TSError("[%s] Unable to set template cache for thread", __FUNCTION__);
+      delete cache;
+      return 0;
+    }
+  }
+  return cache;
+}
+
+static void
+deleteTemplateCache(void *cache) {
+  delete static_cast<TemplateCache *>(cache);
+}
+
+static void
+setTemplateId(ContData *cont_data, uint64_t key, int32_t template_len) {
+  cont_data->template_id.assign(reinterpret_cast<const char *>(&key), sizeof(key));
+  cont_data->template_id.append(reinterpret_cast<const char *>(&template_len), sizeof(template_len));
+}
+
+/** hands the processor the node list of the complete template in
+ * template_data; templates seen before on this thread are not parsed
+ * again. Returns false if the template could not be used */
+static bool
+useTemplateCache(ContData *cont_data) {
+  const string &data = cont_data->template_data;
+  uint64_t key = TemplateCache::hash(data.data(), data.size());
+  key = TemplateCache::hash(cont_data->template_validator.data(), cont_data->template_validator.size(), key);
+  setTemplateId(cont_data, key, data.size());
+  TemplateCache *cache = (gTemplateCacheSize ? getTemplateCache() : 0);
+  if (!cache) {
+    return cont_data->esi_proc->completeParse(data);
+  }
+  if (!cache->lookup(key, data.size(), cont_data->template_validator, cont_data->packed_node_list)) {
+    EsiParser parser(cont_data->debug_tag.c_str(), &TSDebug, &TSError);
+    DocNodeList node_list;
+    if (!parser.parse(node_list, data)) {
+      // regular path will report the error
+      return cont_data->esi_proc->completeParse(data);
+    }
+    FlatDocNodeList flat_list;
+    flat_list.append(node_list);
+    flat_list.pack(cont_data->packed_node_list, false, FlatDocNodeList::PACK_VERSION_2);
+    cache->insert(key, data.size(), cont_data->template_validator, cont_data->packed_node_list);
+  }
+  return cont_data->esi_proc->usePackedNodeList(cont_data->packed_node_list);
+}
+
+static OutputCache *
+getOutputCache() {
+  OutputCache *cache = static_cast<OutputCache *>(pthread_getspecific(gOutputCacheKey));
+  if (!cache) {
+    cache = new OutputCache(OUTPUT_CACHE_DEBUG_TAG, &TSDebug, &TSError, gOutputCacheSize);
+    if (pthread_setspecific(gOutputCacheKey, cache)) {
+      TSError("[%s] Unable to set output cache for thread", __FUNCTION__);
+      delete cache;
+      return 0;
+    }
+  }
+  return cache;
+}
+
+static void
+deleteOutputCache(void *cache) {
+  delete static_cast<OutputCache *>(cache);
+}
+
+/** builds the output cache identity of the document out of the template's
+ * identity, the output encoding and the values of the variables the template
+ * depends on; returns false if output cannot be cached */
+static bool
+getOutputIdentity(ContData *cont_data, string &identity) {
+  if (cont_data->template_id.empty()) {
+    return false;
+  }
+  VariableDependencies deps;
+  cont_data->esi_proc->getDependencies(deps);
+  if (!deps.isComplete()) {
+    TSDebug(cont_data->debug_tag.c_str(), "[%s] Document depends on unknown variables", __FUNCTION__);
+    return false;
+  }
+  identity.assign(cont_data->template_id);
+  identity += (cont_data->gzip_output ? 'z' : 'p');
+  cont_data->esi_vars->getFingerprint(deps, identity);
+  return true;
+}
+
+/** looks up the output cache once all includes fetched so far are in; on
+ * hit, out_data points to the cached (and possibly gzipped) document */
+static bool
+lookupOutputCache(ContData *cont_data, const char *&out_data, int &out_data_len) {
+  if (!cont_data->use_output_cache || cont_data->output_cache_checked) {
+    return false;
+  }
+  cont_data->output_cache_checked = true;
+  OutputCache *cache = getOutputCache();
+  string include_versions;
+  if (!cache || !getOutputIdentity(cont_data, cont_data->output_identity) ||
+      !cont_data->data_fetcher->getResponseVersions(include_versions)) {
+    TSDebug(cont_data->debug_tag.c_str(), "[%s] Output of document cannot be cached", __FUNCTION__);
+    cont_data->use_output_cache = false;
+    return false;
+  }
+  return cache->lookup(cont_data->output_identity, include_versions, out_data, out_data_len);
+}
+
+static void
+insertOutputCache(ContData *cont_data, const ByteBlockList &out_blocks) {
+  OutputCache *cache = getOutputCache();
+  string include_versions; // processing may have triggered further fetches
+  if (cache && cont_data->data_fetcher->getResponseVersions(include_versions)) {
+    cache->insert(cont_data->output_identity, include_versions, out_blocks);
+  }
+}
+
+static void
+markOutput(ContData *cont_data, int out_data_len) {
+  if (!cont_data->first_byte_sent) {
+    cont_data->first_byte_sent = true;
+    int ttfb_ms = static_cast<int>((TShrtime() - cont_data->start_time) / TS_HRTIME_MSECOND(1));
+    TSDebug((cont_data->debug_tag).c_str(), "[%s] Time to first byte: %d ms (%s output)", __FUNCTION__,
+             ttfb_ms, cont_data->stream_output ? "streamed" : "buffered");
+    Stats::increment(Stats::N_TTFB_DOCS);
+    Stats::increment(Stats::TOTAL_TTFB_MS, ttfb_ms);
+  }
+  cont_data->n_output_bytes += out_data_len;
+}
+
+static bool
+writeOutput(ContData *cont_data, const char *out_data, int out_data_len) {
+  if (TSIOBufferWrite(TSVIOBufferGet(cont_data->output_vio), out_data, out_data_len) == TS_ERROR) {
+    TSError("[%s] Error while writing bytes to downstream VC", __FUNCTION__);
+    return false;
+  }
+  markOutput(cont_data, out_data_len);
+  return true;
+}
+
+char *
+IOBufferGzipOutput::getWriteSpace(int &avail) {
+  TSIOBufferBlock block = TSIOBufferStart(TSVIOBufferGet(_cont_data->output_vio));
+  int64_t block_avail = 0;
+  char *space = block ? TSIOBufferBlockWriteStart(block, &block_avail) : NULL;
+  avail = static_cast<int>(block_avail);
+  return space;
+}
+
+void
+IOBufferGzipOutput::produce(int n_bytes) {
+  if (n_bytes > 0) {
+    TSIOBufferProduce(TSVIOBufferGet(_cont_data->output_vio), n_bytes);
+    markOutput(_cont_data, n_bytes);
+  }
+}
+
+/** compresses given data into the output buffer; the gzip stream is
+ * flushed (so that the client can decompress what it got so far) or
+ * finished as requested */
+static bool
+writeGzippedOutput(ContData *cont_data, const ByteBlockList &out_blocks, bool finish) {
+  if (!cont_data->gzip_stream) {
+    // size is known (and can select fast mode) if the document is compressed in one go
+    int expected_size = -1;
+    if (finish) {
+      expected_size = 0;
+      for (ByteBlockList::const_iterator iter = out_blocks.begin(); iter != out_blocks.end(); ++iter) {
+        expected_size += iter->data_len;
+      }
+    }
+    cont_data->gzip_sink = new IOBufferGzipOutput(cont_data);
+    cont_data->gzip_stream = new GzipStream(*cont_data->gzip_sink);
+    if (!cont_data->gzip_stream->init(expected_size)) {
+      TSError("[%s] Could not initialize gzip stream", __FUNCTION__);
+      return false;
+    }
+  }
+  GzipStream *gzip_stream = cont_data->gzip_stream;
+  if (!gzip_stream->stream(out_blocks) || !(finish ? gzip_stream->finish() : gzip_stream->flush())) {
+    TSError("[%s] Error while gzipping content", __FUNCTION__);
+    return false;
+  }
+  return true;
+}
+
+/** writes out whatever the processor can output so far; output is
+ * marked complete once the whole document is out */
+static int
+flushOutput(ContData *cont_data) {
+  const char *out_data;
+  int out_data_len;
+  EsiProcessor::ReturnCode retval = cont_data->esi_proc->flush(out_data, out_data_len);
+  bool output_complete = ((retval != EsiProcessor::NEED_MORE_DATA) &&
+                          (cont_data->curr_state == ContData::FETCHING_DATA));
+  if (output_complete) {
+    cont_data->curr_state = ContData::PROCESSING_COMPLETE;
+    if (retval == EsiProcessor::SUCCESS) {
+      TSDebug((cont_data->debug_tag).c_str(), "[%s] ESI processor streamed document of size %d",
+               __FUNCTION__, static_cast<int>(cont_data->n_output_bytes + out_data_len));
+    } else {
+      TSError("[%s] ESI processor failed to process document; ending output after %d bytes", __FUNCTION__,
+               static_cast<int>(cont_data->n_output_bytes));
+      out_data_len = 0;
+    }
+  }
+  if (cont_data->xform_closed || (!out_data_len && !output_complete)) {
+    return 1;
+  }
+  if (cont_data->gzip_output) {
+    ByteBlockList out_blocks;
+    out_blocks.push_back(ByteBlock(out_data, out_data_len));
+    if (!writeGzippedOutput(cont_data, out_blocks, output_complete)) {
+      return 0;
+    }
+  } else if (out_data_len && !writeOutput(cont_data, out_data, out_data_len)) {
+    return 0;
+  }
+  if (output_complete) {
+    TSVIONBytesSet(cont_data->output_vio, cont_data->n_output_bytes);
+  }
+  TSVIOReenable(cont_data->output_vio);
+  return 1;
+}
+
 static int
 transformData(TSCont contp)
 {
@@ -476,7 +771,7 @@ transformData(TSCont contp)
                __FUNCTION__);
       process_input_complete = true;
     } else {
-      if (!cont_data->data_fetcher->isFetchComplete()) {
+      if (!cont_data->data_fetcher->isFetchComplete() && !cont_data->esi_proc->canProcess()) {
         TSDebug((cont_data->debug_tag).c_str(),
                  "[%s] input_vio NULL, but data needs to be fetched. Returning control", __FUNCTION__);
         return 1;
@@ -508,7 +803,9 @@ transformData(TSCont contp)
         // Now start extraction
         while (block != NULL) {
           data = TSIOBufferBlockReadStart(block, cont_data->input_reader, &data_len);
-          if (cont_data->input_type == DATA_TYPE_RAW_ESI) { 
+          if (cont_data->use_template_cache && (cont_data->input_type == DATA_TYPE_RAW_ESI)) {
+            cont_data->template_data.append(data, data_len);
+          } else if (cont_data->input_type == DATA_TYPE_RAW_ESI) { 
             cont_data->esi_proc->addParseData(data, data_len);
           } else if (cont_data->input_type == DATA_TYPE_GZIPPED_ESI) {
             cont_data->gzipped_data.append(data, data_len);
@@ -537,6 +834,11 @@ transformData(TSCont contp)
       // Modify the input VIO to reflect how much data we've completed.
       TSVIONDoneSet(cont_data->input_vio, TSVIONDoneGet(cont_data->input_vio) + consumed);
 
+      if (cont_data->stream_output && (cont_data->input_type == DATA_TYPE_RAW_ESI) &&
+          !cont_data->use_template_cache) {
+        flushOutput(cont_data);
+      }
+
       toread = TSVIONTodoGet(cont_data->input_vio); // set this for the test after this if block
     }
     
@@ -553,19 +855,28 @@ transformData(TSCont contp)
     if (cont_data->input_type == DATA_TYPE_PACKED_ESI) { 
       TSDebug(DEBUG_TAG, "[%s] Going to use packed node list of size %d",
                __FUNCTION__, (int) cont_data->packed_node_list.size());
-      cont_data->esi_proc->usePackedNodeList(cont_data->packed_node_list);
+      if (cont_data->esi_proc->usePackedNodeList(cont_data->packed_node_list) && cont_data->use_output_cache) {
+        const string &data = cont_data->packed_node_list;
+        setTemplateId(cont_data, TemplateCache::hash(data.data(), data.size()), data.size());
+      }
     } else {
       if (cont_data->input_type == DATA_TYPE_GZIPPED_ESI) {
         BufferList buf_list;
         if (gunzip(cont_data->gzipped_data.data(), cont_data->gzipped_data.size(), buf_list)) {
           for (BufferList::iterator iter = buf_list.begin(); iter != buf_list.end(); ++iter) {
-            cont_data->esi_proc->addParseData(iter->data(), iter->size());
+            if (cont_data->use_template_cache) {
+              cont_data->template_data.append(iter->data(), iter->size());
+            } else {
+              cont_data->esi_proc->addParseData(iter->data(), iter->size());
+            }
           }
         } else {
           TSError("[%s] Error while gunzipping data", __FUNCTION__);
         }
       }
-      if (cont_data->esi_proc->completeParse()) {
+      bool parse_complete = (cont_data->use_template_cache ? useTemplateCache(cont_data) :
+                             cont_data->esi_proc->completeParse());
+      if (parse_complete) {
         if (cont_data->os_response_cacheable) {
           cacheNodeList(cont_data);
         }
@@ -579,11 +890,24 @@ transformData(TSCont contp)
   }
 
   if (cont_data->curr_state == ContData::FETCHING_DATA) { // retest as state may have changed in previous block
-    if (cont_data->data_fetcher->isFetchComplete()) {
+    if (cont_data->stream_output) {
+      return flushOutput(cont_data);
+    }
+    // swapped attempt sections don't hold up processing
+    if (cont_data->data_fetcher->isFetchComplete() || cont_data->esi_proc->canProcess()) {
       TSDebug((cont_data->debug_tag).c_str(), "[%s] data ready; going to process doc", __FUNCTION__);
-      const char *out_data;
-      int out_data_len;
-      EsiProcessor::ReturnCode retval = cont_data->esi_proc->process(out_data, out_data_len);
+      // output is written out block by block as it lies in template and fetched data
+      ByteBlockList out_blocks;
+      const char *cached_data;
+      int cached_data_len;
+      bool cached_output = lookupOutputCache(cont_data, cached_data, cached_data_len);
+      EsiProcessor::ReturnCode retval;
+      if (cached_output) {
+        out_blocks.push_back(ByteBlock(cached_data, cached_data_len));
+        retval = EsiProcessor::SUCCESS;
+      } else {
+        retval = cont_data->esi_proc->process(out_blocks);
+      }
       if (retval == EsiProcessor::NEED_MORE_DATA) {
         TSDebug((cont_data->debug_tag).c_str(), "[%s] ESI processor needs more data; "
                  "will wait for all data to be fetched", __FUNCTION__);
@@ -591,37 +915,58 @@ transformData(TSCont contp)
       }
       cont_data->curr_state = ContData::PROCESSING_COMPLETE;
       if (retval == EsiProcessor::SUCCESS) {
-        TSDebug((cont_data->debug_tag).c_str(),
-                 "[%s] ESI processor output document of size %d starting with [%.10s]", 
-                 __FUNCTION__, out_data_len, (out_data_len ? out_data : "(null)"));
+        TSDebug((cont_data->debug_tag).c_str(), "[%s] ESI processor output document in %d block(s)",
+                 __FUNCTION__, static_cast<int>(out_blocks.size()));
       } else {
         TSError("[%s] ESI processor failed to process document; will return empty document", __FUNCTION__);
-        out_data = "";
-        out_data_len = 0;
+        out_blocks.clear();
       }
 
       // make sure transformation has not been prematurely terminated 
       if (!cont_data->xform_closed) {
         string cdata;
-        if (cont_data->gzip_output) {
-          if (!gzip(out_data, out_data_len, cdata)) {
+        bool output_valid = (retval == EsiProcessor::SUCCESS);
+        bool output_written = false;
+        if (cached_output) {
+          TSDebug((cont_data->debug_tag).c_str(), "[%s] Using cached output of size %d", __FUNCTION__,
+                   cached_data_len);
+        } else if (cont_data->gzip_output && !(cont_data->use_output_cache && output_valid)) {
+          // no need to hold on to the compressed document; it goes straight into the output buffer
+          if (!writeGzippedOutput(cont_data, out_blocks, true)) {
+            output_valid = false;
+          } else {
+            TSDebug((cont_data->debug_tag).c_str(), "[%s] Compressed document of %d bytes to %d bytes",
+                     __FUNCTION__, cont_data->gzip_stream->getTotalIn(),
+                     static_cast<int>(cont_data->n_output_bytes));
+          }
+          out_blocks.clear();
+          output_written = true;
+        } else if (cont_data->gzip_output) {
+          if (!gzip(out_blocks, cdata)) {
             TSError("[%s] Error while gzipping content", __FUNCTION__);
-            out_data_len = 0;
-            out_data = "";
+            cdata.clear();
+            output_valid = false;
           } else {
-            TSDebug((cont_data->debug_tag).c_str(), "[%s] Compressed document from size %d to %d bytes",
-                     __FUNCTION__, out_data_len, (int) cdata.size());
-            out_data_len = cdata.size();
-            out_data = cdata.data();
+            TSDebug((cont_data->debug_tag).c_str(), "[%s] Compressed document to %d bytes",
+                     __FUNCTION__, (int) cdata.size());
           }
+          out_blocks.clear();
+          out_blocks.push_back(ByteBlock(cdata.data(), cdata.size()));
+        }
+        if (cont_data->use_output_cache && !cached_output && output_valid) {
+          insertOutputCache(cont_data, out_blocks);
         }
 
-        if (TSIOBufferWrite(TSVIOBufferGet(cont_data->output_vio), out_data, out_data_len) == TS_ERROR) {
-          TSError("[%s] Error while writing bytes to downstream VC", __FUNCTION__);
-          return 0;
+        if (out_blocks.empty() && !output_written) {
+          out_blocks.push_back(ByteBlock("", 0)); // an empty document still gets its first byte
+        }
+        for (ByteBlockList::iterator iter = out_blocks.begin(); iter != out_blocks.end(); ++iter) {
+          if (!writeOutput(cont_data, iter->data, iter->data_len)) {
+            return 0;
+          }
         }
         
-        TSVIONBytesSet(cont_data->output_vio, out_data_len);
+        TSVIONBytesSet(cont_data->output_vio, cont_data->n_output_bytes);
         
         // Reenable the output connection so it can read the data we've produced.
         TSVIOReenable(cont_data->output_vio);
@@ -660,14 +1005,20 @@ transformHandler(TSCont contp, TSEvent event, void *edata)
 
   cont_data->checkXformStatus();
 
-  is_fetch_event = cont_data->data_fetcher->isFetchEvent(event);
+  is_fetch_event = cont_data->data_fetcher->isFetchEvent(event, edata);
 
   if (cont_data->xform_closed) {
     TSDebug(cont_debug_tag, "[%s] Transformation closed. Post-processing...", __FUNCTION__);
     if (cont_data->curr_state == ContData::PROCESSING_COMPLETE) {
-      TSDebug(cont_debug_tag, "[%s] Processing is complete, not processing current event %d",
-               __FUNCTION__, event);
-      process_event = false;
+      if (is_fetch_event && (!cont_data->data_fetcher->isFetchComplete() ||
+                             cont_data->data_fetcher->hasFetchesInFlight())) {
+        TSDebug(cont_debug_tag, "[%s] Processing is complete; handing late fetch event %d to fetcher",
+                 __FUNCTION__, event);
+      } else {
+        TSDebug(cont_debug_tag, "[%s] Processing is complete, not processing current event %d",
+                 __FUNCTION__, event);
+        process_event = false;
+      }
     } else if (cont_data->curr_state == ContData::READING_ESI_DOC) {
       TSDebug(cont_debug_tag, "[%s] Parsing is incomplete, will force end of input",
                __FUNCTION__);
@@ -679,7 +1030,8 @@ transformHandler(TSCont contp, TSEvent event, void *edata)
                  "[%s] Requested data has been fetched; will skip event and marking processing as complete ",
                  __FUNCTION__);
         cont_data->curr_state = ContData::PROCESSING_COMPLETE;
-        process_event = false;
+        // late responses to timed out requests still need to be dropped
+        process_event = (is_fetch_event && cont_data->data_fetcher->hasFetchesInFlight());
       } else {
         if (is_fetch_event) {
           TSDebug(cont_debug_tag, "[%s] Going to process received data",
@@ -711,29 +1063,43 @@ transformHandler(TSCont contp, TSEvent event, void *edata)
       transformData(contp);
       break;
       
+    case TS_EVENT_VCONN_WRITE_READY:
+      if (cont_data->curr_state != ContData::PROCESSING_COMPLETE) {
+        // streamed output still being produced
+        TSDebug(cont_debug_tag, "[%s] downstream ready for more output", __FUNCTION__);
+        break;
+      }
+      // fall through; we are done writing to downstream VC
     case TS_EVENT_VCONN_WRITE_COMPLETE:
-    case TS_EVENT_VCONN_WRITE_READY:     // we write only once to downstream VC
       TSDebug(cont_debug_tag, "[%s] shutting down transformation", __FUNCTION__);
       TSVConnShutdown(TSTransformOutputVConnGet(contp), 0, 1);
       break;
       
     case TS_EVENT_IMMEDIATE:
-      TSDebug(cont_debug_tag, "[%s] handling TS_EVENT_IMMEDIATE...", __FUNCTION__);
-      transformData(contp);
-      break;
+      if (!is_fetch_event) {
+        TSDebug(cont_debug_tag, "[%s] handling TS_EVENT_IMMEDIATE...", __FUNCTION__);
+        transformData(contp);
+        break;
+      }
+      // fall through; fetcher scheduled us to hand over a shared response
 
     default:
       if (is_fetch_event) {
         TSDebug(cont_debug_tag, "[%s] Handling fetch event %d...", __FUNCTION__, event);
         if (cont_data->data_fetcher->handleFetchEvent(event, edata)) {
           if ((cont_data->curr_state == ContData::FETCHING_DATA) &&
-              cont_data->data_fetcher->isFetchComplete()) {
+              (cont_data->stream_output || cont_data->data_fetcher->isFetchComplete() ||
+               cont_data->esi_proc->canProcess())) {
             // there's a small chance that fetcher is ready even before
-            // parsing is complete; hence we need to check the state too
+            // parsing is complete; hence we need to check the state too.
+            // when streaming, every fetched include may let more output out
             TSDebug(cont_debug_tag, "[%s] fetcher is ready with data, going into process stage",
                      __FUNCTION__);
             transformData(contp);
-          } 
+          } else if (cont_data->curr_state == ContData::PROCESSING_COMPLETE) {
+            // output went out without waiting for this one
+            cont_data->esi_proc->registerDeferredAttempts();
+          }
         } else {
           TSError("[%s] Could not handle fetch event!", __FUNCTION__);
         }
@@ -744,7 +1110,10 @@ transformHandler(TSCont contp, TSEvent event, void *edata)
     }
   }
 
-  shutdown = (cont_data->xform_closed && (cont_data->curr_state == ContData::PROCESSING_COMPLETE));
+  // fetches of swapped attempt sections or of timed out requests may
+  // still be running; the continuation has to outlive them
+  shutdown = (cont_data->xform_closed && (cont_data->curr_state == ContData::PROCESSING_COMPLETE) &&
+              cont_data->data_fetcher->isFetchComplete() && !cont_data->data_fetcher->hasFetchesInFlight());
 
   if (shutdown) {
     if (process_event && is_fetch_event) {
@@ -1169,7 +1538,6 @@ lFail:
   return false;
 } 
 
-pthread_key_t threadKey;
 static int
 globalHookHandler(TSCont contp, TSEvent event, void *edata) {
   TSHttpTxn txnp = (TSHttpTxn) edata;
@@ -1268,10 +1636,105 @@ TSPluginInit(int argc, const char *argv[]) {
     loadHandlerConf(argv[1], handler_conf);
     gHandlerManager->loadObjects(handler_conf);
   }
+  GzipParams gzip_params;
+  int max_doc_fetches = 0, max_process_fetches = 0;
+  int include_timeout = 0, page_deadline = 0;
+  int failure_cache_size = FailureRegistry::DEFAULT_MAX_ENTRIES;
+  CircuitBreakerParams breaker_params;
+  int attempt_deadline = 0, attempt_deadline_percentile = 90;
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "--stream-output") == 0) {
+      TSDebug(DEBUG_TAG, "[%s] Will stream output (gzipped output is compressed as it is streamed)",
+               __FUNCTION__);
+      gStreamOutput = true;
+    } else if (strncmp(argv[i], "--template-cache-size=", 22) == 0) {
+      gTemplateCacheSize = strtoul(argv[i] + 22, NULL, 10);
+      TSDebug(DEBUG_TAG, "[%s] Will cache parsed templates up to %d bytes per thread", __FUNCTION__,
+               static_cast<int>(gTemplateCacheSize));
+    } else if (strncmp(argv[i], "--output-cache-size=", 20) == 0) {
+      gOutputCacheSize = strtoul(argv[i] + 20, NULL, 10);
+      TSDebug(DEBUG_TAG, "[%s] Will cache processed output up to %d bytes per thread", __FUNCTION__,
+               static_cast<int>(gOutputCacheSize));
+    } else if (strncmp(argv[i], "--gzip-level=", 13) == 0) {
+      gzip_params.level = atoi(argv[i] + 13);
+    } else if (strncmp(argv[i], "--gzip-mem-level=", 17) == 0) {
+      gzip_params.mem_level = atoi(argv[i] + 17);
+    } else if (strncmp(argv[i], "--gzip-fast-mode-size=", 22) == 0) {
+      gzip_params.fast_mode_min_size = atoi(argv[i] + 22);
+    } else if (strncmp(argv[i], "--gzip-pool-size=", 17) == 0) {
+      gzip_params.max_pooled_streams = atoi(argv[i] + 17);
+    } else if (strncmp(argv[i], "--fragment-cache-size=", 22) == 0) {
+      size_t fragment_cache_size = strtoul(argv[i] + 22, NULL, 10);
+      TSDebug(DEBUG_TAG, "[%s] Will cache fetched includes up to %d bytes", __FUNCTION__,
+               static_cast<int>(fragment_cache_size));
+      HttpDataFetcherImpl::setFragmentCacheSize(fragment_cache_size);
+    } else if (strncmp(argv[i], "--failure-cache-size=", 21) == 0) {
+      failure_cache_size = atoi(argv[i] + 21);
+      TSDebug(DEBUG_TAG, "[%s] Will keep try/attempt failure statistics for up to %d includes",
+               __FUNCTION__, failure_cache_size);
+    } else if (strncmp(argv[i], "--attempt-deadline=", 19) == 0) {
+      attempt_deadline = atoi(argv[i] + 19);
+    } else if (strncmp(argv[i], "--attempt-deadline-percentile=", 30) == 0) {
+      attempt_deadline_percentile = atoi(argv[i] + 30);
+    } else if (strcmp(argv[i], "--circuit-breaker") == 0) {
+      breaker_params.enabled = true;
+    } else if (strncmp(argv[i], "--circuit-error-rate=", 21) == 0) {
+      breaker_params.error_rate = atoi(argv[i] + 21);
+    } else if (strncmp(argv[i], "--circuit-min-requests=", 23) == 0) {
+      breaker_params.min_requests = atoi(argv[i] + 23);
+    } else if (strncmp(argv[i], "--circuit-latency-threshold=", 28) == 0) {
+      breaker_params.latency_threshold = atoi(argv[i] + 28);
+    } else if (strncmp(argv[i], "--circuit-open-time=", 20) == 0) {
+      breaker_params.open_duration = atoi(argv[i] + 20);
+    } else if (strncmp(argv[i], "--circuit-probes=", 17) == 0) {
+      breaker_params.max_probes = atoi(argv[i] + 17);
+    } else if (strcmp(argv[i], "--coalesce-fetches") == 0) {
+      TSDebug(DEBUG_TAG, "[%s] Will coalesce concurrent fetches of the same include", __FUNCTION__);
+      HttpDataFetcherImpl::setCoalescing(true);
+    } else if (strncmp(argv[i], "--max-fetches-per-doc=", 22) == 0) {
+      max_doc_fetches = atoi(argv[i] + 22);
+    } else if (strncmp(argv[i], "--max-fetches-in-flight=", 24) == 0) {
+      max_process_fetches = atoi(argv[i] + 24);
+    } else if (strncmp(argv[i], "--include-timeout=", 18) == 0) {
+      include_timeout = atoi(argv[i] + 18);
+    } else if (strncmp(argv[i], "--page-deadline=", 16) == 0) {
+      page_deadline = atoi(argv[i] + 16);
+    } else {
+      TSError("[%s] Unknown option [%s]", __FUNCTION__, argv[i]);
+    }
+  }
+  setGzipParams(gzip_params);
+  HttpDataFetcherImpl::setConcurrencyLimits(max_doc_fetches, max_process_fetches);
+  TSDebug(DEBUG_TAG, "[%s] Fetches in flight limited to %d per document and %d overall (0: no limit)",
+           __FUNCTION__, max_doc_fetches, max_process_fetches);
+  HttpDataFetcherImpl::setTimeouts(include_timeout, page_deadline);
+  TSDebug(DEBUG_TAG, "[%s] Includes time out after %d ms and documents after %d ms (0: no limit)",
+           __FUNCTION__, include_timeout, page_deadline);
+
+  FailureInfo::setCircuitBreakerParams(breaker_params);
+  if (breaker_params.enabled) {
+    const CircuitBreakerParams &params = FailureInfo::getCircuitBreakerParams();
+    TSDebug(DEBUG_TAG, "[%s] Attempts will be stopped for %d ms once %d%% of at least %d fail "
+             "(or take more than %d ms); %d probe(s) when half-open", __FUNCTION__, params.open_duration,
+             params.error_rate, params.min_requests, params.latency_threshold, params.max_probes);
+  }
+  EsiProcessor::setAttemptDeadline(attempt_deadline, attempt_deadline_percentile);
+  if (attempt_deadline) {
+    TSDebug(DEBUG_TAG, "[%s] Attempt sections whose includes took over %d ms (%dth percentile) "
+             "will be swapped for their except sections", __FUNCTION__, attempt_deadline,
+             attempt_deadline_percentile);
+  }
+  EsiProcessor::setFailureRegistry(new FailureRegistry(FAILURE_INFO_DEBUG_TAG, &TSDebug, &TSError,
+                                                       failure_cache_size));
 
-  if(pthread_key_create(&threadKey,NULL)){
-    TSError("[%s] Could not create key", __FUNCTION__);
-    return;
+  if (gTemplateCacheSize && pthread_key_create(&gTemplateCacheKey, deleteTemplateCache)) {
+    TSError("[%s] Could not create template cache key; disabling template cache", __FUNCTION__);
+    gTemplateCacheSize = 0;
+  }
+
+  if (gOutputCacheSize && pthread_key_create(&gOutputCacheKey, deleteOutputCache)) {
+    TSError("[%s] Could not create output cache key; disabling output cache", __FUNCTION__);
+    gOutputCacheSize = 0;
   }
   
   TSCont global_contp = TSContCreate(globalHookHandler, NULL);
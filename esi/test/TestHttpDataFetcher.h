@@ -25,6 +25,8 @@
 #define _TEST_HTTP_DATA_FETCHER_H
 
 #include <string>
+#include <list>
+#include <map>
 
 #include "HttpDataFetcher.h"
 
@@ -33,14 +35,25 @@ class TestHttpDataFetcher : public HttpDataFetcher
   
 public:
   
-  TestHttpDataFetcher() :  _n_pending_requests(0), _return_data(true) { }
+  TestHttpDataFetcher() :  _n_pending_requests(0), _return_data(true), _data_pending(false) { }
   
   bool addFetchRequest(const std::string &url, FetchedDataProcessor *callback_obj = 0) {
     ++_n_pending_requests;
     return true;
   }
 
+  void setRequestTimeout(const std::string &url, int timeout) { _timeouts[url] = timeout; }
+
+  // -1 if none was set
+  int getRequestTimeout(const std::string &url) const {
+    std::map<std::string, int>::const_iterator iter = _timeouts.find(url);
+    return (iter == _timeouts.end()) ? -1 : iter->second;
+  }
+
   DataStatus getRequestStatus(const std::string &url) const {
+    if (_data_pending) {
+      return STATUS_DATA_PENDING;
+    }
     if (_return_data) {
       return STATUS_DATA_AVAILABLE;
     }
@@ -54,12 +67,13 @@ public:
     TestHttpDataFetcher &curr_obj = const_cast<TestHttpDataFetcher &>(*this);
     --curr_obj._n_pending_requests;
     if (_return_data) {
-      curr_obj._data.clear();
-      curr_obj._data.append(">>>>> Content for URL [");
-      curr_obj._data.append(url);
-      curr_obj._data.append("] <<<<<");
-      content = curr_obj._data.data();
-      content_len = curr_obj._data.size();
+      curr_obj._data.push_back(std::string()); // content has to stay valid like real fetched data
+      std::string &data = curr_obj._data.back();
+      data.append(">>>>> Content for URL [");
+      data.append(url);
+      data.append("] <<<<<");
+      content = data.data();
+      content_len = data.size();
       return true;
     }
     return false;
@@ -69,10 +83,14 @@ public:
 
   bool getReturnData() const { return _return_data; };
 
+  void setDataPending(bool dp) { _data_pending = dp; };
+
 private:
   int _n_pending_requests;
-  std::string _data;
+  std::list<std::string> _data;
   bool _return_data;
+  bool _data_pending;
+  std::map<std::string, int> _timeouts;
   
 };
 
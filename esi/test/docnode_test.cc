@@ -24,8 +24,11 @@
 #include <iostream>
 #include <assert.h>
 #include <string>
+#include <stdlib.h>
 
 #include "EsiParser.h"
+#include "Arena.h"
+#include "Expression.h"
 #include "print_funcs.h"
 #include "Utils.h"
 
@@ -142,6 +145,72 @@ void checkNodeList2(const DocNodeList &node_list) {
   check_node_attr(list_iter3->attr_list.front(), "src", "bar3");
 }
 
+static void quietDebug(const char *, const char *, ...) { }
+static void quietError(const char *, ...) { }
+
+static bool isInBuffer(const char *str, int str_len, const char *data, int data_len) {
+  return (!str_len || ((str >= data) && ((str + str_len) <= (data + data_len))));
+}
+
+// all nodes and attributes have to point into given buffer
+static void checkFlatNodeList(const FlatDocNodeList &flat_list, const char *data, int data_len) {
+  for (int i = 0; i < flat_list.size(); ++i) {
+    FlatDocNode node = flat_list[i];
+    assert((node.subtree_end > i) && (node.subtree_end <= flat_list.size()));
+    assert((node.type >= DocNode::TYPE_UNKNOWN) && (node.type <= DocNode::TYPE_SPECIAL_INCLUDE));
+    assert(isInBuffer(node.data, node.data_len, data, data_len));
+    assert(isInBuffer(node.code, node.code_len, data, data_len));
+    for (int j = 0; j < node.n_attrs; ++j) {
+      Attribute attr = flat_list.getAttribute(node, j);
+      assert(isInBuffer(attr.name, attr.name_len, data, data_len));
+      assert(isInBuffer(attr.value, attr.value_len, data, data_len));
+    }
+  }
+}
+
+static void checkNodeList(const DocNodeList &node_list, const char *data, int data_len) {
+  for (DocNodeList::const_iterator iter = node_list.begin(); iter != node_list.end(); ++iter) {
+    assert(isInBuffer(iter->data, iter->data_len, data, data_len));
+    for (AttributeList::const_iterator attr_iter = iter->attr_list.begin(); attr_iter != iter->attr_list.end();
+         ++attr_iter) {
+      assert(isInBuffer(attr_iter->name, attr_iter->name_len, data, data_len));
+      assert(isInBuffer(attr_iter->value, attr_iter->value_len, data, data_len));
+    }
+    checkNodeList(iter->child_nodes, data, data_len);
+  }
+}
+
+// unpacking corrupted data must either fail or yield nodes within the
+// buffer
+static void fuzzUnpack(const string &packed, int n_iterations) {
+  string fuzzed, repacked;
+  int n_unpacked = 0;
+  for (int i = 0; i < n_iterations; ++i) {
+    fuzzed = packed;
+    int n_mutations = 1 + (rand() % 4);
+    for (int j = 0; j < n_mutations; ++j) {
+      fuzzed[rand() % fuzzed.size()] = static_cast<char>(rand());
+    }
+    if ((i % 8) == 0) {
+      fuzzed.resize(rand() % fuzzed.size());
+    }
+    FlatDocNodeList flat_list;
+    if (flat_list.unpack(fuzzed)) {
+      ++n_unpacked;
+      checkFlatNodeList(flat_list, fuzzed.data(), fuzzed.size());
+      flat_list.pack(repacked, false, FlatDocNodeList::PACK_VERSION_2);
+      FlatDocNodeList flat_list2;
+      assert(flat_list2.unpack(repacked) == true);
+      assert(flat_list2.size() == flat_list.size());
+    }
+    DocNodeList node_list;
+    if (node_list.unpack(fuzzed)) {
+      checkNodeList(node_list, fuzzed.data(), fuzzed.size());
+    }
+  }
+  cout << "Unpacked " << n_unpacked << " of " << n_iterations << " corrupted lists" << endl;
+}
+
 int main() 
 {
   Utils::init(&Debug, &Error);
@@ -239,7 +308,372 @@ int main()
     assert(node_list2.unpack(packed3.data() + 5, packed3.size() - 5) == true);
     checkNodeList2(node_list2);
   }
-  
+
+  {
+    cout << endl << "==================== Test 3" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    string input_data("<esi:choose>"
+                      "<esi:when test=c1>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo1 />"
+                      "raw1"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar1 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:when test=c2>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo2 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "raw2"
+                      "<esi:include src=bar2 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:otherwise>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo3 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar3 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:otherwise>"
+                      "</esi:choose>");
+
+    Arena arena(256);
+    DocNodeList node_list(&arena);
+    assert(node_list.getArena() == &arena);
+    assert(parser.completeParse(node_list, input_data) == true);
+    checkNodeList2(node_list);
+    assert(arena.getNumAllocations() > 0);
+    assert(arena.getNumBlocks() > 1);
+
+    string packed = node_list.pack();
+    node_list.clear();
+    arena.reset();
+    assert(arena.getNumAllocations() == 0);
+    assert(arena.getNumBlocks() == 0);
+
+    assert(node_list.unpack(packed) == true);
+    checkNodeList2(node_list);
+    assert(node_list.front().child_nodes.getArena() == &arena);
+
+    // heap-backed copy of an arena-backed list
+    DocNodeList node_list2;
+    assert(node_list2.unpack(packed) == true);
+    checkNodeList2(node_list2);
+    assert(node_list2.pack() == packed);
+  }
+
+  {
+    cout << endl << "==================== Test 4" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    string input_data("<esi:choose>"
+                      "<esi:when test=c1>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo1 />"
+                      "raw1"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar1 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:when test=c2>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo2 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "raw2"
+                      "<esi:include src=bar2 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:otherwise>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo3 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar3 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:otherwise>"
+                      "</esi:choose>");
+
+    DocNodeList node_list;
+    assert(parser.completeParse(node_list, input_data) == true);
+
+    FlatDocNodeList flat_list;
+    assert(flat_list.empty());
+    flat_list.append(node_list);
+    assert(flat_list.size() == 21);
+    assert(flat_list[0].type == DocNode::TYPE_CHOOSE);
+    assert(flat_list[0].subtree_end == 21);
+    assert(flat_list[1].type == DocNode::TYPE_WHEN);
+    assert(flat_list[1].n_attrs == 1);
+    check_node_attr(flat_list.getAttribute(flat_list[1], 0), "test", "c1");
+    assert(flat_list[1].subtree_end == 8);
+    assert(flat_list[8].type == DocNode::TYPE_WHEN);
+    check_node_attr(flat_list.getAttribute(flat_list[8], 0), "test", "c2");
+    assert(flat_list[8].subtree_end == 15);
+    assert(flat_list[15].type == DocNode::TYPE_OTHERWISE);
+    assert(flat_list[15].n_attrs == 0);
+    assert(flat_list[15].subtree_end == 21);
+    assert(flat_list[3].type == DocNode::TYPE_ATTEMPT);
+    assert(flat_list[3].subtree_end == 6);
+    assert(flat_list[4].type == DocNode::TYPE_INCLUDE);
+    check_node_attr(flat_list.getAttribute(flat_list[4], 0), "src", "foo1");
+    assert(flat_list[4].subtree_end == 5);
+    assert(flat_list[13].type == DocNode::TYPE_PRE);
+    assert(flat_list[13].data_len == 4);
+    assert(strncmp(flat_list[13].data, "raw2", 4) == 0);
+    assert(flat_list[20].type == DocNode::TYPE_INCLUDE);
+    check_node_attr(flat_list.getAttribute(flat_list[20], 0), "src", "bar3");
+
+    // same packed format as the tree
+    string packed = node_list.pack();
+    assert(flat_list.pack() == packed);
+
+    FlatDocNodeList flat_list2;
+    assert(flat_list2.unpack(packed) == true);
+    assert(flat_list2.size() == 21);
+    assert(flat_list2.pack() == packed);
+
+    DocNodeList node_list2;
+    string packed2 = flat_list2.pack(); // unpacked nodes point into this
+    assert(node_list2.unpack(packed2) == true);
+    checkNodeList2(node_list2);
+
+    // unpack replaces contents
+    assert(flat_list2.unpack(packed) == true);
+    assert(flat_list2.size() == 21);
+
+    // multiple top-level nodes
+    flat_list.append(node_list);
+    assert(flat_list.size() == 42);
+    assert(flat_list[21].type == DocNode::TYPE_CHOOSE);
+    assert(flat_list[21].subtree_end == 42);
+    packed2 = flat_list.pack();
+    assert(node_list2.unpack(packed2) == true);
+    assert(node_list2.size() == 2);
+    node_list2.pop_back();
+    checkNodeList2(node_list2);
+
+    assert(flat_list2.unpack(packed.data(), packed.size() - 1) == false);
+    assert(flat_list2.empty());
+    flat_list.clear();
+    assert(flat_list.size() == 0);
+  }
+
+  {
+    cout << endl << "==================== Test 5" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    string input_data("<esi:choose>"
+                      "<esi:when test=c1>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo1 />"
+                      "raw1"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar1 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:when test=c2>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo2 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "raw2"
+                      "<esi:include src=bar2 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:when>"
+                      "<esi:otherwise>"
+                      "<esi:try>"
+                      "<esi:attempt>"
+                      "<esi:include src=foo3 />"
+                      "</esi:attempt>"
+                      "<esi:except>"
+                      "<esi:include src=bar3 />"
+                      "</esi:except>"
+                      "</esi:try>"
+                      "</esi:otherwise>"
+                      "</esi:choose>");
+
+    DocNodeList node_list;
+    assert(parser.completeParse(node_list, input_data) == true);
+    FlatDocNodeList flat_list;
+    flat_list.append(node_list);
+    string packed_v1 = node_list.pack();
+    string packed_v2 = flat_list.pack(FlatDocNodeList::PACK_VERSION_2);
+    assert(FlatDocNodeList::isPackedVersion2(packed_v2.data(), packed_v2.size()) == true);
+    assert(FlatDocNodeList::isPackedVersion2(packed_v1.data(), packed_v1.size()) == false);
+
+    // used in place
+    FlatDocNodeList flat_list2;
+    assert(flat_list2.unpack(packed_v2) == true);
+    assert(flat_list2.size() == 21);
+    checkFlatNodeList(flat_list2, packed_v2.data(), packed_v2.size());
+    assert(flat_list2[13].type == DocNode::TYPE_PRE);
+    assert(strncmp(flat_list2[13].data, "raw2", flat_list2[13].data_len) == 0);
+    check_node_attr(flat_list2.getAttribute(flat_list2[20], 0), "src", "bar3");
+    assert(flat_list2.pack(FlatDocNodeList::PACK_VERSION_2) == packed_v2);
+    assert(flat_list2.pack() == packed_v1);
+
+    // when nodes carry their compiled tests in version 2 only
+    string code;
+    Expression::compile("c1", -1, code);
+    assert(flat_list[1].type == DocNode::TYPE_WHEN);
+    assert(flat_list[1].code_len == 0);
+    assert(string(flat_list2[1].code, flat_list2[1].code_len) == code);
+    assert(flat_list2[0].code_len == 0);
+    assert(flat_list2[2].code_len == 0);
+
+    // both versions unpack to the same tree
+    DocNodeList node_list2;
+    assert(node_list2.unpack(packed_v2) == true);
+    checkNodeList2(node_list2);
+    checkNodeList(node_list2, packed_v2.data(), packed_v2.size());
+    assert(node_list2.pack() == packed_v1);
+
+    // unaligned buffers are copied out
+    string unaligned("x");
+    unaligned.append(packed_v2);
+    assert(flat_list2.unpack(unaligned.data() + 1, unaligned.size() - 1) == true);
+    checkFlatNodeList(flat_list2, unaligned.data() + 1, unaligned.size() - 1);
+    assert(string(flat_list2[1].code, flat_list2[1].code_len) == code);
+    assert(flat_list2.pack() == packed_v1);
+
+    // appending to a list in use copies it out first
+    assert(flat_list2.unpack(packed_v2) == true);
+    flat_list2.append(node_list);
+    assert(flat_list2.size() == 42);
+    assert(flat_list2[21].type == DocNode::TYPE_CHOOSE);
+    assert(flat_list2[0].subtree_end == 21);
+
+    // packing with retained data
+    string packed3("hello");
+    flat_list.pack(packed3, true, FlatDocNodeList::PACK_VERSION_2);
+    assert(packed3.size() == (packed_v2.size() + 5));
+    assert(flat_list2.unpack(packed3.data() + 5, packed3.size() - 5) == true);
+    assert(flat_list2.size() == 21);
+
+    assert(flat_list2.unpack(packed_v2.data(), packed_v2.size() - 1) == false);
+    assert(flat_list2.empty());
+    assert(node_list2.unpack(packed_v2.data(), packed_v2.size() - 1) == false);
+
+    FlatDocNodeList empty_list;
+    string packed_empty = empty_list.pack(FlatDocNodeList::PACK_VERSION_2);
+    assert(flat_list2.unpack(packed_empty) == true);
+    assert(flat_list2.empty());
+  }
+
+  {
+    cout << endl << "==================== Test 6" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    string input_data("foo <esi:include src=blah /> bar"
+                      "<esi:choose><esi:when test=\"$(HTTP_HOST) == 'a'\">a<esi:vars>$(X)</esi:vars></esi:when>"
+                      "<esi:otherwise>b</esi:otherwise></esi:choose>"
+                      "<esi:try><esi:attempt><esi:include src=foo /></esi:attempt>"
+                      "<esi:except>c</esi:except></esi:try>"
+                      "<!--esi <esi:include src=bar /> -->");
+    DocNodeList node_list;
+    assert(parser.completeParse(node_list, input_data) == true);
+    FlatDocNodeList flat_list;
+    flat_list.append(node_list);
+    string packed_v1 = flat_list.pack(FlatDocNodeList::PACK_VERSION_1);
+    string packed_v2 = flat_list.pack(FlatDocNodeList::PACK_VERSION_2);
+
+    Utils::init(&quietDebug, &quietError);
+    srand(42);
+    fuzzUnpack(packed_v1, 20000);
+    fuzzUnpack(packed_v2, 20000);
+    Utils::init(&Debug, &Error);
+  }
+
+  {
+    cout << endl << "==================== Test 7" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    string input_data("<esi:vars>$(HTTP_COOKIE{B})$(UNKNOWN)</esi:vars>"
+                      "<esi:choose><esi:when test=\"$(HTTP_HOST) == 'a'\">a</esi:when></esi:choose>"
+                      "<esi:include src=\"http://x/y?$(QUERY_STRING{x})&l=$(HTTP_ACCEPT_LANGUAGE{en-us}|'en')\" />"
+                      "<!--esi <esi:vars>$(HTTP_COOKIE{c})</esi:vars> -->"
+                      "$(HTTP_REFERER)");
+    DocNodeList node_list;
+    assert(parser.completeParse(node_list, input_data) == true);
+    FlatDocNodeList flat_list;
+    flat_list.append(node_list);
+
+    const char *attr;
+    int attr_len;
+    int host_id = Variables::getVariableId("HTTP_HOST", -1, attr, attr_len);
+    int cookie_id = Variables::getVariableId("HTTP_COOKIE{B}", -1, attr, attr_len);
+    int query_id = Variables::getVariableId("QUERY_STRING{x}", -1, attr, attr_len);
+    int lang_id = Variables::getVariableId("HTTP_ACCEPT_LANGUAGE{en-us}", -1, attr, attr_len);
+    int referer_id = Variables::getVariableId("HTTP_REFERER", -1, attr, attr_len);
+
+    VariableDependencies deps;
+    flat_list.getDependencies(deps);
+    assert(deps.isComplete());
+    assert(deps.getIdBitmap() == static_cast<uint32_t>((1 << host_id) | (1 << cookie_id) | (1 << query_id) |
+                                                       (1 << lang_id)));
+    assert(!deps.dependsOn(referer_id)); // not in an expression
+    VariableDependencies::DictVariableSet expected;
+    expected.insert(VariableDependencies::DictVariable(cookie_id, "B"));
+    expected.insert(VariableDependencies::DictVariable(cookie_id, "c"));
+    expected.insert(VariableDependencies::DictVariable(query_id, "x"));
+    expected.insert(VariableDependencies::DictVariable(lang_id, "en-us"));
+    assert(deps.getDictVariables() == expected);
+
+    // stored in version 2 lists, whether used in place or copied out
+    string packed_v2 = flat_list.pack(FlatDocNodeList::PACK_VERSION_2);
+    FlatDocNodeList flat_list2;
+    assert(flat_list2.unpack(packed_v2) == true);
+    VariableDependencies deps2;
+    flat_list2.getDependencies(deps2);
+    assert(deps2.getIdBitmap() == deps.getIdBitmap());
+    assert(deps2.getDictVariables() == expected);
+    string unaligned("x");
+    unaligned.append(packed_v2);
+    assert(flat_list2.unpack(unaligned.data() + 1, unaligned.size() - 1) == true);
+    deps2.clear();
+    flat_list2.getDependencies(deps2);
+    assert(deps2.getDictVariables() == expected);
+    assert(flat_list2.unpack(flat_list.pack()) == true);
+    deps2.clear();
+    flat_list2.getDependencies(deps2);
+    assert(deps2.getDictVariables() == expected);
+
+    string packed_deps;
+    deps.pack(packed_deps);
+    assert(deps2.unpack(packed_deps.data(), packed_deps.size()) == true);
+    assert(deps2.getIdBitmap() == deps.getIdBitmap());
+    assert(deps2.unpack(packed_deps.data(), packed_deps.size() - 1) == false);
+    assert(deps2.getDictVariables().empty());
+
+    // special include handlers may look up any variable
+    node_list.clear();
+    assert(parser.completeParse(node_list, "<esi:special-include handler=ads pos=SKY />") == true);
+    flat_list.clear();
+    flat_list.append(node_list);
+    flat_list.getDependencies(deps);
+    assert(!deps.isComplete());
+    assert(deps.getIdBitmap() == 0);
+  }
+
   cout << "All tests passed" << endl;
   return 0;
 }
@@ -0,0 +1,434 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <iostream>
+#include <assert.h>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <new>
+
+#include "EsiParser.h"
+#include "Arena.h"
+#include "Expression.h"
+#include "Utils.h"
+#include "gzip.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+// counts heap allocations for the allocation benchmark
+static size_t g_n_heap_allocs = 0;
+
+void *operator new(size_t size) throw(std::bad_alloc) {
+  ++g_n_heap_allocs;
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) throw() {
+  free(ptr);
+}
+
+// logging is a no-op here; printing would dominate the timings
+static void Debug(const char *, const char *, ...) { }
+static void Error(const char *, ...) { }
+
+static double
+getElapsed(const struct timeval &start) {
+  struct timeval end, result;
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &result);
+  return result.tv_sec + (result.tv_usec / 1000000.0);
+}
+
+// builds a template of roughly doc_size bytes of plain markup with an
+// esi tag every tag_interval bytes
+static void
+buildTemplate(string &doc, int doc_size, int tag_interval) {
+  static const char *markup = "<div class=\"item\"><a href=\"/some/link\">Some link text</a></div>\n";
+  doc.clear();
+  int next_tag = tag_interval;
+  while (static_cast<int>(doc.size()) < doc_size) {
+    doc.append(markup);
+    if (static_cast<int>(doc.size()) >= next_tag) {
+      doc.append("<esi:include src=\"http://example.com/fragment\"/>");
+      next_tag += tag_interval;
+    }
+  }
+}
+
+static void
+benchTagScan(const string &doc, int n_iterations) {
+  const char *names[] = { "vectorized", "scalar" };
+  for (int scalar = 0; scalar < 2; ++scalar) {
+    EsiParser::setScalarTagScan(scalar);
+    EsiParser parser("esi_bench", &Debug, &Error);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < n_iterations; ++i) {
+      DocNodeList node_list;
+      assert(parser.parse(node_list, doc.data(), doc.size()) == true);
+    }
+    double elapsed = getElapsed(start);
+    cout << "tag scan [" << names[scalar] << "]: " << n_iterations << " parses of " << doc.size()
+         << " bytes in " << elapsed << "s; " << (doc.size() * n_iterations / elapsed / (1024 * 1024))
+         << " MB/s" << endl;
+  }
+  EsiParser::setScalarTagScan(false);
+}
+
+// large choose body streamed in small chunks; exercises the closing tag
+// search which should resume where the previous chunk left off
+static void
+benchChunkedParse(const string &doc, int n_iterations, int chunk_size) {
+  string input_data("<esi:choose><esi:when test=\"1\">");
+  input_data.append(doc);
+  input_data.append("</esi:when></esi:choose>");
+  EsiParser parser("esi_bench", &Debug, &Error);
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    DocNodeList node_list;
+    for (size_t pos = 0; pos < input_data.size(); pos += chunk_size) {
+      size_t len = input_data.size() - pos;
+      if (len > static_cast<size_t>(chunk_size)) {
+        len = chunk_size;
+      }
+      assert(parser.parseChunk(input_data.data() + pos, node_list, len) == true);
+    }
+    assert(parser.completeParse(node_list) == true);
+    parser.clear();
+  }
+  double elapsed = getElapsed(start);
+  cout << "chunked parse [" << chunk_size << " byte chunks]: " << n_iterations << " parses of "
+       << input_data.size() << " bytes in " << elapsed << "s; "
+       << (input_data.size() * n_iterations / elapsed / (1024 * 1024)) << " MB/s" << endl;
+}
+
+// builds a template heavy on nested nodes and attributes
+static void
+buildNestedTemplate(string &doc, int n_blocks) {
+  doc.clear();
+  for (int i = 0; i < n_blocks; ++i) {
+    doc.append("<div><esi:include src=\"http://example.com/a\"/>"
+               "<esi:choose><esi:when test=\"$(HTTP_HOST) == 'a'\">a <esi:vars>$(X)</esi:vars></esi:when>"
+               "<esi:otherwise>b</esi:otherwise></esi:choose>"
+               "<esi:try><esi:attempt><esi:include src=\"http://example.com/b\"/></esi:attempt>"
+               "<esi:except>c</esi:except></esi:try>"
+               "<!--esi <esi:include src=\"http://example.com/c\"/>--></div>\n");
+  }
+}
+
+static void
+benchNodeAllocs(const string &doc, int n_iterations) {
+  EsiParser parser("esi_bench", &Debug, &Error);
+  string packed;
+  {
+    DocNodeList node_list;
+    assert(parser.parse(node_list, doc) == true);
+    node_list.pack(packed);
+  }
+  const char *names[] = { "heap", "arena" };
+  for (int use_arena = 0; use_arena < 2; ++use_arena) {
+    Arena arena;
+    size_t parse_allocs = 0, unpack_allocs = 0;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < n_iterations; ++i) {
+      DocNodeList node_list(use_arena ? &arena : 0);
+      size_t n_allocs = g_n_heap_allocs;
+      assert(parser.parse(node_list, doc) == true);
+      parse_allocs += g_n_heap_allocs - n_allocs;
+      node_list.clear();
+      arena.reset();
+
+      n_allocs = g_n_heap_allocs;
+      assert(node_list.unpack(packed) == true);
+      unpack_allocs += g_n_heap_allocs - n_allocs;
+      node_list.clear();
+      arena.reset();
+    }
+    double elapsed = getElapsed(start);
+    cout << "node allocs [" << names[use_arena] << "]: " << (parse_allocs / n_iterations)
+         << " heap allocs per parse, " << (unpack_allocs / n_iterations) << " per unpack of "
+         << doc.size() << " bytes; " << n_iterations << " parse+unpack cycles in " << elapsed << "s" << endl;
+  }
+}
+
+// builds a page made up mostly of PRE and INCLUDE nodes, in the style
+// of the parser_test/processor_test documents
+static void
+buildIncludeHeavyTemplate(string &doc, int n_includes) {
+  doc.clear();
+  char buf[128];
+  for (int i = 0; i < n_includes; ++i) {
+    snprintf(buf, sizeof(buf), "<li>item %d</li><esi:include src=\"http://example.com/frag%d\"/>", i, i % 50);
+    doc.append(buf);
+    if ((i % 10) == 0) {
+      doc.append("<esi:vars>$(HTTP_COOKIE{c})</esi:vars><esi:comment text=\"x\"/>");
+    }
+  }
+}
+
+static int
+walkTree(const DocNodeList &node_list) {
+  int sum = 0;
+  for (DocNodeList::const_iterator iter = node_list.begin(); iter != node_list.end(); ++iter) {
+    sum += iter->type + iter->data_len;
+    for (AttributeList::const_iterator attr_iter = iter->attr_list.begin(); attr_iter != iter->attr_list.end();
+         ++attr_iter) {
+      sum += attr_iter->value_len;
+    }
+    sum += walkTree(iter->child_nodes);
+  }
+  return sum;
+}
+
+static int
+walkFlat(const FlatDocNodeList &flat_list) {
+  int sum = 0;
+  for (int i = 0; i < flat_list.size(); ++i) {
+    const FlatDocNode &node = flat_list[i];
+    sum += node.type + node.data_len;
+    for (int j = 0; j < node.n_attrs; ++j) {
+      sum += flat_list.getAttribute(node, j).value_len;
+    }
+  }
+  return sum;
+}
+
+// compares traversal, packing and unpacking of the list and flat forms
+static void
+benchFlatNodes(const char *name, const string &doc, int n_iterations) {
+  EsiParser parser("esi_bench", &Debug, &Error);
+  Arena arena;
+  DocNodeList heap_list, arena_list(&arena);
+  assert(parser.parse(heap_list, doc) == true);
+  assert(parser.parse(arena_list, doc) == true);
+  FlatDocNodeList flat_list;
+  flat_list.append(heap_list);
+  string packed = heap_list.pack();
+  assert(flat_list.pack() == packed);
+
+  int sum = walkTree(heap_list);
+  assert(walkTree(arena_list) == sum);
+  assert(walkFlat(flat_list) == sum);
+
+  int n_walks = n_iterations * 20;
+  double elapsed[3];
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_walks; ++i) {
+    sum ^= walkTree(heap_list);
+    asm volatile("" : : : "memory"); // keep the walk in the loop
+  }
+  elapsed[0] = getElapsed(start);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_walks; ++i) {
+    sum ^= walkTree(arena_list);
+    asm volatile("" : : : "memory");
+  }
+  elapsed[1] = getElapsed(start);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_walks; ++i) {
+    sum ^= walkFlat(flat_list);
+    asm volatile("" : : : "memory");
+  }
+  elapsed[2] = getElapsed(start);
+  cout << "flat nodes [" << name << "]: " << flat_list.size() << " nodes; " << n_walks << " walks: heap list "
+       << elapsed[0] << "s, arena list " << elapsed[1] << "s, flat " << elapsed[2] << "s (" << sum << ")" << endl;
+
+  string buffer;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    arena_list.pack(buffer);
+  }
+  elapsed[0] = getElapsed(start);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    flat_list.pack(buffer);
+  }
+  elapsed[1] = getElapsed(start);
+  cout << "flat nodes [" << name << "]: " << n_iterations << " packs: list " << elapsed[0] << "s, flat "
+       << elapsed[1] << "s" << endl;
+
+  Arena unpack_arena;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    {
+      DocNodeList node_list(&unpack_arena);
+      assert(node_list.unpack(packed) == true);
+    }
+    unpack_arena.reset();
+  }
+  elapsed[0] = getElapsed(start);
+  FlatDocNodeList flat_list2;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    assert(flat_list2.unpack(packed) == true);
+  }
+  elapsed[1] = getElapsed(start);
+  string packed_v2 = flat_list.pack(FlatDocNodeList::PACK_VERSION_2);
+  size_t n_allocs = g_n_heap_allocs;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    FlatDocNodeList flat_list3;
+    assert(flat_list3.unpack(packed_v2) == true);
+  }
+  elapsed[2] = getElapsed(start);
+  cout << "flat nodes [" << name << "]: " << n_iterations << " unpacks: arena list " << elapsed[0]
+       << "s, flat " << elapsed[1] << "s, flat v2 in place " << elapsed[2] << "s ("
+       << ((g_n_heap_allocs - n_allocs) / n_iterations) << " heap allocs per unpack; v1 size "
+       << packed.size() << ", v2 size " << packed_v2.size() << ")" << endl;
+}
+
+static void
+benchExpressions(int n_iterations) {
+  Variables esi_vars("esi_bench", &Debug, &Error);
+  esi_vars.populate(HttpHeader("Host", -1, "example.com", -1));
+  esi_vars.populate(HttpHeader("Cookie", -1, "type=premium; age=21; country=DE", -1));
+  Expression esi_expr("esi_bench", &Debug, &Error, esi_vars);
+  const char *exprs[] = { "$(HTTP_COOKIE{type}) == 'premium'", "$(HTTP_COOKIE{age}) >= 18",
+                          "$(HTTP_HOST) != 'www.example.com'", "!$(HTTP_COOKIE{opt_out})",
+                          "$(HTTP_COOKIE{country}) == \"US\"", "'1.5' < 2", 0 };
+  string codes[8];
+  int n_exprs;
+  for (n_exprs = 0; exprs[n_exprs]; ++n_exprs) {
+    Expression::compile(exprs[n_exprs], -1, codes[n_exprs]);
+  }
+
+  int n_evals = n_iterations * 1000, n_true[2] = { 0, 0 };
+  double elapsed[2];
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_evals; ++i) {
+    for (int j = 0; j < n_exprs; ++j) {
+      n_true[0] += esi_expr.evaluate(exprs[j]);
+    }
+  }
+  elapsed[0] = getElapsed(start);
+  bool result;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_evals; ++i) {
+    for (int j = 0; j < n_exprs; ++j) {
+      esi_expr.evaluateCompiled(codes[j].data(), codes[j].size(), result);
+      n_true[1] += result;
+    }
+  }
+  elapsed[1] = getElapsed(start);
+  assert(n_true[0] == n_true[1]);
+  n_evals *= n_exprs;
+  cout << "expressions: " << n_evals << " evaluations: string " << elapsed[0] << "s ("
+       << static_cast<int>(n_evals / elapsed[0]) << "/s), compiled " << elapsed[1] << "s ("
+       << static_cast<int>(n_evals / elapsed[1]) << "/s)" << endl;
+
+  const char *url = "http://frag.example.com/$(HTTP_COOKIE{country})/box?type=$(HTTP_COOKIE{type})"
+    "&age=$(HTTP_COOKIE{age})&seg=$(HTTP_COOKIE{segment}|'default')&host=$(HTTP_HOST)";
+  string plan, value;
+  Expression::compileExpansion(url, -1, plan);
+  size_t total_size[2] = { 0, 0 };
+  int n_expansions = n_iterations * 1000;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_expansions; ++i) {
+    total_size[0] += esi_expr.expand(url).size();
+  }
+  elapsed[0] = getElapsed(start);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_expansions; ++i) {
+    value.clear();
+    esi_expr.expandCompiled(plan.data(), plan.size(), value);
+    total_size[1] += value.size();
+  }
+  elapsed[1] = getElapsed(start);
+  assert(total_size[0] == total_size[1]);
+  cout << "expressions: " << n_expansions << " url expansions: string " << elapsed[0] << "s, plan "
+       << elapsed[1] << "s" << endl;
+}
+
+// zlib allocates its state with malloc(); estimate it from the number of
+// deflate streams initialized (window and hash/buffer memory)
+static int
+getDeflateStateKb(int n_inits, int mem_level) {
+  return n_inits * (((1 << (MAX_WBITS + 2)) + (1 << (mem_level + 9))) / 1024);
+}
+
+static void
+benchGzip(const char *name, const GzipParams &params, const string &doc, int n_iterations) {
+  setGzipParams(params);
+  string cdata;
+  int n_inits, n_reuses, n_inits2, n_reuses2;
+  getGzipPoolStats(n_inits, n_reuses);
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < n_iterations; ++i) {
+    assert(gzip(doc.data(), doc.size(), cdata) == true);
+  }
+  double elapsed = getElapsed(start);
+  getGzipPoolStats(n_inits2, n_reuses2);
+  n_inits2 -= n_inits;
+  cout << "gzip [" << name << "]: " << n_iterations << " documents of " << doc.size() << " bytes in "
+       << elapsed << "s; " << (doc.size() * n_iterations / elapsed / (1024 * 1024)) << " MB/s; "
+       << n_inits2 << " stream inits (~" << getDeflateStateKb(n_inits2, params.mem_level) << " KB), "
+       << (n_reuses2 - n_reuses) << " reuses; compressed to " << cdata.size() << " bytes" << endl;
+  setGzipParams(GzipParams());
+}
+
+int main(int argc, char **argv)
+{
+  Utils::init(&Debug, &Error);
+  int n_iterations = (argc > 1) ? atoi(argv[1]) : 200;
+
+  string doc;
+  buildTemplate(doc, 300 * 1024, 16 * 1024);
+  benchTagScan(doc, n_iterations);
+  benchChunkedParse(doc, n_iterations, 1024);
+
+  buildNestedTemplate(doc, 200);
+  benchNodeAllocs(doc, n_iterations);
+  benchFlatNodes("nested", doc, n_iterations);
+
+  buildIncludeHeavyTemplate(doc, 500);
+  benchFlatNodes("includes", doc, n_iterations);
+
+  benchExpressions(n_iterations);
+
+  GzipParams gzip_params;
+  gzip_params.max_pooled_streams = 0;
+  buildTemplate(doc, 8 * 1024, 16 * 1024);
+  benchGzip("small, unpooled", gzip_params, doc, n_iterations * 10);
+  benchGzip("small, pooled", GzipParams(), doc, n_iterations * 10);
+  buildTemplate(doc, 300 * 1024, 16 * 1024);
+  benchGzip("large, pooled", GzipParams(), doc, n_iterations);
+  gzip_params = GzipParams();
+  gzip_params.fast_mode_min_size = 64 * 1024;
+  benchGzip("large, fast mode", gzip_params, doc, n_iterations);
+
+  return 0;
+}
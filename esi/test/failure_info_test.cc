@@ -0,0 +1,314 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <iostream>
+#include <assert.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string>
+
+#include "print_funcs.h"
+#include "Utils.h"
+#include "FailureInfo.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+static FailureRegistry *registry;
+
+static void *
+registerFailures(void *) {
+  for (int i = 0; i < 1000; ++i) {
+    FailureInfo *info = registry->get("http://shared/fail", 100);
+    info->registerSuccFail(false);
+    registry->release(info);
+  }
+  return 0;
+}
+
+static time_t takeover_time;
+static volatile int n_started;
+
+// all threads get the entry at the same time and count one failure each
+static void *
+registerTakeoverFailure(void *) {
+  __sync_fetch_and_add(&n_started, 1);
+  while (n_started < 4) {
+  }
+  FailureInfo *info = registry->get("http://shared/takeover", takeover_time);
+  info->registerSuccFail(false);
+  registry->release(info);
+  return 0;
+}
+
+static FailureInfo *circuit_info;
+static volatile int n_probes;
+
+// all threads fail at the same time, then ask for a probe once the circuit may be tried again
+static void *
+probeCircuit(void *) {
+  __sync_fetch_and_add(&n_started, 1);
+  while (n_started < 4) {
+  }
+  for (int i = 0; i < 10; ++i) {
+    circuit_info->registerSuccFail(false);
+  }
+  __sync_fetch_and_add(&n_started, 1);
+  while (n_started < 8) {
+  }
+  usleep(60 * 1000);
+  for (int i = 0; i < 10; ++i) {
+    if (circuit_info->isAttemptReq()) {
+      __sync_fetch_and_add(&n_probes, 1);
+    }
+  }
+  return 0;
+}
+
+int main() 
+{
+  Utils::init(&Debug, &Error);
+
+  {
+    cout << endl << "===================== Test 1) find, get and shared counts" << endl;
+    FailureRegistry failures("failure_registry", &Debug, &Error, 16, 60);
+    assert(failures.find("http://a", 100) == 0);
+    FailureInfo *info = failures.get("http://a", 100);
+    assert(info);
+    assert(failures.find("http://a", 100) == info);
+    failures.release(info);
+    assert(failures.get("http://a", 100) == info);
+    failures.release(info);
+    assert(failures.getNumEntries(100) == 1);
+
+    int n_failures, n_successes;
+    info->registerSuccFail(false);
+    info->registerSuccFail(false);
+    info->registerSuccFail(true);
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 2) && (n_successes == 1));
+    failures.release(info);
+    assert(failures.find("http://b", 100) == 0);
+
+    // idle entries are not returned and get handed over with fresh counts
+    assert(failures.find("http://a", 161) == 0);
+    assert(failures.getNumEntries(161) == 0);
+    info = failures.get("http://a", 161);
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 0) && (n_successes == 0));
+    assert(info->isAttemptReq() == true);
+    failures.release(info);
+  }
+
+  {
+    cout << endl << "===================== Test 2) bounded size" << endl;
+    FailureRegistry failures("failure_registry", &Debug, &Error, 8, 60);
+    char url[32];
+    for (int i = 0; i < 100; ++i) {
+      sprintf(url, "http://host/%d", i);
+      FailureInfo *info = failures.get(url, 100 + i);
+      assert(info);
+      failures.release(info);
+      assert(failures.getNumEntries(100 + i) <= 8);
+    }
+    // most recently used URL is still in there
+    FailureInfo *info = failures.find(url, 200);
+    assert(info);
+    failures.release(info);
+
+    // entries being held are not handed over to other URLs
+    info = failures.get("http://held", 300);
+    info->registerSuccFail(false);
+    for (int i = 0; i < 100; ++i) {
+      sprintf(url, "http://other/%d", i);
+      FailureInfo *other_info = failures.get(url, 400 + i);
+      assert(other_info != info);
+      if (other_info) {
+        other_info->registerSuccFail(true);
+        failures.release(other_info);
+      }
+    }
+    int n_failures, n_successes;
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 1) && (n_successes == 0));
+    assert(failures.find("http://held", 310) == info);
+    failures.release(info);
+    failures.release(info);
+    // taken over once let go
+    info = failures.get("http://new", 600);
+    assert(info);
+    failures.release(info);
+    assert(failures.find("http://held", 310) == 0);
+  }
+
+  {
+    cout << endl << "===================== Test 3) concurrent updates" << endl;
+    registry = new FailureRegistry("failure_registry", &Debug, &Error);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+      pthread_create(&threads[i], 0, registerFailures, 0);
+    }
+    for (int i = 0; i < 4; ++i) {
+      pthread_join(threads[i], 0);
+    }
+    assert(registry->getNumEntries(100) == 1);
+    int n_failures, n_successes;
+    FailureInfo *info = registry->find("http://shared/fail", 100);
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 4000) && (n_successes == 0));
+    registry->release(info);
+    delete registry;
+  }
+
+  {
+    cout << endl << "===================== Test 4) latency percentiles" << endl;
+    FailureRegistry failures("failure_registry", &Debug, &Error, 16, 60);
+    FailureInfo *info = failures.get("http://slow", 100);
+    assert(info->getLatencyPercentile(90) == -1);
+    info->registerSuccFail(true); // no latency reported
+    assert(info->getLatencyPercentile(90) == -1);
+    for (int i = 0; i < 8; ++i) {
+      info->registerSuccFail(true, 15);
+    }
+    info->registerSuccFail(false, 450);
+    info->registerSuccFail(true, 100000);
+    assert(info->getLatencyPercentile(50) == 20);
+    assert(info->getLatencyPercentile(80) == 20);
+    assert(info->getLatencyPercentile(90) == 500);
+    assert(info->getLatencyPercentile(100) == 60000);
+    info->reset();
+    assert(info->getLatencyPercentile(90) == -1);
+    failures.release(info);
+  }
+
+  {
+    cout << endl << "===================== Test 5) circuit breaker" << endl;
+    CircuitBreakerParams params;
+    params.enabled = true;
+    params.error_rate = 50;
+    params.min_requests = 4;
+    params.latency_threshold = 1000;
+    params.open_duration = 50;
+    params.max_probes = 1;
+    FailureInfo::setCircuitBreakerParams(params);
+    FailureRegistry failures("failure_registry", &Debug, &Error, 16, 60);
+    FailureInfo *info = failures.get("http://breaker", 100);
+
+    info->registerSuccFail(false);
+    info->registerSuccFail(true);
+    info->registerSuccFail(false);
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_CLOSED); // too few attempts yet
+    assert(info->isAttemptReq() == true);
+    info->registerSuccFail(true, 1500); // too slow to count as success
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_OPEN);
+    assert(info->isAttemptReq() == false);
+
+    usleep(60 * 1000);
+    assert(info->isAttemptReq() == true); // probe
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_HALF_OPEN);
+    assert(info->isAttemptReq() == false);
+    info->registerSuccFail(false);
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_OPEN);
+
+    usleep(60 * 1000);
+    assert(info->isAttemptReq() == true);
+    info->registerSuccFail(true, 10);
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_CLOSED);
+    int n_failures, n_successes;
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 0) && (n_successes == 0));
+    assert(info->isAttemptReq() == true);
+
+    // a probe that never reports back doesn't keep the circuit half-open
+    for (int i = 0; i < 4; ++i) {
+      info->registerSuccFail(false);
+    }
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_OPEN);
+    usleep(60 * 1000);
+    assert(info->isAttemptReq() == true);
+    assert(info->isAttemptReq() == false);
+    usleep(60 * 1000);
+    assert(info->isAttemptReq() == true);
+    assert(info->getCircuitState() == FailureInfo::CIRCUIT_HALF_OPEN);
+
+    failures.release(info);
+    FailureInfo::setCircuitBreakerParams(CircuitBreakerParams());
+  }
+
+  {
+    cout << endl << "===================== Test 6) concurrent takeover of entries" << endl;
+    // fresh entries and idle ones are reset before anyone else gets them
+    registry = new FailureRegistry("failure_registry", &Debug, &Error, 8, 60);
+    for (int round = 0; round < 200; ++round) {
+      takeover_time = 100 + (round * 61);
+      n_started = 0;
+      pthread_t threads[4];
+      for (int i = 0; i < 4; ++i) {
+        pthread_create(&threads[i], 0, registerTakeoverFailure, 0);
+      }
+      for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], 0);
+      }
+      int n_failures, n_successes;
+      FailureInfo *info = registry->find("http://shared/takeover", takeover_time);
+      info->getCounts(n_failures, n_successes);
+      assert((n_failures == 4) && (n_successes == 0));
+      registry->release(info);
+    }
+    delete registry;
+  }
+
+  {
+    cout << endl << "===================== Test 7) concurrent circuit transitions" << endl;
+    CircuitBreakerParams params;
+    params.enabled = true;
+    params.min_requests = 4;
+    params.open_duration = 50;
+    params.max_probes = 2;
+    FailureInfo::setCircuitBreakerParams(params);
+    FailureRegistry failures("failure_registry", &Debug, &Error, 16, 60);
+    circuit_info = failures.get("http://circuit", 100);
+    n_started = 0;
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+      pthread_create(&threads[i], 0, probeCircuit, 0);
+    }
+    while (n_started < 8) {
+    }
+    // whichever thread opened the circuit, it is open for the whole duration
+    assert(circuit_info->getCircuitState() == FailureInfo::CIRCUIT_OPEN);
+    for (int i = 0; i < 4; ++i) {
+      pthread_join(threads[i], 0);
+    }
+    assert(circuit_info->getCircuitState() == FailureInfo::CIRCUIT_HALF_OPEN);
+    assert(n_probes == 2);
+    failures.release(circuit_info);
+    FailureInfo::setCircuitBreakerParams(CircuitBreakerParams());
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
@@ -0,0 +1,165 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+#include <iostream>
+#include <assert.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+
+#include "HttpDataFetcherImpl.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+
+// the parts of the TS API the fetcher uses; scheduled events are numbered
+// from 1 and handed to handleFetchEvent() by the test itself
+
+static TSHRTime now = TS_HRTIME_MSECOND(1000);
+static int n_scheduled = 0;
+static int n_fetches = 0;
+static const char RESPONSE[] = "HTTP/1.0 200 OK\r\n\r\nbody";
+
+pthread_key_t key;
+
+const char *TS_MIME_FIELD_ACCEPT_ENCODING = "Accept-Encoding", *TS_MIME_FIELD_CACHE_CONTROL = "Cache-Control",
+  *TS_MIME_FIELD_ETAG = "ETag", *TS_MIME_FIELD_EXPIRES = "Expires", *TS_MIME_FIELD_HOST = "Host",
+  *TS_MIME_FIELD_LAST_MODIFIED = "Last-Modified";
+int TS_MIME_LEN_ACCEPT_ENCODING = 15, TS_MIME_LEN_CACHE_CONTROL = 13, TS_MIME_LEN_ETAG = 4, TS_MIME_LEN_EXPIRES = 7,
+  TS_MIME_LEN_HOST = 4, TS_MIME_LEN_LAST_MODIFIED = 13;
+const char *TS_HTTP_VALUE_MAX_AGE = "max-age", *TS_HTTP_VALUE_NO_CACHE = "no-cache",
+  *TS_HTTP_VALUE_NO_STORE = "no-store", *TS_HTTP_VALUE_PRIVATE = "private";
+int TS_HTTP_LEN_MAX_AGE = 7, TS_HTTP_LEN_NO_CACHE = 8, TS_HTTP_LEN_NO_STORE = 8, TS_HTTP_LEN_PRIVATE = 7;
+
+void TSDebug(const char *tag, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  printf("Debug (%s): ", tag);
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+}
+
+void TSError(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  printf("Error: ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+}
+
+TSHRTime TShrtime(void) { return now; }
+TSAction TSContSchedule(TSCont, TSHRTime, TSThreadPool) { return reinterpret_cast<TSAction>(++n_scheduled); }
+void TSActionCancel(TSAction) { }
+TSReturnCode TSFetchUrl(const char *, int, struct sockaddr const *, TSCont, TSFetchWakeUpOptions, TSFetchEvent) {
+  ++n_fetches;
+  return TS_SUCCESS;
+}
+char *TSFetchRespGet(TSHttpTxn, int *length) {
+  *length = sizeof(RESPONSE) - 1;
+  return const_cast<char *>(RESPONSE);
+}
+TSHttpParser TSHttpParserCreate(void) { return 0; }
+void TSHttpParserClear(TSHttpParser) { }
+void TSHttpParserDestroy(TSHttpParser) { }
+TSMBuffer TSMBufferCreate(void) { return reinterpret_cast<TSMBuffer>(1); }
+TSReturnCode TSMBufferDestroy(TSMBuffer) { return TS_SUCCESS; }
+TSReturnCode TSHandleMLocRelease(TSMBuffer, TSMLoc, TSMLoc) { return TS_SUCCESS; }
+TSMLoc TSHttpHdrCreate(TSMBuffer) { return 0; }
+TSReturnCode TSHttpHdrTypeSet(TSMBuffer, TSMLoc, TSHttpType) { return TS_SUCCESS; }
+TSParseResult TSHttpHdrParseResp(TSHttpParser, TSMBuffer, TSMLoc, const char **start, const char *) {
+  *start = strstr(*start, "\r\n\r\n") + 4;
+  return TS_PARSE_DONE;
+}
+TSHttpStatus TSHttpHdrStatusGet(TSMBuffer, TSMLoc) { return TS_HTTP_STATUS_OK; }
+TSMLoc TSMimeHdrFieldFind(TSMBuffer, TSMLoc, const char *, int) { return 0; }
+int TSMimeHdrFieldValuesCount(TSMBuffer, TSMLoc, TSMLoc) { return 0; }
+const char *TSMimeHdrFieldValueStringGet(TSMBuffer, TSMLoc, TSMLoc, int, int *) { return 0; }
+time_t TSMimeHdrFieldValueDateGet(TSMBuffer, TSMLoc, TSMLoc) { return 0; }
+
+static void *
+scheduledEvent(int id) {
+  return reinterpret_cast<void *>(id);
+}
+
+int main()
+{
+  HttpDataFetcherImpl::setCoalescing(true);
+
+  {
+    cout << endl << "===================== Test 1) coalesced fetch shared with waiters" << endl;
+    HttpDataFetcherImpl leader(reinterpret_cast<TSCont>(1), 0, "leader");
+    HttpDataFetcherImpl waiter(reinterpret_cast<TSCont>(2), 0, "waiter");
+    leader.addFetchRequest("http://frag/a");
+    waiter.addFetchRequest("http://frag/a");
+    assert(n_fetches == 1);
+    assert(leader.handleFetchEvent(static_cast<TSEvent>(10000), 0));
+    assert(!waiter.isFetchComplete());
+    int notify = n_scheduled;
+    assert(!waiter.isFetchEvent(TS_EVENT_IMMEDIATE, scheduledEvent(notify + 1)));
+    assert(waiter.isFetchEvent(TS_EVENT_IMMEDIATE, scheduledEvent(notify)));
+    assert(waiter.handleFetchEvent(TS_EVENT_IMMEDIATE, scheduledEvent(notify)));
+    const char *content;
+    int content_len;
+    assert(waiter.isFetchComplete());
+    assert(waiter.getContent("http://frag/a", content, content_len) && (string(content, content_len) == "body"));
+    leader.clear();
+    waiter.clear();
+  }
+
+  {
+    cout << endl << "===================== Test 2) waiters leaving after the leader completed" << endl;
+    HttpDataFetcherImpl leader(reinterpret_cast<TSCont>(1), 0, "leader");
+    HttpDataFetcherImpl timed_out_waiter(reinterpret_cast<TSCont>(2), 0, "timed_out_waiter");
+    HttpDataFetcherImpl cleared_waiter(reinterpret_cast<TSCont>(3), 0, "cleared_waiter");
+    leader.addFetchRequest("http://frag/b");
+    HttpDataFetcherImpl::setTimeouts(10, 0);
+    timed_out_waiter.addFetchRequest("http://frag/b");
+    int timer = n_scheduled;
+    cleared_waiter.addFetchRequest("http://frag/b");
+    HttpDataFetcherImpl::setTimeouts(0, 0);
+    int n_fetches_before = n_fetches;
+    assert(n_fetches_before > 0);
+
+    // results handed over; waiters leave before their notify events come in
+    assert(leader.handleFetchEvent(static_cast<TSEvent>(10000), 0));
+    int notify = n_scheduled - 1;
+    now += TS_HRTIME_MSECOND(10);
+    assert(timed_out_waiter.handleFetchEvent(TS_EVENT_TIMEOUT, scheduledEvent(timer)));
+    assert(timed_out_waiter.isFetchComplete());
+    assert(timed_out_waiter.getRequestStatus("http://frag/b") == STATUS_ERROR);
+    cleared_waiter.clear();
+
+    assert(timed_out_waiter.handleFetchEvent(TS_EVENT_IMMEDIATE, scheduledEvent(notify)));
+    assert(timed_out_waiter.getRequestStatus("http://frag/b") == STATUS_ERROR);
+    assert(n_fetches == n_fetches_before);
+    timed_out_waiter.clear();
+    leader.clear();
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
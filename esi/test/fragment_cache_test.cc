@@ -0,0 +1,164 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+
+#include <iostream>
+#include <assert.h>
+#include <string>
+
+#include "print_funcs.h"
+#include "Utils.h"
+#include "FragmentCache.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+static FragmentCache::Fragment
+makeFragment(const string &response, const string &body, time_t expiry_time) {
+  FragmentCache::Fragment fragment;
+  fragment.response = new SharedResponse(response.data(), response.size());
+  fragment.body_offset = response.find(body);
+  fragment.body_len = body.size();
+  fragment.validators = "\n\"etag\"\n\n";
+  fragment.expiry_time = expiry_time;
+  return fragment;
+}
+
+int main() 
+{
+  Utils::init(&Debug, &Error);
+
+  {
+    cout << endl << "===================== Test 1) lookup, insert and expiry" << endl;
+    FragmentCache cache("fragment_cache", &Debug, &Error, 64 * 1024, 4);
+    FragmentCache::Fragment fragment, cached;
+    assert(cache.lookup("url1", 100, cached) == false);
+
+    fragment = makeFragment("HTTP/1.0 200 OK\r\n\r\nbody1", "body1", 200);
+    cache.insert("url1", fragment);
+    fragment.response->release(); // cache holds its own reference
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("url1", 100, cached) == true);
+    assert(string(cached.response->data.data() + cached.body_offset, cached.body_len) == "body1");
+    assert(cached.validators == "\n\"etag\"\n\n");
+    assert(cached.expiry_time == 200);
+
+    // caller's reference outlives the entry
+    cache.clear();
+    assert(cache.getNumEntries() == 0);
+    assert(cache.getSize() == 0);
+    assert(string(cached.response->data.data() + cached.body_offset, cached.body_len) == "body1");
+    cached.response->release();
+
+    fragment = makeFragment("HTTP/1.0 200 OK\r\n\r\nbody2", "body2", 200);
+    cache.insert("url2", fragment);
+    fragment.response->release();
+    fragment = makeFragment("HTTP/1.0 200 OK\r\n\r\nbody3", "body3", 300);
+    cache.insert("url2", fragment); // replaces older entry
+    fragment.response->release();
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("url2", 250, cached) == true);
+    assert(string(cached.response->data.data() + cached.body_offset, cached.body_len) == "body3");
+    cached.response->release();
+    assert(cache.lookup("url2", 300, cached) == false); // expired entries are dropped
+    assert(cache.getNumEntries() == 0);
+
+    // expired entries with validators are kept for revalidation
+    bool stale = true;
+    assert(cache.lookup("url3", 100, cached, &stale) == false);
+    assert(stale == false);
+    fragment = makeFragment("HTTP/1.0 200 OK\r\n\r\nbody4", "body4", 200);
+    cache.insert("url3", fragment);
+    fragment.response->release();
+    assert(cache.lookup("url3", 100, cached, &stale) == true);
+    assert(stale == false);
+    cached.response->release();
+    assert(cache.lookup("url3", 200, cached, &stale) == true);
+    assert(stale == true);
+    assert(string(cached.response->data.data() + cached.body_offset, cached.body_len) == "body4");
+
+    // revalidated (304): stale response re-inserted with the 304's freshness and validators
+    cached.expiry_time = 400;
+    cached.validators = "\n\"etag2\"\n\n";
+    cache.insert("url3", cached);
+    cached.response->release();
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("url3", 300, cached, &stale) == true);
+    assert(stale == false);
+    assert(string(cached.response->data.data() + cached.body_offset, cached.body_len) == "body4");
+    assert(cached.validators == "\n\"etag2\"\n\n");
+    assert(cached.expiry_time == 400);
+    cached.response->release();
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("url3", 400, cached) == false);
+    assert(cache.getNumEntries() == 0);
+
+    fragment = makeFragment("HTTP/1.0 200 OK\r\n\r\nbody5", "body5", 200);
+    fragment.validators.clear();
+    cache.insert("url4", fragment);
+    fragment.response->release();
+    assert(cache.lookup("url4", 200, cached, &stale) == false);
+    assert(cache.getNumEntries() == 0);
+  }
+
+  {
+    cout << endl << "===================== Test 2) size limit and LRU eviction" << endl;
+    string body(1000, 'x');
+    FragmentCache cache("fragment_cache", &Debug, &Error, 3000, 1);
+    FragmentCache::Fragment fragment, cached;
+    const char *urls[] = { "url1", "url2", "url3", "url4" };
+    for (int i = 0; i < 3; ++i) {
+      fragment = makeFragment(body, body, 100);
+      cache.insert(urls[i], fragment);
+      fragment.response->release();
+      if (i == 1) {
+        assert(cache.lookup("url1", 0, cached) == true); // url2 is now least recently used
+        cached.response->release();
+      }
+    }
+    assert(cache.getNumEntries() == 2);
+    assert(cache.lookup("url2", 0, cached) == false);
+    fragment = makeFragment(body, body, 100);
+    cache.insert("url4", fragment);
+    fragment.response->release();
+    assert(cache.getNumEntries() == 2);
+    assert(cache.lookup("url3", 0, cached) == true);
+    cached.response->release();
+    assert(cache.lookup("url4", 0, cached) == true);
+    cached.response->release();
+    assert(cache.lookup("url1", 0, cached) == false);
+
+    // too big for the cache (or rather its shard)
+    string big_body(3000, 'x');
+    fragment = makeFragment(big_body, big_body, 100);
+    cache.insert("url5", fragment);
+    fragment.response->release();
+    assert(cache.lookup("url5", 0, cached) == false);
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
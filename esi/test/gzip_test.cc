@@ -0,0 +1,224 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+
+#include <iostream>
+#include <assert.h>
+#include <string>
+
+#include "print_funcs.h"
+#include "Utils.h"
+#include "gzip.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+// hands out a few bytes of space at a time, like a nearly full buffer block
+class SmallBlockOutput : public GzipOutput {
+public:
+  SmallBlockOutput(int block_size) : _block_size(block_size), n_produce_calls(0) { };
+  char *getWriteSpace(int &avail) {
+    _block.resize(_block_size);
+    avail = _block_size;
+    return &_block[0];
+  }
+  void produce(int n_bytes) {
+    data.append(_block.data(), n_bytes);
+    ++n_produce_calls;
+  }
+  string data;
+private:
+  string _block;
+  int _block_size;
+public:
+  int n_produce_calls;
+};
+
+static string
+gunzipToString(const string &cdata) {
+  BufferList buf_list;
+  assert(gunzip(cdata.data(), cdata.size(), buf_list) == true);
+  string data;
+  for (BufferList::iterator iter = buf_list.begin(); iter != buf_list.end(); ++iter) {
+    data.append(*iter);
+  }
+  return data;
+}
+
+int main() 
+{
+  Utils::init(&Debug, &Error);
+
+  {
+    cout << endl << "===================== Test 1) gzip and gunzip" << endl;
+    string data("<html><body>hello world</body></html>");
+    string cdata;
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    assert(cdata.size() > 18);
+    assert(gunzipToString(cdata) == data);
+
+    ByteBlockList blocks;
+    blocks.push_back(ByteBlock("abc", 3));
+    blocks.push_back(ByteBlock(0, 0));
+    blocks.push_back(ByteBlock("def", 3));
+    assert(gzip(blocks, cdata) == true);
+    assert(gunzipToString(cdata) == "abcdef");
+
+    blocks.clear();
+    assert(gzip(blocks, cdata) == true);
+    BufferList buf_list;
+    assert(gunzip(cdata.data(), cdata.size(), buf_list) == true);
+  }
+
+  {
+    cout << endl << "===================== Test 2) streaming into small blocks" << endl;
+    string data;
+    for (int i = 0; i < 5000; ++i) {
+      data.append(1, static_cast<char>('a' + ((i * 7) % 26)));
+      if (i % 100 == 0) {
+        data.append("<esi:include src=\"http://www.example.com/\"/>");
+      }
+    }
+    SmallBlockOutput output(7);
+    GzipStream gzip_stream(output);
+    assert(gzip_stream.init() == true);
+    assert(output.data.empty()); // header goes out with the first data
+    assert(gzip_stream.stream(data.data(), 1000) == true);
+    assert(gzip_stream.flush() == true);
+    assert(output.data.size() > 10);
+    assert(output.data[0] == '\x1f');
+    assert(output.data[1] == '\x8b');
+
+    // flushed output can be decompressed right away
+    z_stream zstrm;
+    zstrm.zalloc = Z_NULL;
+    zstrm.zfree = Z_NULL;
+    zstrm.opaque = Z_NULL;
+    assert(inflateInit2(&zstrm, -MAX_WBITS) == Z_OK);
+    string partial(2000, ' ');
+    zstrm.next_in = reinterpret_cast<Bytef *>(&output.data[10]);
+    zstrm.avail_in = output.data.size() - 10;
+    zstrm.next_out = reinterpret_cast<Bytef *>(&partial[0]);
+    zstrm.avail_out = partial.size();
+    assert(inflate(&zstrm, Z_SYNC_FLUSH) == Z_OK);
+    assert(partial.substr(0, partial.size() - zstrm.avail_out) == data.substr(0, 1000));
+    inflateEnd(&zstrm);
+
+    assert(gzip_stream.flush() == true); // nothing new to flush
+    ByteBlockList blocks;
+    blocks.push_back(ByteBlock(data.data() + 1000, 2000));
+    blocks.push_back(ByteBlock(data.data() + 3000, data.size() - 3000));
+    assert(gzip_stream.stream(blocks) == true);
+    assert(gzip_stream.finish() == true);
+    assert(gzip_stream.getTotalIn() == static_cast<int>(data.size()));
+    assert(output.n_produce_calls > 1);
+    assert(gunzipToString(output.data) == data);
+
+    // finished stream takes no more data
+    assert(gzip_stream.stream("x", 1) == false);
+
+    string cdata;
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    assert(gunzipToString(cdata) == data);
+  }
+
+  {
+    cout << endl << "===================== Test 3) uninitialized stream" << endl;
+    string cdata;
+    StringGzipOutput output(cdata);
+    GzipStream gzip_stream(output);
+    assert(gzip_stream.stream("x", 1) == false);
+    assert(gzip_stream.finish() == false);
+    assert(gzip_stream.init() == true);
+    assert(gzip_stream.init() == false);
+    assert(gzip_stream.finish() == true);
+    assert(gunzipToString(cdata) == "");
+  }
+
+  {
+    cout << endl << "===================== Test 4) stream pool and params" << endl;
+    string data(20000, 'x');
+    for (size_t i = 0; i < data.size(); i += 3) {
+      data[i] = static_cast<char>('a' + (i % 26));
+    }
+    string cdata;
+    int n_inits, n_reuses, n_inits2, n_reuses2;
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    getGzipPoolStats(n_inits, n_reuses);
+    assert(n_inits >= 1);
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    getGzipPoolStats(n_inits2, n_reuses2);
+    assert(n_inits2 == n_inits);
+    assert(n_reuses2 == n_reuses + 2);
+    string default_cdata(cdata);
+
+    // streams with other settings are not reused for these
+    GzipParams params;
+    params.level = 9;
+    params.mem_level = 9;
+    setGzipParams(params);
+    assert(getGzipParams().level == 9);
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    assert(gunzipToString(cdata) == data);
+    getGzipPoolStats(n_inits, n_reuses);
+    assert(n_inits == n_inits2 + 1);
+
+    params.fast_mode_min_size = 10000;
+    setGzipParams(params);
+    string fast_cdata;
+    assert(gzip(data.data(), data.size(), fast_cdata) == true);
+    assert(gunzipToString(fast_cdata) == data);
+    assert(fast_cdata != cdata);
+    assert(gzip(data.data(), 5000, cdata) == true); // too small for fast mode
+    assert(gunzipToString(cdata) == data.substr(0, 5000));
+    getGzipPoolStats(n_inits2, n_reuses2);
+    assert(n_inits2 == n_inits + 1);
+    assert(n_reuses2 == n_reuses + 1);
+
+    params.max_pooled_streams = 0;
+    setGzipParams(params);
+    assert(gzip(data.data(), 5000, cdata) == true); // pooled stream can still be used ...
+    assert(gzip(data.data(), 5000, cdata) == true); // ... but is not put back
+    getGzipPoolStats(n_inits, n_reuses);
+    assert(n_inits == n_inits2 + 1);
+    assert(n_reuses == n_reuses2 + 1);
+
+    // invalid settings fall back to defaults
+    params.level = 12;
+    params.mem_level = 0;
+    setGzipParams(params);
+    assert(getGzipParams().level == GzipParams().level);
+    assert(getGzipParams().mem_level == GzipParams().mem_level);
+
+    setGzipParams(GzipParams());
+    assert(gzip(data.data(), data.size(), cdata) == true);
+    assert(cdata == default_cdata);
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
@@ -0,0 +1,104 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+
+#include <iostream>
+#include <assert.h>
+#include <string>
+
+#include "print_funcs.h"
+#include "Utils.h"
+#include "OutputCache.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+int main() 
+{
+  Utils::init(&Debug, &Error);
+
+  {
+    cout << endl << "===================== Test 1) lookup and insert" << endl;
+    OutputCache cache("output_cache", &Debug, &Error, 64 * 1024);
+    const char *output;
+    int output_len;
+    assert(cache.lookup("id1", "v1", output, output_len) == false);
+    cache.insert("id1", "v1", "output1", 7);
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("id1", "v1", output, output_len) == true);
+    assert(string(output, output_len) == "output1");
+
+    // stale entries are kept till replaced
+    assert(cache.lookup("id1", "v2", output, output_len) == false);
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("id2", "v1", output, output_len) == false);
+    cache.insert("id1", "v2", "output2", 7);
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup("id1", "v1", output, output_len) == false);
+    assert(cache.lookup("id1", "v2", output, output_len) == true);
+    assert(string(output, output_len) == "output2");
+
+    // binary output
+    string gzipped("\x1f\x8b\x08\0\0\0", 6);
+    cache.insert("id2", "", gzipped.data(), gzipped.size());
+    assert(cache.lookup("id2", "", output, output_len) == true);
+    assert(string(output, output_len) == gzipped);
+
+    cache.clear();
+    assert(cache.getNumEntries() == 0);
+    assert(cache.getSize() == 0);
+  }
+
+  {
+    cout << endl << "===================== Test 2) size limit and LRU eviction" << endl;
+    string data(1000, 'x');
+    OutputCache cache("output_cache", &Debug, &Error, 3500);
+    cache.insert("id1", "", data.data(), data.size());
+    cache.insert("id2", "", data.data(), data.size());
+    cache.insert("id3", "", data.data(), data.size());
+    assert(cache.getNumEntries() == 3);
+    assert(cache.getSize() <= 3500);
+
+    const char *output;
+    int output_len;
+    assert(cache.lookup("id1", "", output, output_len) == true); // id2 is now least recently used
+    cache.insert("id4", "", data.data(), data.size());
+    assert(cache.getNumEntries() == 3);
+    assert(cache.lookup("id2", "", output, output_len) == false);
+    assert(cache.lookup("id1", "", output, output_len) == true);
+    assert(cache.lookup("id3", "", output, output_len) == true);
+    assert(cache.lookup("id4", "", output, output_len) == true);
+
+    // too big to be cached at all
+    string big_data(4000, 'x');
+    cache.insert("id5", "", big_data.data(), big_data.size());
+    assert(cache.lookup("id5", "", output, output_len) == false);
+    assert(cache.getNumEntries() == 3);
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
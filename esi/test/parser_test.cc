@@ -24,6 +24,7 @@
 #include <iostream>
 #include <assert.h>
 #include <string>
+#include <algorithm>
 
 #include "EsiParser.h"
 #include "print_funcs.h"
@@ -1582,6 +1583,221 @@ int main()
     assert(attr_iter->value_len == 6);
     assert(strncmp(attr_iter->value, "c >= d", attr_iter->value_len) == 0);
   }
+
+  {
+    cout << endl << "===================== Test 59) vectorized and scalar tag scans agree" << endl;
+    string input_data;
+    for (int i = 0; i < 70; ++i) {
+      input_data.append(i, 'x');
+      input_data.append((i % 2) ? "<esi:include src=url/>" : "<!--esi <esi:comment text=blah/>-->");
+      input_data.append("<a href=foo><!-- c --><");
+    }
+    for (int chunk_size = 1; chunk_size <= 70; ++chunk_size) {
+      DocNodeList node_lists[2];
+      // node data points into the parsers; keep them around till the comparison
+      EsiParser vectorized_parser("parser_test", &Debug, &Error), scalar_parser("parser_test", &Debug, &Error);
+      for (int scalar = 0; scalar < 2; ++scalar) {
+        EsiParser::setScalarTagScan(scalar);
+        EsiParser &parser = scalar ? scalar_parser : vectorized_parser;
+        for (size_t pos = 0; pos < input_data.size(); pos += chunk_size) {
+          assert(parser.parseChunk(input_data.data() + pos, node_lists[scalar],
+                                   std::min(static_cast<size_t>(chunk_size), input_data.size() - pos)) == true);
+        }
+        assert(parser.completeParse(node_lists[scalar]) == true);
+      }
+      EsiParser::setScalarTagScan(false);
+      assert(node_lists[0].size() == node_lists[1].size());
+      assert(node_lists[0].size() == 140);
+      DocNodeList::iterator iter0 = node_lists[0].begin(), iter1 = node_lists[1].begin();
+      for (; iter0 != node_lists[0].end(); ++iter0, ++iter1) {
+        assert(iter0->type == iter1->type);
+        assert(iter0->data_len == iter1->data_len);
+        assert(strncmp(iter0->data, iter1->data, iter0->data_len) == 0);
+      }
+    }
+  }
+
+  {
+    cout << endl << "===================== Test 60) closing tag search across chunks" << endl;
+    string body;
+    for (int i = 0; i < 200; ++i) {
+      body.append("<div>---- - -- --- > </esi:choos </esi:choosee> <!- -></div>\n");
+    }
+    string input_data("<esi:comment text=\"a\"/><!--esi ");
+    input_data.append(body);
+    input_data.append("--><esi:choose><esi:when test=\"1\">");
+    input_data.append(body);
+    input_data.append("</esi:when></esi:choose>");
+    for (int chunk_size = 1; chunk_size < 40; ++chunk_size) {
+      EsiParser parser("parser_test", &Debug, &Error);
+      DocNodeList node_list;
+      for (size_t pos = 0; pos < input_data.size(); pos += chunk_size) {
+        assert(parser.parseChunk(input_data.data() + pos, node_list,
+                                 std::min(static_cast<size_t>(chunk_size), input_data.size() - pos)) == true);
+      }
+      assert(parser.completeParse(node_list) == true);
+      assert(node_list.size() == 3);
+      DocNodeList::iterator list_iter = node_list.begin();
+      assert(list_iter->type == DocNode::TYPE_COMMENT);
+      ++list_iter;
+      assert(list_iter->type == DocNode::TYPE_HTML_COMMENT);
+      assert(list_iter->data_len == static_cast<int>(body.size()));
+      assert(strncmp(list_iter->data, body.data(), body.size()) == 0);
+      ++list_iter;
+      assert(list_iter->type == DocNode::TYPE_CHOOSE);
+      assert(list_iter->child_nodes.size() == 1);
+      assert(list_iter->child_nodes.begin()->type == DocNode::TYPE_WHEN);
+    }
+  }
+
+  {
+    cout << endl << "===================== Test 61) node data stays valid across chunk buffers" << endl;
+    string input_data;
+    char buf[64];
+    for (int i = 0; i < 5000; ++i) {
+      snprintf(buf, sizeof(buf), "<p>text %d</p><esi:vars>$(VAR_%d)</esi:vars>", i, i);
+      input_data.append(buf);
+    }
+    int chunk_sizes[] = { 7, 100, 4096, 70000 };
+    for (int i_chunk = 0; i_chunk < 4; ++i_chunk) {
+      EsiParser parser("parser_test", &Debug, &Error);
+      DocNodeList node_list;
+      int chunk_size = chunk_sizes[i_chunk];
+      for (size_t pos = 0; pos < input_data.size(); pos += chunk_size) {
+        assert(parser.parseChunk(input_data.data() + pos, node_list,
+                                 std::min(static_cast<size_t>(chunk_size), input_data.size() - pos)) == true);
+      }
+      assert(parser.completeParse(node_list) == true);
+      assert(node_list.size() == 10000);
+      DocNodeList::iterator list_iter = node_list.begin();
+      for (int i = 0; i < 5000; ++i) {
+        snprintf(buf, sizeof(buf), "<p>text %d</p>", i);
+        assert(list_iter->type == DocNode::TYPE_PRE);
+        assert(list_iter->data_len == static_cast<int>(strlen(buf)));
+        assert(strncmp(list_iter->data, buf, list_iter->data_len) == 0);
+        ++list_iter;
+        snprintf(buf, sizeof(buf), "$(VAR_%d)", i);
+        assert(list_iter->type == DocNode::TYPE_VARS);
+        assert(list_iter->data_len == static_cast<int>(strlen(buf)));
+        assert(strncmp(list_iter->data, buf, list_iter->data_len) == 0);
+        ++list_iter;
+      }
+    }
+  }
+
+  {
+    cout << endl << "===================== Test 62) include timeout attribute" << endl;
+    const char *inputs[] = { "<esi:include src=\"http://x.com/a?timeout=1\" timeout=\"250\"/>",
+                             "<esi:include timeout=250 src=http://x.com/a?timeout=1 />" };
+    for (int i = 0; i < 2; ++i) {
+      EsiParser parser("parser_test", &Debug, &Error);
+      DocNodeList node_list;
+      assert(parser.parse(node_list, inputs[i]) == true);
+      assert(node_list.size() == 1);
+      DocNode &node = node_list.back();
+      assert(node.type == DocNode::TYPE_INCLUDE);
+      assert(node.attr_list.size() == 2);
+      check_node_attr(node.attr_list.front(), "src", "http://x.com/a?timeout=1");
+      check_node_attr(node.attr_list.back(), "timeout", "250");
+    }
+
+    EsiParser parser("parser_test", &Debug, &Error);
+    DocNodeList node_list;
+    assert(parser.parse(node_list, "<esi:include src=http://x.com/a?timeout=1 />") == true);
+    assert(node_list.size() == 1);
+    assert(node_list.back().attr_list.size() == 1);
+
+    // only an attribute of that name counts
+    const char *other_inputs[] = { "<esi:include src=\"http://a/b\" alt=\"http://a/timeout\"/>",
+                                   "<esi:include src=http://a/b alt=http://a/timeout=1 />",
+                                   "<esi:include src=http://a/b alt=\"x timeout=1\" />",
+                                   "<esi:include src=abc timeout />" };
+    for (int i = 0; i < 4; ++i) {
+      node_list.clear();
+      assert(parser.parse(node_list, other_inputs[i]) == true);
+      assert(node_list.size() == 1);
+      assert(node_list.back().attr_list.size() == 1);
+    }
+
+    node_list.clear();
+    assert(parser.parse(node_list, "<esi:include src=abc timeout=\"250 />") == false);
+  }
+
+  {
+    cout << endl << "===================== Test 64) single quoted and whitespace separated attributes" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    DocNodeList node_list;
+    const char *include_inputs[] = { "<esi:include src='http://a/b' timeout='500'/>",
+                                     "<esi:include src=http://a/b\ttimeout\n='500' />",
+                                     "<esi:include src='http://a/b?x=\"timeout=1\"' timeout=500 />" };
+    for (int i = 0; i < 3; ++i) {
+      node_list.clear();
+      assert(parser.parse(node_list, include_inputs[i]) == true);
+      assert(node_list.size() == 1);
+      DocNode &node = node_list.back();
+      assert(node.attr_list.size() == 2);
+      check_node_attr(node.attr_list.back(), "timeout", "500");
+    }
+    check_node_attr(node_list.back().attr_list.front(), "src", "http://a/b?x=\"timeout=1\"");
+
+    node_list.clear();
+    assert(parser.parse(node_list, "<esi:include src=http://a/b alt='x timeout=1' />") == true);
+    assert(node_list.back().attr_list.size() == 1);
+
+    const char *try_inputs[] = { "<esi:try deadline='50'><esi:attempt>foo</esi:attempt><esi:except>bar</esi:except></esi:try>",
+                                 "<esi:try deadline\t='50' ><esi:attempt>foo</esi:attempt>"
+                                 "<esi:except>bar</esi:except></esi:try>" };
+    for (int i = 0; i < 2; ++i) {
+      node_list.clear();
+      assert(parser.parse(node_list, try_inputs[i]) == true);
+      assert(node_list.size() == 1);
+      DocNode &node = node_list.back();
+      assert(node.type == DocNode::TYPE_TRY);
+      assert(node.attr_list.size() == 1);
+      check_node_attr(node.attr_list.front(), "deadline", "50");
+      assert(node.child_nodes.size() == 2);
+    }
+
+    node_list.clear();
+    assert(parser.parse(node_list, "<esi:include src=abc timeout='250\" />") == false);
+  }
+
+  {
+    cout << endl << "===================== Test 63) try block deadline attribute" << endl;
+    EsiParser parser("parser_test", &Debug, &Error);
+    DocNodeList node_list;
+    const char *inputs[] = { "<esi:try deadline=50><esi:attempt>foo</esi:attempt><esi:except>bar</esi:except></esi:try>",
+                             "<esi:try deadline=\"50\" ><esi:attempt>foo</esi:attempt>"
+                             "<esi:except>bar</esi:except></esi:try>" };
+    for (int i = 0; i < 2; ++i) {
+      node_list.clear();
+      assert(parser.parse(node_list, inputs[i]) == true);
+      assert(node_list.size() == 1);
+      DocNode &node = node_list.back();
+      assert(node.type == DocNode::TYPE_TRY);
+      assert(node.attr_list.size() == 1);
+      check_node_attr(node.attr_list.front(), "deadline", "50");
+      assert(node.child_nodes.size() == 2);
+      assert(node.child_nodes.front().type == DocNode::TYPE_ATTEMPT);
+      assert(node.child_nodes.back().type == DocNode::TYPE_EXCEPT);
+    }
+
+    // other attributes and the deadline attribute of a child are not the try block's
+    const char *other_inputs[] = { "<esi:try id=x><esi:attempt>foo</esi:attempt><esi:except>bar</esi:except></esi:try>",
+                                   "<esi:try ><esi:attempt><esi:include src=a deadline=50 /></esi:attempt>"
+                                   "<esi:except>bar</esi:except></esi:try>" };
+    for (int i = 0; i < 2; ++i) {
+      node_list.clear();
+      assert(parser.parse(node_list, other_inputs[i]) == true);
+      assert(node_list.size() == 1);
+      assert(node_list.back().attr_list.size() == 0);
+      assert(node_list.back().child_nodes.size() == 2);
+    }
+
+    node_list.clear();
+    assert(parser.parse(node_list, "<esi:try deadline=\"50><esi:attempt>foo</esi:attempt>"
+                        "<esi:except>bar</esi:except></esi:try>") == false);
+  }
   
   cout << endl << "All tests passed!" << endl;
   return 0;
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <assert.h>
 #include <string>
+#include <algorithm>
 
 #include "EsiProcessor.h"
 #include "TestHttpDataFetcher.h"
@@ -1127,6 +1128,354 @@ int main()
     assert(esi_proc.usePackedNodeList(packedNodeList.data(), 0) == false);
   }
 
+  {
+    cout << endl << "===================== Test 49) streaming output" << endl;
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+
+    data_fetcher.setDataPending(true);
+    assert(esi_proc.addParseData("foo <esi:include src=url1/>bar ") == true);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+    assert(output_data_len == 4);
+    assert(strncmp(output_data, "foo ", output_data_len) == 0);
+
+    // blocked on include
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+    assert(output_data_len == 0);
+
+    data_fetcher.setDataPending(false);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+    assert(string(output_data, output_data_len) == ">>>>> Content for URL [url1] <<<<<");
+
+    // try block has to wait for parse to complete
+    assert(esi_proc.addParseData("<esi:try><esi:attempt><esi:include src=url2 /></esi:attempt>"
+                                 "<esi:except>except</esi:except></esi:try> end") == true);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+    assert(string(output_data, output_data_len) == "bar ");
+
+    assert(esi_proc.completeParse() == true);
+    data_fetcher.setDataPending(true);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+    assert(output_data_len == 0);
+
+    data_fetcher.setDataPending(false);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == ">>>>> Content for URL [url2] <<<<< end");
+
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(output_data_len == 0);
+  }
+
+  {
+    cout << endl << "===================== Test 50) streamed output matches processed output" << endl;
+    string input_data("<esi:vars>x</esi:vars><esi:include src=url1/>"
+                      "<esi:choose><esi:when test=\"1\"><esi:include src=url3/> when</esi:when></esi:choose>"
+                      "<!--esi <esi:include src=url4/>--><esi:try><esi:attempt><esi:include src=url2 />"
+                      "</esi:attempt><esi:except>except</esi:except></esi:try> end");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    string processed_output(output_data, output_data_len);
+    esi_proc.stop();
+
+    string streamed_output;
+    for (size_t i = 0; i < input_data.size(); i += 5) {
+      assert(esi_proc.addParseData(input_data.data() + i, std::min(static_cast<size_t>(5),
+                                                                   input_data.size() - i)) == true);
+      assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::NEED_MORE_DATA);
+      streamed_output.append(output_data, output_data_len);
+    }
+    assert(esi_proc.completeParse() == true);
+    assert(esi_proc.flush(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    streamed_output.append(output_data, output_data_len);
+    assert(streamed_output == processed_output);
+  }
+
+  {
+    cout << endl << "===================== Test 51) packed node list versions" << endl;
+    string input_data("<esi:vars>x</esi:vars><esi:include src=url1/>"
+                      "<esi:choose><esi:when test=\"1\"><esi:include src=url3/> when</esi:when></esi:choose>"
+                      "<!--esi <esi:include src=url4/>--><esi:try><esi:attempt><esi:include src=url2 />"
+                      "</esi:attempt><esi:except>except</esi:except></esi:try> end");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    string processed_output(output_data, output_data_len);
+
+    // packed as parsed, i.e., not as left by processing
+    string packed_v2;
+    esi_proc.packNodeList(packed_v2, false);
+    assert(FlatDocNodeList::isPackedVersion2(packed_v2.data(), packed_v2.size()) == true);
+    esi_proc.stop();
+
+    assert(esi_proc.usePackedNodeList(packed_v2) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == processed_output);
+    string packed_v2_again;
+    esi_proc.packNodeList(packed_v2_again, false);
+    assert(packed_v2_again == packed_v2);
+    esi_proc.stop();
+
+    string unaligned("x");
+    unaligned.append(packed_v2);
+    assert(esi_proc.usePackedNodeList(unaligned.data() + 1, unaligned.size() - 1) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == processed_output);
+    esi_proc.stop();
+
+    EsiParser parser("parser", &Debug, &Error);
+    DocNodeList node_list;
+    assert(parser.parse(node_list, input_data) == true);
+    string packed_v1 = node_list.pack();
+    assert(esi_proc.usePackedNodeList(packed_v1) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == processed_output);
+    esi_proc.stop();
+
+    assert(esi_proc.usePackedNodeList(packed_v2.data(), packed_v2.size() - 1) == false);
+  }
+
+  {
+    cout << endl << "===================== Test 52) compiled expressions in packed node list" << endl;
+    esi_vars.populate(HttpHeader("Host", -1, "example.com", -1));
+    string input_data("<esi:vars>host=$(HTTP_HOST) ref=$(HTTP_REFERER|'none')</esi:vars>"
+                      "<esi:include src=\"http://$(HTTP_HOST)/inc\"/>"
+                      "<esi:choose><esi:when test=\"$(HTTP_HOST) != 'example.com'\">no match</esi:when>"
+                      "<esi:when test=\"$(HTTP_HOST) == 'example.com'\">match</esi:when></esi:choose>");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    string processed_output(output_data, output_data_len);
+    assert(processed_output.find("host=example.com ref=none") == 0);
+    assert(processed_output.find("no match") == string::npos);
+    assert(processed_output.rfind("match") == (processed_output.size() - 5));
+
+    string packed_v2;
+    esi_proc.packNodeList(packed_v2, false);
+    esi_proc.stop();
+    assert(esi_proc.usePackedNodeList(packed_v2) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == processed_output);
+    esi_proc.stop();
+    esi_vars.clear();
+  }
+
+  {
+    cout << endl << "===================== Test 53) output blocks match processed output" << endl;
+    esi_vars.populate(HttpHeader("Host", -1, "example.com", -1));
+    StubIncludeHandler::FOOTER = "<!--footer-->";
+    StubIncludeHandler::FOOTER_SIZE = strlen(StubIncludeHandler::FOOTER);
+    string input_data("pre <esi:vars>$(HTTP_HOST)</esi:vars><esi:vars>-x</esi:vars> mid"
+                      "<esi:include src=url1/><esi:choose><esi:when test=\"$(HTTP_HOST)\">when"
+                      "<esi:vars>w</esi:vars></esi:when></esi:choose><esi:special-include handler=stub />"
+                      "<esi:try><esi:attempt><esi:include src=url2 /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try><esi:vars></esi:vars> end");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    string processed_output(output_data, output_data_len);
+    esi_proc.stop();
+
+    ByteBlockList blocks;
+    blocks.push_back(ByteBlock("existing", 8)); // left in place
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.process(blocks) == EsiProcessor::SUCCESS);
+    assert(string(blocks.front().data, blocks.front().data_len) == "existing");
+    blocks.pop_front();
+    string gathered_output;
+    bool found_merged_vars = false;
+    for (ByteBlockList::iterator iter = blocks.begin(); iter != blocks.end(); ++iter) {
+      assert(iter->data && (iter->data_len > 0));
+      gathered_output.append(iter->data, iter->data_len);
+      if (string(iter->data, iter->data_len) == "example.com-x") {
+        found_merged_vars = true; // adjacent expansions share a block
+      }
+    }
+    assert(gathered_output == processed_output);
+    assert(found_merged_vars);
+
+    // blocks of a failed document are not handed out
+    blocks.clear();
+    esi_proc.stop();
+    assert(esi_proc.completeParse("<esi:include src=url1/>") == true);
+    data_fetcher.setReturnData(false);
+    assert(esi_proc.process(blocks) == EsiProcessor::FAILURE);
+    assert(blocks.empty());
+    data_fetcher.setReturnData(true);
+    esi_proc.stop();
+    StubIncludeHandler::FOOTER = 0;
+    StubIncludeHandler::FOOTER_SIZE = 0;
+    esi_vars.clear();
+  }
+
+  {
+    cout << endl << "===================== Test 54) circuit breaker skips failing attempts" << endl;
+    CircuitBreakerParams breaker_params;
+    breaker_params.enabled = true;
+    breaker_params.min_requests = 2;
+    breaker_params.open_duration = 60000;
+    FailureInfo::setCircuitBreakerParams(breaker_params);
+    FailureRegistry failures("failure_registry", &Debug, &Error);
+    EsiProcessor::setFailureRegistry(&failures);
+    string input_data("<esi:try><esi:attempt><esi:include src=breaker_attempt /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try>");
+    for (int i = 0; i < 3; ++i) {
+      TestHttpDataFetcher data_fetcher;
+      EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                            handler_mgr);
+      const char *output_data;
+      int output_data_len = 0;
+      data_fetcher.setReturnData(false);
+      assert(esi_proc.completeParse(input_data) == true);
+      // the first two failures open the circuit; the third document doesn't even try
+      assert(data_fetcher.getNumPendingRequests() == ((i < 2) ? 1 : 0));
+      assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+      assert(string(output_data, output_data_len) == "except");
+    }
+    FailureInfo *info = failures.find("breaker_attempt", time(NULL));
+    assert(info && (info->getCircuitState() == FailureInfo::CIRCUIT_OPEN));
+    failures.release(info);
+    EsiProcessor::setFailureRegistry(0);
+    FailureInfo::setCircuitBreakerParams(CircuitBreakerParams());
+  }
+
+  {
+    cout << endl << "===================== Test 55) slow attempt section swapped for except section" << endl;
+    FailureRegistry failures("failure_registry", &Debug, &Error);
+    EsiProcessor::setFailureRegistry(&failures);
+    EsiProcessor::setAttemptDeadline(100, 90);
+    FailureInfo *info = failures.get("slow_attempt", time(NULL));
+    for (int i = 0; i < 10; ++i) {
+      info->registerSuccFail(true, 500);
+    }
+    string input_data("<esi:include src=fast />"
+                      "<esi:try><esi:attempt><esi:include src=slow_attempt /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try>");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    data_fetcher.setDataPending(true);
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(data_fetcher.getNumPendingRequests() == 2);
+    assert(esi_proc.canProcess() == false); // still waiting for the regular include
+
+    TestHttpDataFetcher try_data_fetcher;
+    EsiProcessor try_esi_proc("processor", "parser", "expression", &Debug, &Error, try_data_fetcher, esi_vars,
+                              handler_mgr);
+    try_data_fetcher.setDataPending(true);
+    assert(try_esi_proc.completeParse(input_data.substr(24)) == true);
+    assert(try_esi_proc.canProcess() == true);
+    assert(try_esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == "except");
+
+    // attempt fetch completing later still feeds the statistics
+    int n_failures, n_successes;
+    try_esi_proc.registerDeferredAttempts();
+    info->getCounts(n_failures, n_successes);
+    assert(n_successes == 10);
+    try_data_fetcher.setDataPending(false);
+    try_esi_proc.registerDeferredAttempts();
+    info->getCounts(n_failures, n_successes);
+    assert((n_failures == 0) && (n_successes == 11));
+    EsiProcessor::setAttemptDeadline(0, 90);
+    failures.release(info);
+    EsiProcessor::setFailureRegistry(0);
+  }
+
+  {
+    cout << endl << "===================== Test 56) include timeout attribute" << endl;
+    string input_data("<esi:include src=a timeout=250 /><esi:include src=b />"
+                      "<esi:include src=c timeout=abc /><esi:include src=a timeout=100 />");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    const char *output_data;
+    int output_data_len = 0;
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(data_fetcher.getNumPendingRequests() == 3);
+    assert(data_fetcher.getRequestTimeout("a") == 250);
+    assert(data_fetcher.getRequestTimeout("b") == -1);
+    assert(data_fetcher.getRequestTimeout("c") == -1);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) ==
+           ">>>>> Content for URL [a] <<<<<>>>>> Content for URL [b] <<<<<"
+           ">>>>> Content for URL [c] <<<<<>>>>> Content for URL [a] <<<<<");
+  }
+
+  {
+    cout << endl << "===================== Test 57) try block deadline attribute" << endl;
+    FailureRegistry failures("failure_registry", &Debug, &Error);
+    EsiProcessor::setFailureRegistry(&failures);
+    FailureInfo *info = failures.get("deadline_attempt", time(NULL));
+    for (int i = 0; i < 10; ++i) {
+      info->registerSuccFail(true, 200);
+    }
+    const char *output_data;
+    int output_data_len = 0;
+
+    // no configured deadline; the block's own applies
+    string input_data("<esi:try deadline=100><esi:attempt><esi:include src=deadline_attempt /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try>");
+    TestHttpDataFetcher data_fetcher;
+    EsiProcessor esi_proc("processor", "parser", "expression", &Debug, &Error, data_fetcher, esi_vars,
+                          handler_mgr);
+    data_fetcher.setDataPending(true);
+    assert(esi_proc.completeParse(input_data) == true);
+    assert(esi_proc.canProcess() == true);
+    assert(esi_proc.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == "except");
+
+    // the block's deadline takes precedence over the configured one
+    EsiProcessor::setAttemptDeadline(100, 90);
+    input_data.assign("<esi:try deadline=500><esi:attempt><esi:include src=deadline_attempt /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try>");
+    TestHttpDataFetcher data_fetcher2;
+    EsiProcessor esi_proc2("processor", "parser", "expression", &Debug, &Error, data_fetcher2, esi_vars,
+                           handler_mgr);
+    data_fetcher2.setDataPending(true);
+    assert(esi_proc2.completeParse(input_data) == true);
+    assert(esi_proc2.canProcess() == false); // waits for the attempt
+    data_fetcher2.setDataPending(false);
+    assert(esi_proc2.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == ">>>>> Content for URL [deadline_attempt] <<<<<");
+
+    // an invalid one falls back to the configured deadline
+    input_data.assign("<esi:try deadline=abc><esi:attempt><esi:include src=deadline_attempt /></esi:attempt>"
+                      "<esi:except>except</esi:except></esi:try>");
+    TestHttpDataFetcher data_fetcher3;
+    EsiProcessor esi_proc3("processor", "parser", "expression", &Debug, &Error, data_fetcher3, esi_vars,
+                           handler_mgr);
+    data_fetcher3.setDataPending(true);
+    assert(esi_proc3.completeParse(input_data) == true);
+    assert(esi_proc3.canProcess() == true);
+    assert(esi_proc3.process(output_data, output_data_len) == EsiProcessor::SUCCESS);
+    assert(string(output_data, output_data_len) == "except");
+    EsiProcessor::setAttemptDeadline(0, 90);
+    failures.release(info);
+    EsiProcessor::setFailureRegistry(0);
+  }
+
   cout << endl << "All tests passed!" << endl;
   return 0;
 }
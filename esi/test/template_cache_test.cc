@@ -0,0 +1,107 @@
+/** @file
+
+  A brief file description
+
+  @section license License
+
+  Licensed to the Apache Software Foundation (ASF) under one
+  or more contributor license agreements.  See the NOTICE file
+  distributed with this work for additional information
+  regarding copyright ownership.  The ASF licenses this file
+  to you under the Apache License, Version 2.0 (the
+  "License"); you may not use this file except in compliance
+  with the License.  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+ */
+
+
+#include <iostream>
+#include <assert.h>
+#include <string>
+
+#include "print_funcs.h"
+#include "Utils.h"
+#include "TemplateCache.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using namespace EsiLib;
+
+int main() 
+{
+  Utils::init(&Debug, &Error);
+
+  {
+    cout << endl << "===================== Test 1) hashing" << endl;
+    string data("<html><esi:include src=\"http://example.com/foo\"/></html>");
+    uint64_t full_hash = TemplateCache::hash(data.data(), data.size());
+    uint64_t piece_hash = TemplateCache::hash(data.data(), 10);
+    piece_hash = TemplateCache::hash(data.data() + 10, data.size() - 10, piece_hash);
+    assert(full_hash == piece_hash);
+    assert(TemplateCache::hash("", 0) == TemplateCache::HASH_SEED);
+    data[20] = 'X';
+    assert(TemplateCache::hash(data.data(), data.size()) != full_hash);
+  }
+
+  {
+    cout << endl << "===================== Test 2) lookup and insert" << endl;
+    TemplateCache cache("template_cache", &Debug, &Error, 64 * 1024);
+    string packed_node_list;
+    assert(cache.lookup(1, 10, "etag1", packed_node_list) == false);
+    cache.insert(1, 10, "etag1", "packed1");
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup(1, 10, "etag1", packed_node_list) == true);
+    assert(packed_node_list == "packed1");
+
+    // validator and template size have to match too
+    assert(cache.lookup(1, 10, "etag2", packed_node_list) == false);
+    assert(cache.lookup(1, 11, "etag1", packed_node_list) == false);
+
+    // newer entry replaces older one with same key
+    cache.insert(1, 10, "etag2", "packed2");
+    assert(cache.getNumEntries() == 1);
+    assert(cache.lookup(1, 10, "etag1", packed_node_list) == false);
+    assert(cache.lookup(1, 10, "etag2", packed_node_list) == true);
+    assert(packed_node_list == "packed2");
+
+    cache.clear();
+    assert(cache.getNumEntries() == 0);
+    assert(cache.getSize() == 0);
+  }
+
+  {
+    cout << endl << "===================== Test 3) size limit and LRU eviction" << endl;
+    string packed_node_list(1000, 'x');
+    TemplateCache cache("template_cache", &Debug, &Error, 3500);
+    cache.insert(1, 100, "", packed_node_list);
+    cache.insert(2, 100, "", packed_node_list);
+    cache.insert(3, 100, "", packed_node_list);
+    assert(cache.getNumEntries() == 3);
+    assert(cache.getSize() <= 3500);
+
+    string out;
+    assert(cache.lookup(1, 100, "", out) == true); // 2 is now least recently used
+    cache.insert(4, 100, "", packed_node_list);
+    assert(cache.getNumEntries() == 3);
+    assert(cache.lookup(2, 100, "", out) == false);
+    assert(cache.lookup(1, 100, "", out) == true);
+    assert(cache.lookup(3, 100, "", out) == true);
+    assert(cache.lookup(4, 100, "", out) == true);
+
+    // too big to be cached at all
+    cache.insert(5, 100, "", string(4000, 'x'));
+    assert(cache.lookup(5, 100, "", out) == false);
+    assert(cache.getNumEntries() == 3);
+  }
+
+  cout << endl << "All tests passed!" << endl;
+  return 0;
+}
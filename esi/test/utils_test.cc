@@ -110,6 +110,17 @@ int main()
   const char *expected_strs9[] = { "n1", "v1", "n2", "v2", "n3", "v3", "n4", "v4=extrav4", 0 };
   checkAttributes("test9", attr_list, expected_strs9);
 
+  const char *value;
+  int value_len;
+  assert(Utils::findAttribute(str9.data(), str9.size(), "n4", 2, value, value_len, ";,") == true);
+  assert(string(value, value_len) == "v4=extrav4");
+  assert(Utils::findAttribute(str9.data(), str9.size(), "n", 1, value, value_len, ";,") == false);
+  assert(Utils::findAttribute(str8.data(), str8.size(), "extra_mime", 10, value, value_len) == true);
+  assert(string(value, value_len) == escaped_sequence);
+  string str10("a=1; b=2; a=3");
+  assert(Utils::findAttribute(str10.data(), str10.size(), "a", 1, value, value_len, ";") == true);
+  assert(string(value, value_len) == "3"); // last one wins
+
   cout << endl << "All tests passed!" << endl;
   return 0;
 }
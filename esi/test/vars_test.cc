@@ -50,6 +50,27 @@ addToHeaderList(const char *strings[], HttpHeaderList &headers) {
   }
 }
 
+void
+checkCompiled(Expression &esi_expr, const char *exprs[]) {
+  for (int i = 0; exprs[i]; ++i) {
+    string code;
+    Expression::compile(exprs[i], -1, code);
+    bool result = !esi_expr.evaluate(exprs[i]);
+    assert(esi_expr.evaluateCompiled(code.data(), code.size(), result));
+    assert(result == esi_expr.evaluate(exprs[i]));
+  }
+}
+
+void
+checkExpansion(Expression &esi_expr, const char *exprs[]) {
+  for (int i = 0; exprs[i]; ++i) {
+    string plan, value("prefix");
+    Expression::compileExpansion(exprs[i], -1, plan);
+    assert(esi_expr.expandCompiled(plan.data(), plan.size(), value));
+    assert(value == ("prefix" + esi_expr.expand(exprs[i])));
+  }
+}
+
 string gFakeDebugLog;
 
 void
@@ -210,11 +231,82 @@ int main()
     assert(esi_expr.expand("$(HTTP_ACCEPT_LANGUAGE{en-gb}|'yes)") == "");
     assert(esi_expr.expand("$(HTTP_ACCEPT_LANGUAGE{en-uk}|'yes)") == "");
 
+    // expansion plans should expand exactly like the strings they came from
+    const char *expand_exprs[] = { "", "  ", "blah", "blah$(HTTP_HOST", "blah$A(HTTP_HOST)", "blah$()",
+                                   "blah-$(HTTP_HOST)", "blah-$(HTTP_COOKIE{c1a})", "$()", "$(|foo)x",
+                                   "blah-$(HTTP_COOKIE{c1}$(HTTP_HOST))", "x$(HTTP_HOST)$(HTTP_REFERER)y",
+                                   "blah-$(HTTP_COOKIE{c1})-$(HTTP_HOST)", "'blah", "'blah'", "'$(HTTP_COOKIE{c1})'",
+                                   "   $(HTTP_REFERER) $(HTTP_HOST)  ", " ' foo ' ", "foo|bar", "$(HTTP_HOST|",
+                                   "$(HTTP_HOST|foo", "$(HTTP_HOST|foo)", "$(HTTP_XHOST|foo)", "$(HTTP_XHOST|'')",
+                                   "$(HTTP_ACCEPT_LANGUAGE{en-uk}|'yes with space')", "a)b|c",
+                                   "$(HTTP_ACCEPT_LANGUAGE{en-gb}|'yes')", "$(HTTP_ACCEPT_LANGUAGE{en-uk}|'yes)", "$(HTTP_XHOST|')x", 0 };
+    checkExpansion(esi_expr, expand_exprs);
+
+    string plan, value("abc");
+    Expression::compileExpansion("x$(HTTP_HOST)y$(HTTP_COOKIE{c1}|'z')", -1, plan);
+    for (size_t i = 0; i < plan.size(); ++i) {
+      if ((i == 1) || (plan[i] == 'l') || (plan[i] == 'v')) { // possible segment boundaries
+        continue;
+      }
+      assert(!esi_expr.expandCompiled(plan.data(), i, value));
+      assert(value == "abc");
+    }
+    assert(esi_expr.expandCompiled(plan.data(), plan.size(), value));
+    assert(value == "abcxexample.comyv1");
+
+    // variable ids
+    const char *known_vars[] = { "HTTP_HOST", "HTTP_REFERER", "QUERY_STRING", "HTTP_COOKIE{c1}",
+                                 "HTTP_ACCEPT_LANGUAGE{en}", "HTTP_USER_AGENT{os}", "QUERY_STRING{a}", 0 };
+    int known_ids[7];
+    const char *attr;
+    int attr_len;
+    for (int i = 0; known_vars[i]; ++i) {
+      known_ids[i] = Variables::getVariableId(known_vars[i], -1, attr, attr_len);
+      assert(known_ids[i] != Variables::UNKNOWN_VARIABLE);
+      for (int j = 0; j < i; ++j) {
+        assert(known_ids[i] != known_ids[j]);
+      }
+    }
+    assert(Variables::getVariableId("http_Cookie{c1}", -1, attr, attr_len) == known_ids[3]);
+    assert(string(attr, attr_len) == "c1");
+    assert(Variables::getVariableId("Query_String", -1, attr, attr_len) == known_ids[2]);
+    assert(attr_len == 0);
+    const char *unknown_vars[] = { "", "HTTP_XHOST", "HTTP_COOKIE", "HTTP_HOST{a}", "FOO{bar}", "HTTP_COOKIE{}",
+                                   "HTTP_COOKIE{a}}", "HTTP_COOKIE{a{b}", "HTTP_HOSTS", "{a}", 0 };
+    for (int i = 0; unknown_vars[i]; ++i) {
+      assert(Variables::getVariableId(unknown_vars[i], -1, attr, attr_len) == Variables::UNKNOWN_VARIABLE);
+    }
+    assert(esi_vars.getValue(known_ids[3], "c1", 2) == "v1");
+    assert(esi_vars.getValue(Variables::UNKNOWN_VARIABLE, 0, 0) == "");
+
     assert(esi_expr.evaluate("$(HTTP_COOKIE{non-existent}) < 7") == false);
     assert(esi_expr.evaluate("$(HTTP_COOKIE{c1}) > $(HTTP_COOKIE{non-existent})") == false);
     assert(esi_expr.evaluate("$(HTTP_COOKIE{non-existent}) <= 7") == false);
     assert(esi_expr.evaluate("$(HTTP_COOKIE{c1}) >= $(HTTP_COOKIE{non-existent})") == false);
 
+    // compiled expressions should evaluate exactly like the strings they came from
+    const char *exprs[] = { "foo", "", "  ", "$(HTTP_HOST)", "$(HTTP_XHOST)", "foo == foo", "'foo' == \"foo\"",
+                            "foo == foo1", "$(HTTP_REFERER) == google.com", "$(HTTP_HOST)=='example.com'",
+                            "$(HTTP_REFERER) != google.com", "!", "!abc", "!''", "!$(FOO_BAR)", "!$(HTTP_HOST)",
+                            "abc!abc", "$(HTTP_COOKIE{c1}) <= 'v2'", "$(HTTP_COOKIE{c1}) < 'v2'",
+                            "$(HTTP_COOKIE{c1}) >= 'v0'", "$(HTTP_COOKIE{c1}) > 'v2'", "'v1' > $(HTTP_COOKIE{c1})",
+                            "$(HTTP_COOKIE{c1}) & 'v2'", "$(HTTP_COOKIE{foo}) & $(HTTP_COOKIE{bar})",
+                            "'' | $(HTTP_COOKIE{c1})", "$(HTTP_COOKIE{c1}) == $(HTTP_COOKIE{c1})",
+                            "$(HTTP_COOKIE{non-existent}) < 7", "$(HTTP_COOKIE{non-existent}) <= 7", "'abc",
+                            "'abc' == 'abc", "'", "$(HTTP_XHOST|'x') == x", "a < ab", "ab > a", "1 < 2", "2 <= 10",
+                            "'2' < '10'", "0", "0.0 | 0", "1 & 2", "$(HTTP_HOST", 0 };
+    checkCompiled(esi_expr, exprs);
+
+    // truncated code is rejected
+    bool result;
+    string code;
+    Expression::compile("$(HTTP_COOKIE{c1}) == 'v1'", -1, code);
+    for (size_t i = 0; i < code.size(); ++i) {
+      assert(!esi_expr.evaluateCompiled(code.data(), i, result));
+    }
+    code[1] = 'x';
+    assert(!esi_expr.evaluateCompiled(code.data(), code.size(), result));
+
     // query string tests
     esi_vars.clear();
     assert(esi_vars.getValue("QUERY_STRING").size() == 0);
@@ -318,6 +410,47 @@ int main()
     assert(esi_vars.getValue("HTTP_HOST") == "home");
     assert(gFakeDebugLog.rfind(PARSING_DEBUG_MESSAGE) != str_pos); // should have parsed again
     assert(esi_vars.getValue("HTTP_REFERER") == "");
+
+    // dictionaries are parsed only when one of their variables is looked up
+    const char *COOKIE_PARSING_MESSAGE = "Parsing HTTP_COOKIE dictionary";
+    const char *LANG_PARSING_MESSAGE = "Parsing HTTP_ACCEPT_LANGUAGE dictionary";
+    esi_vars.populate(HttpHeader("Cookie", -1, "c1=v1; Y=v=1&l=abc&intl=us", -1));
+    esi_vars.populate(HttpHeader("Accept-Language", -1, "en-us", -1));
+    assert(esi_vars.getValue("HTTP_HOST") == "home");
+    assert(gFakeDebugLog.find(COOKIE_PARSING_MESSAGE) == string::npos);
+    assert(esi_vars.getValue("HTTP_COOKIE{Y;intl}") == "us"); // sub cookies are searched in place
+    assert(esi_vars.getValue("HTTP_COOKIE{Y;l}") == "abc");
+    assert(esi_vars.getValue("HTTP_COOKIE{Y;x}") == "");
+    assert(esi_vars.getValue("HTTP_COOKIE{X;l}") == "");
+    assert(esi_vars.getValue("HTTP_COOKIE{c1}") == "v1");
+    str_pos = gFakeDebugLog.find(COOKIE_PARSING_MESSAGE);
+    assert(str_pos != string::npos);
+    assert(esi_vars.getValue("HTTP_COOKIE{Y}") == "v=1&l=abc&intl=us");
+    esi_vars.populate(HttpHeader("Cookie", -1, "c2=v2", -1));
+    assert(esi_vars.getValue("HTTP_COOKIE{c2}") == "v2");
+    assert(gFakeDebugLog.rfind(COOKIE_PARSING_MESSAGE) == str_pos); // parsed once
+    assert(gFakeDebugLog.find(LANG_PARSING_MESSAGE) == string::npos);
+    assert(esi_vars.getValue("HTTP_ACCEPT_LANGUAGE{en-us}") == "true");
+    assert(gFakeDebugLog.find(LANG_PARSING_MESSAGE) != string::npos);
+
+    // fingerprints differ exactly when a value the dependencies refer to does
+    VariableDependencies deps;
+    Expression::getDependencies("$(HTTP_HOST) $(HTTP_COOKIE{c1}) $(HTTP_COOKIE{c3}|x)", -1, deps);
+    assert(deps.getDictVariables().size() == 2);
+    string fingerprint1, fingerprint2;
+    esi_vars.getFingerprint(deps, fingerprint1);
+    esi_vars.populate(HttpHeader("Referer", -1, "yahoo.com", -1));
+    esi_vars.populate(HttpHeader("Cookie", -1, "c4=v4", -1));
+    esi_vars.getFingerprint(deps, fingerprint2);
+    assert(fingerprint1 == fingerprint2);
+    fingerprint2.clear();
+    esi_vars.populate(HttpHeader("Cookie", -1, "c3=", -1));
+    esi_vars.getFingerprint(deps, fingerprint2);
+    assert(fingerprint1 == fingerprint2); // empty and missing values look the same to expressions
+    fingerprint2.clear();
+    esi_vars.populate(HttpHeader("Cookie", -1, "c3=v3", -1));
+    esi_vars.getFingerprint(deps, fingerprint2);
+    assert(fingerprint1 != fingerprint2);
   }
 
   {
@@ -348,6 +481,14 @@ int main()
     assert(!esi_expr.evaluate("$(HTTP_COOKIE{t3}) & 1"));
     assert(esi_expr.evaluate("$(HTTP_COOKIE{t5}) == 6"));
 
+    const char *exprs[] = { "$(HTTP_COOKIE{age}) >= -9", "$(HTTP_COOKIE{age}) < 22", "$(HTTP_COOKIE{age}) > 100a",
+                            "$(HTTP_COOKIE{t1})", "$(HTTP_COOKIE{grade}) == -5", "$(HTTP_COOKIE{grade}) != -5.1",
+                            "!$(HTTP_COOKIE{t2})", "!$(HTTP_COOKIE{t3})", "+4.3 == $(HTTP_COOKIE{avg})",
+                            "$(HTTP_COOKIE{grade}) < -0x2", "$(HTTP_COOKIE{t2}) | 1", "$(HTTP_COOKIE{t3}) & 1",
+                            "$(HTTP_COOKIE{age}) == $(HTTP_COOKIE{t5})", "$(HTTP_COOKIE{avg}) > $(HTTP_COOKIE{t5})",
+                            "$(HTTP_COOKIE{t5}) == 6", "$(HTTP_COOKIE{grade}) < 0", 0 };
+    checkCompiled(esi_expr, exprs);
+
     string strange_cookie("c1=123");
     strange_cookie[4] = '\0';
     esi_vars.populate(HttpHeader("Cookie", -1, strange_cookie.data(), strange_cookie.size()));